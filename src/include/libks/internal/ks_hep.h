@@ -119,9 +119,60 @@ struct ks_hepv3_generic {
 
 typedef struct ks_hepv3_generic ks_hepv3_generic_t;
 
+/* Generic chunks, two IPv6 chunks and the payload chunk header */
+#define KS_HEPV3_TEMPLATE_MAX (sizeof(ks_hepv3_generic_t) + 2 * sizeof(ks_hepv3_chunk_ip6_t) + sizeof(ks_hepv3_chunk_t))
+
+struct ks_hepv3_capture_ctx_s {
+	ks_pool_t *pool;
+	ks_size_t prefix_len;
+	char prefix[KS_HEPV3_TEMPLATE_MAX];
+};
+
 struct ks_hepv3_socket_s {
 	ks_socket_t raw_socket;
 	ks_tls_t *tls_socket;
+	ks_bool_t use_udp;
+};
+
+/* One queued packet, encoded when it is accepted */
+typedef struct ks_hepv3_sender_item_s {
+	ks_time_t queued_at;
+	ks_size_t len;
+	char data[];
+} ks_hepv3_sender_item_t;
+
+struct ks_hepv3_sender_s {
+	ks_pool_t *pool;
+	ks_hepv3_socket_params_t socket_params;
+	uint32_t connect_timeout_ms;
+	uint32_t reconnect_min_ms;
+	uint32_t reconnect_max_ms;
+	ks_size_t write_bytes;
+
+	ks_pool_t *item_pool;
+	ks_q_t *q;
+	ks_thread_t *thread;
+	volatile ks_bool_t running;
+	ks_cond_t *cond; /* signalled by destroy to cut a reconnect backoff short */
+
+	/* Owned by the I/O thread */
+	ks_hepv3_socket_t *sock;
+	char *wbuf;
+	uint32_t backoff;
+	ks_time_t warned_at;
+	uint32_t failures;
+
+	/* Bumped by capturing threads */
+	volatile uint64_t queued;
+	volatile uint64_t dropped;
+
+	/* Stored by the I/O thread only */
+	volatile uint64_t sent;
+	volatile uint64_t bytes;
+	volatile uint64_t writes;
+	volatile uint64_t reconnects;
+	volatile uint64_t latency_total_us;
+	volatile uint64_t latency_max_us;
 };
 
 KS_END_EXTERN_C
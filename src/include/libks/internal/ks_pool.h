@@ -31,7 +31,22 @@
 
 #define KS_POOL_FENCE_SIZE			 2		/* fence space */
 
+/*
+ * Slab mode (KS_POOL_FLAG_SLAB) size classes, powers of two from
+ * 1 << KS_POOL_SLAB_MIN_SHIFT up to KS_POOL_SLAB_MAX_SIZE. Anything
+ * larger is still individually malloc'd.
+ */
+#define KS_POOL_SLAB_MIN_SHIFT		 4
+#define KS_POOL_SLAB_CLASS_COUNT	 9
+#define KS_POOL_SLAB_MAX_SIZE		 ((ks_size_t)1 << (KS_POOL_SLAB_MIN_SHIFT + KS_POOL_SLAB_CLASS_COUNT - 1))
+#define KS_POOL_SLAB_NONE			 ((ks_size_t)-1)	/* prefix was not carved from a slab */
+#define KS_POOL_SLAB_MIN_SLOTS		 8		/* slots in the first slab of a class */
+#define KS_POOL_SLAB_MAX_BYTES		 (64 * 1024)	/* slabs stop doubling at this size */
+#define KS_POOL_SLAB_ALIGN			 16		/* alignment of every slot */
+
 typedef struct ks_pool_prefix_s ks_pool_prefix_t;
+typedef struct ks_pool_slab_s ks_pool_slab_t;
+typedef struct ks_pool_slab_class_s ks_pool_slab_class_t;
 
 struct ks_pool_prefix_s {
 	ks_size_t magic1;
@@ -40,6 +55,8 @@ struct ks_pool_prefix_s {
 	ks_size_t refs;
 	ks_pool_prefix_t *prev;
 	ks_pool_prefix_t *next;
+	ks_size_t slab_class; /* size class index, KS_POOL_SLAB_NONE when malloc'd on its own */
+	ks_bool_t tracked; /* true while linked into the pool's first/last list */
 	ks_size_t magic3;
 #ifdef KS_DEBUG_POOL
 	int line;
@@ -56,6 +73,22 @@ struct ks_pool_prefix_s {
 
 #define KS_POOL_PREFIX_SIZE sizeof(ks_pool_prefix_t)
 
+/* A chunk of memory that slots of one size class are carved from */
+struct ks_pool_slab_s {
+	ks_pool_slab_t *next;
+	ks_size_t size;
+};
+
+#define KS_POOL_SLAB_ROUND(_s) (((_s) + KS_POOL_SLAB_ALIGN - 1) & ~((ks_size_t)KS_POOL_SLAB_ALIGN - 1))
+#define KS_POOL_SLAB_HEADER_SIZE KS_POOL_SLAB_ROUND(sizeof(ks_pool_slab_t))
+
+struct ks_pool_slab_class_s {
+	ks_pool_prefix_t *free; /* recycled slots, chained through prefix->next */
+	ks_byte_t *pos; /* bump pointer into the newest slab */
+	ks_byte_t *end; /* end of the newest slab */
+	ks_size_t slots; /* slot count for the next slab of this class */
+};
+
 #define SET_POINTER(pnt, val)					\
 	do {										\
 		if ((pnt) != NULL) {					\
@@ -63,6 +96,25 @@ struct ks_pool_prefix_s {
 		}										\
 	} while(0)
 
+/*
+ * Thread cache mode (KS_POOL_FLAG_THREAD_CACHE) magazine sizing.  Each thread
+ * caches freed slab slots for up to KS_POOL_TCACHE_POOLS pools, keeping at most
+ * KS_POOL_TCACHE_BYTES worth (bounded to 4..64 slots) per size class.
+ */
+#define KS_POOL_TCACHE_POOLS		 4
+#define KS_POOL_TCACHE_BYTES		 (32 * 1024)
+#define KS_POOL_TCACHE_MIN_DEPTH	 4
+#define KS_POOL_TCACHE_MAX_DEPTH	 64
+
+typedef struct ks_pool_tcache_s {
+	struct ks_pool_s *pool; /* pool the magazines belong to, NULL when unused */
+	ks_size_t serial; /* pool serial when the magazines were filled, stale on mismatch */
+	ks_size_t alloc_c; /* allocation count delta not yet folded into the pool */
+	ks_size_t user_alloc; /* user byte delta not yet folded into the pool */
+	ks_pool_prefix_t *head[KS_POOL_SLAB_CLASS_COUNT]; /* cached slots, chained through prefix->next */
+	uint32_t count[KS_POOL_SLAB_CLASS_COUNT];
+} ks_pool_tcache_t;
+
 struct ks_pool_s {
 	ks_size_t magic1; /* magic number for struct */
 	ks_size_t flags; /* flags for the struct */
@@ -86,4 +138,11 @@ struct ks_pool_s {
 	ks_size_t magic2; /* upper magic for overwrite sanity */
 	ks_mutex_t *mutex;
 	ks_bool_t cleaning_up;
+	ks_pool_slab_t *slabs; /* every slab owned by the pool, freed as a whole on clear */
+	ks_size_t slab_bytes; /* bytes held in slabs */
+	ks_pool_slab_class_t slab_classes[KS_POOL_SLAB_CLASS_COUNT];
+	ks_size_t serial; /* changes on every clear so thread caches can spot stale slots */
+	struct ks_pool_s *tcache_next; /* list of live thread cache pools */
+	volatile uint32_t tcache_flushers; /* threads currently flushing into this pool */
+	ks_cond_t *tcache_cond; /* on the pool mutex, broadcast when the last flusher is done */
 };
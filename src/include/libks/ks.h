@@ -83,6 +83,7 @@ KS_END_EXTERN_C
 #include "libks/ks_tls.h"
 #include "libks/ks_hep.h"
 #include "libks/ks_uuid.h"
+#include "libks/ks_random.h"
 #include "libks/ks_acl.h"
 #include "libks/ks_base64.h"
 #include "libks/ks_time.h"
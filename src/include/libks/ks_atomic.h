@@ -28,6 +28,9 @@ KS_BEGIN_EXTERN_C
 /**
  * ks_atomic_increment_* - Atomically increments the value, and returns the value before the increment ocurred.
  * ks_atomic_cas_* - Atomically compares, and performs an exchange on the types if they are the same.
+ * ks_atomic_load_* - Reads the value with acquire semantics.
+ * ks_atomic_store_* - Writes the value with release semantics.
+ * ks_atomic_fence - Full memory barrier.
  */
 #ifdef KS_PLAT_WIN // Windows
 #pragma warning(disable:4057)
@@ -44,6 +47,18 @@ static inline uint64_t ks_atomic_decrement_uint64(volatile uint64_t *value) { re
 
 static inline ks_size_t ks_atomic_decrement_size(volatile ks_size_t *value) { return InterlockedDecrementSizeT(value) + 1; }
 
+static inline ks_bool_t ks_atomic_cas_uint64(volatile uint64_t *value, uint64_t expected, uint64_t desired) { return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)value, (LONG64)desired, (LONG64)expected) == expected; }
+
+static inline uint32_t ks_atomic_load_uint32(volatile uint32_t *value) { uint32_t v = *value; MemoryBarrier(); return v; }
+
+static inline uint64_t ks_atomic_load_uint64(volatile uint64_t *value) { return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)value, 0, 0); }
+
+static inline ks_size_t ks_atomic_load_size(volatile ks_size_t *value) { ks_size_t v = *value; MemoryBarrier(); return v; }
+
+static inline void ks_atomic_store_uint64(volatile uint64_t *value, uint64_t v) { InterlockedExchange64((volatile LONG64 *)value, (LONG64)v); }
+
+static inline void ks_atomic_fence(void) { MemoryBarrier(); }
+
 #else // GCC/CLANG
 
 static inline uint32_t KS_UNUSED ks_atomic_increment_uint32(volatile uint32_t *value) { return __atomic_fetch_add(value, 1, __ATOMIC_SEQ_CST); }
@@ -58,6 +73,18 @@ static inline uint64_t KS_UNUSED ks_atomic_decrement_uint64(volatile uint64_t *v
 
 static inline ks_size_t KS_UNUSED ks_atomic_decrement_size(volatile ks_size_t *value) { return __atomic_fetch_add(value, -1, __ATOMIC_SEQ_CST); }
 
+static inline ks_bool_t KS_UNUSED ks_atomic_cas_uint64(volatile uint64_t *value, uint64_t expected, uint64_t desired) { return __atomic_compare_exchange_n(value, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ? KS_TRUE : KS_FALSE; }
+
+static inline uint32_t KS_UNUSED ks_atomic_load_uint32(volatile uint32_t *value) { return __atomic_load_n(value, __ATOMIC_ACQUIRE); }
+
+static inline uint64_t KS_UNUSED ks_atomic_load_uint64(volatile uint64_t *value) { return __atomic_load_n(value, __ATOMIC_ACQUIRE); }
+
+static inline ks_size_t KS_UNUSED ks_atomic_load_size(volatile ks_size_t *value) { return __atomic_load_n(value, __ATOMIC_ACQUIRE); }
+
+static inline void KS_UNUSED ks_atomic_store_uint64(volatile uint64_t *value, uint64_t v) { __atomic_store_n(value, v, __ATOMIC_RELEASE); }
+
+static inline void KS_UNUSED ks_atomic_fence(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
 #endif
 
 /* Define spinlock macros */
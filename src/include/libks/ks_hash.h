@@ -88,6 +88,14 @@ typedef enum {
 	KS_HASH_FLAG_RWLOCK		= KS_BIT_FLAG(3),
 	KS_HASH_FLAG_DUP_CHECK	= KS_BIT_FLAG(4),
 	KS_HASH_FLAG_NOLOCK		= KS_BIT_FLAG(5),
+	/* Table level only: store entries inline in a power of two open addressing table probed 16 slots at a
+	 * time instead of chaining individually allocated entries. Same API, iterators and destructors. */
+	KS_HASH_FLAG_OPEN_ADDRESSING = KS_BIT_FLAG(6),
+	/* Table level only: split the table into independently locked shards. Writers only lock the shard their key
+	 * falls in and lookups only spin on a per shard reader count while that shard is being written. As with
+	 * RWLOCK, ks_hash_read_lock is shared and ks_hash_write_lock is exclusive, lookups included, across every
+	 * shard for callers that need the whole table to hold still, e.g. while iterating. Replaces MUTEX/RWLOCK/NOLOCK. */
+	KS_HASH_FLAG_SHARDED = KS_BIT_FLAG(7),
 } ks_hash_flag_values_t;
 
 typedef int32_t ks_hash_flag_t;
@@ -52,15 +52,79 @@ typedef struct {
 	ks_port_t port;
 	ks_bool_t use_tls;
 	ks_pool_t *pool;
+	ks_bool_t use_udp;	/* one datagram per packet, use_tls is ignored */
 } ks_hepv3_socket_params_t;
 
 typedef struct ks_hepv3_socket_s ks_hepv3_socket_t;
 
+/* Pre-encoded capture for one flow.  Everything in ks_hepv3_capture_params_t
+ * except the payload is fixed at create time; each encode only writes the
+ * length, timestamp and payload. */
+typedef struct ks_hepv3_capture_ctx_s ks_hepv3_capture_ctx_t;
+
+typedef struct {
+	const char *payload;
+	ks_size_t payload_size;
+	ks_time_t timestamp;	/* usec since epoch, 0 for the time of the batch */
+} ks_hepv3_capture_item_t;
+
+/* Background sender: captures are queued without blocking and written by a
+ * dedicated thread that coalesces them and reconnects with backoff. */
+typedef struct ks_hepv3_sender_s ks_hepv3_sender_t;
+
+typedef struct {
+	char *server;
+	ks_port_t port;
+	ks_bool_t use_tls;
+	ks_bool_t use_udp;
+	ks_pool_t *pool;
+	ks_size_t queue_len;		/* packets, 0 for KS_HEPV3_SENDER_DEFAULT_QUEUE */
+	ks_size_t write_bytes;		/* coalesced bytes per stream write, 0 for 64k */
+	uint32_t connect_timeout_ms;	/* 0 for the blocking socket's timeout */
+	uint32_t reconnect_min_ms;	/* first retry delay, doubles up to reconnect_max_ms */
+	uint32_t reconnect_max_ms;
+} ks_hepv3_sender_params_t;
+
+typedef struct {
+	uint64_t queued;		/* packets accepted */
+	uint64_t sent;			/* packets written to the collector */
+	uint64_t dropped;		/* refused because the queue was full, or discarded on destroy */
+	uint64_t bytes;
+	uint64_t writes;		/* send/sendmmsg/TLS write calls */
+	uint64_t reconnects;		/* connection attempts after the first */
+	ks_size_t depth;		/* packets waiting in the queue */
+	uint64_t latency_avg_us;	/* queued to written */
+	uint64_t latency_max_us;
+} ks_hepv3_sender_stats_t;
+
+#define KS_HEPV3_SENDER_DEFAULT_QUEUE 4096
+
 KS_DECLARE(ks_status_t) ks_hepv3_socket_init(ks_hepv3_socket_params_t *params, ks_hepv3_socket_t **out_hep_socketP);
 KS_DECLARE(void) ks_hepv3_socket_destroy(ks_hepv3_socket_t **hep_socketP);
 KS_DECLARE(ks_status_t) ks_hepv3_socket_write(ks_hepv3_socket_t *hepv3_socket, void *data, ks_size_t *bytes);
 KS_DECLARE(ks_size_t) ks_hepv3_capture_create(const ks_hepv3_capture_params_t *hep_params, char **out_buffer);
 
+KS_DECLARE(ks_status_t) ks_hepv3_capture_ctx_create(ks_hepv3_capture_ctx_t **ctxP, const ks_hepv3_capture_params_t *hep_params, ks_pool_t *pool);
+KS_DECLARE(void) ks_hepv3_capture_ctx_destroy(ks_hepv3_capture_ctx_t **ctxP);
+/* Bytes needed to encode a payload of the given size */
+KS_DECLARE(ks_size_t) ks_hepv3_capture_size(const ks_hepv3_capture_ctx_t *ctx, ks_size_t payload_size);
+/* Encode into buf, returns the packet length or 0 if it does not fit */
+KS_DECLARE(ks_size_t) ks_hepv3_capture_encode(const ks_hepv3_capture_ctx_t *ctx, const char *payload, ks_size_t payload_size, char *buf, ks_size_t buflen);
+/* Encode into a buffer from the context's pool, release with ks_pool_free */
+KS_DECLARE(ks_size_t) ks_hepv3_capture_encode_alloc(const ks_hepv3_capture_ctx_t *ctx, const char *payload, ks_size_t payload_size, char **out_buffer);
+/* Encode items back to back into buf, stopping at the first one that does not
+ * fit.  Returns the number of items encoded and their total size in out_len. */
+KS_DECLARE(ks_size_t) ks_hepv3_capture_encode_batch(const ks_hepv3_capture_ctx_t *ctx, const ks_hepv3_capture_item_t *items, ks_size_t count, char *buf, ks_size_t buflen, ks_size_t *out_len);
+
+KS_DECLARE(ks_status_t) ks_hepv3_sender_create(ks_hepv3_sender_t **senderP, const ks_hepv3_sender_params_t *params);
+/* Stops the sender and writes out what is still queued if connected, dropping it otherwise. Blocks for as long
+ * as a connect already in progress takes (up to connect_timeout_ms) plus the write timeout per batch written */
+KS_DECLARE(void) ks_hepv3_sender_destroy(ks_hepv3_sender_t **senderP);
+/* Never block: KS_STATUS_BREAK when the queue is full and the packet was dropped */
+KS_DECLARE(ks_status_t) ks_hepv3_sender_capture(ks_hepv3_sender_t *sender, const ks_hepv3_capture_ctx_t *ctx, const char *payload, ks_size_t payload_size);
+KS_DECLARE(ks_status_t) ks_hepv3_sender_write(ks_hepv3_sender_t *sender, const void *data, ks_size_t len);
+KS_DECLARE(void) ks_hepv3_sender_stats(ks_hepv3_sender_t *sender, ks_hepv3_sender_stats_t *stats);
+
 KS_END_EXTERN_C
 
 /* For Emacs:
@@ -33,7 +33,22 @@ KS_BEGIN_EXTERN_C
  */
 
 typedef enum {
-	KS_POOL_FLAG_DEFAULT = 0
+	KS_POOL_FLAG_DEFAULT = 0,
+	/* Carve allocations up to 4KB from size-class slabs owned by the pool instead of
+	 * one malloc each.  Freed slots are recycled within the pool and the slabs are
+	 * only released as a whole on ks_pool_clear/ks_pool_close.  Slab allocations are
+	 * only kept on the pool's allocation list once they have a cleanup callback, so
+	 * ks_pool_log_on_close and ks_pool_pool_verify will not see the others. */
+	KS_POOL_FLAG_SLAB = (1 << 0),
+	/* Implies KS_POOL_FLAG_SLAB.  Each thread keeps small per size class magazines of
+	 * free slots for the pool, so allocating and freeing slab sized blocks without a
+	 * cleanup callback or extra refs only takes the pool mutex to refill or drain a
+	 * magazine.  Counters reported by ks_pool_stats lag by up to a magazine per thread.
+	 * Not used while a log function is set or when built with KS_DEBUG_POOL. */
+	KS_POOL_FLAG_THREAD_CACHE = (1 << 1),
+	/* Only zero the prefix and write the fence, leaving user bytes from ks_pool_alloc
+	 * uninitialized.  ks_pool_calloc and ks_pool_resize_zero still zero. */
+	KS_POOL_FLAG_NO_ZERO = (1 << 2)
 } ks_pool_flag_t;
 
 /*
@@ -115,6 +130,7 @@ typedef void (*ks_pool_log_func_t) (const void *pool,
  * ARGUMENTS:
  *
  * poolP <- pointer to new pool that will be set on success
+ * flags -> ks_pool_flag_t attributes of the pool (ks_pool_open_ex only)
  * file  <- pointer to const literal string macro __FILE__
  * line  <- integer value of file line __LINE__ macro
  * tag   <- pointer to const literal string to associate with pool
@@ -127,9 +143,10 @@ typedef void (*ks_pool_log_func_t) (const void *pool,
  */
 
 KS_DECLARE(ks_status_t) ks_pool_tagged_open(ks_pool_t **poolP, const char *fileP, int line, const char *tagP);
+KS_DECLARE(ks_status_t) ks_pool_tagged_open_ex(ks_pool_t **poolP, ks_pool_flag_t flags, const char *fileP, int line, const char *tagP);
 
 #define ks_pool_open(poolP) ks_pool_tagged_open((poolP), __FILE__, __LINE__, __KS_FUNC__)
-#define ks_pool_open_ex(poolP, tag) ks_pool_tagged_open((poolP), __FILE__, __LINE__, NULL, tag)
+#define ks_pool_open_ex(poolP, flags) ks_pool_tagged_open_ex((poolP), (flags), __FILE__, __LINE__, __KS_FUNC__)
 
 #ifdef KS_DEBUG_POOL
 
@@ -210,6 +227,42 @@ KS_DECLARE(ks_pool_t *) ks_pool_get(void *addr);
 
 KS_DECLARE(void) ks_pool_log_on_close(ks_pool_t *pool);
 
+/*
+ * ks_status_t ks_global_pool_set_flags
+ *
+ * DESCRIPTION:
+ *
+ * Choose the flags the global pool is opened with, e.g.
+ * KS_POOL_FLAG_THREAD_CACHE.  Must be called before ks_init.
+ *
+ * RETURNS:
+ *
+ * Success - KS_STATUS_SUCCESS
+ *
+ * Failure - KS_STATUS_FAIL if the global pool is already open
+ *
+ * ARGUMENTS:
+ *
+ * flags -> Flags for the global pool.
+ */
+KS_DECLARE(ks_status_t) ks_global_pool_set_flags(ks_pool_flag_t flags);
+
+/*
+ * void ks_pool_thread_cache_flush
+ *
+ * DESCRIPTION:
+ *
+ * Return every slot the calling thread has cached for
+ * KS_POOL_FLAG_THREAD_CACHE pools.  ks_thread_t threads do this when
+ * their function returns, other threads should call it before exiting
+ * or their cached slots stay unused until the pool is cleared.
+ *
+ * RETURNS:
+ *
+ * None.
+ */
+KS_DECLARE(void) ks_pool_thread_cache_flush(void);
+
 /*
  * void *__ks_pool_alloc
  *
@@ -266,6 +319,34 @@ KS_DECLARE(void *) __ks_pool_alloc_ex(ks_pool_t *pool, const ks_size_t size, con
 
 #define ks_pool_alloc_ex(pool, size, error_p) __ks_pool_alloc_ex(pool, size, __FILE__, __LINE__, __KS_FUNC__, error_p)
 
+/*
+ * void *__ks_pool_alloc_nz
+ *
+ * COMPONENTS:
+ * ks_pool_alloc_nz
+ *
+ * DESCRIPTION:
+ *
+ * Allocate space for bytes inside of an already open memory pool
+ * without zeroing them, for buffers the caller fills completely.
+ *
+ * RETURNS:
+ *
+ * Success - Pointer to the address to use.
+ *
+ * Failure - NULL
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ *
+ * size -> Number of bytes to allocate in the pool.  Must be >0.
+ *
+ */
+KS_DECLARE(void *) __ks_pool_alloc_nz(ks_pool_t *pool, const ks_size_t size, const char *file, int line, const char *tag);
+
+#define ks_pool_alloc_nz(pool, size) __ks_pool_alloc_nz(pool, size, __FILE__, __LINE__, __KS_FUNC__)
+
 /*
  * void *__ks_pool_calloc
  *
@@ -380,7 +461,8 @@ KS_DECLARE(void *) ks_pool_ref_ex(void *addr, ks_status_t *error_p);
  *
  * DESCRIPTION:
  *
- * Reallocate an address in a memory pool to a new size.
+ * Reallocate an address in a memory pool to a new size.  Any growth is
+ * left uninitialized, see ks_pool_resize_zero.
  *
  * RETURNS:
  *
@@ -400,12 +482,39 @@ KS_DECLARE(void *) ks_pool_ref_ex(void *addr, ks_status_t *error_p);
 KS_DECLARE(void *) __ks_pool_resize(void *old_addr, const ks_size_t new_size, const char *file, int line, const char *tag);
 #define ks_pool_resize(old_addr, new_size) __ks_pool_resize(old_addr, new_size, __FILE__, __LINE__, __KS_FUNC__)
 
+/*
+ * void *__ks_pool_resize_zero
+ *
+ * DESCRIPTION:
+ *
+ * Reallocate an address in a memory pool to a new size, zeroing any
+ * growth regardless of KS_POOL_FLAG_NO_ZERO.
+ *
+ * RETURNS:
+ *
+ * Success - Pointer to the address to use.
+ *
+ * Failure - NULL
+ *
+ * ARGUMENTS:
+ *
+ * old_addr -> Previously allocated address.
+ *
+ * new_size -> New size of the allocation.
+ *
+ * file/line/tag -> Contextual information for use with KS_DEBUG_POOL
+ *
+ */
+KS_DECLARE(void *) __ks_pool_resize_zero(void *old_addr, const ks_size_t new_size, const char *file, int line, const char *tag);
+#define ks_pool_resize_zero(old_addr, new_size) __ks_pool_resize_zero(old_addr, new_size, __FILE__, __LINE__, __KS_FUNC__)
+
 /*
  * void *__ks_pool_resize_ex
  *
  * DESCRIPTION:
  *
- * Reallocate an address in a memory pool to a new size.
+ * Reallocate an address in a memory pool to a new size.  Any growth is
+ * left uninitialized, see ks_pool_resize_zero.
  *
  * RETURNS:
  *
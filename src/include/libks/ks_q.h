@@ -27,6 +27,13 @@
 
 KS_BEGIN_EXTERN_C
 
+typedef enum {
+	KS_Q_FLAG_DEFAULT = 0,
+	/* Bounded ring of sequence numbered slots, push/pop never take a lock unless the queue is empty or full.
+	 * maxlen is required and is rounded up to a power of two. */
+	KS_Q_FLAG_LOCKFREE = (1 << 0)
+} ks_q_flags_t;
+
 KS_DECLARE(ks_status_t) ks_q_pop_timeout(ks_q_t *q, void **ptr, uint32_t timeout);
 KS_DECLARE(ks_status_t) ks_q_wake(ks_q_t *q);
 KS_DECLARE(ks_status_t) ks_q_flush(ks_q_t *q);
@@ -37,12 +44,18 @@ KS_DECLARE(ks_size_t) ks_q_size(ks_q_t *q);
 KS_DECLARE(ks_size_t) ks_q_maxlen(ks_q_t *q);
 KS_DECLARE(ks_status_t) ks_q_destroy(ks_q_t **qP);
 KS_DECLARE(ks_status_t) ks_q_create(ks_q_t **qP, ks_pool_t *pool, ks_size_t maxlen);
+KS_DECLARE(ks_status_t) ks_q_create_ex(ks_q_t **qP, ks_pool_t *pool, ks_size_t maxlen, uint32_t flags);
 KS_DECLARE(ks_status_t) ks_q_push(ks_q_t *q, void *ptr);
 KS_DECLARE(ks_status_t) ks_q_trypush(ks_q_t *q, void *ptr);
 KS_DECLARE(ks_status_t) ks_q_pop(ks_q_t *q, void **ptr);
 KS_DECLARE(ks_status_t) ks_q_trypop(ks_q_t *q, void **ptr);
 KS_DECLARE(ks_status_t) ks_q_trypeek(ks_q_t *q, void **ptr);
 
+/* Move up to n items with one lock hold and one wakeup, the count actually moved is returned in pushed/popped.
+ * push_batch waits for room like ks_q_push, pop_batch waits like ks_q_pop_timeout, only if no item can be moved. */
+KS_DECLARE(ks_status_t) ks_q_push_batch(ks_q_t *q, void **ptrs, ks_size_t n, ks_size_t *pushed);
+KS_DECLARE(ks_status_t) ks_q_pop_batch(ks_q_t *q, void **ptrs, ks_size_t max, uint32_t timeout, ks_size_t *popped);
+
 KS_END_EXTERN_C
 
 #endif							/* defined(_KS_Q_H_) */
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2018-2023 SignalWire, Inc
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+KS_BEGIN_EXTERN_C
+
+/*
+ * Fast random numbers, fit for masks, nonces and identifiers. Each thread has its own
+ * ChaCha20 generator seeded from the OS, so calls take no locks. The key is replaced
+ * from the generator's own output after every block it hands out, and reseeded from
+ * the OS every KS_RANDOM_RESEED_BYTES and after a fork.
+ */
+#define KS_RANDOM_RESEED_BYTES (1024 * 1024)
+
+KS_DECLARE(void) ks_random_bytes(void *buf, ks_size_t len);
+KS_DECLARE(uint32_t) ks_random_uint32(void);
+KS_DECLARE(uint64_t) ks_random_uint64(void);
+/* Uniform in [0, bound), without the bias of a plain modulo. 0 when bound is 0 */
+KS_DECLARE(uint32_t) ks_random_uniform(uint32_t bound);
+/* Throw away the calling thread's state and seed it again from the OS */
+KS_DECLARE(void) ks_random_reseed(void);
+
+KS_END_EXTERN_C
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4 noet:
+ */
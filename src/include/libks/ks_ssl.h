@@ -32,6 +32,10 @@ KS_DECLARE(void) ks_ssl_init_skip(ks_bool_t skip);
 KS_DECLARE(void) ks_ssl_init_ssl_locks(void);
 KS_DECLARE(void) ks_ssl_destroy_ssl_locks(void);
 KS_DECLARE(int) ks_gen_cert(const char *dir, const char *file);
+/* Ask for kernel TLS on a connection before its handshake. KS_FALSE when this OpenSSL was built without it */
+KS_DECLARE(ks_bool_t) ks_ssl_request_ktls(SSL *ssl);
+/* Whether record encryption (tx) and decryption (rx) were handed to the kernel after the handshake */
+KS_DECLARE(void) ks_ssl_get_ktls(SSL *ssl, ks_bool_t *tx, ks_bool_t *rx);
 
 KS_END_EXTERN_C
 
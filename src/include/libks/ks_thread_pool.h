@@ -22,11 +22,83 @@
 #pragma once
 
 KS_BEGIN_EXTERN_C
+
+typedef enum {
+	KS_THREAD_POOL_FLAG_DEFAULT = 0,
+	/* Give each worker its own deque; jobs added from a worker stay local and idle workers steal from the others */
+	KS_THREAD_POOL_FLAG_WORK_STEALING = (1 << 0)
+} ks_thread_pool_flags_t;
+
+/* Workers always take a job from the highest priority lane that has one */
+typedef enum {
+	KS_THREAD_POOL_PRIORITY_HIGH = 0,
+	KS_THREAD_POOL_PRIORITY_NORMAL,
+	KS_THREAD_POOL_PRIORITY_LOW,
+	KS_THREAD_POOL_PRIORITY_COUNT
+} ks_thread_pool_priority_t;
+
+/* Wait times are the time from queueing to a worker picking the job up, in microseconds. Percentiles
+ * are rounded up to the next power of two, capped at wait_max. */
+typedef struct ks_thread_pool_lane_stats_s {
+	ks_size_t depth;
+	uint64_t queued;
+	uint64_t run;
+	uint64_t expired;
+	ks_time_t wait_p50;
+	ks_time_t wait_p90;
+	ks_time_t wait_p99;
+	ks_time_t wait_max;
+} ks_thread_pool_lane_stats_t;
+
+typedef struct ks_thread_pool_stats_s {
+	uint32_t threads;
+	uint32_t busy;
+	uint32_t idle;
+	ks_thread_pool_lane_stats_t lanes[KS_THREAD_POOL_PRIORITY_COUNT];
+} ks_thread_pool_stats_t;
+
 KS_DECLARE(ks_status_t) ks_thread_pool_create(ks_thread_pool_t **tp, uint32_t min, uint32_t max, size_t stack_size,
 											  ks_thread_priority_t priority, uint32_t idle_sec);
+KS_DECLARE(ks_status_t) ks_thread_pool_create_ex(ks_thread_pool_t **tp, uint32_t min, uint32_t max, size_t stack_size,
+												 ks_thread_priority_t priority, uint32_t idle_sec, uint32_t flags);
 KS_DECLARE(ks_status_t) ks_thread_pool_destroy(ks_thread_pool_t **tp);
 KS_DECLARE(ks_status_t) ks_thread_pool_add_job(ks_thread_pool_t *tp, ks_thread_function_t func, void *data);
 KS_DECLARE(ks_size_t) ks_thread_pool_backlog(ks_thread_pool_t *tp);
+KS_DECLARE(ks_status_t) ks_thread_pool_stats(ks_thread_pool_t *tp, ks_thread_pool_stats_t *stats);
+
+/*
+ * Futures: like ks_thread_pool_add_job but the caller gets a handle to wait on and read the job's return value from.
+ * A wait with timeout_ms 0 blocks until the job finishes, otherwise KS_STATUS_TIMEOUT is returned when it expires.
+ * Waiting from one of the pool's own workers runs other queued jobs meanwhile. Every future must be destroyed,
+ * and before the pool is.
+ */
+KS_DECLARE(ks_status_t) ks_thread_pool_submit(ks_thread_pool_t *tp, ks_thread_function_t func, void *data, ks_thread_pool_future_t **futureP);
+KS_DECLARE(ks_status_t) ks_thread_pool_future_wait(ks_thread_pool_future_t *future, uint32_t timeout_ms);
+KS_DECLARE(ks_bool_t) ks_thread_pool_future_ready(ks_thread_pool_future_t *future);
+KS_DECLARE(ks_bool_t) ks_thread_pool_future_expired(ks_thread_pool_future_t *future);
+KS_DECLARE(void *) ks_thread_pool_future_result(ks_thread_pool_future_t *future);
+KS_DECLARE(ks_status_t) ks_thread_pool_future_destroy(ks_thread_pool_future_t **futureP);
+
+/*
+ * Queue a job on a priority lane. Jobs with a non zero deadline_ms are taken earliest deadline first, ahead of the
+ * lane's jobs without one. If no worker has picked the job up by its deadline func is not run, expired_func (optional)
+ * is called with data instead so it can be released, and the future (optional, may be NULL) completes with
+ * ks_thread_pool_future_wait returning KS_STATUS_TIMEOUT and ks_thread_pool_future_expired() true.
+ * ks_thread_pool_add_job/submit use the normal lane without a deadline.
+ */
+KS_DECLARE(ks_status_t) ks_thread_pool_add_job_ex(ks_thread_pool_t *tp, ks_thread_function_t func, void *data,
+												  ks_thread_pool_priority_t priority, uint32_t deadline_ms, ks_thread_function_t expired_func,
+												  ks_thread_pool_future_t **futureP);
+
+/*
+ * Task groups: fan out any number of jobs with ks_task_group_add and block once in ks_task_group_wait until they
+ * have all finished. A group can be reused after a wait and can't be destroyed while jobs are pending.
+ */
+KS_DECLARE(ks_status_t) ks_task_group_create(ks_task_group_t **groupP, ks_thread_pool_t *tp);
+KS_DECLARE(ks_status_t) ks_task_group_add(ks_task_group_t *group, ks_thread_function_t func, void *data);
+KS_DECLARE(ks_size_t) ks_task_group_pending(ks_task_group_t *group);
+KS_DECLARE(ks_status_t) ks_task_group_wait(ks_task_group_t *group, uint32_t timeout_ms);
+KS_DECLARE(ks_status_t) ks_task_group_destroy(ks_task_group_t **groupP);
 
 KS_END_EXTERN_C
 
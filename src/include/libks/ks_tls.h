@@ -55,6 +55,8 @@ typedef struct {
 
 	ks_tls_verify_peer_t verify_peer;
 	ks_bool_t debug;
+	ks_bool_t enable_resumption;  /* Offer and keep sessions in the process wide cache, keyed by host:port and verify_peer */
+	ks_bool_t ktls;               /* Hand record encryption to the kernel when it can, see ks_tls_get_ktls */
 
 } ks_tls_connect_params_t;
 
@@ -72,15 +74,33 @@ typedef struct {
 	char *key_file;
 	char *cipher_list;
 	ks_bool_t debug;
+	ks_bool_t disable_resumption;   /* No session cache and no tickets */
+	uint32_t session_cache_size;    /* Default equals KS_TLS_DEFAULT_SESSION_CACHE_SIZE */
+	uint32_t ticket_key_lifetime_s; /* Default equals KS_TLS_DEFAULT_TICKET_KEY_LIFETIME_S, tickets decrypt for twice that */
+	ks_bool_t ktls;                 /* Hand record encryption to the kernel when it can, see ks_tls_get_ktls */
 } ks_tls_server_ctx_params_t;
 
+/* Process wide handshake counters, see ks_tls_get_session_stats */
+typedef struct {
+	uint64_t client_full;
+	uint64_t client_resumed;
+	uint64_t server_full;
+	uint64_t server_resumed;
+	uint64_t tickets_issued;
+	uint64_t tickets_renewed; /* accepted and reissued: previous ticket key, or any TLS 1.3 resumption */
+} ks_tls_session_stats_t;
+
 typedef void (*ks_tls_init_callback_t)(ks_tls_t *ktls, SSL* ssl);
 
 /* Client APIs */
 KS_DECLARE(ks_status_t) ks_tls_connect(ks_tls_t **ktlsP, ks_tls_connect_params_t *params, ks_pool_t *pool);
+/* TCP connect only (bounded by connect_timeout_ms), the TLS handshake is then stepped with ks_tls_handshake */
+KS_DECLARE(ks_status_t) ks_tls_connect_start(ks_tls_t **ktlsP, ks_tls_connect_params_t *params, ks_pool_t *pool);
 
 /* Server APIs */
 KS_DECLARE(ks_status_t) ks_tls_accept(ks_tls_t **ktlsP, ks_tls_accept_params_t *params, ks_pool_t *pool);
+/* Takes the peer socket without handshaking, step it with ks_tls_handshake */
+KS_DECLARE(ks_status_t) ks_tls_accept_start(ks_tls_t **ktlsP, ks_tls_accept_params_t *params, ks_pool_t *pool);
 KS_DECLARE(ks_status_t) ks_tls_create_shared_server_ctx(ks_tls_shared_ctx_t **shared_ctxP, ks_tls_server_ctx_params_t *params, ks_pool_t *pool);
 KS_DECLARE(ks_status_t) ks_tls_destroy_shared_server_ctx(ks_tls_shared_ctx_t **shared_ctxP);
 
@@ -90,9 +110,29 @@ KS_DECLARE(ks_status_t) ks_tls_write_timeout(ks_tls_t *ktls, void *data, ks_size
 KS_DECLARE(ks_status_t) ks_tls_read(ks_tls_t *ktls, void *data, ks_size_t *bytes);
 KS_DECLARE(ks_status_t) ks_tls_read_timeout(ks_tls_t *ktls, void *data, ks_size_t *bytes, uint32_t timeout_ms);
 
+/**
+ * One non blocking step of the handshake, for event loops.
+ * \return KS_STATUS_SUCCESS once established, KS_STATUS_RETRY with `want` set to the
+ *         readiness to wait for on ks_tls_get_socket, anything else is a failure
+ */
+KS_DECLARE(ks_status_t) ks_tls_handshake(ks_tls_t *ktls, ks_poll_t *want);
+KS_DECLARE(ks_socket_t) ks_tls_get_socket(ks_tls_t *ktls);
 KS_DECLARE(int) ks_tls_wait_sock(ks_tls_t *ktls, uint32_t ms, ks_poll_t flags);
+/* Whether kernel TLS took over sending (tx) and receiving (rx) on an established connection */
+KS_DECLARE(void) ks_tls_get_ktls(ks_tls_t *ktls, ks_bool_t *tx, ks_bool_t *rx);
+#ifndef WIN32
+/* Sends `*bytes` of `fd` from `offset`, straight from the page cache with kernel TLS, else through ks_tls_write.
+ * `*bytes` ends up as what was sent, SUCCESS only when it is all of it */
+KS_DECLARE(ks_status_t) ks_tls_sendfile(ks_tls_t *ktls, int fd, off_t offset, ks_size_t *bytes, uint32_t timeout_ms);
+#endif
 KS_DECLARE(void) ks_tls_destroy(ks_tls_t **ktlsP);
 
+/* Session resumption */
+KS_DECLARE(ks_bool_t) ks_tls_session_reused(ks_tls_t *ktls);
+KS_DECLARE(void) ks_tls_get_session_stats(ks_tls_session_stats_t *stats);
+/* Drop every client session kept for reconnects, ks_shutdown does this too */
+KS_DECLARE(void) ks_tls_session_cache_flush(void);
+
 KS_END_EXTERN_C
 
 /* For Emacs:
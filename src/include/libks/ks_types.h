@@ -251,6 +251,8 @@ typedef struct ks_q_s ks_q_t;
 typedef void (*ks_flush_fn_t)(ks_q_t *q, void *ptr, void *flush_data);
 
 typedef struct ks_thread_pool_s ks_thread_pool_t;
+typedef struct ks_thread_pool_future_s ks_thread_pool_future_t;
+typedef struct ks_task_group_s ks_task_group_t;
 
 struct ks_network_list;
 typedef struct ks_network_list ks_network_list_t;
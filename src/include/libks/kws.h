@@ -58,9 +58,54 @@ typedef enum {
 	KWS_BLOCK = (1 << 1),
 	KWS_STAY_OPEN = (1 << 2),
 	KWS_FLAG_DONTMASK = (1 << 3),
-	KWS_HTTP = (1 << 4) /* fallback to HTTP */
+	KWS_HTTP = (1 << 4), /* fallback to HTTP */
+	KWS_FLAG_NO_READ_AHEAD = (1 << 5), /* read each frame header and payload with its own recv/SSL_read */
+	KWS_FLAG_DEFLATE = (1 << 6), /* offer/accept permessage-deflate, tuned with the deflate_* params */
+	KWS_FLAG_KTLS = (1 << 7) /* ask OpenSSL for kernel TLS on secure connections, see kws_get_ktls */
 } kws_flag_t;
 
+/* Headers kws_http_parse indexes on the way past, looked up in O(1) with kws_http_get_known */
+typedef enum {
+	KWS_HTTP_HOST,
+	KWS_HTTP_UPGRADE,
+	KWS_HTTP_CONNECTION,
+	KWS_HTTP_ORIGIN,
+	KWS_HTTP_USER_AGENT,
+	KWS_HTTP_REFERER,
+	KWS_HTTP_AUTHORIZATION,
+	KWS_HTTP_CONTENT_TYPE,
+	KWS_HTTP_CONTENT_LENGTH,
+	KWS_HTTP_SEC_WEBSOCKET_KEY,
+	KWS_HTTP_SEC_WEBSOCKET_VERSION,
+	KWS_HTTP_SEC_WEBSOCKET_PROTOCOL,
+	KWS_HTTP_SEC_WEBSOCKET_EXTENSIONS,
+	KWS_HTTP_SEC_WEBSOCKET_ACCEPT,
+	KWS_HTTP_KNOWN
+} kws_http_known_t;
+
+/* A piece of the buffer handed to kws_http_parse, by offset so the buffer may move */
+typedef struct kws_http_slice_s {
+	uint32_t off;
+	uint32_t len;
+} kws_http_slice_t;
+
+typedef struct kws_http_header_s {
+	kws_http_slice_t name;
+	kws_http_slice_t value;
+} kws_http_header_t;
+
+/* Request or response head parser state. All zeroes is a fresh parser */
+typedef struct kws_http_s {
+	int state;
+	uint32_t pos;              /* scanned up to here */
+	uint32_t line;             /* start of the line being scanned */
+	uint32_t header_len;       /* bytes up to and including the empty line, once complete */
+	kws_http_slice_t start[3]; /* method, uri, version or version, status, reason */
+	kws_http_header_t headers[KWS_MAX_HEADERS];
+	uint32_t count;
+	uint8_t known[KWS_HTTP_KNOWN]; /* 1 + index into headers, 0 when absent */
+} kws_http_t;
+
 typedef struct kws_request_s {
 	const char *method;        /* GET POST PUT DELETE OPTIONS PATCH HEAD */
 	const char *uri;
@@ -93,8 +138,56 @@ typedef struct kws_s kws_t;
 
 typedef void (*kws_init_callback_t)(kws_t *kws, SSL* ssl);
 
+/* Per connection counters, see kws_get_stats */
+typedef struct kws_stats_s {
+	ks_size_t read_calls;      /* recv or SSL_read calls made */
+	ks_size_t bytes_read;      /* bytes those calls returned */
+	ks_size_t frames_read;     /* complete messages returned by kws_read_frame */
+	ks_size_t deflate_in;      /* message bytes handed to the compressor */
+	ks_size_t deflate_out;     /* compressed bytes it turned them into */
+	ks_size_t inflate_in;      /* compressed bytes received */
+	ks_size_t inflate_out;     /* message bytes they inflated back to */
+	ks_size_t write_calls;     /* send, sendmsg or SSL_write calls made */
+	ks_size_t frames_written;  /* frames handed to those calls */
+	ks_size_t flushes;         /* batches of held back frames written out together */
+	ks_size_t flush_timeouts;  /* of those, the ones the coalescing window forced */
+} kws_stats_t;
+
+typedef struct kws_loop_s kws_loop_t;
+
+/* Called from the thread running the loop */
+typedef struct kws_loop_callbacks_s {
+	/* The handshake is done and frames can be written */
+	void (*on_open)(kws_loop_t *loop, kws_t *kws, void *user_data);
+	/* One complete message with any fragments joined, text is NULL terminated. data is only valid during the call */
+	void (*on_message)(kws_loop_t *loop, kws_t *kws, kws_opcode_t oc, uint8_t *data, ks_size_t len, void *user_data);
+	/* The connection is finished, the loop destroys it as soon as this returns */
+	void (*on_close)(kws_loop_t *loop, kws_t *kws, void *user_data);
+} kws_loop_callbacks_t;
+
+/* Where a kws_read_chunk piece sits in its message */
+typedef struct kws_chunk_s {
+	kws_opcode_t oc;           /* the message's opcode, continuation frames report the one they continue */
+	ks_bool_t last;            /* final piece of the message */
+	ks_size_t offset;          /* message bytes handed out before this piece */
+} kws_chunk_t;
+
+/* One piece of a gathered frame payload, see kws_write_framev */
+typedef struct kws_iovec_s {
+	const void *base;
+	ks_size_t len;
+} kws_iovec_t;
+
 KS_DECLARE(ks_ssize_t) kws_read_frame(kws_t *kws, kws_opcode_t *oc, uint8_t **data);
+/*
+ * Streaming alternative to kws_read_frame for large or fragmented messages: returns the next piece of
+ * payload as soon as it arrives, never more than the 64KB frame buffer, so a message is never held
+ * whole. Control frames come back whole in between. Don't mix with kws_read_frame on one connection.
+ */
+KS_DECLARE(ks_ssize_t) kws_read_chunk(kws_t *kws, kws_chunk_t *chunk, uint8_t **data);
 KS_DECLARE(ks_ssize_t) kws_write_frame(kws_t *kws, kws_opcode_t oc, const void *data, ks_size_t bytes);
+/* Writes one frame whose payload is the iovcnt pieces in iov, in order. Returns the payload length written */
+KS_DECLARE(ks_ssize_t) kws_write_framev(kws_t *kws, kws_opcode_t oc, const kws_iovec_t *iov, int iovcnt);
 KS_DECLARE(ks_ssize_t) kws_raw_read(kws_t *kws, void *data, ks_size_t bytes, int block);
 KS_DECLARE(ks_ssize_t) kws_raw_write(kws_t *kws, void *data, ks_size_t bytes);
 KS_DECLARE(ks_status_t) kws_init_ex(kws_t **kwsP, ks_socket_t sock, SSL_CTX *ssl_ctx, const char *client_data, kws_flag_t flags, ks_pool_t *pool, ks_json_t *params);
@@ -112,6 +205,56 @@ KS_DECLARE(ks_bool_t) kws_certified_client(kws_t *kws);
 KS_DECLARE(ks_size_t) kws_sans_count(kws_t *kws);
 KS_DECLARE(const char *) kws_sans_get(kws_t *kws, ks_size_t index);
 KS_DECLARE(int) kws_wait_sock(kws_t *kws, uint32_t ms, ks_poll_t flags);
+KS_DECLARE(void) kws_get_stats(kws_t *kws, kws_stats_t *stats);
+/*
+ * Write coalescing: frames are held back and written out together, one TLS record and one
+ * syscall for a burst of small messages. kws_cork holds them until kws_uncork or kws_flush.
+ * A write_coalesce_ms param holds them automatically for at most that long, a shared timer
+ * thread flushes them when the window runs out and anything held is flushed before reading
+ * or waiting to read. All of these are safe against writers on other threads.
+ * Either way a batch goes out once it reaches write_coalesce_bytes (16k, one TLS record).
+ * Connections on a kws_loop write as they go.
+ */
+KS_DECLARE(void) kws_cork(kws_t *kws);
+KS_DECLARE(ks_status_t) kws_uncork(kws_t *kws);
+KS_DECLARE(ks_status_t) kws_flush(kws_t *kws);
+/* ms until the coalescing window runs out for what is held, 0 when it already has, -1 when nothing is due */
+KS_DECLARE(int) kws_flush_due(kws_t *kws);
+/* True once the handshake agreed on permessage-deflate */
+KS_DECLARE(ks_bool_t) kws_deflate_enabled(kws_t *kws);
+/* Whether kernel TLS took over sending (tx) and receiving (rx), both KS_FALSE on plain or userspace TLS connections */
+KS_DECLARE(void) kws_get_ktls(kws_t *kws, ks_bool_t *tx, ks_bool_t *rx);
+/* Frees the pooled compression contexts, called by ks_shutdown */
+KS_DECLARE(void) kws_deflate_shutdown(void);
+/* Stops the coalescing window timer thread, called by ks_shutdown */
+KS_DECLARE(void) kws_flusher_shutdown(void);
+
+/*
+ * Event loop: connections are non blocking, their handshake, TLS and framing move forward
+ * as the socket becomes ready and messages arrive through callbacks. A loop is run by one
+ * thread, spread connections over several loops to use more. kws_write_frame may be called
+ * from any thread, anything the socket won't take right away is queued. The loop frees a
+ * connection after on_close, so other threads hold a kws_loop_ref (taken from a callback)
+ * while they use it, writes fail once it has closed and the last kws_loop_unref frees it.
+ */
+KS_DECLARE(ks_status_t) kws_loop_create(kws_loop_t **loopP, ks_pool_t *pool);
+KS_DECLARE(void) kws_loop_destroy(kws_loop_t **loopP);
+/* Take over a freshly accepted server socket, the loop does the TLS and websocket handshakes */
+KS_DECLARE(ks_status_t) kws_loop_accept(kws_loop_t *loop, ks_socket_t sock, SSL_CTX *ssl_ctx, kws_flag_t flags, ks_json_t *params,
+										const kws_loop_callbacks_t *callbacks, void *user_data, kws_t **kwsP);
+/* Move an already established connection onto the loop, which owns it from then on. On failure
+ * it is back in blocking mode and still the caller's to destroy */
+KS_DECLARE(ks_status_t) kws_loop_add(kws_loop_t *loop, kws_t *kws, const kws_loop_callbacks_t *callbacks, void *user_data);
+/* Close a connection on a loop from any thread, on_close follows from the loop thread */
+KS_DECLARE(void) kws_loop_close(kws_t *kws, int16_t reason);
+KS_DECLARE(ks_status_t) kws_loop_ref(kws_t *kws);
+KS_DECLARE(void) kws_loop_unref(kws_t **kwsP);
+KS_DECLARE(ks_size_t) kws_loop_count(kws_loop_t *loop);
+/* Wait up to timeout_ms for readiness and service it, returns the number of ready connections or -1 */
+KS_DECLARE(int) kws_loop_run_once(kws_loop_t *loop, uint32_t timeout_ms);
+/* Run until kws_loop_stop */
+KS_DECLARE(void) kws_loop_run(kws_loop_t *loop);
+KS_DECLARE(void) kws_loop_stop(kws_loop_t *loop);
 KS_DECLARE(int) kws_test_flag(kws_t *kws, kws_flag_t);
 KS_DECLARE(int) kws_set_flag(kws_t *kws, kws_flag_t);
 KS_DECLARE(int) kws_clear_flag(kws_t *kws, kws_flag_t);
@@ -135,6 +278,23 @@ KS_DECLARE(ks_status_t) kws_parse_qs(kws_request_t *request, char *qs);
 KS_DECLARE(ks_ssize_t) kws_read_buffer(kws_t *kws, uint8_t **data, ks_size_t bytes, int block);
 KS_DECLARE(ks_status_t) kws_keepalive(kws_t *kws);
 KS_DECLARE(const char *) kws_request_get_header(kws_request_t *request, const char *key);
+KS_DECLARE(void) kws_http_init(kws_http_t *http);
+/**
+ * Parse an HTTP/1.x request or response head in place, resuming where the last call stopped.
+ * buf must hold everything passed so far, with len bytes valid. Lines are NUL terminated as
+ * they complete, so every slice is also a C string at buf + off.
+ * \return 1 once the empty line is seen, 0 when more data is needed, -1 when malformed
+ */
+KS_DECLARE(int) kws_http_parse(kws_http_t *http, char *buf, ks_size_t len);
+/* Header value by name, case insensitive. A repeated header gives its last value */
+KS_DECLARE(const char *) kws_http_get(const kws_http_t *http, const char *buf, const char *name);
+KS_DECLARE(const char *) kws_http_get_known(const kws_http_t *http, const char *buf, kws_http_known_t which);
+/* XOR len bytes of src into dst with a websocket masking key, offset is src's position in the masked stream. dst may equal src */
+KS_DECLARE(void) kws_mask(void *dst, const void *src, ks_size_t len, const uint8_t key[4], ks_size_t offset);
+/* Name of the masking kernel in use: scalar, word, sse2, avx2 or neon. Picked from the cpu on first use */
+KS_DECLARE(const char *) kws_mask_get_kernel(void);
+/* Force a masking kernel by name, NULL goes back to the automatic choice */
+KS_DECLARE(ks_status_t) kws_mask_set_kernel(const char *name);
 
 KS_END_EXTERN_C
 
@@ -27,6 +27,9 @@
 /* The one and only global pool */
 static ks_pool_t *g_pool;
 
+/* Flags the global pool gets opened with */
+static ks_pool_flag_t g_pool_flags = KS_POOL_FLAG_DEFAULT;
+
 /* This keeps track of the number of calls to init, since we allow layered inits
  * we will null up the 2+ inits until the loaded count drops to zero on deinit. */
 static ks_size_t g_init_count;
@@ -96,6 +99,9 @@ KS_DECLARE(ks_status_t) ks_shutdown(void)
 #endif
 
 	ks_ssl_destroy_ssl_locks();
+	kws_flusher_shutdown();
+	kws_deflate_shutdown();
+	ks_tls_session_cache_flush();
 
 	if (g_pool) {
 		status = ks_pool_close(&g_pool);
@@ -122,7 +128,7 @@ KS_DECLARE(ks_pool_t *) ks_global_pool(void)
 
 		if (!g_pool) {
 
-			if (ks_pool_open(&g_pool) != KS_STATUS_SUCCESS) {
+			if (ks_pool_open_ex(&g_pool, g_pool_flags) != KS_STATUS_SUCCESS) {
 				abort();
 			}
 
@@ -137,6 +143,17 @@ KS_DECLARE(ks_pool_t *) ks_global_pool(void)
 	return g_pool;
 }
 
+KS_DECLARE(ks_status_t) ks_global_pool_set_flags(ks_pool_flag_t flags)
+{
+	if (g_pool) {
+		return KS_STATUS_FAIL;
+	}
+
+	g_pool_flags = flags;
+
+	return KS_STATUS_SUCCESS;
+}
+
 KS_ENUM_NAMES(STATUS_NAMES, STATUS_STRINGS)
 KS_STR2ENUM(ks_str2ks_status, ks_status2str, ks_status_t, STATUS_NAMES, KS_STATUS_COUNT)
 
@@ -34,6 +34,25 @@
 #include "libks/ks.h"
 #include "libks/ks_hash.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KS_HASH_SSE2 1
+#endif
+
+/*
+ * KS_HASH_FLAG_OPEN_ADDRESSING layout: a power of two array of entries with one control byte
+ * per slot, probed a 16 slot group at a time. A control byte is EMPTY, DELETED or, for a full
+ * slot, the top 7 bits of the entry's hash.
+ */
+#define OA_GROUP 16
+#define OA_CTRL_EMPTY ((int8_t)-128)
+#define OA_CTRL_DELETED ((int8_t)-2)
+#define OA_H2(_h) ((int8_t)((_h) >> 25))
+
+/* KS_HASH_FLAG_SHARDED splits the table into this many independently locked sub tables */
+#define SHARD_BITS 4
+#define SHARD_COUNT (1u << SHARD_BITS)
+
 struct entry
 {
     void *k, *v;
@@ -48,11 +67,35 @@ struct ks_hash_iterator {
 	ks_locked_t locked;
 	struct entry *e;
 	struct ks_hash *h;
+	/* Sharded tables walk each shard's own iterator in turn */
+	unsigned int shard;
+	struct ks_hash_iterator *inner;
 };
 
+/*
+ * Lookups skip the shard's rwl and use a spinning reader/writer lock instead: they only announce
+ * themselves in readers. A writer raises writing and spins until the readers already inside have
+ * left, and new readers spin until it is done. So a lookup never sees a half applied change or
+ * freed memory, but it is not lock free. Writers and whole table readers take rwl as usual.
+ */
+typedef struct ks_hash_shard {
+	struct ks_hash *table;
+	ks_rwl_t *rwl;
+	volatile uint32_t writing;
+	volatile uint32_t readers;
+	ks_pid_t writer;
+	char pad[64];
+} ks_hash_shard_t;
+
 struct ks_hash {
     unsigned int tablelength;
     struct entry **table;
+	/* Open addressing table, table is unused when set */
+	struct entry *slots;
+	int8_t *ctrl;
+	unsigned int growth_left;
+	ks_bool_t open;
+	ks_hash_shard_t *shards;
     unsigned int entrycount;
     unsigned int loadlimit;
     unsigned int primeindex;
@@ -70,7 +113,7 @@ struct ks_hash {
 /*****************************************************************************/
 
 /*****************************************************************************/
-static inline unsigned int hash(ks_hash_t *h, const void *k)
+static inline unsigned int raw_hash(ks_hash_t *h, const void *k)
 {
     unsigned int i;
 
@@ -90,6 +133,23 @@ static inline unsigned int hash(ks_hash_t *h, const void *k)
 		break;
 	}
 
+	return i;
+}
+
+static inline unsigned int hash(ks_hash_t *h, const void *k)
+{
+    unsigned int i = raw_hash(h, k);
+
+	if (h->open) {
+		/* Power of two tables index with the low bits and fingerprint with the high ones, both need a full avalanche */
+		i ^= i >> 16;
+		i *= 0x85ebca6b;
+		i ^= i >> 13;
+		i *= 0xc2b2ae35;
+		i ^= i >> 16;
+		return i;
+	}
+
 	/* Aim to protect against poor hash functions by adding logic here
 	 * - logic taken from java 1.4 hash source */
 
@@ -137,6 +197,154 @@ static const unsigned int primes[] = {
 const unsigned int prime_table_length = sizeof(primes)/sizeof(primes[0]);
 const float max_load_factor = 0.65f;
 
+/*****************************************************************************/
+/* Open addressing helpers */
+
+static __inline__ unsigned int oa_ctz(uint32_t x)
+{
+#ifdef _MSC_VER
+	unsigned long r;
+	_BitScanForward(&r, x);
+	return (unsigned int) r;
+#else
+	return (unsigned int) __builtin_ctz(x);
+#endif
+}
+
+/* Bit n set for every slot in the group whose control byte equals c */
+static __inline__ uint32_t oa_group_match(const int8_t *group, int8_t c)
+{
+#ifdef KS_HASH_SSE2
+	__m128i g = _mm_loadu_si128((const __m128i *) group);
+	return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < OA_GROUP; i++) {
+		if (group[i] == c) mask |= 1u << i;
+	}
+
+	return mask;
+#endif
+}
+
+/* Bit n set for every EMPTY or DELETED slot, both are the only control values with the sign bit set */
+static __inline__ uint32_t oa_group_free(const int8_t *group)
+{
+#ifdef KS_HASH_SSE2
+	return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#else
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < OA_GROUP; i++) {
+		if (group[i] < 0) mask |= 1u << i;
+	}
+
+	return mask;
+#endif
+}
+
+static __inline__ unsigned int oa_growth(unsigned int capacity)
+{
+	return capacity - capacity / 8;
+}
+
+/* First free slot in the probe sequence for hashvalue, the table always has one */
+static unsigned int oa_find_free(const int8_t *ctrl, unsigned int capacity, unsigned int hashvalue)
+{
+	unsigned int gmask = capacity / OA_GROUP - 1;
+	unsigned int g = hashvalue & gmask, step = 0;
+	uint32_t m;
+
+	for (;;) {
+		if ((m = oa_group_free(ctrl + g * OA_GROUP))) {
+			return g * OA_GROUP + oa_ctz(m);
+		}
+		g = (g + ++step) & gmask;
+	}
+}
+
+static int key_equals(ks_hash_t *h, const void * const k1, const void * const k2);
+
+/* Slot holding k, or -1. Triangular probing over groups visits every group once */
+static int oa_find(ks_hash_t *h, const void *k, unsigned int hashvalue)
+{
+	unsigned int gmask = h->tablelength / OA_GROUP - 1;
+	unsigned int g = hashvalue & gmask, step = 0;
+	int8_t h2 = OA_H2(hashvalue);
+	uint32_t m;
+
+	for (;;) {
+		const int8_t *group = h->ctrl + g * OA_GROUP;
+
+		for (m = oa_group_match(group, h2); m; m &= m - 1) {
+			unsigned int slot = g * OA_GROUP + oa_ctz(m);
+			struct entry *e = &h->slots[slot];
+
+			if (e->h == hashvalue && key_equals(h, k, e->k)) {
+				return (int) slot;
+			}
+		}
+
+		if (oa_group_match(group, OA_CTRL_EMPTY) || step >= gmask) {
+			return -1;
+		}
+
+		g = (g + ++step) & gmask;
+	}
+}
+
+static int oa_alloc(ks_hash_t *h, unsigned int capacity)
+{
+	struct entry *slots;
+	int8_t *ctrl;
+
+	if (!(slots = ks_pool_alloc(ks_pool_get(h), sizeof(struct entry) * capacity))) return 0;
+	if (!(ctrl = ks_pool_alloc(ks_pool_get(h), capacity))) {
+		ks_pool_free(&slots);
+		return 0;
+	}
+
+	memset(ctrl, OA_CTRL_EMPTY, capacity);
+
+	h->slots = slots;
+	h->ctrl = ctrl;
+	h->tablelength = capacity;
+	h->growth_left = oa_growth(capacity) - h->entrycount;
+
+	return 1;
+}
+
+/* Grow when mostly full of live entries, otherwise rebuild at the same size to drop tombstones */
+static int oa_rehash(ks_hash_t *h)
+{
+	struct entry *old_slots = h->slots;
+	int8_t *old_ctrl = h->ctrl;
+	unsigned int old_capacity = h->tablelength, capacity = old_capacity, i;
+
+	if ((h->entrycount + 1) * 2 > oa_growth(old_capacity)) {
+		if (capacity >= (1u << 30)) return 0;
+		capacity *= 2;
+	}
+
+	if (!oa_alloc(h, capacity)) return 0;
+
+	for (i = 0; i < old_capacity; i++) {
+		if (old_ctrl[i] >= 0) {
+			unsigned int slot = oa_find_free(h->ctrl, capacity, old_slots[i].h);
+			h->ctrl[slot] = old_ctrl[i];
+			h->slots[slot] = old_slots[i];
+		}
+	}
+
+	ks_pool_free(&old_slots);
+	ks_pool_free(&old_ctrl);
+
+	return 1;
+}
+
 /*****************************************************************************/
 
 static void ks_hash_cleanup(void *ptr, void *arg, ks_pool_cleanup_action_t action, ks_pool_cleanup_type_t type)
@@ -155,6 +363,100 @@ static void ks_hash_cleanup(void *ptr, void *arg, ks_pool_cleanup_action_t actio
 
 }
 
+/*****************************************************************************/
+/* Sharded table helpers */
+
+/* A different mix from the shard tables' own so shard choice doesn't eat into their index or fingerprint bits */
+static __inline__ ks_hash_shard_t *shard_for(ks_hash_t *h, const void *k)
+{
+	unsigned int i = raw_hash(h, k) * 0x9e3779b1u;
+
+	i ^= i >> 15;
+	i *= 0x2c1b3c6du;
+
+	return &h->shards[i >> (32 - SHARD_BITS)];
+}
+
+static void shard_write_begin(ks_hash_shard_t *shard)
+{
+	uint32_t spins = 0;
+
+	ks_rwl_write_lock(shard->rwl);
+
+	/* Re-entered by the thread already writing, from a destructor or under ks_hash_write_lock */
+	if (ks_atomic_increment_uint32(&shard->writing)) {
+		return;
+	}
+
+	shard->writer = ks_thread_self_id();
+
+	while (ks_atomic_load_uint32(&shard->readers)) {
+		if (++spins > 100) ks_sleep(0);
+	}
+}
+
+static void shard_write_end(ks_hash_shard_t *shard)
+{
+	if (shard->writing == 1) shard->writer = 0;
+	ks_atomic_decrement_uint32(&shard->writing);
+	ks_rwl_write_unlock(shard->rwl);
+}
+
+static void *shard_search(ks_hash_shard_t *shard, const void *k)
+{
+	uint32_t spins = 0;
+	void *v;
+
+	/* The writer looking up its own shard would otherwise wait on itself */
+	if (ks_atomic_load_uint32(&shard->writing) && shard->writer == ks_thread_self_id()) {
+		return ks_hash_search(shard->table, k, KS_UNLOCKED);
+	}
+
+	for (;;) {
+		ks_atomic_increment_uint32(&shard->readers);
+
+		if (!ks_atomic_load_uint32(&shard->writing)) {
+			break;
+		}
+
+		ks_atomic_decrement_uint32(&shard->readers);
+
+		while (ks_atomic_load_uint32(&shard->writing)) {
+			if (++spins > 100) ks_sleep(0);
+		}
+	}
+
+	v = ks_hash_search(shard->table, k, KS_UNLOCKED);
+
+	ks_atomic_decrement_uint32(&shard->readers);
+
+	return v;
+}
+
+static ks_status_t shards_create(ks_hash_t *h, unsigned int minsize, unsigned int (*hashf) (void*), int (*eqf) (void*,void*), ks_pool_t *pool)
+{
+	ks_hash_flag_t flags = (h->flags & ~(KS_HASH_FLAG_SHARDED | KS_HASH_FLAG_RWLOCK | KS_HASH_FLAG_MUTEX)) | KS_HASH_FLAG_NOLOCK;
+	unsigned int i;
+
+	h->shards = ks_pool_alloc(pool, sizeof(ks_hash_shard_t) * SHARD_COUNT);
+
+	for (i = 0; i < SHARD_COUNT; i++) {
+		ks_hash_shard_t *shard = &h->shards[i];
+
+		/* The built in modes pick their own hash/compare functions and assert they weren't given any */
+		if (h->mode == KS_HASH_MODE_DEFAULT || h->mode == KS_HASH_MODE_CASE_SENSITIVE || h->mode == KS_HASH_MODE_ARBITRARY) {
+			ks_hash_create_ex(&shard->table, minsize / SHARD_COUNT, hashf, eqf, h->mode, flags, h->destructor, pool);
+		} else {
+			ks_hash_create_ex(&shard->table, minsize / SHARD_COUNT, NULL, NULL, h->mode, flags, h->destructor, pool);
+		}
+		ks_hash_set_keysize(shard->table, h->keysize);
+
+		ks_rwl_create(&shard->rwl, pool);
+	}
+
+	return KS_STATUS_SUCCESS;
+}
+
 KS_DECLARE(ks_status_t) ks_hash_create(ks_hash_t **hp, ks_hash_mode_t mode, ks_hash_flag_t flags, ks_pool_t *pool)
 {
 	return ks_hash_create_ex(hp, 16, NULL, NULL, mode, flags, NULL, pool);
@@ -162,16 +464,39 @@ KS_DECLARE(ks_status_t) ks_hash_create(ks_hash_t **hp, ks_hash_mode_t mode, ks_h
 
 KS_DECLARE(void) ks_hash_set_flags(ks_hash_t *h, ks_hash_flag_t flags)
 {
+	unsigned int i;
+
+	if (h->shards) {
+		/* The sharded locking scheme is fixed at creation */
+		flags |= KS_HASH_FLAG_SHARDED;
+
+		for (i = 0; i < SHARD_COUNT; i++) {
+			ks_hash_set_flags(h->shards[i].table, (flags & ~(KS_HASH_FLAG_SHARDED | KS_HASH_FLAG_RWLOCK | KS_HASH_FLAG_MUTEX)) | KS_HASH_FLAG_NOLOCK);
+		}
+	}
+
 	h->flags = flags;
 }
 
 KS_DECLARE(void) ks_hash_set_keysize(ks_hash_t *h, ks_size_t keysize)
 {
+	unsigned int i;
+
+	for (i = 0; h->shards && i < SHARD_COUNT; i++) {
+		ks_hash_set_keysize(h->shards[i].table, keysize);
+	}
+
 	h->keysize = keysize;
 }
 
 KS_DECLARE(void) ks_hash_set_destructor(ks_hash_t *h, ks_hash_destructor_t destructor)
 {
+	unsigned int i;
+
+	for (i = 0; h->shards && i < SHARD_COUNT; i++) {
+		ks_hash_set_destructor(h->shards[i].table, destructor);
+	}
+
 	h->destructor = destructor;
 }
 
@@ -231,6 +556,10 @@ ks_hash_create_ex(
 		break;
 	}
 
+	if ((flags & KS_HASH_FLAG_SHARDED)) {
+		flags &= ~(KS_HASH_FLAG_RWLOCK | KS_HASH_FLAG_NOLOCK);
+	}
+
 	if ((flags & KS_HASH_FLAG_NOLOCK)) {
 		flags &= ~KS_HASH_FLAG_RWLOCK;
 	}
@@ -251,11 +580,25 @@ ks_hash_create_ex(
     }
 
     h = (ks_hash_t *) ks_pool_alloc(pool, sizeof(ks_hash_t));
+	h->open = (flags & KS_HASH_FLAG_OPEN_ADDRESSING) ? KS_TRUE : KS_FALSE;
 	h->flags = flags;
 	h->destructor = destructor;
 	h->keysize = keysize;
 	h->mode = mode;
 
+	if ((flags & KS_HASH_FLAG_SHARDED)) {
+		h->hashfn = hashf;
+		h->eqfn = eqf;
+
+		shards_create(h, minsize, hashf, eqf, pool);
+
+		*hp = h;
+
+		ks_pool_set_cleanup(h, NULL, ks_hash_cleanup);
+
+		return KS_STATUS_SUCCESS;
+	}
+
 	if ((flags & KS_HASH_FLAG_RWLOCK)) {
 		ks_rwl_create(&h->rwl, pool);
 	}
@@ -267,6 +610,23 @@ ks_hash_create_ex(
 
     if (NULL == h) abort(); /*oom*/
 
+	h->hashfn       = hashf;
+	h->eqfn         = eqf;
+
+	if (h->open) {
+		unsigned int capacity = OA_GROUP;
+
+		while (oa_growth(capacity) < minsize) capacity *= 2;
+
+		if (!oa_alloc(h, capacity)) abort(); /*oom*/
+
+		*hp = h;
+
+		ks_pool_set_cleanup(h, NULL, ks_hash_cleanup);
+
+		return KS_STATUS_SUCCESS;
+	}
+
     h->table = (struct entry **)ks_pool_alloc(pool, sizeof(struct entry*) * size);
 
     if (NULL == h->table) abort(); /*oom*/
@@ -323,7 +683,7 @@ ks_hash_expand(ks_hash_t *h)
 				ks_pool_resize(h->table, newsize * sizeof(struct entry *));
 			if (NULL == newtable) { (h->primeindex)--; return 0; }
 			h->table = newtable;
-			memset(newtable[h->tablelength], 0, newsize - h->tablelength);
+			memset(&newtable[h->tablelength], 0, (newsize - h->tablelength) * sizeof(struct entry *));
 			for (i = 0; i < h->tablelength; i++) {
 				for (pE = &(newtable[i]), e = *pE; e != NULL; e = *pE) {
 					index = indexFor(newsize,e->h);
@@ -347,6 +707,15 @@ ks_hash_expand(ks_hash_t *h)
 KS_DECLARE(unsigned int)
 ks_hash_count(ks_hash_t *h)
 {
+	unsigned int i, count = 0;
+
+	if (h->shards) {
+		for (i = 0; i < SHARD_COUNT; i++) {
+			count += h->shards[i].table->entrycount;
+		}
+		return count;
+	}
+
     return h->entrycount;
 }
 
@@ -367,6 +736,81 @@ static int key_equals(ks_hash_t *h, const void * const k1, const void * const k2
 	return h->eqfn((void *)k1, (void *)k2);
 }
 
+static void *oa_remove(ks_hash_t *h, const void * const k, unsigned int hashvalue)
+{
+	struct entry *e;
+	void *v;
+	int slot;
+
+	if ((slot = oa_find(h, k, hashvalue)) < 0) {
+		return NULL;
+	}
+
+	/* Leave a tombstone rather than shifting entries, iterators may be parked on a later slot */
+	h->ctrl[slot] = OA_CTRL_DELETED;
+	h->entrycount--;
+
+	e = &h->slots[slot];
+	v = e->v;
+	if (e->flags & KS_HASH_FLAG_FREE_KEY) {
+		ks_pool_free(&e->k);
+	}
+	if (e->flags & KS_HASH_FLAG_FREE_VALUE) {
+		ks_pool_free(&e->v);
+		v = NULL;
+	} else if (e->destructor) {
+		e->destructor(e->v);
+		v = NULL;
+	} else if (h->destructor) {
+		h->destructor(e->v);
+		v = NULL;
+	}
+
+	memset(e, 0, sizeof(*e));
+
+	return v;
+}
+
+static ks_status_t oa_insert(ks_hash_t *h, const void * const k, const void * const v, unsigned int hashvalue, ks_hash_flag_t flags, ks_hash_destructor_t destructor)
+{
+	struct entry *e;
+	unsigned int slot;
+
+	if (flags & KS_HASH_FLAG_DUP_CHECK) {
+		oa_remove(h, k, hashvalue);
+	}
+
+	slot = oa_find_free(h->ctrl, h->tablelength, hashvalue);
+
+	if (h->ctrl[slot] == OA_CTRL_EMPTY) {
+		if (!h->growth_left) {
+			/* Like the chained table, a failed grow still tries to squeeze the entry in */
+			if (oa_rehash(h)) {
+				slot = oa_find_free(h->ctrl, h->tablelength, hashvalue);
+			} else if (h->entrycount + 1 >= h->tablelength) {
+				return KS_STATUS_FAIL;
+			}
+		}
+
+		if (h->ctrl[slot] == OA_CTRL_EMPTY && h->growth_left) {
+			h->growth_left--;
+		}
+	}
+
+	h->ctrl[slot] = OA_H2(hashvalue);
+	h->entrycount++;
+
+	e = &h->slots[slot];
+	e->h = hashvalue;
+	e->k = (void *)k;
+	e->v = (void *)v;
+	e->flags = flags;
+	e->destructor = destructor;
+	e->next = NULL;
+
+	return KS_STATUS_SUCCESS;
+}
+
 static void * _ks_hash_remove(ks_hash_t *h, const void * const k, unsigned int hashvalue, unsigned int index) {
     /* TODO: consider compacting the table when the load factor drops enough,
      *       or provide a 'compact' method. */
@@ -410,8 +854,21 @@ static void * _ks_hash_remove(ks_hash_t *h, const void * const k, unsigned int h
 KS_DECLARE(ks_status_t) ks_hash_insert_ex(ks_hash_t *h, const void * const k, const void * const v, ks_hash_flag_t flags, ks_hash_destructor_t destructor)
 {
     struct entry *e;
-	unsigned int hashvalue = hash(h, k);
-    unsigned int index = indexFor(h->tablelength, hashvalue);
+	unsigned int hashvalue;
+    unsigned int index;
+
+	if (h->shards) {
+		ks_hash_shard_t *shard = shard_for(h, k);
+		ks_status_t status;
+
+		shard_write_begin(shard);
+		status = ks_hash_insert_ex(shard->table, k, v, flags, destructor);
+		shard_write_end(shard);
+
+		return status;
+	}
+
+	hashvalue = hash(h, k);
 
 	ks_hash_write_lock(h);
 
@@ -419,6 +876,14 @@ KS_DECLARE(ks_status_t) ks_hash_insert_ex(ks_hash_t *h, const void * const k, co
 		flags = h->flags;
 	}
 
+	if (h->open) {
+		ks_status_t status = oa_insert(h, k, v, hashvalue, flags, destructor);
+		ks_hash_write_unlock(h);
+		return status;
+	}
+
+	index = indexFor(h->tablelength, hashvalue);
+
 	if (flags & KS_HASH_FLAG_DUP_CHECK) {
 		_ks_hash_remove(h, k, hashvalue, index);
 	}
@@ -449,7 +914,14 @@ KS_DECLARE(ks_status_t) ks_hash_insert_ex(ks_hash_t *h, const void * const k, co
 
 KS_DECLARE(void) ks_hash_write_lock(ks_hash_t *h)
 {
-	if ((h->flags & KS_HASH_FLAG_NOLOCK)) {
+	unsigned int i;
+
+	if (h->shards) {
+		/* Whole table lock, always taken in shard order, with each shard's lookups drained and held off too */
+		for (i = 0; i < SHARD_COUNT; i++) {
+			shard_write_begin(&h->shards[i]);
+		}
+	} else if ((h->flags & KS_HASH_FLAG_NOLOCK)) {
 		return;
 	} else if ((h->flags & KS_HASH_FLAG_RWLOCK)) {
 		ks_rwl_write_lock(h->rwl);
@@ -460,7 +932,13 @@ KS_DECLARE(void) ks_hash_write_lock(ks_hash_t *h)
 
 KS_DECLARE(void) ks_hash_write_unlock(ks_hash_t *h)
 {
-	if ((h->flags & KS_HASH_FLAG_NOLOCK)) {
+	unsigned int i;
+
+	if (h->shards) {
+		for (i = SHARD_COUNT; i > 0; i--) {
+			shard_write_end(&h->shards[i - 1]);
+		}
+	} else if ((h->flags & KS_HASH_FLAG_NOLOCK)) {
 		return;
 	} else if ((h->flags & KS_HASH_FLAG_RWLOCK)) {
 		ks_rwl_write_unlock(h->rwl);
@@ -471,6 +949,16 @@ KS_DECLARE(void) ks_hash_write_unlock(ks_hash_t *h)
 
 KS_DECLARE(ks_status_t) ks_hash_read_lock(ks_hash_t *h)
 {
+	unsigned int i;
+
+	if (h->shards) {
+		/* A consistent view of the whole table, shared with other whole table readers and lookups */
+		for (i = 0; i < SHARD_COUNT; i++) {
+			ks_rwl_read_lock(h->shards[i].rwl);
+		}
+		return KS_STATUS_SUCCESS;
+	}
+
 	if (!(h->flags & KS_HASH_FLAG_RWLOCK)) {
 		return KS_STATUS_INACTIVE;
 	}
@@ -486,6 +974,15 @@ KS_DECLARE(ks_status_t) ks_hash_read_lock(ks_hash_t *h)
 
 KS_DECLARE(ks_status_t) ks_hash_read_unlock(ks_hash_t *h)
 {
+	unsigned int i;
+
+	if (h->shards) {
+		for (i = SHARD_COUNT; i > 0; i--) {
+			ks_rwl_read_unlock(h->shards[i - 1].rwl);
+		}
+		return KS_STATUS_SUCCESS;
+	}
+
 	if (!(h->flags & KS_HASH_FLAG_RWLOCK)) {
 		return KS_STATUS_INACTIVE;
 	}
@@ -508,10 +1005,16 @@ ks_hash_search(ks_hash_t *h, const void *k, ks_locked_t locked)
     unsigned int hashvalue, index;
 	void *v = NULL;
 
-	ks_assert(locked != KS_READLOCKED || (h->flags & KS_HASH_FLAG_RWLOCK));
+	ks_assert(locked != KS_READLOCKED || (h->flags & (KS_HASH_FLAG_RWLOCK | KS_HASH_FLAG_SHARDED)));
+
+	if (h->shards) {
+		if (locked == KS_READLOCKED) {
+			ks_hash_read_lock(h);
+		}
+		return shard_search(shard_for(h, k), k);
+	}
 
     hashvalue = hash(h,k);
-    index = indexFor(h->tablelength,hashvalue);
 
 	if (locked == KS_READLOCKED) {
 		ks_rwl_read_lock(h->rwl);
@@ -521,6 +1024,12 @@ ks_hash_search(ks_hash_t *h, const void *k, ks_locked_t locked)
 		ks_mutex_unlock(h->mutex);
 	}
 
+	if (h->open) {
+		int slot = oa_find(h, k, hashvalue);
+		return slot < 0 ? NULL : h->slots[slot].v;
+	}
+
+    index = indexFor(h->tablelength,hashvalue);
     e = h->table[index];
     while (NULL != e) {
 		/* Check hash value to short circuit heavier comparison */
@@ -539,10 +1048,26 @@ ks_hash_search(ks_hash_t *h, const void *k, ks_locked_t locked)
 KS_DECLARE(void *) ks_hash_remove(ks_hash_t *h, const void * const k)
 {
 	void *v;
-	unsigned int hashvalue = hash(h,k);
+	unsigned int hashvalue;
+
+	if (h->shards) {
+		ks_hash_shard_t *shard = shard_for(h, k);
+
+		shard_write_begin(shard);
+		v = ks_hash_remove(shard->table, k);
+		shard_write_end(shard);
+
+		return v;
+	}
+
+	hashvalue = hash(h,k);
 
 	ks_hash_write_lock(h);
-	v = _ks_hash_remove(h, k, hashvalue, indexFor(h->tablelength,hashvalue));
+	if (h->open) {
+		v = oa_remove(h, k, hashvalue);
+	} else {
+		v = _ks_hash_remove(h, k, hashvalue, indexFor(h->tablelength,hashvalue));
+	}
 	ks_hash_write_unlock(h);
 
 	return v;
@@ -559,11 +1084,50 @@ KS_DECLARE(void) ks_hash_destroy(ks_hash_t **h)
 	if (!h || !*h)
 		return;
 
+	if ((*h)->shards) {
+		for (i = 0; i < SHARD_COUNT; i++) {
+			ks_hash_shard_t *shard = &(*h)->shards[i];
+
+			shard_write_begin(shard);
+			ks_hash_destroy(&shard->table);
+			shard_write_end(shard);
+			ks_rwl_destroy(&shard->rwl);
+		}
+
+		ks_pool_free(&(*h)->shards);
+		ks_pool_free(&(*h));
+		*h = NULL;
+		return;
+	}
+
 	table = (*h)->table;
 
 	ks_hash_write_lock(*h);
 
-	for (i = 0; i < (*h)->tablelength; i++) {
+	for (i = 0; (*h)->open && i < (*h)->tablelength; i++) {
+		if ((*h)->ctrl[i] < 0) continue;
+
+		f = &(*h)->slots[i];
+
+		if (f->flags & KS_HASH_FLAG_FREE_KEY) {
+			ks_pool_free(&f->k);
+		}
+
+		if (f->flags & KS_HASH_FLAG_FREE_VALUE) {
+			ks_pool_free(&f->v);
+		} else if (f->destructor) {
+			f->destructor(f->v);
+		} else if ((*h)->destructor) {
+			(*h)->destructor(f->v);
+		}
+	}
+
+	if ((*h)->open) {
+		ks_pool_free(&(*h)->slots);
+		ks_pool_free(&(*h)->ctrl);
+	}
+
+	for (i = 0; !(*h)->open && i < (*h)->tablelength; i++) {
 		e = table[i];
 		while (NULL != e) {
 			f = e; e = e->next;
@@ -585,7 +1149,9 @@ KS_DECLARE(void) ks_hash_destroy(ks_hash_t **h)
 		}
 	}
 
-    ks_pool_free(&(*h)->table);
+	if ((*h)->table) {
+		ks_pool_free(&(*h)->table);
+	}
 	ks_hash_write_unlock(*h);
 	if ((*h)->rwl) ks_pool_free(&(*h)->rwl);
 	if ((*h)->mutex) {
@@ -599,7 +1165,15 @@ KS_DECLARE(void) ks_hash_last(ks_hash_iterator_t **iP)
 {
 	ks_hash_iterator_t *i = *iP;
 
-	if (i->locked == KS_READLOCKED) {
+	if (i->inner) {
+		ks_hash_last(&i->inner);
+	}
+
+	if (i->h->shards) {
+		if (i->locked == KS_READLOCKED) {
+			ks_hash_read_unlock(i->h);
+		}
+	} else if (i->locked == KS_READLOCKED) {
 		ks_mutex_lock(i->h->mutex);
 		i->h->readers--;
 		ks_mutex_unlock(i->h->mutex);
@@ -617,6 +1191,42 @@ KS_DECLARE(ks_hash_iterator_t *) ks_hash_next(ks_hash_iterator_t **iP)
 
 	ks_hash_iterator_t *i = *iP;
 
+	if (i->h->shards) {
+		if (i->inner) {
+			i->inner = ks_hash_next(&i->inner);
+		} else if (i->shard < SHARD_COUNT) {
+			i->inner = ks_hash_first(i->h->shards[i->shard].table, KS_UNLOCKED);
+		}
+
+		while (!i->inner && ++i->shard < SHARD_COUNT) {
+			i->inner = ks_hash_first(i->h->shards[i->shard].table, KS_UNLOCKED);
+		}
+
+		if (i->inner) {
+			i->e = i->inner->e;
+			return i;
+		}
+
+		goto end;
+	}
+
+	if (i->h->open) {
+		if (i->e) {
+			i->pos++;
+		}
+
+		while (i->pos < i->h->tablelength && i->h->ctrl[i->pos] < 0) {
+			i->pos++;
+		}
+
+		if (i->pos < i->h->tablelength) {
+			i->e = &i->h->slots[i->pos];
+			return i;
+		}
+
+		goto end;
+	}
+
 	if (i->e) {
 		if ((i->e = i->e->next) != 0) {
 			return i;
@@ -648,7 +1258,7 @@ KS_DECLARE(ks_hash_iterator_t *) ks_hash_first(ks_hash_t *h, ks_locked_t locked)
 {
 	ks_hash_iterator_t *iterator;
 
-	ks_assert(locked != KS_READLOCKED || (h->flags & KS_HASH_FLAG_RWLOCK));
+	ks_assert(locked != KS_READLOCKED || (h->flags & (KS_HASH_FLAG_RWLOCK | KS_HASH_FLAG_SHARDED)));
 
 	iterator = ks_pool_alloc(ks_pool_get(h), sizeof(*iterator));
 	ks_assert(iterator);
@@ -657,7 +1267,12 @@ KS_DECLARE(ks_hash_iterator_t *) ks_hash_first(ks_hash_t *h, ks_locked_t locked)
 	iterator->e = NULL;
 	iterator->h = h;
 
-	if (locked == KS_READLOCKED) {
+	if (h->shards) {
+		if (locked == KS_READLOCKED) {
+			ks_hash_read_lock(h);
+			iterator->locked = locked;
+		}
+	} else if (locked == KS_READLOCKED) {
 		ks_rwl_read_lock(h->rwl);
 		iterator->locked = locked;
 		ks_mutex_lock(h->mutex);
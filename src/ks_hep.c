@@ -47,194 +47,300 @@ static const uint16_t KS_HEPV3_GENERIC_TYPE_ID_AGENT_ID       = 0x000c;
 static const uint16_t KS_HEPV3_GENERIC_TYPE_ID_PAYLOAD        = 0x000f;
 
 
-KS_DECLARE(ks_size_t) ks_hepv3_capture_create(const ks_hepv3_capture_params_t *hep_params, char **out_buffer)
+static void hep_chunk_set(ks_hepv3_chunk_t *chunk, uint16_t type_id, uint16_t length)
 {
-	ks_hepv3_generic_t *hg = NULL;
-	ks_hepv3_chunk_ip4_t src_ip4 = {{0}}, dst_ip4 = {{0}};
-	ks_hepv3_chunk_ip6_t src_ip6 = {{0}}, dst_ip6 = {{0}};
-	ks_hepv3_chunk_t payload_chunk;
-
-	size_t buflen = 0, iplen = 0, total_len = 0;
-	ks_time_t now_usec = 0, now_sec = 0;
-
-	uint8_t is_send;
-
-	ks_assert(hep_params);
-	ks_assert(out_buffer);
-
-	if (!hep_params->payload || !hep_params->payload_size) {
-		ks_log(KS_LOG_ERROR, "hepv3: Empty payload.\n");
-
-		return 0;
-	}
-
-	is_send = (hep_params->direction == KS_HEPV3_DIR_SEND);
-
-	/* Buffer for ethernet frame */
-	hg = malloc(sizeof(ks_hepv3_generic_t));
-	if (!hg) {
-		ks_log(KS_LOG_ERROR, "hepv3: No memory for generic header.\n");
+	chunk->vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
+	chunk->type_id = htons(type_id);
+	chunk->length = htons(length);
+}
 
-		return 0;
-	}
+/* Encode everything that does not change between packets of one flow: the
+ * generic chunks, both ip chunks and the payload chunk header.  The header
+ * length, timestamps and payload length are patched per packet. */
+static ks_status_t hep_template_build(ks_hepv3_capture_ctx_t *ctx, const ks_hepv3_capture_params_t *hep_params)
+{
+	ks_hepv3_generic_t *hg = (ks_hepv3_generic_t *)ctx->prefix;
+	ks_size_t len = sizeof(ks_hepv3_generic_t);
+	uint8_t is_send = (hep_params->direction == KS_HEPV3_DIR_SEND);
 
-	memset(hg, 0, sizeof(ks_hepv3_generic_t));
+	memset(ctx->prefix, 0, sizeof(ctx->prefix));
 
 	/* Header set */
 	memcpy(hg->header.id, KS_HEPV3_HEADER_ID, 4);
 
 	/* IP proto */
-	hg->ip_family.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-	hg->ip_family.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_IP_FAMILY);
-	hg->ip_family.chunk.length = htons(sizeof(hg->ip_family));
+	hep_chunk_set(&hg->ip_family.chunk, KS_HEPV3_GENERIC_TYPE_ID_IP_FAMILY, sizeof(hg->ip_family));
 	hg->ip_family.data = hep_params->ip_family;
 
 	/* Proto ID */
-	hg->ip_proto.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-	hg->ip_proto.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_IP_PROTO);
-	hg->ip_proto.chunk.length = htons(sizeof(hg->ip_proto));
+	hep_chunk_set(&hg->ip_proto.chunk, KS_HEPV3_GENERIC_TYPE_ID_IP_PROTO, sizeof(hg->ip_proto));
 	hg->ip_proto.data = IPPROTO_TCP;
 
-
 	/* Src port */
-	hg->src_port.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-	hg->src_port.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_SRC_PORT);
-	hg->src_port.chunk.length = htons(sizeof(hg->src_port));
+	hep_chunk_set(&hg->src_port.chunk, KS_HEPV3_GENERIC_TYPE_ID_SRC_PORT, sizeof(hg->src_port));
 	hg->src_port.data = htons(is_send ? hep_params->local_port : hep_params->remote_port);
 
 	/* Dst port */
-	hg->dst_port.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-	hg->dst_port.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_DST_PORT);
-	hg->dst_port.chunk.length = htons(sizeof(hg->dst_port));
+	hep_chunk_set(&hg->dst_port.chunk, KS_HEPV3_GENERIC_TYPE_ID_DST_PORT, sizeof(hg->dst_port));
 	hg->dst_port.data = htons(is_send ? hep_params->remote_port : hep_params->local_port);
 
-	now_usec = ks_time_now();
-	now_sec = now_usec / 1000000;
-
-	/* Timestamp sec */
-	hg->time_sec.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-	hg->time_sec.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_TIMESTAMP_SEC);
-	hg->time_sec.chunk.length = htons(sizeof(hg->time_sec));
-	hg->time_sec.data = htonl((uint32_t)now_sec);
-
-	/* Timestamp usec */
-	hg->time_usec.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-	hg->time_usec.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_TIMESTAMP_USEC);
-	hg->time_usec.chunk.length = htons(sizeof(hg->time_usec));
-	hg->time_usec.data = htonl((uint32_t)(now_usec - (now_sec * 1000000)));
+	/* Timestamps, data filled per packet */
+	hep_chunk_set(&hg->time_sec.chunk, KS_HEPV3_GENERIC_TYPE_ID_TIMESTAMP_SEC, sizeof(hg->time_sec));
+	hep_chunk_set(&hg->time_usec.chunk, KS_HEPV3_GENERIC_TYPE_ID_TIMESTAMP_USEC, sizeof(hg->time_usec));
 
 	/* Protocol type */
-	hg->proto_t.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-	hg->proto_t.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_PROTO_TYPE);
-	hg->proto_t.chunk.length = htons(sizeof(hg->proto_t));
+	hep_chunk_set(&hg->proto_t.chunk, KS_HEPV3_GENERIC_TYPE_ID_PROTO_TYPE, sizeof(hg->proto_t));
 	hg->proto_t.data = hep_params->protocol_type_id;
 
 	/* Capture ID */
-	hg->capt_id.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-	hg->capt_id.chunk.type_id   = htons(KS_HEPV3_GENERIC_TYPE_ID_AGENT_ID);
-	hg->capt_id.chunk.length = htons(sizeof(hg->capt_id));
+	hep_chunk_set(&hg->capt_id.chunk, KS_HEPV3_GENERIC_TYPE_ID_AGENT_ID, sizeof(hg->capt_id));
 	hg->capt_id.data = htonl(hep_params->capture_id);
 
-	/* Copy destination and source IPs */
-	if(hep_params->ip_family == AF_INET) {
+	/* Destination and source IPs */
+	if (hep_params->ip_family == AF_INET) {
+		ks_hepv3_chunk_ip4_t src_ip4 = {{0}}, dst_ip4 = {{0}};
 		struct in_addr local_addr = {0};
 		struct in_addr remote_addr = {0};
 
+		if (!hep_params->local_ip || !hep_params->remote_ip) {
+			ks_log(KS_LOG_ERROR, "hepv3: Missing IPv4 address.\n");
+			return KS_STATUS_ARG_NULL;
+		}
+
 		local_addr.s_addr = inet_addr(hep_params->local_ip);
 		remote_addr.s_addr = inet_addr(hep_params->remote_ip);
 
-		/* Src IP */
-		src_ip4.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-		src_ip4.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_SRC_IP4);
-		src_ip4.chunk.length = htons(sizeof(src_ip4));
+		hep_chunk_set(&src_ip4.chunk, KS_HEPV3_GENERIC_TYPE_ID_SRC_IP4, sizeof(src_ip4));
 		src_ip4.data = is_send ? local_addr : remote_addr;
 
-		/* Dst IP */
-		dst_ip4.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-		dst_ip4.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_DST_IP4);
-		dst_ip4.chunk.length = htons(sizeof(dst_ip4));
+		hep_chunk_set(&dst_ip4.chunk, KS_HEPV3_GENERIC_TYPE_ID_DST_IP4, sizeof(dst_ip4));
 		dst_ip4.data = is_send ? remote_addr : local_addr;
 
-		iplen = sizeof(dst_ip4) + sizeof(src_ip4);
+		memcpy(ctx->prefix + len, &src_ip4, sizeof(src_ip4));
+		len += sizeof(src_ip4);
+		memcpy(ctx->prefix + len, &dst_ip4, sizeof(dst_ip4));
+		len += sizeof(dst_ip4);
 	} else {
+		ks_hepv3_chunk_ip6_t src_ip6 = {{0}}, dst_ip6 = {{0}};
 		struct in6_addr local_addr = {0};
 		struct in6_addr remote_addr = {0};
 
+		if (!hep_params->local_ip || !hep_params->remote_ip) {
+			ks_log(KS_LOG_ERROR, "hepv3: Missing IPv6 address.\n");
+			return KS_STATUS_ARG_NULL;
+		}
+
 		inet_pton(AF_INET6, hep_params->local_ip, &local_addr);
 		inet_pton(AF_INET6, hep_params->remote_ip, &remote_addr);
 
-		/* Src IPv6 */
-		src_ip6.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-		src_ip6.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_SRC_IP6);
-		src_ip6.chunk.length = htons(sizeof(src_ip6));
+		hep_chunk_set(&src_ip6.chunk, KS_HEPV3_GENERIC_TYPE_ID_SRC_IP6, sizeof(src_ip6));
 		memcpy(&src_ip6.data, is_send ? &local_addr : &remote_addr, sizeof(struct in6_addr));
 
-		/* Dst IPv6 */
-		dst_ip6.chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-		dst_ip6.chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_DST_IP6);
-		dst_ip6.chunk.length = htons(sizeof(dst_ip6));
+		hep_chunk_set(&dst_ip6.chunk, KS_HEPV3_GENERIC_TYPE_ID_DST_IP6, sizeof(dst_ip6));
 		memcpy(&dst_ip6.data, is_send ? &remote_addr : &local_addr, sizeof(struct in6_addr));
 
-		iplen = sizeof(dst_ip6) + sizeof(src_ip6);
+		memcpy(ctx->prefix + len, &src_ip6, sizeof(src_ip6));
+		len += sizeof(src_ip6);
+		memcpy(ctx->prefix + len, &dst_ip6, sizeof(dst_ip6));
+		len += sizeof(dst_ip6);
 	}
 
-	/* Payload */
-	payload_chunk.vendor_id = htons(KS_HEPV3_VENDOR_ID_GENERIC);
-	payload_chunk.type_id = htons(KS_HEPV3_GENERIC_TYPE_ID_PAYLOAD);
-	payload_chunk.length = htons((uint16_t)(sizeof(payload_chunk) + hep_params->payload_size));
+	/* Payload chunk (header), length filled per packet */
+	hep_chunk_set((ks_hepv3_chunk_t *)(ctx->prefix + len), KS_HEPV3_GENERIC_TYPE_ID_PAYLOAD, 0);
+	len += sizeof(ks_hepv3_chunk_t);
+
+	ctx->prefix_len = len;
+
+	return KS_STATUS_SUCCESS;
+}
+
+/* Copy the template and patch the per packet fields, buf must hold prefix_len + payload_size */
+static ks_size_t hep_encode(const ks_hepv3_capture_ctx_t *ctx, const char *payload, ks_size_t payload_size, ks_time_t now_usec, char *buf)
+{
+	ks_size_t total_len = ctx->prefix_len + payload_size;
+	uint32_t sec = (uint32_t)(now_usec / 1000000);
+	uint32_t usec = (uint32_t)(now_usec % 1000000);
+	uint16_t len16;
+	uint32_t len32;
+
+	memcpy(buf, ctx->prefix, ctx->prefix_len);
+
+	len16 = htons((uint16_t)total_len);
+	memcpy(buf + offsetof(ks_hepv3_generic_t, header.length), &len16, sizeof(len16));
 
-	total_len = sizeof(ks_hepv3_generic_t) + hep_params->payload_size + iplen + sizeof(ks_hepv3_chunk_t);
+	len32 = htonl(sec);
+	memcpy(buf + offsetof(ks_hepv3_generic_t, time_sec.data), &len32, sizeof(len32));
 
-	/* Total */
-	hg->header.length = htons((uint16_t)total_len);
+	len32 = htonl(usec);
+	memcpy(buf + offsetof(ks_hepv3_generic_t, time_usec.data), &len32, sizeof(len32));
 
-	/* Fill the output buffer */
+	len16 = htons((uint16_t)(sizeof(ks_hepv3_chunk_t) + payload_size));
+	memcpy(buf + ctx->prefix_len - sizeof(uint16_t), &len16, sizeof(len16));
 
-	*out_buffer = malloc(total_len);
+	memcpy(buf + ctx->prefix_len, payload, payload_size);
 
-	if (*out_buffer == NULL){
+	return total_len;
+}
+
+static ks_bool_t hep_payload_ok(const ks_hepv3_capture_ctx_t *ctx, const char *payload, ks_size_t payload_size)
+{
+	if (!payload || !payload_size) {
+		ks_log(KS_LOG_ERROR, "hepv3: Empty payload.\n");
+		return KS_FALSE;
+	}
+
+	/* The HEP header carries a 16 bit total length */
+	if (ctx->prefix_len + payload_size > UINT16_MAX) {
+		ks_log(KS_LOG_ERROR, "hepv3: Payload too large (%zu bytes).\n", (size_t)payload_size);
+		return KS_FALSE;
+	}
+
+	return KS_TRUE;
+}
+
+KS_DECLARE(ks_size_t) ks_hepv3_capture_create(const ks_hepv3_capture_params_t *hep_params, char **out_buffer)
+{
+	ks_hepv3_capture_ctx_t ctx;
+	char *buf;
+
+	ks_assert(hep_params);
+	ks_assert(out_buffer);
+
+	*out_buffer = NULL;
+
+	if (hep_template_build(&ctx, hep_params) != KS_STATUS_SUCCESS) {
+		return 0;
+	}
+
+	if (!hep_payload_ok(&ctx, hep_params->payload, hep_params->payload_size)) {
+		return 0;
+	}
+
+	if (!(buf = malloc(ctx.prefix_len + hep_params->payload_size))) {
 		ks_log(KS_LOG_ERROR, "hepv3: No memory for buffer\n");
-		goto done;
+		return 0;
 	}
 
-	/* Generic chunk */
-	memcpy((void*) *out_buffer, hg, sizeof(ks_hepv3_generic_t));
-	buflen = sizeof(ks_hepv3_generic_t);
+	*out_buffer = buf;
+
+	return hep_encode(&ctx, hep_params->payload, hep_params->payload_size, ks_time_now(), buf);
+}
 
-	/* IP addresses chunks */
-	if(hep_params->ip_family == AF_INET) {
-		/* Src IPv4 */
-		memcpy(*out_buffer + buflen, &src_ip4, sizeof(ks_hepv3_chunk_ip4_t));
-		buflen += sizeof(ks_hepv3_chunk_ip4_t);
+KS_DECLARE(ks_status_t) ks_hepv3_capture_ctx_create(ks_hepv3_capture_ctx_t **ctxP, const ks_hepv3_capture_params_t *hep_params, ks_pool_t *pool)
+{
+	ks_hepv3_capture_ctx_t *ctx;
+	ks_status_t status;
 
-		memcpy(*out_buffer + buflen, &dst_ip4, sizeof(ks_hepv3_chunk_ip4_t));
-		buflen += sizeof(ks_hepv3_chunk_ip4_t);
-	} else {
-		/* Src IPv6 */
-		memcpy(*out_buffer + buflen, &src_ip6, sizeof(ks_hepv3_chunk_ip6_t));
-		buflen += sizeof(ks_hepv3_chunk_ip6_t);
+	ks_assert(ctxP);
+	ks_assert(hep_params);
+
+	*ctxP = NULL;
 
-		memcpy(*out_buffer + buflen, &dst_ip6, sizeof(ks_hepv3_chunk_ip6_t));
-		buflen += sizeof(ks_hepv3_chunk_ip6_t);
+	if (!(ctx = ks_pool_alloc(pool, sizeof(*ctx)))) {
+		return KS_STATUS_ALLOC;
+	}
+
+	if ((status = hep_template_build(ctx, hep_params)) != KS_STATUS_SUCCESS) {
+		ks_pool_free(&ctx);
+		return status;
 	}
 
-	/* Payload chunk (header) */
-	memcpy(*out_buffer + buflen, &payload_chunk,  sizeof(ks_hepv3_chunk_t));
-	buflen += sizeof(ks_hepv3_chunk_t);
+	ctx->pool = pool;
+	*ctxP = ctx;
 
-	/* Payload itself */
-	memcpy(*out_buffer + buflen, hep_params->payload, hep_params->payload_size);
-	buflen += hep_params->payload_size;
+	return KS_STATUS_SUCCESS;
+}
 
-done:
-	if (hg) {
-		free(hg);
+KS_DECLARE(void) ks_hepv3_capture_ctx_destroy(ks_hepv3_capture_ctx_t **ctxP)
+{
+	if (!ctxP || !*ctxP) {
+		return;
 	}
 
-	return buflen;
+	ks_pool_free(ctxP);
 }
 
-static ks_status_t ks_hepv3_socket_init_tls(ks_hepv3_socket_params_t *params, ks_hepv3_socket_t **out_hep_socketP)
+KS_DECLARE(ks_size_t) ks_hepv3_capture_size(const ks_hepv3_capture_ctx_t *ctx, ks_size_t payload_size)
+{
+	ks_assert(ctx);
+
+	return ctx->prefix_len + payload_size;
+}
+
+KS_DECLARE(ks_size_t) ks_hepv3_capture_encode(const ks_hepv3_capture_ctx_t *ctx, const char *payload, ks_size_t payload_size, char *buf, ks_size_t buflen)
+{
+	ks_assert(ctx);
+	ks_assert(buf);
+
+	if (!hep_payload_ok(ctx, payload, payload_size)) {
+		return 0;
+	}
+
+	if (buflen < ctx->prefix_len + payload_size) {
+		return 0;
+	}
+
+	return hep_encode(ctx, payload, payload_size, ks_time_now(), buf);
+}
+
+KS_DECLARE(ks_size_t) ks_hepv3_capture_encode_alloc(const ks_hepv3_capture_ctx_t *ctx, const char *payload, ks_size_t payload_size, char **out_buffer)
+{
+	char *buf;
+
+	ks_assert(ctx);
+	ks_assert(out_buffer);
+
+	*out_buffer = NULL;
+
+	if (!hep_payload_ok(ctx, payload, payload_size)) {
+		return 0;
+	}
+
+	if (!(buf = ks_pool_alloc(ctx->pool, ctx->prefix_len + payload_size))) {
+		return 0;
+	}
+
+	*out_buffer = buf;
+
+	return hep_encode(ctx, payload, payload_size, ks_time_now(), buf);
+}
+
+KS_DECLARE(ks_size_t) ks_hepv3_capture_encode_batch(const ks_hepv3_capture_ctx_t *ctx, const ks_hepv3_capture_item_t *items, ks_size_t count, char *buf, ks_size_t buflen, ks_size_t *out_len)
+{
+	ks_time_t now_usec = 0;
+	ks_size_t i, used = 0;
+
+	ks_assert(ctx);
+	ks_assert(items || !count);
+	ks_assert(buf);
+
+	for (i = 0; i < count; i++) {
+		const ks_hepv3_capture_item_t *item = &items[i];
+		ks_time_t ts = item->timestamp;
+
+		if (!hep_payload_ok(ctx, item->payload, item->payload_size)) {
+			break;
+		}
+
+		if (buflen - used < ctx->prefix_len + item->payload_size) {
+			break;
+		}
+
+		if (!ts) {
+			/* One clock read for the whole batch */
+			if (!now_usec) now_usec = ks_time_now();
+			ts = now_usec;
+		}
+
+		used += hep_encode(ctx, item->payload, item->payload_size, ts, buf + used);
+	}
+
+	if (out_len) *out_len = used;
+
+	return i;
+}
+
+static ks_status_t ks_hepv3_socket_init_tls(ks_hepv3_socket_params_t *params, uint32_t timeout_ms, ks_hepv3_socket_t **out_hep_socketP)
 {
 	ks_hepv3_socket_t *hep_sock = NULL;
 	ks_tls_t *ktls = NULL;
@@ -243,8 +349,8 @@ static ks_status_t ks_hepv3_socket_init_tls(ks_hepv3_socket_params_t *params, ks
 	*out_hep_socketP = NULL;
 	tls_conn_params.host = params->server;
 	tls_conn_params.port = params->port;
-	tls_conn_params.connect_timeout_ms = KS_HEPV3_CONNECT_TIMIEOUT_MS;
-	tls_conn_params.init_timeout_ms = KS_HEPV3_CONNECT_TIMIEOUT_MS;
+	tls_conn_params.connect_timeout_ms = timeout_ms;
+	tls_conn_params.init_timeout_ms = timeout_ms;
 
 	hep_sock = ks_pool_alloc(params->pool, sizeof(ks_hepv3_socket_t));
 
@@ -265,11 +371,13 @@ static ks_status_t ks_hepv3_socket_init_tls(ks_hepv3_socket_params_t *params, ks
 	return KS_STATUS_SUCCESS;
 }
 
-static ks_status_t ks_hepv3_socket_init_raw(ks_hepv3_socket_params_t *params, ks_hepv3_socket_t **out_hep_socketP)
+static ks_status_t ks_hepv3_socket_init_raw(ks_hepv3_socket_params_t *params, uint32_t timeout_ms, ks_hepv3_socket_t **out_hep_socketP)
 {
 	ks_hepv3_socket_t *hep_sock = NULL;
 	ks_sockaddr_t capt_addr = {0};
 	ks_socket_t tcp_socket = KS_SOCK_INVALID;
+	int type = params->use_udp ? SOCK_DGRAM : SOCK_STREAM;
+	int proto = params->use_udp ? IPPROTO_UDP : IPPROTO_TCP;
 
 	*out_hep_socketP = NULL;
 
@@ -285,7 +393,8 @@ static ks_status_t ks_hepv3_socket_init_raw(ks_hepv3_socket_params_t *params, ks
 		return KS_STATUS_ALLOC;
 	}
 
-	tcp_socket = ks_socket_connect_ex(SOCK_STREAM, IPPROTO_TCP, &capt_addr, KS_HEPV3_CONNECT_TIMIEOUT_MS);
+	/* A datagram socket only records the peer, there is nothing to wait for */
+	tcp_socket = ks_socket_connect_ex(type, proto, &capt_addr, params->use_udp ? 0 : timeout_ms);
 
 	if (tcp_socket == KS_SOCK_INVALID) {
 		ks_log(KS_LOG_ERROR, "Can't connect to [%s]!\n", capt_addr.host);
@@ -294,8 +403,13 @@ static ks_status_t ks_hepv3_socket_init_raw(ks_hepv3_socket_params_t *params, ks
 		return KS_STATUS_FAIL;
 	}
 
-	ks_socket_common_setup(tcp_socket);
+	if (params->use_udp) {
+		ks_socket_option(tcp_socket, KS_SO_NONBLOCK, KS_TRUE);
+	} else {
+		ks_socket_common_setup(tcp_socket);
+	}
 
+	hep_sock->use_udp = params->use_udp;
 	hep_sock->raw_socket = tcp_socket;
 	hep_sock->tls_socket = NULL;
 	*out_hep_socketP = hep_sock;
@@ -303,6 +417,15 @@ static ks_status_t ks_hepv3_socket_init_raw(ks_hepv3_socket_params_t *params, ks
 	return KS_STATUS_SUCCESS;
 }
 
+static ks_status_t hep_socket_init(ks_hepv3_socket_params_t *params, uint32_t timeout_ms, ks_hepv3_socket_t **out_hep_socketP)
+{
+	if (params->use_tls && !params->use_udp) {
+		return ks_hepv3_socket_init_tls(params, timeout_ms, out_hep_socketP);
+	} else {
+		return ks_hepv3_socket_init_raw(params, timeout_ms, out_hep_socketP);
+	}
+}
+
 KS_DECLARE(ks_status_t) ks_hepv3_socket_init(ks_hepv3_socket_params_t *params, ks_hepv3_socket_t **out_hep_socketP)
 {
 	ks_assert(params);
@@ -314,11 +437,7 @@ KS_DECLARE(ks_status_t) ks_hepv3_socket_init(ks_hepv3_socket_params_t *params, k
 		return KS_STATUS_ARG_NULL;
 	}
 
-	if (params->use_tls) {
-		return ks_hepv3_socket_init_tls(params, out_hep_socketP);
-	} else {
-		return ks_hepv3_socket_init_raw(params, out_hep_socketP);
-	}
+	return hep_socket_init(params, KS_HEPV3_CONNECT_TIMIEOUT_MS, out_hep_socketP);
 }
 
 KS_DECLARE(void) ks_hepv3_socket_destroy(ks_hepv3_socket_t **hep_socketP)
@@ -360,6 +479,526 @@ KS_DECLARE(ks_status_t) ks_hepv3_socket_write(ks_hepv3_socket_t *hep_socket, voi
 	}
 }
 
+/* Packets taken off the queue per write */
+#define KS_HEPV3_SENDER_BATCH 64
+#define KS_HEPV3_SENDER_WRITE_BYTES (64 * 1024)
+#define KS_HEPV3_SENDER_POLL_MS 100
+#define KS_HEPV3_SENDER_RECONNECT_MIN_MS 100
+#define KS_HEPV3_SENDER_RECONNECT_MAX_MS 30000
+#define KS_HEPV3_SENDER_WARN_MS 10000
+
+static void hep_sender_sleep(ks_hepv3_sender_t *sender, uint32_t ms)
+{
+	ks_time_t deadline = ks_time_now() + (ks_time_t)ms * 1000, now;
+
+	ks_cond_lock(sender->cond);
+
+	while (sender->running && (now = ks_time_now()) < deadline) {
+		ks_cond_timedwait(sender->cond, (deadline - now + 999) / 1000);
+	}
+
+	ks_cond_unlock(sender->cond);
+}
+
+/* Wait until the socket takes more, giving up at the deadline */
+static ks_status_t hep_sender_wait_write(ks_hepv3_sender_t *sender, ks_time_t deadline)
+{
+	ks_time_t now = ks_time_now();
+	ks_time_t ms;
+	int r;
+
+	if (now >= deadline) {
+		return KS_STATUS_TIMEOUT;
+	}
+
+	ms = (deadline - now + 999) / 1000;
+	r = ks_wait_sock(sender->sock->raw_socket, (uint32_t)(ms < KS_HEPV3_SENDER_POLL_MS ? ms : KS_HEPV3_SENDER_POLL_MS), KS_POLL_WRITE);
+
+	return (r & KS_POLL_ERROR) ? KS_STATUS_FAIL : KS_STATUS_SUCCESS;
+}
+
+static void hep_sender_account(ks_hepv3_sender_t *sender, ks_hepv3_sender_item_t **items, ks_size_t n, ks_size_t bytes)
+{
+	ks_time_t now = ks_time_now();
+	uint64_t total = sender->latency_total_us, max = sender->latency_max_us;
+	ks_size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint64_t age = (uint64_t)(now - items[i]->queued_at);
+
+		total += age;
+		if (age > max) max = age;
+	}
+
+	ks_atomic_store_uint64(&sender->latency_total_us, total);
+	ks_atomic_store_uint64(&sender->latency_max_us, max);
+	ks_atomic_store_uint64(&sender->sent, sender->sent + n);
+	ks_atomic_store_uint64(&sender->bytes, sender->bytes + bytes);
+}
+
+/* Write a buffer completely, the stream's only failure is a dead connection. written says how far it got */
+static ks_status_t hep_sender_write_stream(ks_hepv3_sender_t *sender, const char *buf, ks_size_t len, ks_time_t deadline, ks_size_t *written)
+{
+	ks_size_t off = 0;
+
+	*written = 0;
+
+	while (off < len) {
+		ks_size_t chunk = len - off;
+		ks_status_t status;
+
+		if (sender->sock->tls_socket) {
+			ks_time_t now = ks_time_now();
+
+			if (now >= deadline) return KS_STATUS_TIMEOUT;
+			status = ks_tls_write_timeout(sender->sock->tls_socket, (void *)(buf + off), &chunk, (uint32_t)((deadline - now + 999) / 1000));
+		} else {
+			status = ks_socket_send(sender->sock->raw_socket, (void *)(buf + off), &chunk);
+		}
+
+		ks_atomic_store_uint64(&sender->writes, sender->writes + 1);
+
+		if (status == KS_STATUS_SUCCESS) {
+			off += chunk;
+			*written = off;
+		} else if (status == KS_STATUS_BREAK && !sender->sock->tls_socket) {
+			if ((status = hep_sender_wait_write(sender, deadline)) != KS_STATUS_SUCCESS) {
+				return status;
+			}
+		} else {
+			return status;
+		}
+	}
+
+	return KS_STATUS_SUCCESS;
+}
+
+/* Coalesce as many packets as fit in the write buffer into each write */
+static ks_status_t hep_sender_flush_stream(ks_hepv3_sender_t *sender, ks_hepv3_sender_item_t **items, ks_size_t n, ks_size_t *done)
+{
+	ks_time_t deadline = ks_time_now() + (ks_time_t)KS_HEPV3_WRITE_TIMIEOUT_MS * 1000;
+	ks_size_t i = 0;
+
+	*done = 0;
+
+	while (i < n) {
+		ks_size_t first = i, len = 0, written;
+		ks_status_t status;
+
+		while (i < n && len + items[i]->len <= sender->write_bytes) {
+			memcpy(sender->wbuf + len, items[i]->data, items[i]->len);
+			len += items[i]->len;
+			i++;
+		}
+
+		if ((status = hep_sender_write_stream(sender, sender->wbuf, len, deadline, &written)) != KS_STATUS_SUCCESS) {
+			ks_size_t whole = 0, last = first;
+
+			/* Packets that made it out whole are done, a torn one goes again in full on the next connection */
+			while (last < i && whole + items[last]->len <= written) {
+				whole += items[last]->len;
+				last++;
+			}
+
+			if (last > first) {
+				hep_sender_account(sender, items + first, last - first, whole);
+				*done = last;
+			}
+
+			return status;
+		}
+
+		hep_sender_account(sender, items + first, i - first, len);
+		*done = i;
+	}
+
+	return KS_STATUS_SUCCESS;
+}
+
+/* One datagram per packet, handed to the kernel in a single sendmmsg where we have it */
+static ks_status_t hep_sender_flush_dgram(ks_hepv3_sender_t *sender, ks_hepv3_sender_item_t **items, ks_size_t n, ks_size_t *done)
+{
+	ks_time_t deadline = ks_time_now() + (ks_time_t)KS_HEPV3_WRITE_TIMIEOUT_MS * 1000;
+	ks_size_t i = 0;
+	ks_status_t status;
+#if defined(KS_PLAT_LIN)
+	struct mmsghdr msgs[KS_HEPV3_SENDER_BATCH];
+	struct iovec iov[KS_HEPV3_SENDER_BATCH];
+
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = items[i]->data;
+		iov[i].iov_len = items[i]->len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	i = 0;
+#endif
+
+	*done = 0;
+
+	while (i < n) {
+		ks_size_t sent_bytes = 0, k, count;
+#if defined(KS_PLAT_LIN)
+		int r = sendmmsg(sender->sock->raw_socket, msgs + i, (unsigned int)(n - i), 0);
+
+		ks_atomic_store_uint64(&sender->writes, sender->writes + 1);
+
+		if (r < 0) {
+			if (ks_errno_is_interupt(ks_errno())) continue;
+			status = ks_errno_is_blocking(ks_errno()) ? KS_STATUS_BREAK : KS_STATUS_FAIL;
+			count = 0;
+		} else {
+			status = KS_STATUS_SUCCESS;
+			count = (ks_size_t)r;
+		}
+#else
+		ks_size_t len = items[i]->len;
+
+		status = ks_socket_send(sender->sock->raw_socket, items[i]->data, &len);
+		ks_atomic_store_uint64(&sender->writes, sender->writes + 1);
+		count = status == KS_STATUS_SUCCESS;
+#endif
+
+		for (k = i; k < i + count; k++) {
+			sent_bytes += items[k]->len;
+		}
+
+		if (count) {
+			hep_sender_account(sender, items + i, count, sent_bytes);
+			i += count;
+			*done = i;
+		}
+
+		if (status == KS_STATUS_BREAK) {
+			if ((status = hep_sender_wait_write(sender, deadline)) != KS_STATUS_SUCCESS) {
+				return status;
+			}
+		} else if (status != KS_STATUS_SUCCESS) {
+			return status;
+		}
+	}
+
+	return KS_STATUS_SUCCESS;
+}
+
+static ks_status_t hep_sender_flush(ks_hepv3_sender_t *sender, ks_hepv3_sender_item_t **items, ks_size_t *n)
+{
+	ks_size_t done = 0, i;
+	ks_status_t status;
+
+	if (sender->sock->use_udp) {
+		status = hep_sender_flush_dgram(sender, items, *n, &done);
+	} else {
+		status = hep_sender_flush_stream(sender, items, *n, &done);
+	}
+
+	/* Whatever was not written stays at the front for the next connection */
+	for (i = 0; i < done; i++) {
+		ks_pool_free(&items[i]);
+	}
+
+	memmove(items, items + done, (*n - done) * sizeof(*items));
+	*n -= done;
+
+	return status;
+}
+
+static void hep_sender_disconnect(ks_hepv3_sender_t *sender)
+{
+	if (sender->sock) {
+		ks_hepv3_socket_destroy(&sender->sock);
+	}
+}
+
+/* A collector that keeps dropping us would otherwise log on every attempt */
+static void hep_sender_warn(ks_hepv3_sender_t *sender)
+{
+	ks_time_t now = ks_time_now();
+
+	sender->failures++;
+
+	if (sender->warned_at && now - sender->warned_at < (ks_time_t)KS_HEPV3_SENDER_WARN_MS * 1000) {
+		return;
+	}
+
+	ks_log(KS_LOG_WARNING, "hepv3: Write to [%s:%d] failed, reconnecting (%u failures since the last warning).\n",
+		   sender->socket_params.server, sender->socket_params.port, sender->failures);
+
+	sender->warned_at = now;
+	sender->failures = 0;
+}
+
+/* Wait before the next connect, doubling up to reconnect_max_ms until a write gets through */
+static void hep_sender_backoff(ks_hepv3_sender_t *sender)
+{
+	hep_sender_sleep(sender, sender->backoff);
+	sender->backoff = sender->backoff > sender->reconnect_max_ms / 2 ? sender->reconnect_max_ms : sender->backoff * 2;
+}
+
+static void *hep_sender_thread(ks_thread_t *thread, void *data)
+{
+	ks_hepv3_sender_t *sender = (ks_hepv3_sender_t *)data;
+	ks_hepv3_sender_item_t *items[KS_HEPV3_SENDER_BATCH];
+	ks_bool_t attempted = KS_FALSE;
+	ks_size_t n = 0, i;
+
+	while (sender->running) {
+		if (!sender->sock) {
+			if (attempted) {
+				ks_atomic_store_uint64(&sender->reconnects, sender->reconnects + 1);
+			}
+
+			attempted = KS_TRUE;
+
+			if (hep_socket_init(&sender->socket_params, sender->connect_timeout_ms, &sender->sock) != KS_STATUS_SUCCESS) {
+				hep_sender_backoff(sender);
+				continue;
+			}
+		}
+
+		if (!n) {
+			ks_size_t popped = 0;
+
+			if (ks_q_pop_batch(sender->q, (void **)items, KS_HEPV3_SENDER_BATCH, KS_HEPV3_SENDER_POLL_MS, &popped) != KS_STATUS_SUCCESS) {
+				continue;
+			}
+
+			n = popped;
+		}
+
+		/* Only a write that went through shows the collector is really back, a connect alone doesn't */
+		if (hep_sender_flush(sender, items, &n) == KS_STATUS_SUCCESS) {
+			sender->backoff = sender->reconnect_min_ms;
+			continue;
+		}
+
+		hep_sender_warn(sender);
+		hep_sender_disconnect(sender);
+		hep_sender_backoff(sender);
+	}
+
+	/* Last pass over what is left, only if the collector is still there */
+	for (;;) {
+		while (n < KS_HEPV3_SENDER_BATCH && ks_q_trypop(sender->q, (void **)&items[n]) == KS_STATUS_SUCCESS) {
+			n++;
+		}
+
+		if (!n) break;
+
+		if (!sender->sock || hep_sender_flush(sender, items, &n) != KS_STATUS_SUCCESS) {
+			hep_sender_disconnect(sender);
+
+			for (i = 0; i < n; i++) {
+				ks_pool_free(&items[i]);
+				ks_atomic_increment_uint64(&sender->dropped);
+			}
+
+			n = 0;
+		}
+	}
+
+	hep_sender_disconnect(sender);
+
+	return NULL;
+}
+
+static void hep_sender_q_flush(ks_q_t *q, void *ptr, void *flush_data)
+{
+	ks_hepv3_sender_t *sender = (ks_hepv3_sender_t *)flush_data;
+
+	ks_atomic_increment_uint64(&sender->dropped);
+	ks_pool_free(&ptr);
+}
+
+KS_DECLARE(ks_status_t) ks_hepv3_sender_create(ks_hepv3_sender_t **senderP, const ks_hepv3_sender_params_t *params)
+{
+	ks_hepv3_sender_t *sender;
+	ks_size_t queue_len;
+
+	ks_assert(senderP);
+	ks_assert(params);
+
+	*senderP = NULL;
+
+	if (!params->server || !params->port || !params->pool) {
+		ks_log(KS_LOG_ERROR, "hepv3: Required argument isn't set. Server [%p], Port [%d], Pool [%p]. \n", params->server, params->port, params->pool);
+
+		return KS_STATUS_ARG_NULL;
+	}
+
+	if (!(sender = ks_pool_alloc(params->pool, sizeof(*sender)))) {
+		return KS_STATUS_ALLOC;
+	}
+
+	sender->pool = params->pool;
+	sender->socket_params.server = ks_pstrdup(params->pool, params->server);
+	sender->socket_params.port = params->port;
+	sender->socket_params.use_tls = params->use_tls;
+	sender->socket_params.use_udp = params->use_udp;
+	sender->socket_params.pool = params->pool;
+	sender->connect_timeout_ms = params->connect_timeout_ms ? params->connect_timeout_ms : KS_HEPV3_CONNECT_TIMIEOUT_MS;
+	sender->reconnect_min_ms = params->reconnect_min_ms ? params->reconnect_min_ms : KS_HEPV3_SENDER_RECONNECT_MIN_MS;
+	sender->reconnect_max_ms = params->reconnect_max_ms ? params->reconnect_max_ms : KS_HEPV3_SENDER_RECONNECT_MAX_MS;
+	sender->write_bytes = params->write_bytes ? params->write_bytes : KS_HEPV3_SENDER_WRITE_BYTES;
+
+	if (sender->reconnect_max_ms < sender->reconnect_min_ms) {
+		sender->reconnect_max_ms = sender->reconnect_min_ms;
+	}
+
+	sender->backoff = sender->reconnect_min_ms;
+
+	/* A single packet must always fit */
+	if (sender->write_bytes < UINT16_MAX) {
+		sender->write_bytes = UINT16_MAX;
+	}
+	queue_len = params->queue_len ? params->queue_len : KS_HEPV3_SENDER_DEFAULT_QUEUE;
+
+	if (!(sender->wbuf = ks_pool_alloc(params->pool, sender->write_bytes))) {
+		goto fail;
+	}
+
+	/* Items are allocated on every capturing thread and freed on ours */
+	if (ks_pool_open_ex(&sender->item_pool, KS_POOL_FLAG_THREAD_CACHE | KS_POOL_FLAG_NO_ZERO) != KS_STATUS_SUCCESS) {
+		goto fail;
+	}
+
+	if (ks_q_create_ex(&sender->q, params->pool, queue_len, KS_Q_FLAG_LOCKFREE) != KS_STATUS_SUCCESS) {
+		goto fail;
+	}
+
+	ks_q_set_flush_fn(sender->q, hep_sender_q_flush, sender);
+
+	if (ks_cond_create(&sender->cond, params->pool) != KS_STATUS_SUCCESS) {
+		goto fail;
+	}
+
+	sender->running = KS_TRUE;
+
+	if (ks_thread_create_tag(&sender->thread, hep_sender_thread, sender, params->pool, "hepv3_sender") != KS_STATUS_SUCCESS) {
+		goto fail;
+	}
+
+	*senderP = sender;
+
+	return KS_STATUS_SUCCESS;
+
+fail:
+	if (sender->cond) ks_cond_destroy(&sender->cond);
+	if (sender->q) ks_q_destroy(&sender->q);
+	if (sender->item_pool) ks_pool_close(&sender->item_pool);
+	ks_pool_free(&sender->wbuf);
+	ks_pool_free(&sender->socket_params.server);
+	ks_pool_free(&sender);
+
+	return KS_STATUS_FAIL;
+}
+
+KS_DECLARE(void) ks_hepv3_sender_destroy(ks_hepv3_sender_t **senderP)
+{
+	ks_hepv3_sender_t *sender;
+
+	if (!senderP || !*senderP) {
+		return;
+	}
+
+	sender = *senderP;
+	*senderP = NULL;
+
+	/* Out of a backoff sleep or an empty queue wait straight away, a connect in progress runs its course */
+	ks_cond_lock(sender->cond);
+	sender->running = KS_FALSE;
+	ks_cond_signal(sender->cond);
+	ks_cond_unlock(sender->cond);
+	ks_q_wake(sender->q);
+
+	ks_thread_join(sender->thread);
+	ks_thread_destroy(&sender->thread);
+	ks_cond_destroy(&sender->cond);
+
+	/* Frees and counts anything pushed after the thread's last pass */
+	ks_q_destroy(&sender->q);
+	ks_pool_close(&sender->item_pool);
+
+	ks_pool_free(&sender->wbuf);
+	ks_pool_free(&sender->socket_params.server);
+	ks_pool_free(&sender);
+}
+
+static ks_status_t hep_sender_push(ks_hepv3_sender_t *sender, ks_hepv3_sender_item_t *item)
+{
+	item->queued_at = ks_time_now();
+
+	if (ks_q_trypush(sender->q, item) != KS_STATUS_SUCCESS) {
+		ks_pool_free(&item);
+		ks_atomic_increment_uint64(&sender->dropped);
+
+		return KS_STATUS_BREAK;
+	}
+
+	ks_atomic_increment_uint64(&sender->queued);
+
+	return KS_STATUS_SUCCESS;
+}
+
+KS_DECLARE(ks_status_t) ks_hepv3_sender_capture(ks_hepv3_sender_t *sender, const ks_hepv3_capture_ctx_t *ctx, const char *payload, ks_size_t payload_size)
+{
+	ks_hepv3_sender_item_t *item;
+
+	ks_assert(sender);
+	ks_assert(ctx);
+
+	if (!hep_payload_ok(ctx, payload, payload_size)) {
+		return KS_STATUS_ARG_INVALID;
+	}
+
+	if (!(item = ks_pool_alloc(sender->item_pool, sizeof(*item) + ctx->prefix_len + payload_size))) {
+		return KS_STATUS_ALLOC;
+	}
+
+	item->len = hep_encode(ctx, payload, payload_size, ks_time_now(), item->data);
+
+	return hep_sender_push(sender, item);
+}
+
+KS_DECLARE(ks_status_t) ks_hepv3_sender_write(ks_hepv3_sender_t *sender, const void *data, ks_size_t len)
+{
+	ks_hepv3_sender_item_t *item;
+
+	ks_assert(sender);
+
+	if (!data || !len || len > UINT16_MAX) {
+		return KS_STATUS_ARG_INVALID;
+	}
+
+	if (!(item = ks_pool_alloc(sender->item_pool, sizeof(*item) + len))) {
+		return KS_STATUS_ALLOC;
+	}
+
+	memcpy(item->data, data, len);
+	item->len = len;
+
+	return hep_sender_push(sender, item);
+}
+
+KS_DECLARE(void) ks_hepv3_sender_stats(ks_hepv3_sender_t *sender, ks_hepv3_sender_stats_t *stats)
+{
+	ks_assert(sender);
+	ks_assert(stats);
+
+	stats->queued = ks_atomic_load_uint64(&sender->queued);
+	stats->sent = ks_atomic_load_uint64(&sender->sent);
+	stats->dropped = ks_atomic_load_uint64(&sender->dropped);
+	stats->bytes = ks_atomic_load_uint64(&sender->bytes);
+	stats->writes = ks_atomic_load_uint64(&sender->writes);
+	stats->reconnects = ks_atomic_load_uint64(&sender->reconnects);
+	stats->depth = ks_q_size(sender->q);
+	stats->latency_max_us = ks_atomic_load_uint64(&sender->latency_max_us);
+	stats->latency_avg_us = stats->sent ? ks_atomic_load_uint64(&sender->latency_total_us) / stats->sent : 0;
+}
+
 
 /* For Emacs:
 * Local Variables:
@@ -35,9 +35,29 @@ typedef struct ks_debug_pool_pack_ctx_s ks_debug_pool_pack_ctx_t;
 
 static KS_THREAD_LOCAL uint32_t g_default_scanned_value = 0;
 
+/* Source of pool serials, a pool takes a new one when opened and on every clear */
+static volatile ks_size_t g_pool_serial = 0;
+
+/* Live KS_POOL_FLAG_THREAD_CACHE pools, guarded by g_tcache_lock.  A thread only
+ * flushes its magazines into a pool it can still find here. */
+static ks_spinlock_t g_tcache_lock;
+static ks_pool_t *g_tcache_pools = NULL;
+
+/* This thread's magazines, one entry per pool it has recently used */
+static KS_THREAD_LOCAL ks_pool_tcache_t g_tcache[KS_POOL_TCACHE_POOLS];
+static KS_THREAD_LOCAL uint32_t g_tcache_evict = 0;
+
+#ifdef KS_DEBUG_POOL
+/* Debug builds need every allocation on the pool list with its file/line */
+#define TCACHE_ENABLED(_pool) KS_FALSE
+#else
+#define TCACHE_ENABLED(_pool) (KS_BIT_IS_SET((_pool)->flags, KS_POOL_FLAG_THREAD_CACHE) && !(_pool)->log_func)
+#endif
+
 static ks_status_t check_pool(const ks_pool_t *pool);
 static ks_status_t check_fence(const void *addr);
 static void write_fence(void *addr);
+static void track_prefix(ks_pool_t *pool, ks_pool_prefix_t *prefix);
 
 #define CHECK_PREFIX(p) { \
 	ks_assert(p->magic1 == KS_POOL_PREFIX_MAGIC && \
@@ -148,6 +168,14 @@ KS_DECLARE(ks_status_t) ks_pool_set_cleanup(void *ptr, void *arg, ks_pool_cleanu
 
 	CHECK_PREFIX(prefix);
 
+	/* Slab allocations are not on the allocation list until they need to be
+	 * visited by perform_pool_cleanup */
+	if (!prefix->tracked) {
+		ks_mutex_lock(prefix->pool->mutex);
+		if (!prefix->tracked) track_prefix(prefix->pool, prefix);
+		ks_mutex_unlock(prefix->pool->mutex);
+	}
+
 	prefix->cleanup_arg = arg;
 	prefix->cleanup_callback = callback;
 
@@ -190,37 +218,583 @@ static ks_status_t check_pool(const ks_pool_t *pool)
  *
  * DESCRIPTION:
  *
- * Check the validity of the fence checksums.
+ * Check the validity of the fence checksums.
+ *
+ * RETURNS:
+ *
+ * Success - KS_STATUS_SUCCESS
+ *
+ * Failure - Ks_Pool error code
+ *
+ * ARGUMENTS:
+ *
+ * addr -> A pointer directly to the fence.
+ */
+static ks_status_t check_fence(const void *addr)
+{
+	const ks_byte_t *mem_p;
+
+	mem_p = (ks_byte_t *)addr;
+
+	if (*mem_p == KS_POOL_FENCE_MAGIC0 && *(mem_p + 1) == KS_POOL_FENCE_MAGIC1)
+		return KS_STATUS_SUCCESS;
+
+	ks_debug_break();
+	return KS_STATUS_PNT_OVER;
+}
+
+/*
+ * static void write_fence
+ *
+ * DESCRIPTION:
+ *
+ * Write the magic ID to the address.
+ *
+ * RETURNS:
+ *
+ * None.
+ *
+ * ARGUMENTS:
+ *
+ * addr -> Address where to write the magic.
+ */
+static void write_fence(void *addr)
+{
+	*((ks_byte_t *)addr) = KS_POOL_FENCE_MAGIC0;
+	*((ks_byte_t *)addr + 1) = KS_POOL_FENCE_MAGIC1;
+}
+
+/*
+ * static void track_prefix
+ *
+ * DESCRIPTION:
+ *
+ * Link a prefix at the head of the pool's allocation list.  The pool
+ * mutex must be held.
+ *
+ * RETURNS:
+ *
+ * None.
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ *
+ * prefix -> The prefix to link.
+ */
+static void track_prefix(ks_pool_t *pool, ks_pool_prefix_t *prefix)
+{
+	prefix->prev = NULL;
+	prefix->next = pool->first;
+
+	if (pool->first) pool->first->prev = prefix;
+	pool->first = prefix;
+	if (!pool->last) pool->last = prefix;
+
+	prefix->tracked = KS_TRUE;
+}
+
+/*
+ * static void untrack_prefix
+ *
+ * DESCRIPTION:
+ *
+ * Unlink a prefix from the pool's allocation list.  The pool mutex
+ * must be held.
+ *
+ * RETURNS:
+ *
+ * None.
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ *
+ * prefix -> The prefix to unlink.
+ */
+static void untrack_prefix(ks_pool_t *pool, ks_pool_prefix_t *prefix)
+{
+	if (!prefix->prev && !prefix->next) pool->first = pool->last = NULL;
+	else if (!prefix->prev) {
+		pool->first = prefix->next;
+		pool->first->prev = NULL;
+	}
+	else if (!prefix->next) {
+		pool->last = prefix->prev;
+		pool->last->next = NULL;
+	} else {
+		prefix->prev->next = prefix->next;
+		prefix->next->prev = prefix->prev;
+	}
+
+	prefix->prev = prefix->next = NULL;
+	prefix->tracked = KS_FALSE;
+}
+
+#define slab_class_size(_index) ((ks_size_t)1 << (KS_POOL_SLAB_MIN_SHIFT + (_index)))
+#define slab_slot_size(_index) KS_POOL_SLAB_ROUND(KS_POOL_PREFIX_SIZE + slab_class_size(_index) + KS_POOL_FENCE_SIZE)
+
+/*
+ * static ks_size_t slab_class_index
+ *
+ * DESCRIPTION:
+ *
+ * Find the smallest slab size class that can hold size bytes.
+ *
+ * RETURNS:
+ *
+ * The size class index, the caller must ensure size does not exceed
+ * KS_POOL_SLAB_MAX_SIZE.
+ *
+ * ARGUMENTS:
+ *
+ * size -> Number of user bytes requested.
+ */
+static ks_size_t slab_class_index(const ks_size_t size)
+{
+	ks_size_t index = 0;
+
+	while (slab_class_size(index) < size) {
+		index++;
+	}
+
+	return index;
+}
+
+/*
+ * static void *slab_alloc_slot
+ *
+ * DESCRIPTION:
+ *
+ * Take a slot from a size class, reusing a freed slot when there is
+ * one, otherwise bumping into the newest slab and carving a new slab
+ * once that one is exhausted.  Slabs double in slot count up to
+ * KS_POOL_SLAB_MAX_BYTES.  The pool mutex must be held.
+ *
+ * RETURNS:
+ *
+ * Success - Pointer to the start of the slot (where the prefix goes).
+ *
+ * Failure - NULL
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ *
+ * index -> Size class index.
+ */
+static void *slab_alloc_slot(ks_pool_t *pool, const ks_size_t index)
+{
+	ks_pool_slab_class_t *slab_class = &pool->slab_classes[index];
+	ks_size_t slot_size = slab_slot_size(index);
+	void *slot = NULL;
+
+	if (slab_class->free) {
+		slot = slab_class->free;
+		slab_class->free = slab_class->free->next;
+		return slot;
+	}
+
+	if ((ks_size_t)(slab_class->end - slab_class->pos) < slot_size) {
+		ks_pool_slab_t *slab = NULL;
+		ks_size_t size;
+
+		if (!slab_class->slots) slab_class->slots = KS_POOL_SLAB_MIN_SLOTS;
+
+		size = KS_POOL_SLAB_HEADER_SIZE + slab_class->slots * slot_size;
+		if (!(slab = malloc(size))) return NULL;
+
+		slab->size = size;
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		pool->slab_bytes += size;
+
+		slab_class->pos = (ks_byte_t *)slab + KS_POOL_SLAB_HEADER_SIZE;
+		slab_class->end = (ks_byte_t *)slab + size;
+
+		if (slab_class->slots * slot_size * 2 <= KS_POOL_SLAB_MAX_BYTES) {
+			slab_class->slots *= 2;
+		}
+	}
+
+	slot = slab_class->pos;
+	slab_class->pos += slot_size;
+
+	return slot;
+}
+
+/*
+ * static void slab_release_slot
+ *
+ * DESCRIPTION:
+ *
+ * Return a slot to its size class for reuse.  The prefix magic is
+ * wiped so stale pointers trip CHECK_PREFIX.  The pool mutex must be
+ * held.
+ *
+ * RETURNS:
+ *
+ * None.
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ *
+ * prefix -> Prefix at the start of the slot, must not be tracked.
+ */
+static void slab_release_slot(ks_pool_t *pool, ks_pool_prefix_t *prefix)
+{
+	ks_pool_slab_class_t *slab_class = &pool->slab_classes[prefix->slab_class];
+
+	prefix->magic1 = 0;
+	prefix->next = slab_class->free;
+	slab_class->free = prefix;
+}
+
+/*
+ * static void slab_destroy_all
+ *
+ * DESCRIPTION:
+ *
+ * Release every slab owned by the pool in one pass and reset the size
+ * classes.  The pool mutex must be held.
+ *
+ * RETURNS:
+ *
+ * None.
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ */
+static void slab_destroy_all(ks_pool_t *pool)
+{
+	ks_pool_slab_t *slab, *nslab;
+
+	for (slab = pool->slabs; slab; slab = nslab) {
+		nslab = slab->next;
+		free(slab);
+	}
+
+	pool->slabs = NULL;
+	pool->slab_bytes = 0;
+	memset(pool->slab_classes, 0, sizeof(pool->slab_classes));
+}
+
+
+
+/*
+ * static void *init_prefix
+ *
+ * DESCRIPTION:
+ *
+ * Stamp the prefix and fence of a zeroed block.
+ *
+ * RETURNS:
+ *
+ * Pointer to the user address following the prefix.
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ *
+ * prefix -> Start of the block.
+ *
+ * size -> Number of user bytes.
+ *
+ * slab_class -> Size class the block was carved from or KS_POOL_SLAB_NONE.
+ */
+static void *init_prefix(ks_pool_t *pool, ks_pool_prefix_t *prefix, const ks_size_t size, const ks_size_t slab_class, const char *file, int line, const char *tag)
+{
+	void *addr = (void *)((ks_byte_t *)prefix + KS_POOL_PREFIX_SIZE);
+
+#ifdef KS_DEBUG_POOL
+	prefix->scanned = g_default_scanned_value;
+#endif
+
+	prefix->magic1 = KS_POOL_PREFIX_MAGIC;
+	prefix->size = size;
+	prefix->magic2 = KS_POOL_PREFIX_MAGIC;
+	prefix->refs = 1;
+	prefix->slab_class = slab_class;
+
+#ifdef KS_DEBUG_POOL
+	prefix->file = file;
+	prefix->line = line;
+	prefix->tag = tag;
+#endif
+
+	prefix->magic3 = KS_POOL_PREFIX_MAGIC;
+	prefix->magic4 = KS_POOL_PREFIX_MAGIC;
+	prefix->pool = pool;
+	prefix->magic5 = KS_POOL_PREFIX_MAGIC;
+
+	write_fence((ks_byte_t *)addr + size);
+
+	return addr;
+}
+
+/*
+ * static uint32_t tcache_depth
+ *
+ * DESCRIPTION:
+ *
+ * Number of slots a thread may cache for a size class.
+ *
+ * RETURNS:
+ *
+ * The magazine depth.
+ *
+ * ARGUMENTS:
+ *
+ * index -> Size class index.
+ */
+static uint32_t tcache_depth(const ks_size_t index)
+{
+	ks_size_t depth = KS_POOL_TCACHE_BYTES / slab_class_size(index);
+
+	if (depth > KS_POOL_TCACHE_MAX_DEPTH) depth = KS_POOL_TCACHE_MAX_DEPTH;
+	if (depth < KS_POOL_TCACHE_MIN_DEPTH) depth = KS_POOL_TCACHE_MIN_DEPTH;
+
+	return (uint32_t)depth;
+}
+
+/*
+ * static void tcache_sync
+ *
+ * DESCRIPTION:
+ *
+ * Fold the statistics gathered by a thread cache into its pool.  The pool
+ * mutex must be held.
+ *
+ * RETURNS:
+ *
+ * None.
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ *
+ * tcache -> The calling thread's cache for pool.
+ */
+static void tcache_sync(ks_pool_t *pool, ks_pool_tcache_t *tcache)
+{
+	pool->alloc_c += tcache->alloc_c;
+	pool->user_alloc += tcache->user_alloc;
+
+	/* Deltas from different threads land in any order, compare signed so a
+	 * free folded ahead of its alloc can't bump max_alloc */
+	if ((int64_t)(pool->user_alloc - pool->max_alloc) > 0) {
+		pool->max_alloc = pool->user_alloc;
+	}
+
+	tcache->alloc_c = 0;
+	tcache->user_alloc = 0;
+}
+
+/*
+ * static void tcache_release
+ *
+ * DESCRIPTION:
+ *
+ * Move up to count slots of one size class from a thread cache back to the
+ * pool.  The pool mutex must be held.
+ *
+ * RETURNS:
+ *
+ * None.
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ *
+ * tcache -> Thread cache holding slots of pool.
+ *
+ * index -> Size class index.
+ *
+ * count -> Maximum number of slots to move.
+ */
+static void tcache_release(ks_pool_t *pool, ks_pool_tcache_t *tcache, const ks_size_t index, uint32_t count)
+{
+	ks_pool_prefix_t *prefix;
+
+	while (count-- && (prefix = tcache->head[index])) {
+		tcache->head[index] = prefix->next;
+		tcache->count[index]--;
+
+		/* Slots from a refill that were never handed out have no prefix yet */
+		prefix->slab_class = index;
+		slab_release_slot(pool, prefix);
+	}
+}
+
+/*
+ * static void tcache_flush
+ *
+ * DESCRIPTION:
+ *
+ * Hand every slot in a thread cache back to its pool, provided the pool is
+ * still open and has not been cleared since, then reset the cache.
+ *
+ * RETURNS:
+ *
+ * None.
+ *
+ * ARGUMENTS:
+ *
+ * tcache -> Thread cache to flush.
+ */
+static void tcache_flush(ks_pool_tcache_t *tcache)
+{
+	ks_pool_t *pool = NULL;
+	ks_size_t index;
+
+	if (!tcache->pool) return;
+
+	ks_spinlock_acquire(&g_tcache_lock);
+	for (pool = g_tcache_pools; pool; pool = pool->tcache_next) {
+		if (pool == tcache->pool) {
+			ks_atomic_increment_uint32(&pool->tcache_flushers);
+			break;
+		}
+	}
+	ks_spinlock_release(&g_tcache_lock);
+
+	if (pool) {
+		ks_mutex_lock(pool->mutex);
+
+		/* The serial only changes under the pool mutex */
+		if (pool->serial == tcache->serial) {
+			tcache_sync(pool, tcache);
+			for (index = 0; index < KS_POOL_SLAB_CLASS_COUNT; index++) {
+				tcache_release(pool, tcache, index, tcache->count[index]);
+			}
+		}
+
+		/* Still under the mutex, so ks_pool_raw_close can't miss the wake up between its check and wait */
+		if (ks_atomic_decrement_uint32(&pool->tcache_flushers) == 1) {
+			ks_cond_broadcast(pool->tcache_cond);
+		}
+
+		ks_mutex_unlock(pool->mutex);
+	}
+
+	memset(tcache, 0, sizeof(*tcache));
+}
+
+/*
+ * static ks_pool_tcache_t *tcache_get
+ *
+ * DESCRIPTION:
+ *
+ * Find the calling thread's cache for a pool, claiming a free entry or
+ * evicting (flushing) another pool's entry when there is none yet.
+ *
+ * RETURNS:
+ *
+ * The thread cache for pool.
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool.
+ */
+static ks_pool_tcache_t *tcache_get(ks_pool_t *pool)
+{
+	ks_pool_tcache_t *tcache = NULL;
+	int i;
+
+	for (i = 0; i < KS_POOL_TCACHE_POOLS; i++) {
+		if (g_tcache[i].pool == pool) {
+			if (g_tcache[i].serial == pool->serial) return &g_tcache[i];
+
+			/* The pool was cleared or closed (and the address reused), its
+			 * slots were released with the slabs so just forget them */
+			memset(&g_tcache[i], 0, sizeof(g_tcache[i]));
+			tcache = &g_tcache[i];
+			break;
+		}
+
+		if (!tcache && !g_tcache[i].pool) tcache = &g_tcache[i];
+	}
+
+	if (!tcache) {
+		tcache = &g_tcache[g_tcache_evict++ % KS_POOL_TCACHE_POOLS];
+		tcache_flush(tcache);
+	}
+
+	tcache->pool = pool;
+	tcache->serial = pool->serial;
+
+	return tcache;
+}
+
+/*
+ * static void *tcache_alloc
+ *
+ * DESCRIPTION:
+ *
+ * Allocate a slab slot from the calling thread's magazine, refilling half a
+ * magazine from the pool under its mutex when it runs dry.
  *
  * RETURNS:
  *
- * Success - KS_STATUS_SUCCESS
+ * Success - Pointer to the address to use.
  *
- * Failure - Ks_Pool error code
+ * Failure - NULL
  *
  * ARGUMENTS:
  *
- * addr -> A pointer directly to the fence.
+ * pool -> Pointer to the memory pool.
+ *
+ * size -> Number of bytes to allocate, at most KS_POOL_SLAB_MAX_SIZE.
+ *
+ * zero -> When false only the prefix is zeroed.
  */
-static ks_status_t check_fence(const void *addr)
+static void *tcache_alloc(ks_pool_t *pool, const ks_size_t size, const ks_bool_t zero, const char *file, int line, const char *tag)
 {
-	const ks_byte_t *mem_p;
+	ks_pool_tcache_t *tcache = tcache_get(pool);
+	ks_size_t index = slab_class_index(size);
+	ks_pool_prefix_t *prefix = NULL;
 
-	mem_p = (ks_byte_t *)addr;
+	if (!tcache->head[index]) {
+		uint32_t want = tcache_depth(index) / 2;
 
-	if (*mem_p == KS_POOL_FENCE_MAGIC0 && *(mem_p + 1) == KS_POOL_FENCE_MAGIC1)
-		return KS_STATUS_SUCCESS;
+		ks_mutex_lock(pool->mutex);
 
-	ks_debug_break();
-	return KS_STATUS_PNT_OVER;
+		tcache_sync(pool, tcache);
+
+		while (tcache->count[index] < want) {
+			if (!(prefix = slab_alloc_slot(pool, index))) break;
+
+			prefix->next = tcache->head[index];
+			tcache->head[index] = prefix;
+			tcache->count[index]++;
+		}
+
+		ks_mutex_unlock(pool->mutex);
+
+		if (!tcache->head[index]) return NULL;
+	}
+
+	prefix = tcache->head[index];
+	tcache->head[index] = prefix->next;
+	tcache->count[index]--;
+
+	tcache->alloc_c++;
+	tcache->user_alloc += size;
+
+	memset(prefix, 0, zero ? KS_POOL_PREFIX_SIZE + size + KS_POOL_FENCE_SIZE : KS_POOL_PREFIX_SIZE);
+
+	return init_prefix(pool, prefix, size, index, file, line, tag);
 }
 
 /*
- * static void write_fence
+ * static void tcache_free
  *
  * DESCRIPTION:
  *
- * Write the magic ID to the address.
+ * Park a slab slot in the calling thread's magazine, first returning half
+ * the magazine to the pool if it is full.
  *
  * RETURNS:
  *
@@ -228,15 +802,31 @@ static ks_status_t check_fence(const void *addr)
  *
  * ARGUMENTS:
  *
- * addr -> Address where to write the magic.
+ * pool -> Pointer to the memory pool.
+ *
+ * prefix -> An untracked slab prefix with no references left.
  */
-static void write_fence(void *addr)
+static void tcache_free(ks_pool_t *pool, ks_pool_prefix_t *prefix)
 {
-	*((ks_byte_t *)addr) = KS_POOL_FENCE_MAGIC0;
-	*((ks_byte_t *)addr + 1) = KS_POOL_FENCE_MAGIC1;
-}
+	ks_pool_tcache_t *tcache = tcache_get(pool);
+	ks_size_t index = prefix->slab_class;
+	uint32_t depth = tcache_depth(index);
+
+	if (tcache->count[index] >= depth) {
+		ks_mutex_lock(pool->mutex);
+		tcache_sync(pool, tcache);
+		tcache_release(pool, tcache, index, depth / 2);
+		ks_mutex_unlock(pool->mutex);
+	}
 
+	tcache->alloc_c--;
+	tcache->user_alloc -= prefix->size;
 
+	prefix->magic1 = 0;
+	prefix->next = tcache->head[index];
+	tcache->head[index] = prefix;
+	tcache->count[index]++;
+}
 
 /*
  * static void *alloc_mem
@@ -257,53 +847,41 @@ static void write_fence(void *addr)
  *
  * byte_size -> Number of bytes to allocate in the pool.  Must be >0.
  *
+ * zero -> When false only the prefix is zeroed, the fence is always written.
+ *
  * error_p <- Pointer to ks_status_t which, if not NULL, will be set with
  * a ks_pool error code.
  */
-static void *alloc_mem(ks_pool_t *pool, const ks_size_t size, const char *file, int line, const char *tag, ks_status_t *error_p)
+static void *alloc_mem(ks_pool_t *pool, const ks_size_t size, const ks_bool_t zero, const char *file, int line, const char *tag, ks_status_t *error_p)
 {
 	ks_size_t required;
+	ks_size_t slab_class = KS_POOL_SLAB_NONE;
 	void *start = NULL;
 	void *addr = NULL;
-	void *fence = NULL;
 	ks_pool_prefix_t *prefix = NULL;
 
 	ks_assert(pool);
 	ks_assert(size);
 
 	required = KS_POOL_PREFIX_SIZE + size + KS_POOL_FENCE_SIZE;
-	start = malloc(required);
+
+	if (KS_BIT_IS_SET(pool->flags, KS_POOL_FLAG_SLAB) && size <= KS_POOL_SLAB_MAX_SIZE) {
+		slab_class = slab_class_index(size);
+		start = slab_alloc_slot(pool, slab_class);
+	} else {
+		start = malloc(required);
+	}
 	ks_assert(start);
-	memset(start, 0, required); // @todo consider readding the NO_ZERO flag option, which would reduce this to only zero out PREFIX_SIZE instead of the entire allocation.
+	memset(start, 0, zero ? required : KS_POOL_PREFIX_SIZE);
 
 	prefix = (ks_pool_prefix_t *)start;
-#ifdef KS_DEBUG_POOL
-	prefix->scanned = g_default_scanned_value;
-#endif
-	addr = (void *)((ks_byte_t *)start + KS_POOL_PREFIX_SIZE);
-	fence = (void *)((ks_byte_t *)addr + size);
-
-	prefix->magic1 = KS_POOL_PREFIX_MAGIC;
-	prefix->size = size;
-	prefix->magic2 = KS_POOL_PREFIX_MAGIC;
-	prefix->refs = 1;
-	prefix->next = pool->first;
-
-#ifdef KS_DEBUG_POOL
-	prefix->file = file;
-	prefix->line = line;
-	prefix->tag = tag;
-#endif
-
-	if (pool->first) pool->first->prev = prefix;
-	pool->first = prefix;
-	if (!pool->last) pool->last = prefix;
-	prefix->magic3 = KS_POOL_PREFIX_MAGIC;
-	prefix->magic4 = KS_POOL_PREFIX_MAGIC;
-	prefix->pool = pool;
-	prefix->magic5 = KS_POOL_PREFIX_MAGIC;
+	addr = init_prefix(pool, prefix, size, slab_class, file, line, tag);
 
-	write_fence(fence);
+	/* Slab carved allocations are released with their slab, so they only need
+	 * to be on the allocation list once a cleanup callback is attached */
+	if (slab_class == KS_POOL_SLAB_NONE) {
+		track_prefix(pool, prefix);
+	}
 
 	if (pool->log_func != NULL) {
 		pool->log_func(pool, KS_POOL_FUNC_INCREF, prefix->size, prefix->refs, NULL, addr, 0);
@@ -356,8 +934,9 @@ static ks_status_t free_mem(void *addr)
 
 	pool = prefix->pool;
 
+	/* Atomic so the unlocked refs check in ks_pool_free_ex reads a whole value */
 	if (prefix->refs > 0) {
-		prefix->refs--;
+		ks_atomic_decrement_size(&prefix->refs);
 
 		if (pool->log_func != NULL) {
 			pool->log_func(pool, KS_POOL_FUNC_DECREF, prefix->size, prefix->refs, addr, NULL, 0);
@@ -373,23 +952,18 @@ static ks_status_t free_mem(void *addr)
 
 	perform_pool_cleanup_on_free(prefix);
 
-	if (!prefix->prev && !prefix->next) pool->first = pool->last = NULL;
-	else if (!prefix->prev) {
-		pool->first = prefix->next;
-		pool->first->prev = NULL;
-	}
-	else if (!prefix->next) {
-		pool->last = prefix->prev;
-		pool->last->next = NULL;
-	} else {
-		prefix->prev->next = prefix->next;
-		prefix->next->prev = prefix->prev;
+	if (prefix->tracked) {
+		untrack_prefix(pool, prefix);
 	}
 
 	pool->alloc_c--;
 	pool->user_alloc -= prefix->size;
 
-	free(start);
+	if (prefix->slab_class != KS_POOL_SLAB_NONE) {
+		slab_release_slot(pool, prefix);
+	} else {
+		free(start);
+	}
 
 	return ret;
 }
@@ -434,8 +1008,19 @@ static ks_pool_t *ks_pool_raw_open(const ks_size_t flags, const char *file, int
 	pool->line = line;
 	pool->file = file;
 	pool->tag = tag;
+	pool->serial = ks_atomic_increment_size(&g_pool_serial) + 1;
 	pool->magic2 = KS_POOL_MAGIC;
 
+	/* Thread caches hand out slab slots */
+	if (KS_BIT_IS_SET(flags, KS_POOL_FLAG_THREAD_CACHE)) {
+		KS_BIT_SET(pool->flags, KS_POOL_FLAG_SLAB);
+
+		ks_spinlock_acquire(&g_tcache_lock);
+		pool->tcache_next = g_tcache_pools;
+		g_tcache_pools = pool;
+		ks_spinlock_release(&g_tcache_lock);
+	}
+
 	SET_POINTER(error_p, KS_STATUS_SUCCESS);
 	return pool;
 }
@@ -467,18 +1052,50 @@ static ks_pool_t *ks_pool_raw_open(const ks_size_t flags, const char *file, int
  * allocated.
  */
 KS_DECLARE(ks_status_t) ks_pool_tagged_open(ks_pool_t **poolP, const char *file, int line, const char *tag)
+{
+	return ks_pool_tagged_open_ex(poolP, KS_POOL_FLAG_DEFAULT, file, line, tag);
+}
+
+/*
+ * ks_pool_t *ks_pool_tagged_open_ex
+ *
+ * DESCRIPTION:
+ *
+ * Open/allocate a new memory pool with flags.
+ *
+ * RETURNS:
+ *
+ * Success - KS_SUCCESS
+ *
+ * Failure - KS_FAIL
+ *
+ * ARGUMENTS:
+ *
+ * poolP <- pointer to new pool that will be set on success
+ * flags -> Flags to set attributes of the memory pool.  See the top
+ * of ks_pool.h.
+ * file  <- pointer to const literal string macro __FILE__
+ * line  <- integer value of file line __LINE__ macro
+ * tag   <- pointer to const literal string to associate with pool
+ */
+KS_DECLARE(ks_status_t) ks_pool_tagged_open_ex(ks_pool_t **poolP, ks_pool_flag_t flags, const char *file, int line, const char *tag)
 {
 	ks_status_t ret = KS_STATUS_SUCCESS;
 	ks_pool_t *pool = NULL;
 
 	ks_assert(poolP);
 
-	pool = ks_pool_raw_open(KS_POOL_FLAG_DEFAULT, file, line, tag, &ret);
+	pool = ks_pool_raw_open(flags, file, line, tag, &ret);
 
 	*poolP = pool;
 
 	ret = __ks_mutex_create(&pool->mutex, KS_MUTEX_FLAG_DEFAULT | KS_MUTEX_FLAG_RAW_ALLOC, NULL, file, line, tag);
 
+	/* Shares the pool mutex, flushers already hold it when they are done */
+	if (ret == KS_STATUS_SUCCESS && KS_BIT_IS_SET(pool->flags, KS_POOL_FLAG_THREAD_CACHE)) {
+		ret = __ks_cond_create_ex(&pool->tcache_cond, NULL, pool->mutex, file, line, tag);
+	}
+
 	return ret;
 }
 
@@ -764,6 +1381,29 @@ static ks_status_t ks_pool_raw_close(ks_pool_t *pool)
 {
 	ks_status_t ret = KS_STATUS_SUCCESS;
 
+	if (KS_BIT_IS_SET(pool->flags, KS_POOL_FLAG_THREAD_CACHE)) {
+		ks_pool_t **poolP;
+
+		/* Once off the list no new thread can start flushing into us,
+		 * wait out the ones that already have */
+		ks_spinlock_acquire(&g_tcache_lock);
+		for (poolP = &g_tcache_pools; *poolP; poolP = &(*poolP)->tcache_next) {
+			if (*poolP == pool) {
+				*poolP = pool->tcache_next;
+				break;
+			}
+		}
+		ks_spinlock_release(&g_tcache_lock);
+
+		ks_cond_lock(pool->tcache_cond);
+		while (pool->tcache_flushers) {
+			ks_cond_wait(pool->tcache_cond);
+		}
+		ks_cond_unlock(pool->tcache_cond);
+
+		ks_cond_destroy(&pool->tcache_cond);
+	}
+
 	if (ret = ks_pool_clear(pool)) {
 		ks_log(KS_LOG_ERROR, "Pool close was not successful for pool at address: %p status: %d\n", (void *)pool, ret);
 		goto done;
@@ -851,10 +1491,15 @@ KS_DECLARE(ks_status_t) ks_pool_clear(ks_pool_t *pool)
 
 	for (prefix = pool->first; prefix; prefix = nprefix) {
 		nprefix = prefix->next;
-		free(prefix);
+		if (prefix->slab_class == KS_POOL_SLAB_NONE) free(prefix);
 	}
 	pool->first = pool->last = NULL;
 
+	slab_destroy_all(pool);
+
+	/* Invalidates every slot still parked in a thread cache */
+	pool->serial = ks_atomic_increment_size(&g_pool_serial) + 1;
+
 	ks_mutex_unlock(pool->mutex);
 
 done:
@@ -904,10 +1549,7 @@ KS_DECLARE(ks_pool_t *) ks_pool_get(void *addr)
 }
 
 /*
- * void *__ks_pool_alloc_ex
- *
- * COMPONENTS:
- * ks_pool_alloc_ex
+ * static void *pool_alloc
  *
  * DESCRIPTION:
  *
@@ -925,12 +1567,15 @@ KS_DECLARE(ks_pool_t *) ks_pool_get(void *addr)
  *
  * size -> Number of bytes to allocate in the pool.  Must be >0.
  *
+ * no_zero -> Skip zeroing the user bytes even if the pool would.
+ *
  * error_p <- Pointer to integer which, if not NULL, will be set with
  * a ks_pool error code.
  */
-KS_DECLARE(void *) __ks_pool_alloc_ex(ks_pool_t *pool, const ks_size_t size, const char *file, int line, const char *tag, ks_status_t *error_p)
+static void *pool_alloc(ks_pool_t *pool, const ks_size_t size, const ks_bool_t no_zero, const char *file, int line, const char *tag, ks_status_t *error_p)
 {
 	ks_status_t ret = KS_STATUS_SUCCESS;
+	ks_bool_t zero;
 	void *addr = NULL;
 
 	/* Default to the global pool if null provided */
@@ -943,9 +1588,15 @@ KS_DECLARE(void *) __ks_pool_alloc_ex(ks_pool_t *pool, const ks_size_t size, con
 
 	if ((ret = check_pool(pool)) != KS_STATUS_SUCCESS) goto done;
 
-	ks_mutex_lock(pool->mutex);
-	addr = alloc_mem(pool, size, file, line, tag, &ret);
-	ks_mutex_unlock(pool->mutex);
+	zero = !no_zero && !KS_BIT_IS_SET(pool->flags, KS_POOL_FLAG_NO_ZERO);
+
+	if (TCACHE_ENABLED(pool) && size <= KS_POOL_SLAB_MAX_SIZE) {
+		addr = tcache_alloc(pool, size, zero, file, line, tag);
+	} else {
+		ks_mutex_lock(pool->mutex);
+		addr = alloc_mem(pool, size, zero, file, line, tag, &ret);
+		ks_mutex_unlock(pool->mutex);
+	}
 
 	if (pool->log_func != NULL) {
 		pool->log_func(pool, KS_POOL_FUNC_ALLOC, size, 0, addr, NULL, 0);
@@ -958,9 +1609,68 @@ KS_DECLARE(void *) __ks_pool_alloc_ex(ks_pool_t *pool, const ks_size_t size, con
 
 done:
 	ks_assert(ret == KS_STATUS_SUCCESS);
+	SET_POINTER(error_p, ret);
 	return addr;
 }
 
+/*
+ * void *__ks_pool_alloc_ex
+ *
+ * COMPONENTS:
+ * ks_pool_alloc_ex
+ *
+ * DESCRIPTION:
+ *
+ * Allocate space for bytes inside of an already open memory pool.
+ *
+ * RETURNS:
+ *
+ * Success - Pointer to the address to use.
+ *
+ * Failure - NULL
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool (NULL will use global).
+ *
+ * size -> Number of bytes to allocate in the pool.  Must be >0.
+ *
+ * error_p <- Pointer to integer which, if not NULL, will be set with
+ * a ks_pool error code.
+ */
+KS_DECLARE(void *) __ks_pool_alloc_ex(ks_pool_t *pool, const ks_size_t size, const char *file, int line, const char *tag, ks_status_t *error_p)
+{
+	return pool_alloc(pool, size, KS_FALSE, file, line, tag, error_p);
+}
+
+/*
+ * void *__ks_pool_alloc_nz
+ *
+ * COMPONENTS:
+ * ks_pool_alloc_nz
+ *
+ * DESCRIPTION:
+ *
+ * Allocate space for bytes inside of an already open memory pool
+ * without zeroing it.
+ *
+ * RETURNS:
+ *
+ * Success - Pointer to the address to use.
+ *
+ * Failure - NULL
+ *
+ * ARGUMENTS:
+ *
+ * pool -> Pointer to the memory pool (NULL will use global).
+ *
+ * size -> Number of bytes to allocate in the pool.  Must be >0.
+ */
+KS_DECLARE(void *) __ks_pool_alloc_nz(ks_pool_t *pool, const ks_size_t size, const char *file, int line, const char *tag)
+{
+	return pool_alloc(pool, size, KS_TRUE, file, line, tag, NULL);
+}
+
 /*
  * void *__ks_pool_alloc
  *
@@ -1038,10 +1748,14 @@ KS_DECLARE(void *) __ks_pool_calloc_ex(ks_pool_t *pool, const ks_size_t ele_n, c
 
 	size = ele_n * ele_size;
 
-	ks_mutex_lock(pool->mutex);
-	addr = alloc_mem(pool, size, file, line, tag, &ret);
-	// @todo consider readding the NO_ZERO flag option, in which case must zero the user-space here based on expected calloc behaviour... memset(addr, 0, size);
-	ks_mutex_unlock(pool->mutex);
+	/* Always zeroed, regardless of KS_POOL_FLAG_NO_ZERO */
+	if (TCACHE_ENABLED(pool) && size <= KS_POOL_SLAB_MAX_SIZE) {
+		addr = tcache_alloc(pool, size, KS_TRUE, file, line, tag);
+	} else {
+		ks_mutex_lock(pool->mutex);
+		addr = alloc_mem(pool, size, KS_TRUE, file, line, tag, &ret);
+		ks_mutex_unlock(pool->mutex);
+	}
 
 	if (pool->log_func != NULL) {
 		pool->log_func(pool, KS_POOL_FUNC_CALLOC, ele_size, ele_n, addr, NULL, 0);
@@ -1122,6 +1836,15 @@ KS_DECLARE(ks_status_t) ks_pool_free_ex(void **addrP)
 	pool = prefix->pool;
 	if ((ret = check_pool(pool)) != KS_STATUS_SUCCESS) goto done;
 
+	/* Last reference to a slot with no cleanup callback, recycle it through
+	 * this thread's magazine without touching the pool mutex */
+	if (TCACHE_ENABLED(pool) && prefix->slab_class != KS_POOL_SLAB_NONE && !prefix->tracked && ks_atomic_load_size(&prefix->refs) == 1) {
+		if ((ret = check_fence((void *)((uintptr_t)addr + prefix->size))) == KS_STATUS_SUCCESS) {
+			tcache_free(pool, prefix);
+		}
+		goto done;
+	}
+
 	ks_mutex_lock(pool->mutex);
 
 	if (pool->log_func != NULL) {
@@ -1176,7 +1899,7 @@ KS_DECLARE(void *) ks_pool_ref_ex(void *addr, ks_status_t *error_p)
 	if ((ret = check_pool(pool)) != KS_STATUS_SUCCESS) goto done;
 
 	ks_mutex_lock(pool->mutex);
-	refs = ++prefix->refs;
+	refs = ks_atomic_increment_size(&prefix->refs) + 1;
 	ks_mutex_unlock(pool->mutex);
 
 	if (pool->log_func != NULL) {
@@ -1190,11 +1913,12 @@ done:
 }
 
 /*
- * void *__ks_pool_resize_ex
+ * static void *resize_mem
  *
  * DESCRIPTION:
  *
- * Reallocate an address in a memory pool to a new size.  This is
+ * Reallocate an address in a memory pool to a new size.  Bytes past
+ * the old size are only zeroed when zero is set.
  *
  * RETURNS:
  *
@@ -1208,12 +1932,14 @@ done:
  *
  * new_size -> New size of the allocation.
  *
+ * zero -> Zero any growth.
+ *
  * error_p <- Pointer to integer which, if not NULL, will be set with
  * a ks_pool error code.
  *
  * file/line/tag <- Contextual information for use with KS_DEBUG_POOL
  */
-KS_DECLARE(void *) __ks_pool_resize_ex(void *old_addr, const ks_size_t new_size, ks_status_t *error_p, const char *file, int line, const char *tag)
+static void *resize_mem(void *old_addr, const ks_size_t new_size, const ks_bool_t zero, ks_status_t *error_p, const char *file, int line, const char *tag)
 {
 	ks_status_t ret = KS_STATUS_SUCCESS;
 	ks_size_t old_size;
@@ -1247,21 +1973,58 @@ KS_DECLARE(void *) __ks_pool_resize_ex(void *old_addr, const ks_size_t new_size,
 
 	old_size = prefix->size;
 
-	required = KS_POOL_PREFIX_SIZE + new_size + KS_POOL_FENCE_SIZE;
-	new_addr = realloc((void *)prefix, required);
-	ks_assert(new_addr);
+	if (prefix->slab_class != KS_POOL_SLAB_NONE && new_size <= slab_class_size(prefix->slab_class)) {
+		/* Still fits in its slot, only the fence moves */
+		prefix->size = new_size;
+		new_addr = old_addr;
+		write_fence((void *)((uintptr_t)new_addr + new_size));
+
+		pool->user_alloc = pool->user_alloc - old_size + new_size;
+	} else if (prefix->slab_class != KS_POOL_SLAB_NONE) {
+		ks_pool_prefix_t *new_prefix = NULL;
+
+		/* Outgrew the slot, move to a bigger class (or the heap) and recycle the old slot */
+		new_addr = alloc_mem(pool, new_size, KS_FALSE, file, line, tag, &ret);
+		ks_assert(new_addr);
+		memcpy(new_addr, old_addr, old_size);
+
+		new_prefix = (ks_pool_prefix_t *)((uintptr_t)new_addr - KS_POOL_PREFIX_SIZE);
+		new_prefix->cleanup_callback = prefix->cleanup_callback;
+		new_prefix->cleanup_arg = prefix->cleanup_arg;
+		if (new_prefix->cleanup_callback && !new_prefix->tracked) track_prefix(pool, new_prefix);
+
+		/* alloc_mem already accounted for the new size */
+		if (prefix->tracked) untrack_prefix(pool, prefix);
+		pool->alloc_c--;
+		pool->user_alloc -= old_size;
+		slab_release_slot(pool, prefix);
+	} else {
+		required = KS_POOL_PREFIX_SIZE + new_size + KS_POOL_FENCE_SIZE;
+		new_addr = realloc((void *)prefix, required);
+		ks_assert(new_addr);
+
+		prefix = (ks_pool_prefix_t *)new_addr;
+
+		prefix->size = new_size;
 
-	prefix = (ks_pool_prefix_t *)new_addr;
+		new_addr = (void *)((uintptr_t)new_addr + KS_POOL_PREFIX_SIZE);
+		write_fence((void *)((uintptr_t)new_addr + new_size));
 
-	prefix->size = new_size;
+		if (prefix->prev) prefix->prev->next = prefix;
+		else pool->first = prefix;
+		if (prefix->next) prefix->next->prev = prefix;
+		else pool->last = prefix;
 
-	new_addr = (void *)((uintptr_t)new_addr + KS_POOL_PREFIX_SIZE);
-	write_fence((void *)((uintptr_t)new_addr + new_size));
+		pool->user_alloc = pool->user_alloc - old_size + new_size;
+	}
+
+	if (pool->user_alloc > pool->max_alloc) {
+		pool->max_alloc = pool->user_alloc;
+	}
 
-	if (prefix->prev) prefix->prev->next = prefix;
-	else pool->first = prefix;
-	if (prefix->next) prefix->next->prev = prefix;
-	else pool->last = prefix;
+	if (new_size > old_size && zero) {
+		memset((ks_byte_t *)new_addr + old_size, 0, new_size - old_size);
+	}
 
 	if (pool->log_func != NULL) {
 		pool->log_func(pool, KS_POOL_FUNC_RESIZE, new_size, 0, old_addr, new_addr, old_size);
@@ -1275,6 +2038,63 @@ done:
 	return new_addr;
 }
 
+/*
+ * void *__ks_pool_resize_ex
+ *
+ * DESCRIPTION:
+ *
+ * Reallocate an address in a memory pool to a new size.  Any growth is
+ * left uninitialized, see ks_pool_resize_zero.
+ *
+ * RETURNS:
+ *
+ * Success - Pointer to the address to use.
+ *
+ * Failure - NULL
+ *
+ * ARGUMENTS:
+ *
+ * old_addr -> Previously allocated address.
+ *
+ * new_size -> New size of the allocation.
+ *
+ * error_p <- Pointer to integer which, if not NULL, will be set with
+ * a ks_pool error code.
+ *
+ * file/line/tag <- Contextual information for use with KS_DEBUG_POOL
+ */
+KS_DECLARE(void *) __ks_pool_resize_ex(void *old_addr, const ks_size_t new_size, ks_status_t *error_p, const char *file, int line, const char *tag)
+{
+	return resize_mem(old_addr, new_size, KS_FALSE, error_p, file, line, tag);
+}
+
+/*
+ * void *__ks_pool_resize_zero
+ *
+ * DESCRIPTION:
+ *
+ * Reallocate an address in a memory pool to a new size, zeroing any
+ * growth regardless of KS_POOL_FLAG_NO_ZERO.
+ *
+ * RETURNS:
+ *
+ * Success - Pointer to the address to use.
+ *
+ * Failure - NULL
+ *
+ * ARGUMENTS:
+ *
+ * old_addr -> Previously allocated address.
+ *
+ * new_size -> New size of the allocation.
+ *
+ * file/line/tag -> Contextual info for use with KS_DEBUG_POOL
+ */
+KS_DECLARE(void *) __ks_pool_resize_zero(void *old_addr, const ks_size_t new_size, const char *file, int line, const char *tag)
+{
+	return resize_mem(old_addr, new_size, KS_TRUE, NULL, file, line, tag);
+}
+
 /*
  * void *__ks_pool_resize
  *
@@ -1610,6 +2430,15 @@ KS_DECLARE(void*) __ks_calloc(size_t count, ks_size_t elem_size, const char *fil
 	return __ks_pool_calloc(ks_global_pool(), count, elem_size, file, line, tag);
 }
 
+KS_DECLARE(void) ks_pool_thread_cache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < KS_POOL_TCACHE_POOLS; i++) {
+		tcache_flush(&g_tcache[i]);
+	}
+}
+
 KS_DECLARE(void) ks_pool_log_on_close(ks_pool_t *pool)
 {
 	pool->log_on_close = KS_TRUE;
@@ -23,6 +23,12 @@
 #include "libks/ks.h"
 #include "libks/ks_atomic.h"
 
+/* Slot in a KS_Q_FLAG_LOCKFREE ring; seq tells producers and consumers whose turn it is */
+typedef struct ks_qslot_s {
+	volatile uint64_t seq;
+	void *ptr;
+} ks_qslot_t;
+
 typedef struct ks_qnode_s {
 	void *ptr;
 	struct ks_qnode_s *next;
@@ -37,12 +43,22 @@ struct ks_q_s {
 	ks_cond_t *pop_cond;
 	ks_cond_t *push_cond;
 	ks_mutex_t *list_mutex;
-	uint32_t pushers;
-	uint32_t poppers;
+	volatile uint32_t pushers;
+	volatile uint32_t poppers;
+	uint32_t wake_gen; /* bumped by ks_q_wake under list_mutex, sends ring waiters back with KS_STATUS_BREAK */
 	struct ks_qnode_s *head;
 	struct ks_qnode_s *tail;
 	struct ks_qnode_s *empty;
 	uint8_t active;
+	uint32_t flags;
+	ks_qslot_t *ring;
+	uint64_t ring_mask;
+	/* Keep producers and consumers on separate cache lines */
+	char pad0[64];
+	volatile uint64_t enqueue_pos;
+	char pad1[64];
+	volatile uint64_t dequeue_pos;
+	char pad2[64];
 };
 
 static void ks_q_cleanup(void *ptr, void *arg, ks_pool_cleanup_action_t action, ks_pool_cleanup_type_t type)
@@ -62,6 +78,10 @@ static void ks_q_cleanup(void *ptr, void *arg, ks_pool_cleanup_action_t action,
 		}
 		break;
 	case KS_MPCL_TEARDOWN:
+		if (q->ring) {
+			ks_pool_free(&q->ring);
+		}
+
 		np = q->head;
 		while(np) {
 			fp = np;
@@ -111,6 +131,7 @@ KS_DECLARE(ks_status_t) ks_q_set_flush_fn(ks_q_t *q, ks_flush_fn_t fn, void *flu
 KS_DECLARE(ks_status_t) ks_q_wake(ks_q_t *q)
 {
 	ks_mutex_lock(q->list_mutex);
+	q->wake_gen++;
 	ks_cond_broadcast(q->push_cond);
 	ks_cond_broadcast(q->pop_cond);
 	ks_mutex_unlock(q->list_mutex);
@@ -134,10 +155,26 @@ KS_DECLARE(ks_size_t) ks_q_term(ks_q_t *q)
 	return active ? KS_STATUS_SUCCESS : KS_STATUS_INACTIVE;
 }
 
+static ks_size_t ring_len(ks_q_t *q)
+{
+	uint64_t head = ks_atomic_load_uint64(&q->dequeue_pos);
+	uint64_t tail = ks_atomic_load_uint64(&q->enqueue_pos);
+
+	/* The two loads are not a snapshot, clamp what a racing pop can skew */
+	if ((int64_t)(tail - head) <= 0) return 0;
+	if (tail - head > q->maxlen) return q->maxlen;
+
+	return (ks_size_t)(tail - head);
+}
+
 KS_DECLARE(ks_size_t) ks_q_size(ks_q_t *q)
 {
 	ks_size_t size;
 
+	if (q->ring) {
+		return ring_len(q);
+	}
+
 	//ks_mutex_lock(q->list_mutex);
 	size = q->len;
 	//ks_mutex_unlock(q->list_mutex);
@@ -171,9 +208,14 @@ KS_DECLARE(ks_status_t) ks_q_destroy(ks_q_t **qP)
 	return KS_STATUS_FAIL;
 }
 
-KS_DECLARE(ks_status_t) ks_q_create(ks_q_t **qP, ks_pool_t *pool, ks_size_t maxlen)
+KS_DECLARE(ks_status_t) ks_q_create_ex(ks_q_t **qP, ks_pool_t *pool, ks_size_t maxlen, uint32_t flags)
 {
 	ks_q_t *q = NULL;
+	uint64_t i, slots = 1;
+
+	if ((flags & KS_Q_FLAG_LOCKFREE) && !maxlen) {
+		return KS_STATUS_ARG_INVALID;
+	}
 
 	q = ks_pool_alloc(pool, sizeof(*q));
 	ks_assert(q);
@@ -187,7 +229,22 @@ KS_DECLARE(ks_status_t) ks_q_create(ks_q_t **qP, ks_pool_t *pool, ks_size_t maxl
 	ks_cond_create_ex(&q->push_cond, pool, q->list_mutex);
 	ks_assert(q->push_cond);
 
+	if (flags & KS_Q_FLAG_LOCKFREE) {
+		while (slots < maxlen) slots <<= 1;
+
+		q->ring = ks_pool_alloc(pool, (ks_size_t)slots * sizeof(ks_qslot_t));
+		ks_assert(q->ring);
+
+		for (i = 0; i < slots; i++) {
+			q->ring[i].seq = i;
+		}
+
+		q->ring_mask = slots - 1;
+		maxlen = (ks_size_t)slots;
+	}
+
 	q->maxlen = maxlen;
+	q->flags = flags;
 	q->active = 1;
 
 	ks_pool_set_cleanup(q, NULL, ks_q_cleanup);
@@ -197,6 +254,204 @@ KS_DECLARE(ks_status_t) ks_q_create(ks_q_t **qP, ks_pool_t *pool, ks_size_t maxl
 	return KS_STATUS_SUCCESS;
 }
 
+KS_DECLARE(ks_status_t) ks_q_create(ks_q_t **qP, ks_pool_t *pool, ks_size_t maxlen)
+{
+	return ks_q_create_ex(qP, pool, maxlen, KS_Q_FLAG_DEFAULT);
+}
+
+/* Lock free ring operations, these never block and return KS_STATUS_BREAK when full/empty */
+
+static ks_status_t ring_push(ks_q_t *q, void *ptr)
+{
+	uint64_t pos = ks_atomic_load_uint64(&q->enqueue_pos);
+	ks_qslot_t *slot;
+	int64_t diff;
+
+	for (;;) {
+		slot = &q->ring[pos & q->ring_mask];
+		diff = (int64_t)(ks_atomic_load_uint64(&slot->seq) - pos);
+
+		if (diff == 0) {
+			if (ks_atomic_cas_uint64(&q->enqueue_pos, pos, pos + 1)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return KS_STATUS_BREAK;
+		}
+
+		pos = ks_atomic_load_uint64(&q->enqueue_pos);
+	}
+
+	slot->ptr = ptr;
+	ks_atomic_store_uint64(&slot->seq, pos + 1);
+
+	return KS_STATUS_SUCCESS;
+}
+
+static ks_status_t ring_pop(ks_q_t *q, void **ptr)
+{
+	uint64_t pos = ks_atomic_load_uint64(&q->dequeue_pos);
+	ks_qslot_t *slot;
+	int64_t diff;
+
+	for (;;) {
+		slot = &q->ring[pos & q->ring_mask];
+		diff = (int64_t)(ks_atomic_load_uint64(&slot->seq) - (pos + 1));
+
+		if (diff == 0) {
+			if (ks_atomic_cas_uint64(&q->dequeue_pos, pos, pos + 1)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return KS_STATUS_BREAK;
+		}
+
+		pos = ks_atomic_load_uint64(&q->dequeue_pos);
+	}
+
+	*ptr = slot->ptr;
+	ks_atomic_store_uint64(&slot->seq, pos + q->ring_mask + 1);
+
+	return KS_STATUS_SUCCESS;
+}
+
+static ks_status_t ring_peek(ks_q_t *q, void **ptr)
+{
+	uint64_t pos;
+	ks_qslot_t *slot;
+	void *val;
+
+	do {
+		pos = ks_atomic_load_uint64(&q->dequeue_pos);
+		slot = &q->ring[pos & q->ring_mask];
+
+		if (ks_atomic_load_uint64(&slot->seq) != pos + 1) {
+			return KS_STATUS_BREAK;
+		}
+
+		val = slot->ptr;
+	} while (ks_atomic_load_uint64(&slot->seq) != pos + 1);
+
+	*ptr = val;
+
+	return KS_STATUS_SUCCESS;
+}
+
+/*
+ * Parked threads count themselves in pushers/poppers under list_mutex before
+ * re-checking the ring, so the fence here guarantees that either the waiter
+ * sees our operation or we see the waiter and signal it.
+ */
+static void ring_wake(ks_q_t *q, volatile uint32_t *waiters, ks_cond_t *cond)
+{
+	ks_atomic_fence();
+
+	if (ks_atomic_load_uint32(waiters)) {
+		ks_mutex_lock(q->list_mutex);
+		ks_cond_signal(cond);
+		ks_mutex_unlock(q->list_mutex);
+	}
+}
+
+/*
+ * A slot can be claimed but not yet published when we look, so an empty or full ring
+ * after a wakeup is not final. Keep waiting until it works, the queue is terminated,
+ * ks_q_wake is called (KS_STATUS_BREAK, like the list queue) or the timeout runs out.
+ */
+static ks_status_t ring_push_wait(ks_q_t *q, void *ptr)
+{
+	ks_status_t r;
+	uint32_t gen;
+
+	if (!q->active) return KS_STATUS_INACTIVE;
+
+	if ((r = ring_push(q, ptr)) != KS_STATUS_SUCCESS) {
+		ks_mutex_lock(q->list_mutex);
+		ks_atomic_increment_uint32(&q->pushers);
+		ks_atomic_fence();
+		gen = q->wake_gen;
+
+		while ((r = ring_push(q, ptr)) != KS_STATUS_SUCCESS) {
+			if (!q->active) {
+				r = KS_STATUS_INACTIVE;
+				break;
+			}
+
+			if (q->wake_gen != gen) {
+				r = KS_STATUS_BREAK;
+				break;
+			}
+
+			ks_cond_wait(q->push_cond);
+		}
+
+		ks_atomic_decrement_uint32(&q->pushers);
+		ks_mutex_unlock(q->list_mutex);
+
+		if (r != KS_STATUS_SUCCESS) {
+			return r;
+		}
+	}
+
+	ring_wake(q, &q->poppers, q->pop_cond);
+
+	return KS_STATUS_SUCCESS;
+}
+
+static ks_status_t ring_pop_wait(ks_q_t *q, void **ptr, uint32_t timeout)
+{
+	ks_time_t deadline = 0, now;
+	ks_status_t r;
+	uint32_t gen;
+
+	if (!q->active) return KS_STATUS_INACTIVE;
+
+	if ((r = ring_pop(q, ptr)) != KS_STATUS_SUCCESS) {
+		if (timeout) {
+			deadline = ks_time_now() + (ks_time_t)timeout * 1000;
+		}
+
+		ks_mutex_lock(q->list_mutex);
+		ks_atomic_increment_uint32(&q->poppers);
+		ks_atomic_fence();
+		gen = q->wake_gen;
+
+		while ((r = ring_pop(q, ptr)) != KS_STATUS_SUCCESS) {
+			if (!q->active) {
+				r = KS_STATUS_INACTIVE;
+				break;
+			}
+
+			if (q->wake_gen != gen) {
+				r = KS_STATUS_BREAK;
+				break;
+			}
+
+			if (timeout) {
+				if ((now = ks_time_now()) >= deadline) {
+					r = KS_STATUS_TIMEOUT;
+					break;
+				}
+
+				ks_cond_timedwait(q->pop_cond, (ks_time_t)((deadline - now + 999) / 1000));
+			} else {
+				ks_cond_wait(q->pop_cond);
+			}
+		}
+
+		ks_atomic_decrement_uint32(&q->poppers);
+		ks_mutex_unlock(q->list_mutex);
+
+		if (r != KS_STATUS_SUCCESS) {
+			return r;
+		}
+	}
+
+	ring_wake(q, &q->pushers, q->push_cond);
+
+	return KS_STATUS_SUCCESS;
+}
+
 static ks_qnode_t *new_node(ks_q_t *q)
 {
 	ks_qnode_t *np;
@@ -246,6 +501,10 @@ KS_DECLARE(ks_status_t) ks_q_push(ks_q_t *q, void *ptr)
 {
 	ks_status_t r;
 
+	if (q->ring) {
+		return ring_push_wait(q, ptr);
+	}
+
 	ks_mutex_lock(q->list_mutex);
 	if (q->active == 0) {
 		r = KS_STATUS_INACTIVE;
@@ -284,6 +543,14 @@ KS_DECLARE(ks_status_t) ks_q_trypush(ks_q_t *q, void *ptr)
 {
 	ks_status_t r;
 
+	if (q->ring) {
+		if (!q->active) return KS_STATUS_INACTIVE;
+		if ((r = ring_push(q, ptr)) == KS_STATUS_SUCCESS) {
+			ring_wake(q, &q->poppers, q->pop_cond);
+		}
+		return r;
+	}
+
 	ks_mutex_lock(q->list_mutex);
 	if (q->active == 0) {
 		r = KS_STATUS_INACTIVE;
@@ -368,6 +635,10 @@ KS_DECLARE(ks_status_t) ks_q_pop_timeout(ks_q_t *q, void **ptr, uint32_t timeout
 {
 	ks_status_t r;
 
+	if (q->ring) {
+		return ring_pop_wait(q, ptr, timeout);
+	}
+
 	ks_mutex_lock(q->list_mutex);
 
 	if (!q->active) {
@@ -423,6 +694,14 @@ KS_DECLARE(ks_status_t) ks_q_trypop(ks_q_t *q, void **ptr)
 {
 	ks_status_t r;
 
+	if (q->ring) {
+		if (!q->active) return KS_STATUS_INACTIVE;
+		if ((r = ring_pop(q, ptr)) == KS_STATUS_SUCCESS) {
+			ring_wake(q, &q->pushers, q->push_cond);
+		}
+		return r;
+	}
+
 	ks_mutex_lock(q->list_mutex);
 
 	if (!q->active) {
@@ -449,10 +728,258 @@ KS_DECLARE(ks_status_t) ks_q_trypop(ks_q_t *q, void **ptr)
 
 }
 
+static void ring_wake_all(ks_q_t *q, volatile uint32_t *waiters, ks_cond_t *cond, ks_size_t count)
+{
+	if (count == 1) {
+		ring_wake(q, waiters, cond);
+		return;
+	}
+
+	ks_atomic_fence();
+
+	if (ks_atomic_load_uint32(waiters)) {
+		ks_mutex_lock(q->list_mutex);
+		ks_cond_broadcast(cond);
+		ks_mutex_unlock(q->list_mutex);
+	}
+}
+
+static ks_status_t ring_push_batch(ks_q_t *q, void **ptrs, ks_size_t n, ks_size_t *pushed)
+{
+	ks_status_t r;
+	ks_size_t i = 0;
+
+	if (!q->active) return KS_STATUS_INACTIVE;
+
+	while (i < n && ring_push(q, ptrs[i]) == KS_STATUS_SUCCESS) {
+		i++;
+	}
+
+	if (i == 0) {
+		/* Full, park once for the first item the same way ks_q_push would */
+		if ((r = ring_push_wait(q, ptrs[0])) != KS_STATUS_SUCCESS) {
+			return r;
+		}
+
+		i++;
+
+		while (i < n && ring_push(q, ptrs[i]) == KS_STATUS_SUCCESS) {
+			i++;
+		}
+
+		if (i > 1) {
+			ring_wake_all(q, &q->poppers, q->pop_cond, i - 1);
+		}
+	} else {
+		ring_wake_all(q, &q->poppers, q->pop_cond, i);
+	}
+
+	*pushed = i;
+
+	return KS_STATUS_SUCCESS;
+}
+
+static ks_status_t ring_pop_batch(ks_q_t *q, void **ptrs, ks_size_t max, uint32_t timeout, ks_size_t *popped)
+{
+	ks_status_t r;
+	ks_size_t i = 0;
+
+	if (!q->active) return KS_STATUS_INACTIVE;
+
+	while (i < max && ring_pop(q, &ptrs[i]) == KS_STATUS_SUCCESS) {
+		i++;
+	}
+
+	if (i == 0) {
+		if ((r = ring_pop_wait(q, &ptrs[0], timeout)) != KS_STATUS_SUCCESS) {
+			return r;
+		}
+
+		i++;
+
+		while (i < max && ring_pop(q, &ptrs[i]) == KS_STATUS_SUCCESS) {
+			i++;
+		}
+
+		if (i > 1) {
+			ring_wake_all(q, &q->pushers, q->push_cond, i - 1);
+		}
+	} else {
+		ring_wake_all(q, &q->pushers, q->push_cond, i);
+	}
+
+	*popped = i;
+
+	return KS_STATUS_SUCCESS;
+}
+
+KS_DECLARE(ks_status_t) ks_q_push_batch(ks_q_t *q, void **ptrs, ks_size_t n, ks_size_t *pushed)
+{
+	ks_status_t r = KS_STATUS_SUCCESS;
+	ks_qnode_t *node;
+	ks_size_t i = 0;
+
+	ks_assert(pushed);
+	*pushed = 0;
+
+	if (!n) return KS_STATUS_SUCCESS;
+
+	if (q->ring) {
+		return ring_push_batch(q, ptrs, n, pushed);
+	}
+
+	ks_mutex_lock(q->list_mutex);
+	if (q->active == 0) {
+		r = KS_STATUS_INACTIVE;
+		goto end;
+	}
+
+	if (q->maxlen && q->len == q->maxlen) {
+		q->pushers++;
+		ks_cond_wait(q->push_cond);
+		q->pushers--;
+
+		if (q->maxlen && q->len == q->maxlen) {
+			if (!q->active) {
+				r = KS_STATUS_INACTIVE;
+			} else {
+				r = KS_STATUS_BREAK;
+			}
+			goto end;
+		}
+	}
+
+	if (!q->active) {
+		r = KS_STATUS_INACTIVE;
+		goto end;
+	}
+
+	for (i = 0; i < n && (!q->maxlen || q->len < q->maxlen); i++) {
+		node = new_node(q);
+		node->ptr = ptrs[i];
+
+		if (!q->head) {
+			q->head = q->tail = node;
+		} else {
+			q->tail->next = node;
+			node->prev = q->tail;
+			q->tail = node;
+		}
+		ks_atomic_increment_size(&q->len);
+	}
+
+	if (q->poppers) {
+		if (i > 1) {
+			ks_cond_broadcast(q->pop_cond);
+		} else {
+			ks_cond_signal(q->pop_cond);
+		}
+	}
+
+	*pushed = i;
+
+ end:
+
+	ks_mutex_unlock(q->list_mutex);
+
+	return r;
+}
+
+KS_DECLARE(ks_status_t) ks_q_pop_batch(ks_q_t *q, void **ptrs, ks_size_t max, uint32_t timeout, ks_size_t *popped)
+{
+	ks_status_t r = KS_STATUS_SUCCESS;
+	ks_qnode_t *np;
+	ks_size_t i = 0;
+
+	ks_assert(popped);
+	*popped = 0;
+
+	if (!max) return KS_STATUS_SUCCESS;
+
+	if (q->ring) {
+		return ring_pop_batch(q, ptrs, max, timeout, popped);
+	}
+
+	ks_mutex_lock(q->list_mutex);
+
+	if (!q->active) {
+		r = KS_STATUS_INACTIVE;
+		goto end;
+	}
+
+	if (q->len == 0) {
+		q->poppers++;
+		if (timeout) {
+			r = ks_cond_timedwait(q->pop_cond, timeout);
+		} else {
+			r = ks_cond_wait(q->pop_cond);
+		}
+		q->poppers--;
+
+		if (timeout && r != KS_STATUS_SUCCESS) {
+			goto end;
+		}
+
+		if (q->len == 0) {
+			if (!q->active) {
+				r = KS_STATUS_INACTIVE;
+			} else {
+				r = KS_STATUS_BREAK;
+			}
+			goto end;
+		}
+	}
+
+	if (!q->active) {
+		r = KS_STATUS_INACTIVE;
+		goto end;
+	}
+
+	r = KS_STATUS_SUCCESS;
+
+	for (i = 0; i < max && q->head; i++) {
+		np = q->head;
+		if ((q->head = q->head->next)) {
+			q->head->prev = NULL;
+		} else {
+			q->tail = NULL;
+		}
+
+		ptrs[i] = np->ptr;
+
+		np->next = q->empty;
+		np->prev = NULL;
+		np->ptr = NULL;
+		q->empty = np;
+		ks_atomic_decrement_size(&q->len);
+	}
+
+	if (q->pushers) {
+		if (i > 1) {
+			ks_cond_broadcast(q->push_cond);
+		} else {
+			ks_cond_signal(q->push_cond);
+		}
+	}
+
+	*popped = i;
+
+ end:
+
+	ks_mutex_unlock(q->list_mutex);
+
+	return r;
+}
+
 KS_DECLARE(ks_status_t) ks_q_trypeek(ks_q_t *q, void **ptr)
 {
 	ks_status_t r;
 
+	if (q->ring) {
+		if (!q->active) return KS_STATUS_INACTIVE;
+		return ring_peek(q, ptr);
+	}
+
 	ks_mutex_lock(q->list_mutex);
 
 	if (!q->active) {
@@ -491,7 +1018,7 @@ KS_DECLARE(ks_status_t) ks_q_wait(ks_q_t *q)
 			done = 1;
 		}
 
-		if (q->len == 0) {
+		if (ks_q_size(q) == 0) {
 			done = 1;
 		}
 
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2018-2023 SignalWire, Inc
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "libks/ks.h"
+#include <openssl/rand.h>
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#include <sys/random.h>
+#define KS_RANDOM_GETRANDOM 1
+#endif
+
+#define KS_RANDOM_BLOCKS 8
+#define KS_RANDOM_BUFLEN (KS_RANDOM_BLOCKS * 64)
+#define KS_RANDOM_KEYLEN 32
+
+typedef struct ks_random_state_s {
+	uint32_t key[8];
+	uint64_t counter;
+	uint8_t buf[KS_RANDOM_BUFLEN];
+	ks_size_t avail;      /* unused bytes at the end of buf */
+	ks_size_t produced;   /* output since the last seed */
+	int seeded;
+} ks_random_state_t;
+
+static KS_THREAD_LOCAL ks_random_state_t g_random;
+
+#ifndef WIN32
+static pthread_once_t g_random_atfork_once = PTHREAD_ONCE_INIT;
+
+/* A forked child must not repeat its parent's stream. Only the forking thread carries on, so its state is all there is to drop */
+static void ks_random_atfork_child(void)
+{
+	memset(&g_random, 0, sizeof(g_random));
+}
+
+static void ks_random_atfork(void)
+{
+	pthread_atfork(NULL, NULL, ks_random_atfork_child);
+}
+#endif
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7)
+
+static void store32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t load32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* One 64 byte ChaCha20 block (RFC 8439) for the current key, with a 64 bit counter and a zero nonce */
+static void chacha20_block(const uint32_t key[8], uint64_t counter, uint8_t *out)
+{
+	uint32_t in[16], x[16];
+	int i;
+
+	in[0] = 0x61707865;
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	memcpy(in + 4, key, sizeof(uint32_t) * 8);
+	in[12] = (uint32_t)counter;
+	in[13] = (uint32_t)(counter >> 32);
+	in[14] = 0;
+	in[15] = 0;
+
+	memcpy(x, in, sizeof(x));
+
+	for (i = 0; i < 10; i++) {
+		QUARTER(x[0], x[4], x[8], x[12]);
+		QUARTER(x[1], x[5], x[9], x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[8], x[13]);
+		QUARTER(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; i++) {
+		store32(out + i * 4, x[i] + in[i]);
+	}
+}
+
+/* Entropy from the OS: getrandom where there is one, OpenSSL's generator otherwise */
+static void ks_random_os(uint8_t *buf, ks_size_t len)
+{
+#ifdef KS_RANDOM_GETRANDOM
+	ks_size_t got = 0;
+
+	while (got < len) {
+		ssize_t r = getrandom(buf + got, len - got, 0);
+
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		got += (ks_size_t)r;
+	}
+
+	if (got == len) {
+		return;
+	}
+#endif
+
+	if (RAND_bytes(buf, (int)len) != 1) {
+		/* Nothing else to fall back on, but never hand out the same stream twice */
+		ks_log(KS_LOG_CRIT, "No OS entropy for ks_random\n");
+		abort();
+	}
+}
+
+static void ks_random_seed(ks_random_state_t *rs)
+{
+	uint8_t seed[KS_RANDOM_KEYLEN];
+	int i;
+
+#ifndef WIN32
+	pthread_once(&g_random_atfork_once, ks_random_atfork);
+#endif
+
+	ks_random_os(seed, sizeof(seed));
+
+	for (i = 0; i < 8; i++) {
+		rs->key[i] = load32(seed + i * 4);
+	}
+
+	memset(seed, 0, sizeof(seed));
+
+	rs->counter = 0;
+	rs->avail = 0;
+	rs->produced = 0;
+	rs->seeded = 1;
+}
+
+/*
+ * Refills buf and replaces the key with the first bytes of it, so the state left behind
+ * can't be used to work back to anything already handed out.
+ */
+static void ks_random_refill(ks_random_state_t *rs)
+{
+	int i;
+
+	if (!rs->seeded || rs->produced >= KS_RANDOM_RESEED_BYTES) {
+		ks_random_seed(rs);
+	}
+
+	for (i = 0; i < KS_RANDOM_BLOCKS; i++) {
+		chacha20_block(rs->key, rs->counter++, rs->buf + i * 64);
+	}
+
+	for (i = 0; i < 8; i++) {
+		rs->key[i] = load32(rs->buf + i * 4);
+	}
+
+	memset(rs->buf, 0, KS_RANDOM_KEYLEN);
+	rs->counter = 0;
+	rs->avail = KS_RANDOM_BUFLEN - KS_RANDOM_KEYLEN;
+	rs->produced += KS_RANDOM_BUFLEN - KS_RANDOM_KEYLEN;
+}
+
+KS_DECLARE(void) ks_random_bytes(void *buf, ks_size_t len)
+{
+	ks_random_state_t *rs = &g_random;
+	uint8_t *out = (uint8_t *)buf;
+
+	/* Whole blocks of big requests go straight into the caller's buffer, with the key replaced after each run */
+	while (len >= KS_RANDOM_BUFLEN) {
+		ks_size_t n = len & ~(ks_size_t)63, off;
+
+		if (!rs->seeded || rs->produced >= KS_RANDOM_RESEED_BYTES) {
+			ks_random_seed(rs);
+		}
+
+		if (n > KS_RANDOM_RESEED_BYTES - rs->produced) {
+			n = (KS_RANDOM_RESEED_BYTES - rs->produced + 63) & ~(ks_size_t)63;
+		}
+
+		for (off = 0; off < n; off += 64) {
+			chacha20_block(rs->key, rs->counter++, out + off);
+		}
+
+		rs->produced += n;
+		out += n;
+		len -= n;
+
+		ks_random_refill(rs);
+	}
+
+	while (len) {
+		uint8_t *p;
+		ks_size_t n;
+
+		if (!rs->avail) {
+			ks_random_refill(rs);
+		}
+
+		n = rs->avail < len ? rs->avail : len;
+		p = rs->buf + KS_RANDOM_BUFLEN - rs->avail;
+
+		memcpy(out, p, n);
+		/* Handed out once, then gone */
+		memset(p, 0, n);
+
+		rs->avail -= n;
+		out += n;
+		len -= n;
+	}
+}
+
+KS_DECLARE(uint32_t) ks_random_uint32(void)
+{
+	ks_random_state_t *rs = &g_random;
+	uint32_t v;
+
+	uint8_t *p;
+
+	if (rs->avail < sizeof(v)) {
+		ks_random_bytes(&v, sizeof(v));
+		return v;
+	}
+
+	p = rs->buf + KS_RANDOM_BUFLEN - rs->avail;
+	memcpy(&v, p, sizeof(v));
+	memset(p, 0, sizeof(v));
+	rs->avail -= sizeof(v);
+
+	return v;
+}
+
+KS_DECLARE(uint64_t) ks_random_uint64(void)
+{
+	ks_random_state_t *rs = &g_random;
+	uint64_t v;
+
+	uint8_t *p;
+
+	if (rs->avail < sizeof(v)) {
+		ks_random_bytes(&v, sizeof(v));
+		return v;
+	}
+
+	p = rs->buf + KS_RANDOM_BUFLEN - rs->avail;
+	memcpy(&v, p, sizeof(v));
+	memset(p, 0, sizeof(v));
+	rs->avail -= sizeof(v);
+
+	return v;
+}
+
+KS_DECLARE(uint32_t) ks_random_uniform(uint32_t bound)
+{
+	uint64_t m;
+	uint32_t low;
+
+	if (bound < 2) {
+		return 0;
+	}
+
+	/* Lemire's multiply and shift, redrawing the few values that would skew the result */
+	m = (uint64_t)ks_random_uint32() * bound;
+	low = (uint32_t)m;
+
+	if (low < bound) {
+		uint32_t threshold = (uint32_t)-bound % bound;
+
+		while (low < threshold) {
+			m = (uint64_t)ks_random_uint32() * bound;
+			low = (uint32_t)m;
+		}
+	}
+
+	return (uint32_t)(m >> 32);
+}
+
+KS_DECLARE(void) ks_random_reseed(void)
+{
+	ks_random_state_t *rs = &g_random;
+
+	memset(rs->buf, 0, sizeof(rs->buf));
+	ks_random_seed(rs);
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4 noet:
+ */
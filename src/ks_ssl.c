@@ -262,6 +262,31 @@ static int mkcert(X509 **x509p, EVP_PKEY **pkeyp, int bits, int serial, int days
 	return(0);
 }
 
+KS_DECLARE(ks_bool_t) ks_ssl_request_ktls(SSL *ssl)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+	return KS_TRUE;
+#else
+	(void)ssl;
+	return KS_FALSE;
+#endif
+}
+
+KS_DECLARE(void) ks_ssl_get_ktls(SSL *ssl, ks_bool_t *tx, ks_bool_t *rx)
+{
+	/* Without kernel support OpenSSL quietly keeps the records in userspace */
+	if (tx) *tx = KS_FALSE;
+	if (rx) *rx = KS_FALSE;
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	if (ssl) {
+		if (tx) *tx = BIO_get_ktls_send(SSL_get_wbio(ssl)) ? KS_TRUE : KS_FALSE;
+		if (rx) *rx = BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? KS_TRUE : KS_FALSE;
+	}
+#endif
+}
+
 /* For Emacs:
  * Local Variables:
  * mode:c
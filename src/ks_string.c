@@ -575,8 +575,7 @@ KS_DECLARE(void) ks_random_string(char *buf, uint16_t len, char *set)
 	max = (int) strlen(set);
 
 	for (x = 0; x < len; x++) {
-		int j = (int) (max * 1.0 * rand() / (RAND_MAX + 1.0));
-		buf[x] = set[j];
+		buf[x] = set[ks_random_uniform((uint32_t)max)];
 	}
 }
 
@@ -188,6 +188,9 @@ static void *KS_THREAD_CALLING_CONVENTION thread_launch(void *args)
 	ret = thread->function(thread, thread->private_data);
 	ks_log(KS_LOG_DEBUG, "STOP call user thread callback with address: %p, tid: %"KS_PID_FMT"\n", (void *)thread, thread->id);
 
+	/* Hand any slots this thread cached back to their pools */
+	ks_pool_thread_cache_flush();
+
 	if (thread->flags & KS_THREAD_FLAG_DETACHED) {
 		thread->in_use = KS_FALSE;
 		__ks_thread_destroy_ex(&thread, KS_TRUE);
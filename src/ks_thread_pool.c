@@ -23,21 +23,77 @@
 #include "libks/ks.h"
 
 #define TP_MAX_QLEN 1024
+#define TP_DEQUE_LEN 256
+#define TP_WAIT_BUCKETS 32
 
 typedef enum {
 	TP_STATE_DOWN = 0,
 	TP_STATE_RUNNING = 1
 } ks_thread_pool_state_t;
 
+typedef struct ks_thread_job_s {
+	ks_thread_function_t func;
+	ks_thread_function_t expired_func;
+	void *data;
+	/* Only used when the job was submitted with a future or a task group */
+	ks_thread_pool_t *tp;
+	void *result;
+	volatile uint32_t done;
+	ks_task_group_t *group;
+	ks_time_t queued_at;
+	ks_time_t deadline;
+	uint8_t lane;
+	uint8_t expired;
+} ks_thread_job_t;
+
+/* Wait times are kept as a log2 histogram in microseconds, bucket n covers [2^(n-1), 2^n) */
+typedef struct ks_thread_pool_lane_s {
+	ks_q_t *q;
+	volatile uint64_t queued;
+	volatile uint64_t run;
+	volatile uint64_t expired;
+	volatile uint64_t wait_max;
+	volatile uint32_t wait_hist[TP_WAIT_BUCKETS];
+	/* Jobs with a deadline, a min heap on it so the earliest due is taken first */
+	ks_spinlock_t edf_lock;
+	volatile uint32_t edf_count;
+	uint32_t edf_size;
+	ks_thread_job_t **edf;
+} ks_thread_pool_lane_t;
+
+/* A future is the job itself, kept alive by an extra ref until ks_thread_pool_future_destroy */
+struct ks_thread_pool_future_s {
+	ks_thread_job_t job;
+};
+
+struct ks_task_group_s {
+	ks_thread_pool_t *tp;
+	volatile uint32_t pending;
+};
+
+/* Per worker deque for KS_THREAD_POOL_FLAG_WORK_STEALING, the owner works the tail and thieves take from the head */
+typedef struct ks_thread_pool_deque_s {
+	ks_spinlock_t lock;
+	volatile uint32_t owned;
+	volatile uint32_t count;
+	uint32_t head;
+	uint32_t tail;
+	ks_thread_job_t *jobs[TP_DEQUE_LEN];
+} ks_thread_pool_deque_t;
+
 struct ks_thread_pool_s {
 	uint32_t min;
 	uint32_t max;
 	uint32_t idle_sec;
 	size_t stack_size;
 	ks_thread_priority_t priority;
-	ks_q_t *q;
+	ks_thread_pool_lane_t lanes[KS_THREAD_POOL_PRIORITY_COUNT];
+	uint32_t flags;
 	uint32_t thread_count;
-	uint32_t busy_thread_count;
+	volatile uint32_t busy_thread_count;
+	volatile uint32_t idle_thread_count;
+	ks_thread_pool_deque_t *deques;
+	uint32_t deque_count;
 	uint32_t running_thread_count;
 	uint32_t dying_thread_count;
 	ks_hash_t *thread_hash;
@@ -45,16 +101,385 @@ struct ks_thread_pool_s {
 	ks_thread_pool_state_t state;
 	ks_mutex_t *state_mutex;
 	ks_mutex_t *mutex;
+	/* Idle workers park here, only signalled when idle_thread_count is non zero */
+	ks_cond_t *work_cond;
+	/* Shared by everyone waiting on a future or task group, only signalled when waiters is non zero */
+	ks_cond_t *done_cond;
+	volatile uint32_t waiters;
 };
 
-typedef struct ks_thread_job_s {
-	ks_thread_function_t func;
-	void *data;
-} ks_thread_job_t;
-
 
 static void *worker_thread(ks_thread_t *thread, void *data);
 
+/* The pool, thread and deque of the current worker thread, if any */
+static KS_THREAD_LOCAL ks_thread_pool_t *tls_pool = NULL;
+static KS_THREAD_LOCAL ks_thread_t *tls_thread = NULL;
+static KS_THREAD_LOCAL ks_thread_pool_deque_t *tls_deque = NULL;
+
+static ks_bool_t deque_push(ks_thread_pool_deque_t *deque, ks_thread_job_t *job)
+{
+	ks_bool_t pushed = KS_FALSE;
+
+	ks_spinlock_acquire(&deque->lock);
+	if (deque->count < TP_DEQUE_LEN) {
+		deque->jobs[deque->tail++ & (TP_DEQUE_LEN - 1)] = job;
+		deque->count++;
+		pushed = KS_TRUE;
+	}
+	ks_spinlock_release(&deque->lock);
+
+	return pushed;
+}
+
+static ks_thread_job_t *deque_pop(ks_thread_pool_deque_t *deque, ks_bool_t steal)
+{
+	ks_thread_job_t *job = NULL;
+
+	/* Unlocked peek keeps idle scans from bouncing every deque's lock */
+	if (!deque->count) return NULL;
+
+	if (steal) {
+		if (!ks_spinlock_try_acquire(&deque->lock)) return NULL;
+	} else {
+		ks_spinlock_acquire(&deque->lock);
+	}
+
+	if (deque->count) {
+		if (steal) {
+			job = deque->jobs[deque->head++ & (TP_DEQUE_LEN - 1)];
+		} else {
+			job = deque->jobs[--deque->tail & (TP_DEQUE_LEN - 1)];
+		}
+		deque->count--;
+	}
+	ks_spinlock_release(&deque->lock);
+
+	return job;
+}
+
+static ks_thread_pool_deque_t *deque_claim(ks_thread_pool_t *tp)
+{
+	ks_thread_pool_deque_t *deque = NULL;
+	uint32_t i;
+
+	ks_mutex_lock(tp->mutex);
+	for (i = 0; i < tp->deque_count; i++) {
+		if (!tp->deques[i].owned) {
+			deque = &tp->deques[i];
+			deque->owned = 1;
+			break;
+		}
+	}
+	ks_mutex_unlock(tp->mutex);
+
+	return deque;
+}
+
+static void lane_push(ks_thread_pool_t *tp, ks_thread_pool_lane_t *lane, ks_thread_job_t *job)
+{
+	ks_thread_job_t **grown = NULL, **old = NULL;
+	uint32_t i, parent, size = 0;
+
+	if (!job->deadline) {
+		ks_q_push(lane->q, job);
+		return;
+	}
+
+	ks_spinlock_acquire(&lane->edf_lock);
+
+	/* Full heaps are grown with the lock dropped, the pool mutex and copy are no place to spin on */
+	while (lane->edf_count == lane->edf_size) {
+		if (grown && size > lane->edf_size) {
+			if (lane->edf_count) memcpy(grown, lane->edf, sizeof(*lane->edf) * lane->edf_count);
+			old = lane->edf;
+			lane->edf = grown;
+			lane->edf_size = size;
+			grown = NULL;
+			break;
+		}
+
+		size = lane->edf_size ? lane->edf_size * 2 : 64;
+		ks_spinlock_release(&lane->edf_lock);
+
+		if (grown) ks_pool_free(&grown);
+		grown = ks_pool_alloc_nz(ks_pool_get(tp), sizeof(*grown) * size);
+
+		ks_spinlock_acquire(&lane->edf_lock);
+	}
+
+	for (i = lane->edf_count; i; i = parent) {
+		parent = (i - 1) / 2;
+		if (lane->edf[parent]->deadline <= job->deadline) break;
+		lane->edf[i] = lane->edf[parent];
+	}
+
+	lane->edf[i] = job;
+	lane->edf_count++;
+
+	ks_spinlock_release(&lane->edf_lock);
+
+	/* Another producer grew it first, or this one replaced the old array */
+	if (grown) ks_pool_free(&grown);
+	if (old) ks_pool_free(&old);
+}
+
+/* Earliest deadline first, then the jobs without one in the order they came */
+static ks_status_t lane_pop(ks_thread_pool_lane_t *lane, void **pop)
+{
+	ks_thread_job_t *job = NULL, *last;
+	uint32_t i, child, count;
+
+	/* Unlocked peek, same as deque_pop */
+	if (lane->edf_count) {
+		ks_spinlock_acquire(&lane->edf_lock);
+
+		if ((count = lane->edf_count)) {
+			job = lane->edf[0];
+			last = lane->edf[--count];
+
+			for (i = 0; (child = i * 2 + 1) < count; i = child) {
+				if (child + 1 < count && lane->edf[child + 1]->deadline < lane->edf[child]->deadline) child++;
+				if (last->deadline <= lane->edf[child]->deadline) break;
+				lane->edf[i] = lane->edf[child];
+			}
+
+			lane->edf[i] = last;
+			lane->edf_count = count;
+		}
+
+		ks_spinlock_release(&lane->edf_lock);
+
+		if (job) {
+			*pop = job;
+			return KS_STATUS_SUCCESS;
+		}
+	}
+
+	return ks_q_trypop(lane->q, pop);
+}
+
+/*
+ * Highest priority lane first, then our local deque (LIFO, still warm in cache), the normal lane,
+ * stealing the oldest job from another worker and finally the low priority lane.
+ */
+static ks_status_t try_job(ks_thread_pool_t *tp, uint32_t seed, void **pop)
+{
+	uint32_t i;
+
+	if (lane_pop(&tp->lanes[KS_THREAD_POOL_PRIORITY_HIGH], pop) == KS_STATUS_SUCCESS) {
+		return KS_STATUS_SUCCESS;
+	}
+
+	if (tls_deque && (*pop = deque_pop(tls_deque, KS_FALSE))) {
+		return KS_STATUS_SUCCESS;
+	}
+
+	if (lane_pop(&tp->lanes[KS_THREAD_POOL_PRIORITY_NORMAL], pop) == KS_STATUS_SUCCESS) {
+		return KS_STATUS_SUCCESS;
+	}
+
+	for (i = 0; i < tp->deque_count; i++) {
+		ks_thread_pool_deque_t *victim = &tp->deques[(seed + i) % tp->deque_count];
+
+		if (victim != tls_deque && (*pop = deque_pop(victim, KS_TRUE))) {
+			return KS_STATUS_SUCCESS;
+		}
+	}
+
+	if (lane_pop(&tp->lanes[KS_THREAD_POOL_PRIORITY_LOW], pop) == KS_STATUS_SUCCESS) {
+		return KS_STATUS_SUCCESS;
+	}
+
+	return KS_STATUS_BREAK;
+}
+
+/*
+ * Idle workers count themselves in idle_thread_count under the work_cond lock before looking again,
+ * queue_job() checks the count after a full fence so a job can't slip past a worker going to sleep.
+ */
+static ks_status_t next_job(ks_thread_pool_t *tp, uint32_t seed, void **pop)
+{
+	ks_status_t status;
+
+	if (try_job(tp, seed, pop) == KS_STATUS_SUCCESS) {
+		return KS_STATUS_SUCCESS;
+	}
+
+	ks_cond_lock(tp->work_cond);
+	ks_atomic_increment_uint32(&tp->idle_thread_count);
+	ks_atomic_fence();
+
+	if ((status = try_job(tp, seed, pop)) != KS_STATUS_SUCCESS && tp->state == TP_STATE_RUNNING) {
+		if ((status = ks_cond_timedwait(tp->work_cond, 100)) == KS_STATUS_SUCCESS) {
+			status = try_job(tp, seed, pop);
+		}
+	}
+
+	ks_atomic_decrement_uint32(&tp->idle_thread_count);
+	ks_cond_unlock(tp->work_cond);
+
+	return status;
+}
+
+static void wake_worker(ks_thread_pool_t *tp)
+{
+	ks_atomic_fence();
+
+	if (ks_atomic_load_uint32(&tp->idle_thread_count)) {
+		ks_cond_lock(tp->work_cond);
+		ks_cond_signal(tp->work_cond);
+		ks_cond_unlock(tp->work_cond);
+	}
+}
+
+static void lane_record_wait(ks_thread_pool_lane_t *lane, ks_time_t wait)
+{
+	uint64_t max;
+	int bucket = 0;
+
+	if (wait < 0) wait = 0;
+
+	while (bucket < TP_WAIT_BUCKETS - 1 && ((ks_time_t)1 << bucket) <= wait) {
+		bucket++;
+	}
+
+	ks_atomic_increment_uint32(&lane->wait_hist[bucket]);
+
+	while ((max = ks_atomic_load_uint64(&lane->wait_max)) < (uint64_t)wait) {
+		if (ks_atomic_cas_uint64(&lane->wait_max, max, (uint64_t)wait)) break;
+	}
+}
+
+/* Upper bound of the bucket holding the pct'th percentile */
+static ks_time_t lane_percentile(const uint32_t *hist, uint64_t total, uint32_t pct)
+{
+	uint64_t want, seen = 0;
+	int i;
+
+	if (!total) return 0;
+
+	want = (total * pct + 99) / 100;
+
+	for (i = 0; i < TP_WAIT_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= want) {
+			return (ks_time_t)1 << i;
+		}
+	}
+
+	return (ks_time_t)1 << (TP_WAIT_BUCKETS - 1);
+}
+
+static ks_size_t deque_backlog(ks_thread_pool_t *tp)
+{
+	ks_size_t backlog = 0;
+	uint32_t i;
+
+	for (i = 0; i < tp->deque_count; i++) {
+		backlog += tp->deques[i].count;
+	}
+
+	return backlog;
+}
+
+static void notify_waiters(ks_thread_pool_t *tp)
+{
+	/* Pairs with the fence in wait_done(), either the waiter sees our update or we see the waiter */
+	ks_atomic_fence();
+
+	if (ks_atomic_load_uint32(&tp->waiters)) {
+		ks_cond_lock(tp->done_cond);
+		ks_cond_broadcast(tp->done_cond);
+		ks_cond_unlock(tp->done_cond);
+	}
+}
+
+static void run_job(ks_thread_pool_t *tp, ks_thread_t *thread, ks_thread_job_t *job)
+{
+	ks_task_group_t *group = job->group;
+	ks_thread_pool_lane_t *lane = &tp->lanes[job->lane];
+	ks_time_t now = ks_time_now();
+
+	ks_atomic_increment_uint32(&tp->busy_thread_count);
+
+	lane_record_wait(lane, now - job->queued_at);
+
+	/* Jobs that missed their deadline while queued aren't run late, expired_func gets to release their data */
+	if (job->deadline && now > job->deadline) {
+		job->expired = 1;
+		if (job->expired_func) {
+			job->result = job->expired_func(thread, job->data);
+		}
+		ks_atomic_increment_uint64(&lane->expired);
+	} else {
+		job->result = job->func(thread, job->data);
+		ks_atomic_increment_uint64(&lane->run);
+	}
+
+	ks_atomic_increment_uint32(&job->done);
+
+	if (group) {
+		ks_atomic_decrement_uint32(&group->pending);
+	}
+
+	/* Drops the worker's ref, a future still holds its own */
+	ks_pool_free(&job);
+
+	notify_waiters(tp);
+
+	ks_atomic_decrement_uint32(&tp->busy_thread_count);
+}
+
+/*
+ * Block until *value reaches target. A worker of this pool waiting on its own jobs runs queued work
+ * in the meantime instead of sleeping, so nested fan out can't starve the pool of threads.
+ */
+static ks_status_t wait_done(ks_thread_pool_t *tp, volatile uint32_t *value, uint32_t target, uint32_t timeout_ms)
+{
+	ks_time_t deadline = timeout_ms ? ks_time_now() + (ks_time_t)timeout_ms * 1000 : 0;
+	ks_status_t status = KS_STATUS_SUCCESS;
+	void *pop;
+
+	while (ks_atomic_load_uint32(value) != target) {
+		ks_time_t wait = 0;
+
+		if (tls_pool == tp && try_job(tp, 0, &pop) == KS_STATUS_SUCCESS) {
+			run_job(tp, tls_thread, (ks_thread_job_t *) pop);
+			continue;
+		}
+
+		if (deadline) {
+			wait = (deadline - ks_time_now()) / 1000;
+			if (wait <= 0) {
+				status = KS_STATUS_TIMEOUT;
+				break;
+			}
+		}
+
+		/* Helpers wake up every so often to look for more work to run */
+		if (tls_pool == tp && (!wait || wait > 10)) {
+			wait = 10;
+		}
+
+		ks_cond_lock(tp->done_cond);
+		ks_atomic_increment_uint32(&tp->waiters);
+		ks_atomic_fence();
+
+		if (ks_atomic_load_uint32(value) != target) {
+			if (wait) {
+				ks_cond_timedwait(tp->done_cond, wait);
+			} else {
+				ks_cond_wait(tp->done_cond);
+			}
+		}
+
+		ks_atomic_decrement_uint32(&tp->waiters);
+		ks_cond_unlock(tp->done_cond);
+	}
+
+	return status;
+}
+
 static void cleanup_threads(ks_thread_pool_t *tp)
 {
 	ks_hash_iterator_t *itt;
@@ -97,7 +522,7 @@ static int check_queue(ks_thread_pool_t *tp, ks_bool_t adding)
 	}
 
 	if (adding) {
-		if (!need && tp->busy_thread_count + ks_q_size(tp->q) >= tp->running_thread_count - tp->dying_thread_count &&
+		if (!need && tp->busy_thread_count + ks_thread_pool_backlog(tp) >= tp->running_thread_count - tp->dying_thread_count &&
 			(tp->thread_count - tp->dying_thread_count + 1 <= tp->max)) {
 			need++;
 		}
@@ -151,12 +576,20 @@ static void *worker_thread(ks_thread_t *thread, void *data)
 	my_id = ++TID;
 	ks_mutex_unlock(tp->mutex);
 
+	tls_pool = tp;
+	tls_thread = thread;
+
+	if (tp->deques) {
+		tls_deque = deque_claim(tp);
+	}
+
 	while(tp->state == TP_STATE_RUNNING) {
 		ks_thread_job_t *job;
 		void *pop = NULL;
 		ks_status_t status;
 
-		status = ks_q_pop_timeout(tp->q, &pop, 100);
+		status = next_job(tp, my_id, &pop);
+
 		if (status == KS_STATUS_BREAK) {
 			if (tp->state != TP_STATE_RUNNING) {
 				break;
@@ -169,7 +602,10 @@ static void *worker_thread(ks_thread_t *thread, void *data)
 			   my_id, idle_sec, tp->idle_sec, tp->running_thread_count, tp->dying_thread_count, tp->thread_count, tp->max);
 		*/
 
-		check_queue(tp, KS_FALSE);
+		/* Work stealing workers only do housekeeping when idle so the hot path stays off tp->mutex */
+		if (!tp->deques || status != KS_STATUS_SUCCESS) {
+			check_queue(tp, KS_FALSE);
+		}
 
 		if (status == KS_STATUS_TIMEOUT) { // || status == KS_STATUS_BREAK) {
 			idle_sec++;
@@ -200,19 +636,17 @@ static void *worker_thread(ks_thread_t *thread, void *data)
 
 		job = (ks_thread_job_t *) pop;
 
-		ks_mutex_lock(tp->mutex);
-		tp->busy_thread_count++;
-		ks_mutex_unlock(tp->mutex);
-
 		idle_sec = 0;
-		job->func(thread, job->data);
-
-		ks_pool_free(&job);
+		run_job(tp, thread, job);
+	}
 
-		ks_mutex_lock(tp->mutex);
-		tp->busy_thread_count--;
-		ks_mutex_unlock(tp->mutex);
+	if (tls_deque) {
+		/* Anything left behind stays stealable and goes to the next worker to claim the deque */
+		tls_deque->owned = 0;
+		tls_deque = NULL;
 	}
+	tls_pool = NULL;
+	tls_thread = NULL;
 
 	ks_mutex_lock(tp->mutex);
 	tp->running_thread_count--;
@@ -228,8 +662,15 @@ static void *worker_thread(ks_thread_t *thread, void *data)
 
 KS_DECLARE(ks_status_t) ks_thread_pool_create(ks_thread_pool_t **tp, uint32_t min, uint32_t max, size_t stack_size,
 											  ks_thread_priority_t priority, uint32_t idle_sec)
+{
+	return ks_thread_pool_create_ex(tp, min, max, stack_size, priority, idle_sec, KS_THREAD_POOL_FLAG_DEFAULT);
+}
+
+KS_DECLARE(ks_status_t) ks_thread_pool_create_ex(ks_thread_pool_t **tp, uint32_t min, uint32_t max, size_t stack_size,
+												 ks_thread_priority_t priority, uint32_t idle_sec, uint32_t flags)
 {
 	ks_pool_t *pool = NULL;
+	int i;
 
 	ks_pool_open(&pool);
 
@@ -241,10 +682,21 @@ KS_DECLARE(ks_status_t) ks_thread_pool_create(ks_thread_pool_t **tp, uint32_t mi
 	(*tp)->priority = priority;
 	(*tp)->state = TP_STATE_RUNNING;
 	(*tp)->idle_sec = idle_sec;
+	(*tp)->flags = flags;
+
+	if ((flags & KS_THREAD_POOL_FLAG_WORK_STEALING) && max) {
+		(*tp)->deques = ks_pool_alloc(pool, sizeof(ks_thread_pool_deque_t) * max);
+		(*tp)->deque_count = max;
+	}
 
 	ks_mutex_create(&(*tp)->mutex, KS_MUTEX_FLAG_DEFAULT, pool);
 	ks_mutex_create(&(*tp)->state_mutex, KS_MUTEX_FLAG_DEFAULT, pool);
-	ks_q_create(&(*tp)->q, pool, TP_MAX_QLEN);
+	ks_cond_create(&(*tp)->done_cond, pool);
+	ks_cond_create(&(*tp)->work_cond, pool);
+
+	for (i = 0; i < KS_THREAD_POOL_PRIORITY_COUNT; i++) {
+		ks_q_create_ex(&(*tp)->lanes[i].q, pool, TP_MAX_QLEN, KS_Q_FLAG_LOCKFREE);
+	}
 	ks_hash_create(&(*tp)->thread_hash, KS_HASH_MODE_PTR, KS_HASH_FLAG_NONE, pool);
 	ks_hash_create(&(*tp)->thread_die_hash, KS_HASH_MODE_PTR, KS_HASH_FLAG_NONE, pool);
 
@@ -289,22 +741,260 @@ KS_DECLARE(ks_status_t) ks_thread_pool_destroy(ks_thread_pool_t **tp)
 }
 
 
-KS_DECLARE(ks_status_t) ks_thread_pool_add_job(ks_thread_pool_t *tp, ks_thread_function_t func, void *data)
+static ks_status_t queue_job(ks_thread_pool_t *tp, ks_thread_job_t *job)
+{
+	/*
+	 * A job submitted from one of our own workers stays on its local deque while every worker is busy.
+	 * If anyone is parked, hand it to the shared queue instead so it gets woken rather than waiting to steal.
+	 */
+	ks_thread_pool_lane_t *lane = &tp->lanes[job->lane];
+
+	job->queued_at = ks_time_now();
+	ks_atomic_increment_uint64(&lane->queued);
+
+	if (job->lane == KS_THREAD_POOL_PRIORITY_NORMAL && !job->deadline && tls_pool == tp && tls_deque &&
+		!tp->idle_thread_count && deque_push(tls_deque, job)) {
+		if (tp->thread_count < tp->max) {
+			check_queue(tp, KS_TRUE);
+		}
+		return KS_STATUS_SUCCESS;
+	}
+
+	lane_push(tp, lane, job);
+	wake_worker(tp);
+
+	check_queue(tp, KS_TRUE);
+
+	return KS_STATUS_SUCCESS;
+}
+
+static ks_thread_job_t *new_job(ks_thread_pool_t *tp, ks_thread_function_t func, void *data)
 {
 	ks_thread_job_t *job = (ks_thread_job_t *) ks_pool_alloc(ks_pool_get(tp), sizeof(*job));
 
+	job->tp = tp;
 	job->func = func;
 	job->data = data;
-	ks_q_push(tp->q, job);
+	job->lane = KS_THREAD_POOL_PRIORITY_NORMAL;
 
-	check_queue(tp, KS_TRUE);
+	return job;
+}
+
+KS_DECLARE(ks_status_t) ks_thread_pool_add_job(ks_thread_pool_t *tp, ks_thread_function_t func, void *data)
+{
+	return queue_job(tp, new_job(tp, func, data));
+}
+
+KS_DECLARE(ks_status_t) ks_thread_pool_submit(ks_thread_pool_t *tp, ks_thread_function_t func, void *data, ks_thread_pool_future_t **futureP)
+{
+	ks_thread_job_t *job;
+
+	ks_assert(futureP);
+
+	job = new_job(tp, func, data);
+
+	/* One ref for the worker, one for the caller */
+	ks_pool_ref(job);
+	*futureP = (ks_thread_pool_future_t *) job;
+
+	return queue_job(tp, job);
+}
+
+KS_DECLARE(ks_status_t) ks_thread_pool_add_job_ex(ks_thread_pool_t *tp, ks_thread_function_t func, void *data,
+												  ks_thread_pool_priority_t priority, uint32_t deadline_ms, ks_thread_function_t expired_func,
+												  ks_thread_pool_future_t **futureP)
+{
+	ks_thread_job_t *job;
+
+	if (priority < 0 || priority >= KS_THREAD_POOL_PRIORITY_COUNT) {
+		return KS_STATUS_ARG_INVALID;
+	}
+
+	job = new_job(tp, func, data);
+	job->lane = (uint8_t)priority;
+	job->expired_func = expired_func;
+
+	if (deadline_ms) {
+		job->deadline = ks_time_now() + (ks_time_t)deadline_ms * 1000;
+	}
+
+	if (futureP) {
+		ks_pool_ref(job);
+		*futureP = (ks_thread_pool_future_t *) job;
+	}
+
+	return queue_job(tp, job);
+}
+
+KS_DECLARE(ks_status_t) ks_thread_pool_future_wait(ks_thread_pool_future_t *future, uint32_t timeout_ms)
+{
+	ks_status_t status;
+
+	ks_assert(future);
+
+	if ((status = wait_done(future->job.tp, &future->job.done, 1, timeout_ms)) == KS_STATUS_SUCCESS && future->job.expired) {
+		status = KS_STATUS_TIMEOUT;
+	}
+
+	return status;
+}
+
+KS_DECLARE(ks_bool_t) ks_thread_pool_future_ready(ks_thread_pool_future_t *future)
+{
+	ks_assert(future);
+
+	return ks_atomic_load_uint32(&future->job.done) ? KS_TRUE : KS_FALSE;
+}
+
+KS_DECLARE(ks_bool_t) ks_thread_pool_future_expired(ks_thread_pool_future_t *future)
+{
+	ks_assert(future);
+
+	return ks_atomic_load_uint32(&future->job.done) && future->job.expired ? KS_TRUE : KS_FALSE;
+}
+
+KS_DECLARE(void *) ks_thread_pool_future_result(ks_thread_pool_future_t *future)
+{
+	ks_assert(future);
+
+	if (!ks_atomic_load_uint32(&future->job.done)) {
+		return NULL;
+	}
+
+	return future->job.result;
+}
+
+KS_DECLARE(ks_status_t) ks_thread_pool_future_destroy(ks_thread_pool_future_t **futureP)
+{
+	ks_thread_pool_future_t *future;
+
+	ks_assert(futureP);
+
+	if (!(future = *futureP)) {
+		return KS_STATUS_FAIL;
+	}
+
+	*futureP = NULL;
+	ks_pool_free(&future);
 
 	return KS_STATUS_SUCCESS;
 }
 
+KS_DECLARE(ks_status_t) ks_task_group_create(ks_task_group_t **groupP, ks_thread_pool_t *tp)
+{
+	ks_task_group_t *group;
+
+	ks_assert(groupP);
+	ks_assert(tp);
+
+	group = ks_pool_alloc(ks_pool_get(tp), sizeof(*group));
+	group->tp = tp;
 
+	*groupP = group;
+
+	return KS_STATUS_SUCCESS;
+}
+
+KS_DECLARE(ks_status_t) ks_task_group_add(ks_task_group_t *group, ks_thread_function_t func, void *data)
+{
+	ks_thread_job_t *job;
+
+	ks_assert(group);
+
+	job = new_job(group->tp, func, data);
+	job->group = group;
+	ks_atomic_increment_uint32(&group->pending);
+
+	return queue_job(group->tp, job);
+}
+
+KS_DECLARE(ks_size_t) ks_task_group_pending(ks_task_group_t *group)
+{
+	return ks_atomic_load_uint32(&group->pending);
+}
+
+KS_DECLARE(ks_status_t) ks_task_group_wait(ks_task_group_t *group, uint32_t timeout_ms)
+{
+	ks_assert(group);
+
+	return wait_done(group->tp, &group->pending, 0, timeout_ms);
+}
+
+KS_DECLARE(ks_status_t) ks_task_group_destroy(ks_task_group_t **groupP)
+{
+	ks_task_group_t *group;
+
+	ks_assert(groupP);
+
+	if (!(group = *groupP)) {
+		return KS_STATUS_FAIL;
+	}
+
+	/* Jobs still running point at the group */
+	if (ks_atomic_load_uint32(&group->pending)) {
+		return KS_STATUS_REFS_EXIST;
+	}
+
+	*groupP = NULL;
+	ks_pool_free(&group);
+
+	return KS_STATUS_SUCCESS;
+}
 
 KS_DECLARE(ks_size_t) ks_thread_pool_backlog(ks_thread_pool_t *tp)
 {
-	return ks_q_size(tp->q);
+	ks_size_t backlog = deque_backlog(tp);
+	int i;
+
+	for (i = 0; i < KS_THREAD_POOL_PRIORITY_COUNT; i++) {
+		backlog += ks_q_size(tp->lanes[i].q) + tp->lanes[i].edf_count;
+	}
+
+	return backlog;
+}
+
+KS_DECLARE(ks_status_t) ks_thread_pool_stats(ks_thread_pool_t *tp, ks_thread_pool_stats_t *stats)
+{
+	uint32_t hist[TP_WAIT_BUCKETS];
+	uint64_t total;
+	int i, j;
+
+	ks_assert(tp);
+	ks_assert(stats);
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->threads = tp->running_thread_count;
+	stats->busy = tp->busy_thread_count;
+	stats->idle = tp->idle_thread_count;
+
+	for (i = 0; i < KS_THREAD_POOL_PRIORITY_COUNT; i++) {
+		ks_thread_pool_lane_t *lane = &tp->lanes[i];
+		ks_thread_pool_lane_stats_t *ls = &stats->lanes[i];
+
+		ls->depth = ks_q_size(lane->q) + lane->edf_count;
+		ls->queued = lane->queued;
+		ls->run = lane->run;
+		ls->expired = lane->expired;
+		ls->wait_max = (ks_time_t)lane->wait_max;
+
+		for (total = 0, j = 0; j < TP_WAIT_BUCKETS; j++) {
+			hist[j] = lane->wait_hist[j];
+			total += hist[j];
+		}
+
+		ls->wait_p50 = lane_percentile(hist, total, 50);
+		ls->wait_p90 = lane_percentile(hist, total, 90);
+		ls->wait_p99 = lane_percentile(hist, total, 99);
+
+		/* Bucket bounds can overshoot the slowest wait actually seen */
+		if (ls->wait_p50 > ls->wait_max) ls->wait_p50 = ls->wait_max;
+		if (ls->wait_p90 > ls->wait_max) ls->wait_p90 = ls->wait_max;
+		if (ls->wait_p99 > ls->wait_max) ls->wait_p99 = ls->wait_max;
+	}
+
+	/* Jobs parked on worker deques are always normal priority */
+	stats->lanes[KS_THREAD_POOL_PRIORITY_NORMAL].depth += deque_backlog(tp);
+
+	return KS_STATUS_SUCCESS;
 }
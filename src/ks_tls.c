@@ -21,6 +21,9 @@
  */
 
 #include "libks/ks.h"
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 
 #ifdef _MSC_VER
 /* warning C4706: assignment within conditional expression*/
@@ -36,28 +39,48 @@ struct ks_tls_s {
 	SSL_CTX *ssl_ctx;
 	ks_bool_t ssl_io_error; /* This flag indicates that we should not attempt to shut down the connection with SSL_shutdown. */
 	ks_bool_t secure_established;
+	ks_poll_t want; /* what the last KS_STATUS_RETRY was waiting on */
 
 	ks_tls_init_callback_t init_callback;
 
 	char *req_host;
+	char *session_key; /* host:port plus verify policy the client session cache is keyed by, NULL when not resuming */
 	char peer_cipher_name[128];
 };
 
+typedef struct {
+	unsigned char name[16];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+	ks_time_t created; /* seconds */
+} ks_tls_ticket_key_t;
+
 struct ks_tls_shared_ctx_s {
 	SSL_CTX *ssl_ctx;
+	ks_spinlock_t ticket_lock;
+	ks_tls_ticket_key_t ticket_keys[2]; /* current and previous */
+	ks_time_t ticket_key_lifetime;
 };
 
+typedef struct {
+	char key[272];
+	ks_time_t used;
+	SSL_SESSION *session;
+} ks_tls_session_entry_t;
+
 #define KS_TLS_SHUTDOWN_BUFLEN 1024
+#define KS_TLS_SENDFILE_CHUNK 16384 /* one full TLS record per write when falling back */
 
-static const uint32_t KS_TLS_WRITE_RETRY_MS = 10;
-static const uint32_t KS_TLS_READ_RETRY_MS = 10;
-static const uint32_t KS_TLS_INIT_RETRY_MS = 10;
-static const uint32_t KS_TLS_SHUTDOWN_RETRY_MS = 10;
+static const uint32_t KS_TLS_WAIT_SLICE_MS = 1000;
 
 static const uint32_t KS_TLS_DEFAULT_CONN_TIMEOUT_MS = 5000;
 static const uint32_t KS_TLS_DEFAULT_INIT_TIMEOUT_MS = 5000;
 static const uint32_t KS_TLS_SHUTDOWN_TIMEOUT_MS = 2000;
 
+#define KS_TLS_CLIENT_SESSIONS 64
+static const uint32_t KS_TLS_DEFAULT_SESSION_CACHE_SIZE = 1024;
+static const uint32_t KS_TLS_DEFAULT_TICKET_KEY_LIFETIME_S = 3600;
+
 static const char *KS_TLS_DEFAULT_CIPHER_LIST = "HIGH:!DSS:!aNULL@STRENGTH";
 
 static int log_ssl_errors(const char *err, size_t len, void *u)
@@ -85,6 +108,7 @@ KS_DECLARE(ks_status_t) ks_tls_write(ks_tls_t *ktls, const void *data, ks_size_t
 		int ssl_err = SSL_get_error(ktls->ssl, 0);
 
 		if (KS_SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+			ktls->want = ssl_err == SSL_ERROR_WANT_READ ? KS_POLL_READ : KS_POLL_WRITE;
 			return KS_STATUS_RETRY;
 		}
 
@@ -100,28 +124,51 @@ KS_DECLARE(ks_status_t) ks_tls_write(ks_tls_t *ktls, const void *data, ks_size_t
 	return KS_STATUS_SUCCESS;
 }
 
-/* `timout_ms` is a total max time spent between retries, so it isn't precise. 0 - infinite.*/
+/*
+ * Waits until the socket can do what the last KS_STATUS_RETRY wanted, or the deadline (0 - none) passes.
+ * Without a deadline it wakes up every KS_TLS_WAIT_SLICE_MS so the caller retries anyway.
+ */
+static ks_status_t ks_tls_wait(ks_tls_t *ktls, ks_time_t deadline)
+{
+	uint32_t ms = KS_TLS_WAIT_SLICE_MS;
+	int r;
+
+	if (deadline) {
+		ks_time_t now = ks_time_now();
+
+		if (now >= deadline) {
+			return KS_STATUS_TIMEOUT;
+		}
+
+		ms = (uint32_t)((deadline - now + 999) / 1000);
+	}
+
+	/* Errors and hangups wake us too, the retry is what reports them */
+	if ((r = ks_wait_sock(ktls->sock, ms, ktls->want | KS_POLL_ERROR)) < 0 && !ks_errno_is_interupt(ks_errno())) {
+		return KS_STATUS_FAIL;
+	}
+
+	return KS_STATUS_SUCCESS;
+}
+
+/* `timout_ms` is a total max time to wait for the socket. 0 - infinite.*/
 KS_DECLARE(ks_status_t) ks_tls_write_timeout(ks_tls_t *ktls, void *data, ks_size_t *bytes, uint32_t timeout_ms)
 {
-	uint32_t num_retries = timeout_ms / KS_TLS_WRITE_RETRY_MS;
-	uint32_t retry = 0;
+	ks_time_t deadline = timeout_ms ? ks_time_now() + (ks_time_t)timeout_ms * 1000 : 0;
+	ks_status_t status;
 
 	for (;;) {
 		/* We must always retry with the same `data` and `bytes` values. */
-		ks_status_t status = ks_tls_write(ktls, data, bytes);
+		status = ks_tls_write(ktls, data, bytes);
 
 		if (status != KS_STATUS_RETRY) {
 			return status;
 		}
 
-		if (timeout_ms && (++retry > num_retries)) {
-			break;
+		if ((status = ks_tls_wait(ktls, deadline)) != KS_STATUS_SUCCESS) {
+			return status;
 		}
-
-		ks_sleep_ms(KS_TLS_WRITE_RETRY_MS);
 	}
-
-	return KS_STATUS_TIMEOUT;
 }
 
 KS_DECLARE(ks_status_t) ks_tls_read(ks_tls_t *ktls, void *data, ks_size_t *bytes)
@@ -142,6 +189,7 @@ KS_DECLARE(ks_status_t) ks_tls_read(ks_tls_t *ktls, void *data, ks_size_t *bytes
 		if (ssl_err == SSL_ERROR_ZERO_RETURN) {
 			return KS_STATUS_BREAK;
 		} else if (KS_SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+			ktls->want = ssl_err == SSL_ERROR_WANT_READ ? KS_POLL_READ : KS_POLL_WRITE;
 			return KS_STATUS_RETRY;
 		}
 
@@ -160,35 +208,30 @@ KS_DECLARE(ks_status_t) ks_tls_read(ks_tls_t *ktls, void *data, ks_size_t *bytes
 	return KS_STATUS_SUCCESS;
 }
 
-/* `timout_ms` is a total max time spent between retries, so it isn't precise. 0 - infinite. */
+/* `timout_ms` is a total max time to wait for the socket. 0 - infinite. */
 KS_DECLARE(ks_status_t) ks_tls_read_timeout(ks_tls_t *ktls, void *data, ks_size_t *bytes, uint32_t timeout_ms)
 {
-	uint32_t num_retries = timeout_ms / KS_TLS_READ_RETRY_MS;
-	uint32_t retry = 0;
+	ks_time_t deadline = timeout_ms ? ks_time_now() + (ks_time_t)timeout_ms * 1000 : 0;
+	ks_status_t status;
 
 	for (;;) {
-		ks_status_t status = ks_tls_read(ktls, data, bytes);
+		status = ks_tls_read(ktls, data, bytes);
 
 		if (status != KS_STATUS_RETRY) {
 			return status;
 		}
 
-		if (timeout_ms && (++retry > num_retries)) {
-			break;
+		if ((status = ks_tls_wait(ktls, deadline)) != KS_STATUS_SUCCESS) {
+			return status;
 		}
-
-		ks_sleep_ms(KS_TLS_READ_RETRY_MS);
 	}
-
-	return KS_STATUS_TIMEOUT;
 }
 
 
 static void ks_tls_close(ks_tls_t *ktls)
 {
 	char shutdown_buffer[KS_TLS_SHUTDOWN_BUFLEN] = {0};
-	uint32_t num_retries = KS_TLS_SHUTDOWN_TIMEOUT_MS / KS_TLS_SHUTDOWN_RETRY_MS;
-	uint32_t retry = 0;
+	ks_time_t deadline;
 
 	if (ktls->down) {
 		return;
@@ -208,7 +251,7 @@ static void ks_tls_close(ks_tls_t *ktls)
 	/* First invocation of SSL_shutdown() would normally return 0 and just try to send SSL protocol close request (close_notify_alert).
 	   It is recommended to do bidirectional shutdown and also to read all the remaining data sent by the client
 	   before it indicates EOF (SSL_ERROR_ZERO_RETURN). To avoid stuck in this process in case of dead peers,
-	   we wait for KS_TLS_SHUTDOWN_TIMEOUT_MS time before we give up.
+	   we wait on the socket for up to KS_TLS_SHUTDOWN_TIMEOUT_MS in total before we give up.
 	*/
 	int code = 0, rcode = 0;
 	int ssl_error = 0;
@@ -234,6 +277,8 @@ static void ks_tls_close(ks_tls_t *ktls)
 	}
 
 	/* us closes the connection. We do bidirection shutdown handshake */
+	deadline = ks_time_now() + (ks_time_t)KS_TLS_SHUTDOWN_TIMEOUT_MS * 1000;
+
 	for (;;) {
 		ERR_clear_error();
 		code = SSL_shutdown(ktls->ssl);
@@ -256,13 +301,12 @@ static void ks_tls_close(ks_tls_t *ktls)
 					ssl_error = SSL_get_error(ktls->ssl, 0);
 
 					if (ssl_error == SSL_ERROR_WANT_READ) {
+						ktls->want = KS_POLL_READ;
 
-						if (++retry > num_retries) {
+						if (ks_tls_wait(ktls, deadline) != KS_STATUS_SUCCESS) {
 							goto close_end;
 						}
 
-						ks_sleep_ms(KS_TLS_SHUTDOWN_RETRY_MS);
-
 						continue;  /* retry SSL_read() */
 					} else if ((ssl_error == SSL_ERROR_ZERO_RETURN) || (ssl_error == SSL_ERROR_WANT_WRITE)) {
 						break;     /* retry SSL_shutdown() */
@@ -271,20 +315,26 @@ static void ks_tls_close(ks_tls_t *ktls)
 					goto close_end; /* other errors - close socket */
 				}
 
-				if (++retry > num_retries) {
+				if (ks_time_now() >= deadline) {
 					break;
 				}
 			};
 
-		} else if (ssl_error != SSL_ERROR_WANT_WRITE) {
+		} else if (ssl_error == SSL_ERROR_WANT_WRITE) {
+			ktls->want = KS_POLL_WRITE;
+
+			if (ks_tls_wait(ktls, deadline) != KS_STATUS_SUCCESS) {
+				break;  /* close socket */
+			}
+
+			continue;
+		} else {
 			break;  /* close socket */
 		}
 
-		if (++retry > num_retries) {
+		if (ks_time_now() >= deadline) {
 			break;  /* close socket */
 		}
-
-		ks_sleep_ms(KS_TLS_SHUTDOWN_RETRY_MS);
 	};
 
  close_end:
@@ -354,6 +404,10 @@ KS_DECLARE(void) ks_tls_destroy(ks_tls_t **ktlsP)
 		ktls->req_host = NULL;
 	}
 
+	if (ktls->session_key) {
+		ks_pool_free(&ktls->session_key);
+	}
+
 	ks_pool_free(&ktls);
 	ktls = NULL;
 }
@@ -370,45 +424,304 @@ static inline void get_cipher_name(ks_tls_t *ktls)
 	}
 }
 
-/* Client/Server side. */
-static ks_status_t establish_peer_tls(ks_tls_t *ktls, uint32_t timeout_ms)
+/* Session resumption.
+ * Clients keep the last session per host:port in a small process wide table and offer it on the next
+ * connect. Servers keep a bounded session cache and encrypt tickets with keys that rotate every
+ * ticket_key_lifetime_s, the previous key still decrypting (and renewing) tickets for another lifetime.
+ */
+
+static ks_spinlock_t g_session_lock;
+static ks_tls_session_entry_t g_sessions[KS_TLS_CLIENT_SESSIONS];
+static ks_tls_session_stats_t g_session_stats;
+
+static SSL_SESSION *session_cache_get(const char *key)
 {
-	ks_bool_t is_client;
-	uint32_t num_retries;
-	uint32_t retry = 0;
+	SSL_SESSION *session = NULL, *stale = NULL;
+	int i;
 
-	if (!ktls) {
-		ks_log(KS_LOG_ERROR, "Establish: Invalid (empty) pointer!\n");
+	ks_spinlock_acquire(&g_session_lock);
 
-		return KS_STATUS_ARG_NULL;
+	for (i = 0; i < KS_TLS_CLIENT_SESSIONS; i++) {
+		ks_tls_session_entry_t *e = &g_sessions[i];
+
+		if (!e->session || strcmp(e->key, key)) {
+			continue;
+		}
+
+		if (SSL_SESSION_is_resumable(e->session) &&
+			(time_t)(SSL_SESSION_get_time(e->session) + SSL_SESSION_get_timeout(e->session)) > time(NULL)) {
+			session = e->session;
+			SSL_SESSION_up_ref(session);
+			e->used = ks_time_now();
+		} else {
+			stale = e->session;
+			e->session = NULL;
+		}
+
+		break;
 	}
 
-	if (ktls->secure_established) {
-		return KS_STATUS_SUCCESS;
+	ks_spinlock_release(&g_session_lock);
+
+	if (stale) {
+		SSL_SESSION_free(stale);
 	}
 
-	is_client = (ktls->type == KS_TLS_CLIENT);
+	return session;
+}
 
-	if (!ktls->ssl) {
-		ktls->ssl = SSL_new(ktls->ssl_ctx);
-		if (!ktls->ssl) {
-			ks_log(KS_LOG_ERROR, "Failed to initiate SSL with error [%lu]\n", ERR_peek_error());
+static void session_cache_put(const char *key, SSL_SESSION *session)
+{
+	ks_tls_session_entry_t *slot = NULL;
+	SSL_SESSION *old;
+	int i;
 
-			return KS_STATUS_FAIL;
+	ks_spinlock_acquire(&g_session_lock);
+
+	/* The same peer, else a free slot, else the least recently used */
+	for (i = 0; i < KS_TLS_CLIENT_SESSIONS; i++) {
+		ks_tls_session_entry_t *e = &g_sessions[i];
+
+		if (e->session && !strcmp(e->key, key)) {
+			slot = e;
+			break;
 		}
 
-		if (!SSL_set_fd(ktls->ssl, (int)ktls->sock)) {
-			ks_log(KS_LOG_ERROR, "Failed to connect the SSL object with a file descriptor [%lu]\n", ERR_peek_error());
+		if (!slot || (slot->session && (!e->session || e->used < slot->used))) {
+			slot = e;
+		}
+	}
 
-			return KS_STATUS_FAIL;
-		};
+	old = slot->session;
+	slot->session = session;
+	slot->used = ks_time_now();
+	ks_copy_string(slot->key, key, sizeof(slot->key));
+
+	ks_spinlock_release(&g_session_lock);
+
+	if (old) {
+		SSL_SESSION_free(old);
+	}
+}
+
+/* The client SSL_CTX belongs to one connection, so its app data is that connection.
+ * A copy is kept since the connection marks its own session not resumable if it ends badly */
+static int client_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	ks_tls_t *ktls = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	SSL_SESSION *copy;
 
-		if (ktls->init_callback) {
-			ktls->init_callback(ktls, ktls->ssl);
+	if (ktls && ktls->session_key && !ktls->init_callback && SSL_SESSION_is_resumable(session) && (copy = SSL_SESSION_dup(session))) {
+		session_cache_put(ktls->session_key, copy);
+	}
+
+	return 0;
+}
+
+KS_DECLARE(void) ks_tls_session_cache_flush(void)
+{
+	SSL_SESSION *sessions[KS_TLS_CLIENT_SESSIONS];
+	int i;
+
+	ks_spinlock_acquire(&g_session_lock);
+
+	for (i = 0; i < KS_TLS_CLIENT_SESSIONS; i++) {
+		sessions[i] = g_sessions[i].session;
+		g_sessions[i].session = NULL;
+	}
+
+	ks_spinlock_release(&g_session_lock);
+
+	for (i = 0; i < KS_TLS_CLIENT_SESSIONS; i++) {
+		if (sessions[i]) SSL_SESSION_free(sessions[i]);
+	}
+}
+
+KS_DECLARE(void) ks_tls_get_session_stats(ks_tls_session_stats_t *stats)
+{
+	stats->client_full = ks_atomic_load_uint64(&g_session_stats.client_full);
+	stats->client_resumed = ks_atomic_load_uint64(&g_session_stats.client_resumed);
+	stats->server_full = ks_atomic_load_uint64(&g_session_stats.server_full);
+	stats->server_resumed = ks_atomic_load_uint64(&g_session_stats.server_resumed);
+	stats->tickets_issued = ks_atomic_load_uint64(&g_session_stats.tickets_issued);
+	stats->tickets_renewed = ks_atomic_load_uint64(&g_session_stats.tickets_renewed);
+}
+
+KS_DECLARE(ks_bool_t) ks_tls_session_reused(ks_tls_t *ktls)
+{
+	return ktls && ktls->ssl && ktls->secure_established && SSL_session_reused(ktls->ssl) ? KS_TRUE : KS_FALSE;
+}
+
+static void ticket_key_generate(ks_tls_ticket_key_t *key)
+{
+	ks_random_bytes(key->name, sizeof(key->name));
+	ks_random_bytes(key->aes, sizeof(key->aes));
+	ks_random_bytes(key->hmac, sizeof(key->hmac));
+	key->created = ks_time_now_sec();
+}
+
+/* Copies out the key to encrypt with, or the one named, and says what OpenSSL should do with the ticket:
+ * 1 use it, 2 use it and issue a fresh one, 0 not ours (full handshake).
+ * TLS 1.3 clients use a ticket once, so every resumption there hands out the next one. */
+static int ticket_key_select(SSL *ssl, ks_tls_shared_ctx_t *shared_ctx, unsigned char name[16], int enc, ks_tls_ticket_key_t *out)
+{
+	ks_time_t now = ks_time_now_sec(), lifetime = shared_ctx->ticket_key_lifetime;
+	int r = 0, i;
+
+	ks_spinlock_acquire(&shared_ctx->ticket_lock);
+
+	if (enc) {
+		if (!shared_ctx->ticket_keys[0].created || now - shared_ctx->ticket_keys[0].created >= lifetime) {
+			shared_ctx->ticket_keys[1] = shared_ctx->ticket_keys[0];
+			ticket_key_generate(&shared_ctx->ticket_keys[0]);
 		}
+
+		*out = shared_ctx->ticket_keys[0];
+		memcpy(name, out->name, sizeof(out->name));
+		r = 1;
+	} else {
+		for (i = 0; i < 2; i++) {
+			ks_tls_ticket_key_t *key = &shared_ctx->ticket_keys[i];
+
+			if (key->created && now - key->created < 2 * lifetime && !memcmp(name, key->name, sizeof(key->name))) {
+				*out = *key;
+				r = (i == 0 && now - key->created < lifetime && SSL_version(ssl) < TLS1_3_VERSION) ? 1 : 2;
+				break;
+			}
+		}
+	}
+
+	ks_spinlock_release(&shared_ctx->ticket_lock);
+
+	if (r == 1 && enc) {
+		ks_atomic_increment_uint64(&g_session_stats.tickets_issued);
+	} else if (r == 2) {
+		ks_atomic_increment_uint64(&g_session_stats.tickets_renewed);
+	}
+
+	return r;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int server_ticket_key(SSL *ssl, unsigned char name[16], unsigned char *iv, EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+{
+	ks_tls_shared_ctx_t *shared_ctx = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	ks_tls_ticket_key_t key;
+	OSSL_PARAM params[3];
+	int r;
+
+	if (!(r = ticket_key_select(ssl, shared_ctx, name, enc, &key))) {
+		return 0;
+	}
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	if (enc) {
+		ks_random_bytes(iv, EVP_MAX_IV_LENGTH);
+
+		if (!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv)) r = -1;
+	} else if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv)) {
+		r = -1;
+	}
+
+	if (r > 0 && !EVP_MAC_CTX_set_params(hctx, params)) r = -1;
+
+	OPENSSL_cleanse(&key, sizeof(key));
+
+	return r;
+}
+#else
+static int server_ticket_key(SSL *ssl, unsigned char name[16], unsigned char *iv, EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+{
+	ks_tls_shared_ctx_t *shared_ctx = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	ks_tls_ticket_key_t key;
+	int r;
+
+	if (!(r = ticket_key_select(ssl, shared_ctx, name, enc, &key))) {
+		return 0;
+	}
+
+	if (enc) {
+		ks_random_bytes(iv, EVP_MAX_IV_LENGTH);
+
+		if (!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv)) r = -1;
+	} else if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv)) {
+		r = -1;
+	}
+
+	if (r > 0 && !HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL)) r = -1;
+
+	OPENSSL_cleanse(&key, sizeof(key));
+
+	return r;
+}
+#endif
+
+static void setup_server_resumption(ks_tls_shared_ctx_t *shared_ctx, const ks_tls_server_ctx_params_t *params)
+{
+	SSL_CTX *ssl_ctx = shared_ctx->ssl_ctx;
+
+	if (params->disable_resumption) {
+		SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+		SSL_CTX_set_num_tickets(ssl_ctx, 0);
+
+		return;
+	}
+
+	shared_ctx->ticket_key_lifetime = params->ticket_key_lifetime_s ? params->ticket_key_lifetime_s : KS_TLS_DEFAULT_TICKET_KEY_LIFETIME_S;
+
+	SSL_CTX_set_app_data(ssl_ctx, shared_ctx);
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ssl_ctx, params->session_cache_size ? params->session_cache_size : KS_TLS_DEFAULT_SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(ssl_ctx, (long)shared_ctx->ticket_key_lifetime);
+	SSL_CTX_set_session_id_context(ssl_ctx, (const unsigned char *)"libks", 5);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, server_ticket_key);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, server_ticket_key);
+#endif
+}
+
+/* Client/Server side. Sets up the SSL object the handshake runs on. */
+static ks_status_t tls_prepare(ks_tls_t *ktls)
+{
+	ks_bool_t is_client = (ktls->type == KS_TLS_CLIENT);
+
+	if (ktls->ssl) {
+		return KS_STATUS_SUCCESS;
+	}
+
+	ktls->ssl = SSL_new(ktls->ssl_ctx);
+	if (!ktls->ssl) {
+		ks_log(KS_LOG_ERROR, "Failed to initiate SSL with error [%lu]\n", ERR_peek_error());
+
+		return KS_STATUS_FAIL;
+	}
+
+	if (!SSL_set_fd(ktls->ssl, (int)ktls->sock)) {
+		ks_log(KS_LOG_ERROR, "Failed to connect the SSL object with a file descriptor [%lu]\n", ERR_peek_error());
+
+		return KS_STATUS_FAIL;
+	};
+
+	if (ktls->init_callback) {
+		ktls->init_callback(ktls, ktls->ssl);
 	}
 
 	if (is_client) {
+		/* The callback may have changed the identity or trust the cache key does not cover */
+		if (ktls->session_key && !ktls->init_callback) {
+			SSL_SESSION *session = session_cache_get(ktls->session_key);
+
+			if (session) {
+				SSL_set_session(ktls->ssl, session);
+				SSL_SESSION_free(session);
+			}
+		}
+
 		/* Provide the server name, allowing SNI to work. */
 		if (!SSL_set_tlsext_host_name(ktls->ssl, ktls->req_host)) {
 			ks_log(KS_LOG_ERROR, "Failed to set the SNI\n");
@@ -421,49 +734,117 @@ static ks_status_t establish_peer_tls(ks_tls_t *ktls, uint32_t timeout_ms)
 
 			return KS_STATUS_FAIL;
 		}
-	}
 
-	if (!timeout_ms) {
-		timeout_ms = KS_TLS_DEFAULT_INIT_TIMEOUT_MS;
+		SSL_set_connect_state(ktls->ssl);
+	} else {
+		SSL_set_accept_state(ktls->ssl);
 	}
 
-	num_retries = timeout_ms / KS_TLS_INIT_RETRY_MS;
+	return KS_STATUS_SUCCESS;
+}
 
-	for (;;) {
-		int ssl_err;
-		int code;
+/* One pass of the handshake. KS_STATUS_RETRY leaves what it waits for in ktls->want */
+static ks_status_t tls_handshake_step(ks_tls_t *ktls)
+{
+	ks_bool_t is_client = (ktls->type == KS_TLS_CLIENT);
+	int ssl_err;
+	int code;
 
-		ERR_clear_error();
+	if (ktls->secure_established) {
+		return KS_STATUS_SUCCESS;
+	}
 
-		code = (is_client ? SSL_connect(ktls->ssl) : SSL_accept(ktls->ssl));
+	ERR_clear_error();
 
-		if (code == 1) {
-			ktls->secure_established = KS_TRUE;
+	code = SSL_do_handshake(ktls->ssl);
 
-			get_cipher_name(ktls);
+	if (code == 1) {
+		ktls->secure_established = KS_TRUE;
 
-			return KS_STATUS_SUCCESS;
+		if (SSL_session_reused(ktls->ssl)) {
+			ks_atomic_increment_uint64(is_client ? &g_session_stats.client_resumed : &g_session_stats.server_resumed);
+		} else {
+			ks_atomic_increment_uint64(is_client ? &g_session_stats.client_full : &g_session_stats.server_full);
 		}
 
-		ssl_err = SSL_get_error(ktls->ssl, code);
+		get_cipher_name(ktls);
 
-		if (!KS_SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
-			ks_log(KS_LOG_ERROR, "Failed to negotiate ssl connection with ssl error code: %d (%s)\n", ssl_err, ERR_error_string(ssl_err, NULL));
-			ERR_print_errors_cb(log_ssl_errors, NULL);
+		return KS_STATUS_SUCCESS;
+	}
 
-			return KS_STATUS_FAIL;
-		}
+	ssl_err = SSL_get_error(ktls->ssl, code);
 
-		if (++retry > num_retries) {
-			break;
+	if (KS_SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+		ktls->want = ssl_err == SSL_ERROR_WANT_READ ? KS_POLL_READ : KS_POLL_WRITE;
+
+		return KS_STATUS_RETRY;
+	}
+
+	if (KS_SSL_IO_ERROR(ssl_err)) {
+		ktls->ssl_io_error = KS_TRUE;
+	}
+
+	ks_log(KS_LOG_ERROR, "Failed to negotiate ssl connection with ssl error code: %d (%s)\n", ssl_err, ERR_error_string(ssl_err, NULL));
+	ERR_print_errors_cb(log_ssl_errors, NULL);
+
+	return KS_STATUS_FAIL;
+}
+
+/* Client/Server side. Runs the handshake to the end, sleeping only in ks_tls_wait on the direction OpenSSL asked for. */
+static ks_status_t establish_peer_tls(ks_tls_t *ktls, uint32_t timeout_ms)
+{
+	ks_time_t deadline;
+	ks_status_t status;
+
+	if (!ktls) {
+		ks_log(KS_LOG_ERROR, "Establish: Invalid (empty) pointer!\n");
+
+		return KS_STATUS_ARG_NULL;
+	}
+
+	if ((status = tls_prepare(ktls)) != KS_STATUS_SUCCESS) {
+		return status;
+	}
+
+	if (!timeout_ms) {
+		timeout_ms = KS_TLS_DEFAULT_INIT_TIMEOUT_MS;
+	}
+
+	deadline = ks_time_now() + (ks_time_t)timeout_ms * 1000;
+
+	while ((status = tls_handshake_step(ktls)) == KS_STATUS_RETRY) {
+		if ((status = ks_tls_wait(ktls, deadline)) != KS_STATUS_SUCCESS) {
+			if (status == KS_STATUS_TIMEOUT) {
+				ks_log(KS_LOG_INFO, "Timeout.\n");
+			}
+
+			return status;
 		}
+	}
 
-		ks_sleep_ms(KS_TLS_INIT_RETRY_MS);
-	};
+	return status;
+}
 
-	ks_log(KS_LOG_INFO, "Timeout.\n");
+KS_DECLARE(ks_status_t) ks_tls_handshake(ks_tls_t *ktls, ks_poll_t *want)
+{
+	ks_status_t status;
+
+	if (!ktls || !ktls->ssl) {
+		ks_log(KS_LOG_ERROR, "Handshake: Invalid (empty) parameter!\n");
+
+		return KS_STATUS_ARG_NULL;
+	}
+
+	if ((status = tls_handshake_step(ktls)) == KS_STATUS_RETRY && want) {
+		*want = ktls->want;
+	}
+
+	return status;
+}
 
-	return KS_STATUS_TIMEOUT;
+KS_DECLARE(ks_socket_t) ks_tls_get_socket(ks_tls_t *ktls)
+{
+	return ktls ? ktls->sock : KS_SOCK_INVALID;
 }
 
 static void ssl_info_callback(const SSL *s, int where, int ret)
@@ -518,6 +899,18 @@ static SSL_CTX *do_create_client_ctx(const ks_tls_connect_params_t *client_param
 		SSL_CTX_set_info_callback(ssl_ctx, ssl_info_callback);
 	}
 
+#ifdef SSL_OP_ENABLE_KTLS
+	if (client_params->ktls) {
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+
+	if (client_params->enable_resumption) {
+		/* Sessions go to the shared table from client_new_session, not to this short lived SSL_CTX */
+		SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ssl_ctx, client_new_session);
+	}
+
 	return ssl_ctx;
 }
 
@@ -588,6 +981,12 @@ static SSL_CTX *do_create_server_ctx(const ks_tls_server_ctx_params_t *server_pa
 		SSL_CTX_set_info_callback(ssl_ctx, ssl_info_callback);
 	}
 
+#ifdef SSL_OP_ENABLE_KTLS
+	if (server_params->ktls) {
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+
 	return ssl_ctx;
 
  fail:
@@ -622,6 +1021,7 @@ KS_DECLARE(ks_status_t) ks_tls_create_shared_server_ctx(ks_tls_shared_ctx_t **sh
 	}
 
 	shared_ctx->ssl_ctx = ssl_ctx;
+	setup_server_resumption(shared_ctx, params);
 	*shared_ctxP = shared_ctx;
 
 	return KS_STATUS_SUCCESS;
@@ -646,14 +1046,15 @@ KS_DECLARE(ks_status_t) ks_tls_destroy_shared_server_ctx(ks_tls_shared_ctx_t **s
 	}
 
 	SSL_CTX_free(shared_ctx->ssl_ctx);
+	OPENSSL_cleanse(shared_ctx->ticket_keys, sizeof(shared_ctx->ticket_keys));
 	ks_pool_free(&shared_ctx);
 	*shared_ctxP = NULL;
 
 	return KS_STATUS_SUCCESS;
 }
 
-/* Only one of `client_params` or `server_params` must be provided. */
-static ks_status_t ks_tls_init(ks_tls_t **ktlsP, ks_socket_t sock, ks_tls_connect_params_t *client_params, ks_tls_accept_params_t *server_params, ks_pool_t *pool)
+/* Only one of `client_params` or `server_params` must be provided. Without `handshake` the caller steps it with ks_tls_handshake. */
+static ks_status_t ks_tls_init(ks_tls_t **ktlsP, ks_socket_t sock, ks_tls_connect_params_t *client_params, ks_tls_accept_params_t *server_params, ks_pool_t *pool, ks_bool_t handshake)
 {
 	ks_tls_t *ktls = NULL;
 	SSL_CTX *ssl_ctx = NULL;
@@ -694,6 +1095,13 @@ static ks_status_t ks_tls_init(ks_tls_t **ktlsP, ks_socket_t sock, ks_tls_connec
 	if (is_client) {
 		if (client_params->host) {
 			ktls->req_host = ks_pstrdup(pool, client_params->host);
+
+			/* A session is only offered to connections that would have verified the peer the same way,
+			 * the certificate is not checked again on resumption */
+			if (client_params->enable_resumption) {
+				ktls->session_key = ks_psprintf(pool, "%s:%u:%d", client_params->host, client_params->port ? client_params->port : 443,
+												client_params->verify_peer ? client_params->verify_peer : KS_TLS_DEFAULT_VERIRY_PEER);
+			}
 		}
 
 		ssl_ctx = do_create_client_ctx(client_params);
@@ -703,6 +1111,8 @@ static ks_status_t ks_tls_init(ks_tls_t **ktlsP, ks_socket_t sock, ks_tls_connec
 			ks_log(KS_LOG_ERROR, "Failed to initiate SSL context with ssl error [%lu].\n", ssl_ctx_error);
 			goto err;
 		}
+
+		SSL_CTX_set_app_data(ssl_ctx, ktls);
 	} else { /* KS_TLS_SERVER */
 		ssl_ctx = server_params->shared_ctx->ssl_ctx;
 	}
@@ -714,7 +1124,7 @@ static ks_status_t ks_tls_init(ks_tls_t **ktlsP, ks_socket_t sock, ks_tls_connec
 
 	timeout_ms = (is_client ? client_params->init_timeout_ms : server_params->init_timeout_ms);
 
-	if (establish_peer_tls(ktls, timeout_ms) != KS_STATUS_SUCCESS) {
+	if ((handshake ? establish_peer_tls(ktls, timeout_ms) : tls_prepare(ktls)) != KS_STATUS_SUCCESS) {
 		ks_log(KS_LOG_ERROR, "[%s] Failed to establish TLS layer\n", (is_client ? "client" : "server"));
 		goto err;
 	}
@@ -729,7 +1139,7 @@ static ks_status_t ks_tls_init(ks_tls_t **ktlsP, ks_socket_t sock, ks_tls_connec
 	return KS_STATUS_FAIL;
 }
 
-KS_DECLARE(ks_status_t) ks_tls_connect(ks_tls_t **ktlsP, ks_tls_connect_params_t *params, ks_pool_t *pool)
+static ks_status_t tls_connect(ks_tls_t **ktlsP, ks_tls_connect_params_t *params, ks_pool_t *pool, ks_bool_t handshake)
 {
 #if OPENSSL_VERSION_NUMBER < 0x10100000
 	/* OpenSSL < 1.1  */
@@ -773,10 +1183,20 @@ KS_DECLARE(ks_status_t) ks_tls_connect(ks_tls_t **ktlsP, ks_tls_connect_params_t
 	 */
 	sock = ks_socket_connect_ex(SOCK_STREAM, IPPROTO_TCP, &addr, sock_timeout_ms);
 
-	return ks_tls_init(ktlsP, sock, params, NULL, pool); //->host, params->flags, params->init_timeout_ms, pool);
+	return ks_tls_init(ktlsP, sock, params, NULL, pool, handshake);
 #endif
 }
 
+KS_DECLARE(ks_status_t) ks_tls_connect(ks_tls_t **ktlsP, ks_tls_connect_params_t *params, ks_pool_t *pool)
+{
+	return tls_connect(ktlsP, params, pool, KS_TRUE);
+}
+
+KS_DECLARE(ks_status_t) ks_tls_connect_start(ks_tls_t **ktlsP, ks_tls_connect_params_t *params, ks_pool_t *pool)
+{
+	return tls_connect(ktlsP, params, pool, KS_FALSE);
+}
+
 KS_DECLARE(ks_status_t) ks_tls_accept(ks_tls_t **ktlsP, ks_tls_accept_params_t *params, ks_pool_t *pool)
 {
 	if (!ktlsP || !params || !pool) {
@@ -785,9 +1205,104 @@ KS_DECLARE(ks_status_t) ks_tls_accept(ks_tls_t **ktlsP, ks_tls_accept_params_t *
 		return KS_STATUS_ARG_NULL;
 	}
 
-	return ks_tls_init(ktlsP, params->peer_socket, NULL, params, pool);
+	return ks_tls_init(ktlsP, params->peer_socket, NULL, params, pool, KS_TRUE);
 }
 
+KS_DECLARE(ks_status_t) ks_tls_accept_start(ks_tls_t **ktlsP, ks_tls_accept_params_t *params, ks_pool_t *pool)
+{
+	if (!ktlsP || !params || !pool) {
+		ks_log(KS_LOG_ERROR, "Accept: Invalid (empty) parameter! (ktlsP [%p], params [%p], pool [%p])\n", ktlsP, params, pool);
+
+		return KS_STATUS_ARG_NULL;
+	}
+
+	return ks_tls_init(ktlsP, params->peer_socket, NULL, params, pool, KS_FALSE);
+}
+
+KS_DECLARE(void) ks_tls_get_ktls(ks_tls_t *ktls, ks_bool_t *tx, ks_bool_t *rx)
+{
+	ks_ssl_get_ktls(ktls && ktls->secure_established ? ktls->ssl : NULL, tx, rx);
+}
+
+#ifndef WIN32
+KS_DECLARE(ks_status_t) ks_tls_sendfile(ks_tls_t *ktls, int fd, off_t offset, ks_size_t *bytes, uint32_t timeout_ms)
+{
+	ks_time_t deadline = timeout_ms ? ks_time_now() + (ks_time_t)timeout_ms * 1000 : 0;
+	ks_size_t sent = 0, want;
+	ks_status_t status = KS_STATUS_SUCCESS;
+	char buf[KS_TLS_SENDFILE_CHUNK];
+#ifdef SSL_OP_ENABLE_KTLS
+	ks_bool_t tx = KS_FALSE;
+#endif
+
+	if (!ktls || !bytes || fd < 0) {
+		ks_log(KS_LOG_ERROR, "Sendfile: Invalid (empty) parameter!\n");
+
+		return KS_STATUS_ARG_NULL;
+	}
+
+	want = *bytes;
+#ifdef SSL_OP_ENABLE_KTLS
+	ks_tls_get_ktls(ktls, &tx, NULL);
+#endif
+
+	while (sent < want) {
+#ifdef SSL_OP_ENABLE_KTLS
+		/* SSL_sendfile came with kernel TLS in OpenSSL 3, older libraries always take the pread path */
+		if (tx) {
+			ossl_ssize_t r;
+
+			ERR_clear_error();
+
+			if ((r = SSL_sendfile(ktls->ssl, fd, offset + (off_t)sent, want - sent, 0)) > 0) {
+				sent += r;
+				continue;
+			}
+
+			if (!KS_SSL_ERROR_WANT_READ_WRITE(SSL_get_error(ktls->ssl, (int)r))) {
+				status = KS_STATUS_FAIL;
+				break;
+			}
+
+			ktls->want = KS_POLL_WRITE;
+
+			if ((status = ks_tls_wait(ktls, deadline)) != KS_STATUS_SUCCESS) {
+				break;
+			}
+		} else
+#endif
+		{
+			ks_size_t len = want - sent < sizeof(buf) ? want - sent : sizeof(buf);
+			ssize_t r = pread(fd, buf, len, offset + (off_t)sent);
+			ks_time_t now;
+
+			if (r <= 0) {
+				status = KS_STATUS_FAIL;
+				break;
+			}
+
+			len = (ks_size_t)r;
+			now = ks_time_now();
+
+			if (deadline && now >= deadline) {
+				status = KS_STATUS_TIMEOUT;
+				break;
+			}
+
+			if ((status = ks_tls_write_timeout(ktls, buf, &len, deadline ? (uint32_t)((deadline - now + 999) / 1000) : 0)) != KS_STATUS_SUCCESS) {
+				break;
+			}
+
+			sent += len;
+		}
+	}
+
+	*bytes = sent;
+
+	return status;
+}
+#endif
+
 KS_DECLARE(int) ks_tls_wait_sock(ks_tls_t *ktls, uint32_t ms, ks_poll_t flags)
 {
 	if (ktls->sock == KS_SOCK_INVALID) {
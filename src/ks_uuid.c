@@ -27,7 +27,12 @@ KS_DECLARE(ks_uuid_t *) ks_uuid(ks_uuid_t *uuid)
 #ifdef KS_PLAT_WIN
     UuidCreate(uuid);
 #else
-    uuid_generate_random((unsigned char *)uuid);
+	unsigned char *b = (unsigned char *)uuid;
+
+	/* Version 4, laid out the way uuid_generate_random does it */
+	ks_random_bytes(b, sizeof(uuid_t));
+	b[6] = (b[6] & 0x0f) | 0x40;
+	b[8] = (b[8] & 0x3f) | 0x80;
 #endif
 	return uuid;
 }
@@ -22,6 +22,18 @@
 
 #include "libks/ks.h"
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define KWS_LOOP_EPOLL 1
+#endif
 
 #ifdef _MSC_VER
 /* warning C4706: assignment within conditional expression*/
@@ -33,10 +45,12 @@
 #define WS_NOBLOCK 0
 
 #define WS_INIT_SANITY 5000
-#define WS_WRITE_SANITY 200
+#define WS_WRITE_NOBLOCK 200 /* ms, how long a write on a non blocking connection waits for the socket */
 
 #define SHA1_HASH_SIZE 20
 
+#define WS_READ_AHEAD (16 * 1024) /* one full TLS record */
+
 static const char c64[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
 //static ks_ssize_t ws_send_buf(kws_t *kws, kws_opcode_t oc);
@@ -70,7 +84,6 @@ struct kws_s {
 	int logical_established;
 	char cipher_name[128];
 	kws_flag_t flags;
-	int x;
 	int ssl_io_error;
 	void *write_buffer;
 	ks_size_t write_buffer_len;
@@ -83,6 +96,73 @@ struct kws_s {
 	ks_size_t sans_count;
 	ks_size_t unprocessed_buffer_len; /* extra data remains unprocessed */
 	char *unprocessed_position;
+	char *read_ahead; /* WS_READ_AHEAD bytes that small reads are served from once framing starts */
+	kws_http_t http; /* index of the handshake or request head sitting in buffer */
+
+	kws_stats_t stats;
+
+	/* kws_loop state, only used while the connection is on a loop */
+	kws_loop_t *loop;
+	struct kws_s *loop_next;
+	struct kws_s *loop_prev;
+	struct kws_s *loop_sweep; /* next one past its close deadline, loop thread only */
+	kws_loop_callbacks_t callbacks;
+	void *user_data;
+	ks_mutex_t *write_mutex; /* frames, compression and the loop's output, recursive */
+	int loop_refs; /* the loop's own plus kws_loop_ref, the last kws_loop_unref frees the connection */
+	uint8_t *in;
+	ks_size_t in_len;
+	ks_size_t in_size;
+	uint8_t *out;
+	ks_size_t out_len;
+	ks_size_t out_size;
+	kws_opcode_t frag_oc;
+	ks_size_t frag_len;
+	int loop_want_write;
+	int loop_armed;
+	int loop_closing;
+	ks_time_t loop_linger; /* deadline for the close frame and anything queued ahead of it */
+	int close_sent;
+
+	/* kws_read_chunk position inside the current message */
+	kws_opcode_t stream_oc;
+	uint64_t stream_left;
+	uint64_t stream_frame_off;
+	ks_size_t stream_msg_len;
+	uint8_t stream_mask[4];
+	int stream_masked;
+	int stream_fin;
+	int stream_deflated;
+	int stream_tail;
+	int stream_out_full;
+
+	/* permessage-deflate as agreed in the handshake */
+	int deflate;
+	int deflate_bits;
+	int deflate_level;
+	int deflate_reset;
+	int inflate_bits;
+	int inflate_reset;
+	struct kws_zctx_s *zdef;
+	struct kws_zctx_s *zinf;
+	uint8_t *deflate_buf;
+	ks_size_t deflate_buf_size;
+	uint8_t *inflate_buf;
+	ks_size_t inflate_buf_size;
+	int frag_deflated;
+
+	/* Frames held back by kws_cork or the coalescing window, written out together */
+	uint8_t *cork_buf;
+	ks_size_t cork_len;
+	ks_size_t cork_size;
+	ks_size_t cork_frames;
+	ks_time_t cork_since;
+	int corked;
+	ks_time_t coalesce_window; /* us, 0 when only kws_cork holds frames back */
+	ks_size_t coalesce_bytes;
+	kws_t *flush_next; /* on the flusher's list while the window is open */
+	kws_t *flush_prev;
+	int flush_linked;
 
 	kws_init_callback_t init_callback;
 	ks_json_t *params;
@@ -92,54 +172,183 @@ struct kws_s {
 
 
 
-static int cheezy_get_var(char *data, char *name, char *buf, ks_size_t buflen)
+enum {
+	HTTP_START = 0,
+	HTTP_HEADERS,
+	HTTP_DONE,
+	HTTP_ERROR
+};
+
+static const struct {
+	const char *name;
+	uint32_t len;
+} http_known_names[KWS_HTTP_KNOWN] = {
+	{ "Host", 4 },
+	{ "Upgrade", 7 },
+	{ "Connection", 10 },
+	{ "Origin", 6 },
+	{ "User-Agent", 10 },
+	{ "Referer", 7 },
+	{ "Authorization", 13 },
+	{ "Content-Type", 12 },
+	{ "Content-Length", 14 },
+	{ "Sec-WebSocket-Key", 17 },
+	{ "Sec-WebSocket-Version", 21 },
+	{ "Sec-WebSocket-Protocol", 22 },
+	{ "Sec-WebSocket-Extensions", 24 },
+	{ "Sec-WebSocket-Accept", 20 }
+};
+
+static int http_known(const char *name, ks_size_t len)
 {
-  char *p=data;
+	int i;
+
+	for (i = 0; i < KWS_HTTP_KNOWN; i++) {
+		if (http_known_names[i].len == len && !strncasecmp(http_known_names[i].name, name, len)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
 
-  /* the old way didnt make sure that variable values were used for the name hunt
-   * and didnt ensure that only a full match of the variable name was used
-   */
-  ks_assert(buflen > 0);
+static void http_slice(kws_http_slice_t *slice, char *buf, char *s, char *e)
+{
+	slice->off = (uint32_t)(s - buf);
+	slice->len = (uint32_t)(e - s);
+	*e = '\0';
+}
 
-  do {
-    if(!strncasecmp(p,name,strlen(name)) && *(p+strlen(name))==':') break;
-  } while((p = (strstr(p,"\n")+1))!=(char *)1);
+/* method SP uri SP version, or version SP status SP reason where the reason may hold spaces */
+static int http_start_line(kws_http_t *http, char *buf, char *s, char *e)
+{
+	char *sp1, *sp2;
 
+	if (!(sp1 = memchr(s, ' ', e - s)) || sp1 == s) {
+		return -1;
+	}
 
-  if (p && p != (char *)1 && *p!='\0') {
-    char *v, *e = 0;
+	if (!(sp2 = memchr(sp1 + 1, ' ', e - sp1 - 1))) {
+		sp2 = e;
+	}
 
-    v = strchr(p, ':');
-    if (v) {
-      v++;
-      while(v && *v == ' ') {
-	v++;
-      }
-      if (v)  {
-	e = strchr(v, '\r');
-	if (!e) {
-	  e = strchr(v, '\n');
+	if (sp2 == sp1 + 1) {
+		return -1;
 	}
-      }
 
-      if (v && e) {
-	size_t cplen;
-	ks_size_t len = e - v;
+	http_slice(&http->start[0], buf, s, sp1);
+	http_slice(&http->start[1], buf, sp1 + 1, sp2);
+	http_slice(&http->start[2], buf, sp2 < e ? sp2 + 1 : e, e);
 
-	if (len > buflen - 1) {
-	  cplen = buflen - 1;
-	} else {
-	  cplen = len;
+	return 0;
+}
+
+static int http_header_line(kws_http_t *http, char *buf, char *s, char *e)
+{
+	kws_http_header_t *h;
+	char *colon, *v;
+	int k;
+
+	/* No folded lines, no whitespace before the colon (RFC 7230 3.2.4) */
+	if (*s == ' ' || *s == '\t' || !(colon = memchr(s, ':', e - s)) || colon == s ||
+		colon[-1] == ' ' || colon[-1] == '\t' || http->count == KWS_MAX_HEADERS) {
+		return -1;
 	}
 
-	strncpy(buf, v, cplen);
-	*(buf+cplen) = '\0';
-	return 1;
-      }
+	for (v = colon + 1; v < e && (*v == ' ' || *v == '\t'); v++);
+	while (e > v && (e[-1] == ' ' || e[-1] == '\t')) e--;
+
+	h = &http->headers[http->count++];
+	http_slice(&h->name, buf, s, colon);
+	http_slice(&h->value, buf, v, e);
+
+	/* A repeated header replaces the earlier one, as the request fields always have */
+	if ((k = http_known(s, h->name.len)) >= 0) {
+		http->known[k] = (uint8_t)http->count;
+	}
+
+	return 0;
+}
+
+KS_DECLARE(void) kws_http_init(kws_http_t *http)
+{
+	memset(http, 0, sizeof(*http));
+}
+
+KS_DECLARE(int) kws_http_parse(kws_http_t *http, char *buf, ks_size_t len)
+{
+	char *nl;
+
+	if (http->state == HTTP_DONE) return 1;
+	if (http->state == HTTP_ERROR || len > UINT32_MAX) goto err;
+
+	while (http->pos < len && (nl = memchr(buf + http->pos, '\n', len - http->pos))) {
+		char *s = buf + http->line, *e = nl;
+
+		if (e > s && e[-1] == '\r') e--;
+
+		http->pos = (uint32_t)(nl - buf) + 1;
+
+		if (e == s) {
+			if (http->state == HTTP_START) {
+				/* Stray empty lines ahead of the start line are allowed */
+				http->line = http->pos;
+				continue;
+			}
+
+			*e = '\0';
+			http->header_len = http->pos;
+			http->state = HTTP_DONE;
+			return 1;
+		}
+
+		if (http->state == HTTP_START) {
+			if (http_start_line(http, buf, s, e) < 0) goto err;
+			http->state = HTTP_HEADERS;
+		} else if (http_header_line(http, buf, s, e) < 0) {
+			goto err;
+		}
+
+		http->line = http->pos;
+	}
+
+	http->pos = (uint32_t)len;
+
+	return 0;
+
+ err:
+
+	http->state = HTTP_ERROR;
+
+	return -1;
+}
+
+KS_DECLARE(const char *) kws_http_get_known(const kws_http_t *http, const char *buf, kws_http_known_t which)
+{
+	if (which >= KWS_HTTP_KNOWN || !http->known[which]) {
+		return NULL;
+	}
+
+	return buf + http->headers[http->known[which] - 1].value.off;
+}
+
+KS_DECLARE(const char *) kws_http_get(const kws_http_t *http, const char *buf, const char *name)
+{
+	ks_size_t len = strlen(name);
+	uint32_t i;
+	int k;
+
+	if ((k = http_known(name, len)) >= 0) {
+		return kws_http_get_known(http, buf, (kws_http_known_t)k);
+	}
+
+	for (i = http->count; i-- > 0;) {
+		if (http->headers[i].name.len == len && !strncasecmp(buf + http->headers[i].name.off, name, len)) {
+			return buf + http->headers[i].value.off;
+		}
+	}
 
-    }
-  }
-  return 0;
+	return NULL;
 }
 
 static int b64encode(unsigned char *in, ks_size_t ilen, unsigned char *out, ks_size_t olen)
@@ -184,2008 +393,4512 @@ static void sha1_digest(unsigned char *digest, char *in)
 
 }
 
-/* fix me when we get real rand funcs in ks */
 static void gen_nonce(unsigned char *buf, uint16_t len)
 {
-	int max = 255;
-	uint16_t x;
-	ks_time_t time_now = ks_time_now();
-	srand((unsigned int)(((time_now >> 32) ^ time_now) & 0xffffffff));
-
-	for (x = 0; x < len; x++) {
-		int j = (int) (max * 1.0 * rand() / (RAND_MAX + 1.0));
-		buf[x] = (char) j;
-	}
+	ks_random_bytes(buf, len);
 }
 
-static int verify_accept(kws_t *kws, const unsigned char *enonce, const char *accept)
+/*
+ * Payload masking. The key repeats every 4 bytes, so once a buffer is split on a multiple of 4
+ * every lane of a wide register sees the same key pattern. Kernels take the key already rotated
+ * to line up with dst[0] and return how many bytes they handled, always a multiple of 4.
+ */
+typedef ks_size_t (*kws_mask_func_t)(uint8_t *dst, const uint8_t *src, ks_size_t len, uint32_t key);
+
+static ks_size_t mask_word(uint8_t *dst, const uint8_t *src, ks_size_t len, uint32_t key)
 {
-	char input[256] = { 0 };
-	unsigned char output[SHA1_HASH_SIZE] = { 0 };
-	char b64[256] = { 0 };
+	uint64_t key64 = ((uint64_t)key << 32) | key, w;
+	ks_size_t i;
 
-	snprintf(input, sizeof(input), "%s%s", enonce, WEBSOCKET_GUID);
-	sha1_digest(output, input);
-	b64encode((unsigned char *)output, SHA1_HASH_SIZE, (unsigned char *)b64, sizeof(b64));
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, src + i, 8);
+		w ^= key64;
+		memcpy(dst + i, &w, 8);
+	}
 
-	return !strcmp(b64, accept);
+	return i;
 }
 
-static int ws_client_handshake(kws_t *kws)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KWS_MASK_SSE2 1
+
+static ks_size_t mask_sse2(uint8_t *dst, const uint8_t *src, ks_size_t len, uint32_t key)
 {
-	unsigned char nonce[16] = { 0 };
-	unsigned char enonce[128] = { 0 };
-	char *req = NULL;
-	char *frame_end = NULL;
-	char *extra_headers = NULL;
+	__m128i k = _mm_set1_epi32((int)key);
+	ks_size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, k));
+		_mm_storeu_si128((__m128i *)(dst + i + 16), _mm_xor_si128(b, k));
+		_mm_storeu_si128((__m128i *)(dst + i + 32), _mm_xor_si128(c, k));
+		_mm_storeu_si128((__m128i *)(dst + i + 48), _mm_xor_si128(d, k));
+	}
 
-	gen_nonce(nonce, sizeof(nonce));
-	b64encode(nonce, sizeof(nonce), enonce, sizeof(enonce));
+	for (; i + 16 <= len; i += 16) {
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), k));
+	}
 
-	if (kws->params) {
-		ks_json_t *headers = ks_json_get_object_item(kws->params, "headers");
+	return i;
+}
+#endif
 
-		if (headers) {
-			ks_json_t *param;
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define KWS_MASK_AVX2 1
 
-			KS_JSON_ARRAY_FOREACH(param, headers) {
-				const char *k = ks_json_get_object_string(param, "key", NULL);
-				const char *v = ks_json_get_object_string(param, "value", NULL);
+/* Built for AVX2 regardless of the compile flags, only picked when the cpu says it has it */
+__attribute__((target("avx2")))
+static ks_size_t mask_avx2(uint8_t *dst, const uint8_t *src, ks_size_t len, uint32_t key)
+{
+	__m256i k = _mm256_set1_epi32((int)key);
+	ks_size_t i;
+
+	for (i = 0; i + 128 <= len; i += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, k));
+		_mm256_storeu_si256((__m256i *)(dst + i + 32), _mm256_xor_si256(b, k));
+		_mm256_storeu_si256((__m256i *)(dst + i + 64), _mm256_xor_si256(c, k));
+		_mm256_storeu_si256((__m256i *)(dst + i + 96), _mm256_xor_si256(d, k));
+	}
 
-				if (k && v) {
-					if (extra_headers) {
-						char *tmp = extra_headers;
-						extra_headers = ks_mprintf("%s%s: %s\r\n", tmp, k, v);
-						ks_safe_free(tmp);
-					} else {
-						extra_headers = ks_mprintf("%s: %s\r\n", k, v);
-					}
-				}
-			}
-		}
+	for (; i + 32 <= len; i += 32) {
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src + i)), k));
 	}
 
-	req = ks_mprintf("GET %s HTTP/1.1\r\n"
-				"Host: %s\r\n"
-				"Upgrade: websocket\r\n"
-				"Connection: Upgrade\r\n"
-				"Sec-WebSocket-Key: %s\r\n"
-				"Sec-WebSocket-Version: 13\r\n"
-				"%s%s%s%s"
-				"\r\n",
-				kws->req_uri, kws->req_host, enonce,
-				kws->req_proto ? "Sec-WebSocket-Protocol: " : "",
-				kws->req_proto ? kws->req_proto : "",
-				kws->req_proto ? "\r\n" : "",
-				extra_headers ? extra_headers : "");
+	return i;
+}
+#endif
 
-	if (extra_headers) free(extra_headers);
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define KWS_MASK_NEON 1
 
-	kws_raw_write(kws, req, strlen(req));
+static ks_size_t mask_neon(uint8_t *dst, const uint8_t *src, ks_size_t len, uint32_t key)
+{
+	uint8x16_t k = vreinterpretq_u8_u32(vdupq_n_u32(key));
+	ks_size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		uint8x16_t a = vld1q_u8(src + i);
+		uint8x16_t b = vld1q_u8(src + i + 16);
+		uint8x16_t c = vld1q_u8(src + i + 32);
+		uint8x16_t d = vld1q_u8(src + i + 48);
+		vst1q_u8(dst + i, veorq_u8(a, k));
+		vst1q_u8(dst + i + 16, veorq_u8(b, k));
+		vst1q_u8(dst + i + 32, veorq_u8(c, k));
+		vst1q_u8(dst + i + 48, veorq_u8(d, k));
+	}
 
-	ks_safe_free(req);
+	for (; i + 16 <= len; i += 16) {
+		vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), k));
+	}
 
-	ks_ssize_t bytes;
+	return i;
+}
+#endif
 
-	do {
-		bytes = kws_string_read(kws, kws->buffer + kws->datalen, kws->buflen - kws->datalen, WS_BLOCK);
-	} while (bytes > 0 && !strstr((char *)kws->buffer, "\r\n\r\n"));
+static ks_size_t mask_none(uint8_t *dst, const uint8_t *src, ks_size_t len, uint32_t key)
+{
+	return 0;
+}
 
-	if (bytes > 0) {
-		char accept[128] = { 0 };
+static const struct {
+	const char *name;
+	kws_mask_func_t func;
+} mask_kernels[] = {
+	{ "scalar", mask_none },
+	{ "word", mask_word },
+#ifdef KWS_MASK_SSE2
+	{ "sse2", mask_sse2 },
+#endif
+#ifdef KWS_MASK_AVX2
+	{ "avx2", mask_avx2 },
+#endif
+#ifdef KWS_MASK_NEON
+	{ "neon", mask_neon },
+#endif
+	{ NULL, NULL }
+};
 
-		frame_end = strstr((char *)kws->buffer, "\r\n\r\n");
-		if (frame_end) frame_end += 4;
+static int mask_kernel = -1;
+
+static ks_bool_t mask_kernel_supported(const char *name)
+{
+#ifdef KWS_MASK_AVX2
+	if (!strcmp(name, "avx2")) {
+		return __builtin_cpu_supports("avx2") ? KS_TRUE : KS_FALSE;
+	}
+#endif
+	return KS_TRUE;
+}
 
-		cheezy_get_var(kws->buffer, "Sec-WebSocket-Accept", accept, sizeof(accept));
+/* Pick the widest kernel this cpu can run, the table is in order of preference */
+static int mask_kernel_select(void)
+{
+	int i, best = 0;
 
-		if (ks_zstr_buf(accept) || !verify_accept(kws, enonce, (char *)accept)) {
-			return -1;
+	for (i = 0; mask_kernels[i].name; i++) {
+		if (mask_kernel_supported(mask_kernels[i].name)) {
+			best = i;
 		}
-	} else {
-		return -1;
 	}
 
-	/* check if any more data */
-	if (frame_end && frame_end - kws->buffer < bytes) {
-		kws->unprocessed_buffer_len = bytes - (frame_end - kws->buffer);
-		kws->unprocessed_position = frame_end;
-	}
+	return best;
+}
 
-	kws->handshake = 1;
+KS_DECLARE(const char *) kws_mask_get_kernel(void)
+{
+	if (mask_kernel < 0) mask_kernel = mask_kernel_select();
 
-	return 0;
+	return mask_kernels[mask_kernel].name;
 }
 
-static int ws_server_handshake(kws_t *kws)
+KS_DECLARE(ks_status_t) kws_mask_set_kernel(const char *name)
 {
-	char key[256] = "";
-	char version[5] = "";
-	char proto[256] = "";
-	char proto_buf[384] = "";
-	char input[512] = "";
-	unsigned char output[SHA1_HASH_SIZE] = "";
-	char b64[256] = "";
-	char respond[1024] = "";
-	ks_ssize_t bytes;
-	char *p, *e = 0;
+	int i;
 
-	if (kws->sock == KS_SOCK_INVALID) {
-		return -3;
+	if (!name) {
+		mask_kernel = mask_kernel_select();
+		return KS_STATUS_SUCCESS;
 	}
 
-	while((bytes = kws_string_read(kws, kws->buffer + kws->datalen, kws->buflen - kws->datalen, WS_BLOCK)) > 0) {
-		kws->datalen += bytes;
-		if (strstr(kws->buffer, "\r\n\r\n") || strstr(kws->buffer, "\n\n")) {
-			break;
+	for (i = 0; mask_kernels[i].name; i++) {
+		if (!strcmp(mask_kernels[i].name, name)) {
+			if (!mask_kernel_supported(name)) {
+				return KS_STATUS_NOT_ALLOWED;
+			}
+			mask_kernel = i;
+			return KS_STATUS_SUCCESS;
 		}
 	}
 
-	if (bytes < 0 || ((ks_size_t)bytes) > kws->buflen - 1) {
-		goto err;
-	}
-
-	*(kws->buffer + kws->datalen) = '\0';
+	return KS_STATUS_NOT_FOUND;
+}
 
-	if (strncasecmp(kws->buffer, "GET ", 4)) {
-		goto err;
-	}
+KS_DECLARE(void) kws_mask(void *dst, const void *src, ks_size_t len, const uint8_t key[4], ks_size_t offset)
+{
+	uint8_t *d = (uint8_t *)dst, rot[4];
+	const uint8_t *s = (const uint8_t *)src;
+	ks_size_t i = 0, j;
+	uint32_t key32;
 
-	p = kws->buffer + 4;
+	if (mask_kernel < 0) mask_kernel = mask_kernel_select();
 
-	e = strchr(p, ' ');
-	if (!e) {
-		goto err;
-	}
+	if (len >= 16) {
+		/* Line dst up on a 16 byte boundary a byte at a time, the vector stores are then never split */
+		for (; ((uintptr_t)(d + i) & 15); i++) {
+			d[i] = s[i] ^ key[(offset + i) & 3];
+		}
 
-	kws->uri = ks_pool_alloc(ks_pool_get(kws), (unsigned long)(e-p) + 1);
-	strncpy(kws->uri, p, e-p);
-	*(kws->uri + (e-p)) = '\0';
+		for (j = 0; j < 4; j++) {
+			rot[j] = key[(offset + i + j) & 3];
+		}
+		memcpy(&key32, rot, 4);
 
-	cheezy_get_var(kws->buffer, "Sec-WebSocket-Key", key, sizeof(key));
-	cheezy_get_var(kws->buffer, "Sec-WebSocket-Version", version, sizeof(version));
-	cheezy_get_var(kws->buffer, "Sec-WebSocket-Protocol", proto, sizeof(proto));
+		i += mask_kernels[mask_kernel].func(d + i, s + i, len - i, key32);
+		i += mask_word(d + i, s + i, len - i, key32);
+	}
 
-	if (!*key) {
-		goto err;
+	for (; i < len; i++) {
+		d[i] = s[i] ^ key[(offset + i) & 3];
 	}
+}
 
-	snprintf(input, sizeof(input), "%s%s", key, WEBSOCKET_GUID);
+static int verify_accept(kws_t *kws, const unsigned char *enonce, const char *accept)
+{
+	char input[256] = { 0 };
+	unsigned char output[SHA1_HASH_SIZE] = { 0 };
+	char b64[256] = { 0 };
+
+	snprintf(input, sizeof(input), "%s%s", enonce, WEBSOCKET_GUID);
 	sha1_digest(output, input);
 	b64encode((unsigned char *)output, SHA1_HASH_SIZE, (unsigned char *)b64, sizeof(b64));
 
-	if (*proto) {
-		snprintf(proto_buf, sizeof(proto_buf), "Sec-WebSocket-Protocol: %s\r\n", proto);
-	}
+	return !strcmp(b64, accept);
+}
 
-	snprintf(respond, sizeof(respond),
-			 "HTTP/1.1 101 Switching Protocols\r\n"
-			 "Upgrade: websocket\r\n"
-			 "Connection: Upgrade\r\n"
-			 "Sec-WebSocket-Accept: %s\r\n"
-			 "%s\r\n",
-			 b64,
-			 proto_buf);
-	respond[511] = 0;
+static ks_status_t ws_reserve(kws_t *kws, uint8_t **buf, ks_size_t *size, ks_size_t need)
+{
+	void *tmp;
+	ks_size_t grow = *size ? *size : WS_READ_AHEAD;
 
-	if (kws_raw_write(kws, respond, strlen(respond)) != (ks_ssize_t)strlen(respond)) {
-		goto err;
+	if (need <= *size) {
+		return KS_STATUS_SUCCESS;
 	}
 
-	kws->handshake = 1;
-	kws->flags &= ~KWS_HTTP;
+	while (grow < need) grow *= 2;
 
-	return 0;
+	/* One spare byte so a text payload can always be NULL terminated in place */
+	if (!*buf) {
+		*buf = ks_pool_alloc_nz(ks_pool_get(kws), (unsigned long)grow + 1);
+	} else if ((tmp = ks_pool_resize(*buf, (unsigned long)grow + 1))) {
+		*buf = tmp;
+	} else {
+		return KS_STATUS_FAIL;
+	}
 
- err:
+	*size = grow;
 
-	if (!(kws->flags & KWS_STAY_OPEN)) {
+	return KS_STATUS_SUCCESS;
+}
 
-		if (bytes > 0) {
-			snprintf(respond, sizeof(respond), "HTTP/1.1 400 Bad Request\r\n"
-					 "Sec-WebSocket-Version: 13\r\n\r\n");
-			respond[511] = 0;
+#define WS_DEFLATE_MIN 64 /* smaller messages go out as they are */
+#define WS_ZPOOL_MAX 64
 
-			kws_raw_write(kws, respond, strlen(respond));
-		}
+/* The empty stored block a sync flush ends with, left off on the wire (RFC 7692 7.2.1) */
+static const uint8_t ws_deflate_tail[4] = { 0x00, 0x00, 0xff, 0xff };
 
-		kws_close(kws, WS_NONE);
-	} else if (kws->flags & KWS_HTTP) {
-		kws->handshake = 1;
-		return 0;
-	}
+typedef struct ws_deflate_params_s {
+	int server_no_takeover;
+	int client_no_takeover;
+	int server_bits;           /* 0 when absent */
+	int client_bits;           /* -1 when absent, 0 when offered without a value */
+} ws_deflate_params_t;
 
-	return -1;
+static char *ws_trim(char *p)
+{
+	char *e;
 
-}
+	while (*p == ' ' || *p == '\t') p++;
+	for (e = p + strlen(p); e > p && (e[-1] == ' ' || e[-1] == '\t'); ) *--e = '\0';
 
-#define SSL_IO_ERROR(err) (err == SSL_ERROR_SYSCALL || err == SSL_ERROR_SSL)
-#define SSL_ERROR_WANT_READ_WRITE(err) (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+	return p;
+}
 
-KS_DECLARE(ks_ssize_t) kws_raw_read(kws_t *kws, void *data, ks_size_t bytes, int block)
+/* Finds the first permessage-deflate offer (or the response) we understand in a Sec-WebSocket-Extensions value */
+static int ws_deflate_parse(const char *value, ws_deflate_params_t *dp)
 {
-	int r;
-	int ssl_err = 0;
-	int block_n = block / 10;
+	char buf[512];
+	char *offer, *next_offer;
 
-	if (kws->unprocessed_buffer_len > 0) {
-		if (kws->unprocessed_buffer_len > bytes) {
-			memmove((char *)data, kws->unprocessed_position, bytes);
-			kws->unprocessed_position += bytes;
-			kws->unprocessed_buffer_len -= bytes;
-			return bytes;
-		} else {
-			ssize_t len = kws->unprocessed_buffer_len;
-			memmove((char *)data, kws->unprocessed_position, len);
-			kws->unprocessed_buffer_len = 0;
-			kws->unprocessed_position = NULL;
-			return len;
-		}
-	}
+	ks_set_string(buf, value);
 
-	kws->x++;
-	if (kws->x > 250) ks_sleep_ms(1);
+	for (offer = buf; offer; offer = next_offer) {
+		char *param, *next_param;
+		int good = 1, first = 1;
 
-	if (kws->ssl) {
-		do {
-			ERR_clear_error();
-			r = SSL_read(kws->ssl, data, (int)bytes);
-			if (r == 0) {
-				ssl_err = SSL_get_error(kws->ssl, r);
-				if (ssl_err != SSL_ERROR_ZERO_RETURN) {
-					ks_log(KS_LOG_WARNING, "Weird SSL_read error: %d\n", ssl_err);
-					if (SSL_IO_ERROR(ssl_err)) {
-						kws->ssl_io_error = 1;
-					}
-				}
-			}
+		if ((next_offer = strchr(offer, ','))) *next_offer++ = '\0';
 
-			if (r < 0) {
-				ssl_err = SSL_get_error(kws->ssl, r);
+		memset(dp, 0, sizeof(*dp));
+		dp->client_bits = -1;
 
-				if (SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
-					if (!block) {
-						r = -2;
-						goto end;
-					}
-					kws->x++;
-					ks_sleep_ms(10);
-				} else {
-					if (SSL_IO_ERROR(ssl_err)) {
-						kws->ssl_io_error = 1;
-					}
+		for (param = offer; param && good; param = next_param, first = 0) {
+			char *val;
 
-					r = -1;
-					goto end;
-				}
+			if ((next_param = strchr(param, ';'))) *next_param++ = '\0';
+
+			if ((val = strchr(param, '='))) {
+				*val++ = '\0';
+				val = ws_trim(val);
+				if (*val == '"') val++;
+				if (*val && val[strlen(val) - 1] == '"') val[strlen(val) - 1] = '\0';
 			}
 
-		} while (r < 0 && SSL_ERROR_WANT_READ_WRITE(ssl_err) && kws->x < block_n);
+			param = ws_trim(param);
+
+			if (first) {
+				good = !strcasecmp(param, "permessage-deflate") && !val;
+			} else if (!strcasecmp(param, "server_no_context_takeover") && !val) {
+				dp->server_no_takeover = 1;
+			} else if (!strcasecmp(param, "client_no_context_takeover") && !val) {
+				dp->client_no_takeover = 1;
+			} else if (!strcasecmp(param, "server_max_window_bits") && val) {
+				dp->server_bits = atoi(val);
+				good = dp->server_bits >= 8 && dp->server_bits <= 15;
+			} else if (!strcasecmp(param, "client_max_window_bits")) {
+				dp->client_bits = val ? atoi(val) : 0;
+				good = !val || (dp->client_bits >= 8 && dp->client_bits <= 15);
+			} else {
+				good = 0;
+			}
+		}
 
-		goto end;
+		if (good) return 1;
 	}
 
-	do {
-		r = recv(kws->sock, data, (int)bytes, 0);
+	return 0;
+}
 
-		if (r == -1) {
-			if (!block && ks_errno_is_blocking(ks_errno())) {
-				r = -2;
-				goto end;
-			}
+/* Our side's wishes from params. zlib can't compress with a 256 byte window, so 9 is the floor */
+static void ws_deflate_config(kws_t *kws, int *bits, int *no_takeover)
+{
+	*bits = ks_json_get_object_number_int(kws->params, "deflate_window_bits", 15);
+	if (*bits < 9) *bits = 9;
+	if (*bits > 15) *bits = 15;
 
-			if (block) {
-				kws->x++;
-				ks_sleep_ms(10);
-			}
-		}
-	} while (r == -1 && ks_errno_is_blocking(ks_errno()) && kws->x < block_n);
+	*no_takeover = ks_json_get_object_bool(kws->params, "deflate_no_context_takeover", KS_FALSE);
+	kws->deflate_level = ks_json_get_object_number_int(kws->params, "deflate_level", -1);
+}
 
- end:
+#ifdef HAVE_ZLIB
+#define ws_deflate_available() 1
+#else
+#define ws_deflate_available() 0
+#endif
 
-	if (kws->x >= 10000 || (block && kws->x >= block_n)) {
-		r = -1;
-	}
+/* The extension header a client sends, empty when it isn't asking for deflate */
+static void ws_deflate_offer(kws_t *kws, char *buf, ks_size_t len)
+{
+	int bits, no_takeover;
 
-	if (r > 0 && r < bytes) {
-		*((char *)data + r) = '\0';
-	}
+	*buf = '\0';
 
-	if (r >= 0) {
-		kws->x = 0;
+	if (!(kws->flags & KWS_FLAG_DEFLATE) || !ws_deflate_available()) {
+		return;
 	}
 
-	return r;
-}
+	ws_deflate_config(kws, &bits, &no_takeover);
 
-/*
- * Blocking read until bytes have been received, failure, or too many retries.
- */
-static ks_ssize_t kws_raw_read_blocking(kws_t *kws, char *data, ks_size_t max_bytes, int max_retries)
-{
-	ks_ssize_t total_bytes_read = 0;
-	int zero_reads = 0;
-	while (total_bytes_read < max_bytes && zero_reads < max_retries)
-	{
-		int bytes_read = kws_raw_read(kws, data + total_bytes_read, max_bytes - total_bytes_read, WS_BLOCK);
-		if (bytes_read == 0)
-		{
-			zero_reads++;
-			continue;
-		}
-		else if (bytes_read < 0)
-		{
-			break;
-		}
-		total_bytes_read += (ks_ssize_t)bytes_read;
-		zero_reads = 0;
+	if (bits < 15) {
+		snprintf(buf, len, "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits=%d; server_max_window_bits=%d%s\r\n",
+				 bits, bits, no_takeover ? "; client_no_context_takeover; server_no_context_takeover" : "");
+	} else {
+		snprintf(buf, len, "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits%s\r\n",
+				 no_takeover ? "; client_no_context_takeover; server_no_context_takeover" : "");
 	}
-	return total_bytes_read;
 }
 
-/**
- * Read from websocket and store as NULL terminated string. Up to buffer_size - 1 bytes will be read from websocket. Contents of str_buffer is NULL terminated if >0 bytes are read from the websocket.
- */
-KS_DECLARE(ks_ssize_t) kws_string_read(kws_t *kws, char *str_buffer, ks_size_t buffer_size, int block)
+/* Client side, takes on whatever the server's response agreed to. -1 fails the handshake */
+static int ws_deflate_accept(kws_t *kws)
 {
-	if (buffer_size < 1) {
-		return -1;
-	}
-	str_buffer[buffer_size - 1] = '\0';
-	if (buffer_size < 2) {
+	const char *ext;
+	ws_deflate_params_t dp;
+	int bits, no_takeover;
+
+	if (!(ext = kws_http_get_known(&kws->http, kws->buffer, KWS_HTTP_SEC_WEBSOCKET_EXTENSIONS))) {
 		return 0;
 	}
-	return kws_raw_read(kws, str_buffer, buffer_size - 1, block);
-}
 
-/*
- * Blocking read as from websocket and store as NULL terminated string until buffer_size - 1 have been received, failure, or too many retries. Contents of str_buffer is NULL terminated if >0 bytes are read from the websocket.
- */
-static ks_ssize_t kws_string_read_blocking(kws_t *kws, char *str_buffer, ks_size_t buffer_size, int max_retries)
-{
-	if (buffer_size < 1) {
+	/* Anything but a single permessage-deflate we offered is an extension we can't speak */
+	if (!(kws->flags & KWS_FLAG_DEFLATE) || !ws_deflate_available() || strchr(ext, ',') || !ws_deflate_parse(ext, &dp) || dp.client_bits == 8) {
+		ks_log(KS_LOG_ERROR, "WS server answered with unsupported extensions [%s]\n", ext);
 		return -1;
 	}
-	str_buffer[buffer_size - 1] = '\0';
-	if (buffer_size < 2) {
-		return 0;
-	}
-	return kws_raw_read_blocking(kws, str_buffer, buffer_size - 1, max_retries);
+
+	ws_deflate_config(kws, &bits, &no_takeover);
+
+	kws->deflate = 1;
+	kws->deflate_bits = dp.client_bits > 0 && dp.client_bits < bits ? dp.client_bits : bits;
+	kws->deflate_reset = dp.client_no_takeover || no_takeover;
+	kws->inflate_bits = dp.server_bits ? dp.server_bits : 15;
+	kws->inflate_reset = dp.server_no_takeover;
+
+	return 0;
 }
 
-KS_DECLARE(ks_ssize_t) kws_raw_write(kws_t *kws, void *data, ks_size_t bytes)
+/* Server side, agrees to the client's offer if there is one and fills in the response header */
+static void ws_deflate_answer(kws_t *kws, char *buf, ks_size_t len)
 {
-	int r;
-	int sanity = WS_WRITE_SANITY;
-	int ssl_err = 0;
-	ks_size_t wrote = 0;
+	const char *ext;
+	ws_deflate_params_t dp;
+	int bits, no_takeover, n;
 
-	if (kws->ssl) {
-		do {
-			ERR_clear_error();
-			r = SSL_write(kws->ssl, (void *)((unsigned char *)data + wrote), (int)(bytes - wrote));
+	*buf = '\0';
 
-			if (r == 0) {
-				ssl_err = SSL_get_error(kws->ssl, r);
-				if (SSL_IO_ERROR(ssl_err)) {
-					kws->ssl_io_error = 1;
-				}
+	if (!(kws->flags & KWS_FLAG_DEFLATE) || !ws_deflate_available() ||
+		!(ext = kws_http_get_known(&kws->http, kws->buffer, KWS_HTTP_SEC_WEBSOCKET_EXTENSIONS)) || !ws_deflate_parse(ext, &dp)) {
+		return;
+	}
 
-				ssl_err = 42;
-				break;
-			}
+	ws_deflate_config(kws, &bits, &no_takeover);
 
-			if (r > 0) {
-				wrote += r;
-			}
+	if (dp.server_bits == 8) {
+		/* Rather than a window zlib can't do */
+		return;
+	}
 
-			if (sanity < WS_WRITE_SANITY) {
-				int ms = 1;
+	kws->deflate = 1;
+	kws->deflate_bits = dp.server_bits && dp.server_bits < bits ? dp.server_bits : bits;
+	kws->deflate_reset = dp.server_no_takeover || no_takeover;
+	/* The client's window can only be limited when it said it would listen */
+	kws->inflate_bits = dp.client_bits < 0 ? 15 : (dp.client_bits && dp.client_bits < bits ? dp.client_bits : bits);
+	kws->inflate_reset = dp.client_no_takeover || no_takeover;
 
-				if (kws->block) {
-					if (sanity < WS_WRITE_SANITY * 3 / 4) {
-						ms = 50;
-					} else if (sanity < WS_WRITE_SANITY / 2) {
-						ms = 25;
-					}
-				}
+	n = snprintf(buf, len, "Sec-WebSocket-Extensions: permessage-deflate%s%s",
+				 kws->deflate_reset ? "; server_no_context_takeover" : "",
+				 kws->inflate_reset ? "; client_no_context_takeover" : "");
 
-				ks_sleep_ms(ms);
-			}
+	if (kws->deflate_bits < 15) {
+		n += snprintf(buf + n, len - n, "; server_max_window_bits=%d", kws->deflate_bits);
+	}
 
-			if (r < 0) {
-				ssl_err = SSL_get_error(kws->ssl, r);
+	if (kws->inflate_bits < 15) {
+		n += snprintf(buf + n, len - n, "; client_max_window_bits=%d", kws->inflate_bits);
+	}
 
-				if (!SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
-					if (SSL_IO_ERROR(ssl_err)) {
-						kws->ssl_io_error = 1;
-					}
+	snprintf(buf + n, len - n, "\r\n");
+}
 
-					break;
-				}
+#ifdef HAVE_ZLIB
+typedef struct kws_zctx_s {
+	z_stream z;
+	int inflate;
+	int bits;
+	int level;
+	struct kws_zctx_s *next;
+} kws_zctx_t;
 
-				ssl_err = 0;
-			}
+/*
+ * Idle compression contexts shared by every connection. Connections that reset between
+ * messages only hold one while a message is in flight, which keeps their memory bounded.
+ */
+static ks_spinlock_t g_zpool_lock;
+static kws_zctx_t *g_zpool;
+static int g_zpool_len;
 
-		} while (--sanity > 0 && wrote < bytes);
+static void ws_zctx_free(kws_zctx_t *ctx)
+{
+	if (ctx->inflate) inflateEnd(&ctx->z);
+	else deflateEnd(&ctx->z);
 
-		if (!sanity) ssl_err = 56;
+	free(ctx);
+}
 
-		if (ssl_err) {
-			r = ssl_err * -1;
+static kws_zctx_t *ws_zctx_get(int inflate, int bits, int level)
+{
+	kws_zctx_t *ctx, **ctxp;
+
+	ks_spinlock_acquire(&g_zpool_lock);
+
+	for (ctxp = &g_zpool; (ctx = *ctxp); ctxp = &ctx->next) {
+		if (ctx->inflate == inflate && ctx->bits == bits && (inflate || ctx->level == level)) {
+			*ctxp = ctx->next;
+			g_zpool_len--;
+			break;
 		}
+	}
 
-		return r > 0 ? wrote : r;
+	ks_spinlock_release(&g_zpool_lock);
+
+	if (ctx) {
+		return ctx;
 	}
 
-	do {
-		r = send(kws->sock, (void *)((unsigned char *)data + wrote), (int)(bytes - wrote), 0);
+	if (!(ctx = calloc(1, sizeof(*ctx)))) {
+		return NULL;
+	}
 
-		if (r > 0) {
-			wrote += r;
-		}
+	ctx->inflate = inflate;
+	ctx->bits = bits;
+	ctx->level = level;
 
-		if (sanity < WS_WRITE_SANITY) {
-			int ms = 1;
+	if ((inflate ? inflateInit2(&ctx->z, -bits) : deflateInit2(&ctx->z, level, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY)) != Z_OK) {
+		free(ctx);
+		return NULL;
+	}
 
-			if (kws->block) {
-				if (sanity < WS_WRITE_SANITY * 3 / 4) {
-					ms = 50;
-				} else if (sanity < WS_WRITE_SANITY / 2) {
-					ms = 25;
-				}
-			}
-			ks_sleep_ms(ms);
-		}
+	return ctx;
+}
 
-		if (r == -1) {
-			if (!ks_errno_is_blocking(ks_errno())) {
-				break;
-			}
-		}
+static void ws_zctx_put(kws_zctx_t **ctxP)
+{
+	kws_zctx_t *ctx = *ctxP;
 
-	} while (--sanity > 0 && wrote < bytes);
+	if (!ctx) {
+		return;
+	}
 
-	//if (r<0) {
-		//printf("wRITE FAIL: %s\n", strerror(errno));
-	//}
+	*ctxP = NULL;
 
-	return r >= 0 ? wrote : r;
+	if (ctx->inflate) inflateReset(&ctx->z);
+	else deflateReset(&ctx->z);
+
+	ks_spinlock_acquire(&g_zpool_lock);
+
+	if (g_zpool_len < WS_ZPOOL_MAX) {
+		ctx->next = g_zpool;
+		g_zpool = ctx;
+		g_zpool_len++;
+		ctx = NULL;
+	}
+
+	ks_spinlock_release(&g_zpool_lock);
+
+	if (ctx) {
+		ws_zctx_free(ctx);
+	}
 }
 
-static void restore_socket(ks_socket_t sock)
+/* Drops a context whose stream state can't be trusted any more */
+static void ws_zctx_drop(kws_zctx_t **ctxP)
 {
-	ks_socket_option(sock, KS_SO_NONBLOCK, KS_FALSE);
+	if (*ctxP) {
+		ws_zctx_free(*ctxP);
+		*ctxP = NULL;
+	}
 }
 
-static int __log_ssl_errors(const char *err, size_t len, void *u)
+KS_DECLARE(void) kws_deflate_shutdown(void)
 {
-	ks_log(KS_LOG_ERROR, "  %s", err);	// ssl adds a \n
-	return 0;
+	kws_zctx_t *ctx;
+
+	ks_spinlock_acquire(&g_zpool_lock);
+
+	while ((ctx = g_zpool)) {
+		g_zpool = ctx->next;
+		ws_zctx_free(ctx);
+	}
+
+	g_zpool_len = 0;
+
+	ks_spinlock_release(&g_zpool_lock);
 }
 
-static int establish_client_logical_layer(kws_t *kws)
+/* Compresses a message into deflate_buf, less the sync flush tail. Returns the compressed length or -1 */
+static ks_ssize_t ws_deflate_message(kws_t *kws, const kws_iovec_t *iov, int iovcnt, ks_size_t bytes)
 {
+	z_stream *z;
+	ks_size_t out = 0;
+	int i, r = Z_OK;
 
-	if (!kws->sanity) {
+	if (!kws->zdef && !(kws->zdef = ws_zctx_get(0, kws->deflate_bits, kws->deflate_level))) {
 		return -1;
 	}
 
-	if (kws->logical_established) {
-		return 0;
-	}
+	z = &kws->zdef->z;
 
-	if (kws->secure && !kws->secure_established) {
-		int code;
+	for (i = 0; i <= iovcnt; i++) {
+		int flush = i == iovcnt ? Z_SYNC_FLUSH : Z_NO_FLUSH;
 
-		if (!kws->ssl) {
-			kws->ssl = SSL_new(kws->ssl_ctx);
-			if (!kws->ssl) {
-				unsigned long ssl_new_error = ERR_peek_error();
-				ks_log(KS_LOG_ERROR, "Failed to initiate SSL with error [%lu]\n", ssl_new_error);
-				return -1;
+		z->next_in = i < iovcnt ? (Bytef *)iov[i].base : NULL;
+		z->avail_in = i < iovcnt ? (uInt)iov[i].len : 0;
+
+		do {
+			if (ws_reserve(kws, &kws->deflate_buf, &kws->deflate_buf_size, out + 64 + bytes / 8) != KS_STATUS_SUCCESS) {
+				goto fail;
 			}
 
-			SSL_set_fd(kws->ssl, (int)kws->sock);
+			z->next_out = kws->deflate_buf + out;
+			z->avail_out = (uInt)(kws->deflate_buf_size - out);
+			r = deflate(z, flush);
+			out = kws->deflate_buf_size - z->avail_out;
+		} while (r == Z_OK && (z->avail_in || (flush == Z_SYNC_FLUSH && !z->avail_out)));
 
-			if (kws->init_callback) kws->init_callback(kws, kws->ssl);
+		if (r != Z_OK && r != Z_BUF_ERROR) {
+			goto fail;
 		}
+	}
 
-		/* Provide the server name, allowing SNI to work. */
-		SSL_set_tlsext_host_name(kws->ssl, kws->req_host);
+	if (out < 4 || memcmp(kws->deflate_buf + out - 4, ws_deflate_tail, 4)) {
+		goto fail;
+	}
 
-		do {
-			ERR_clear_error();
-			code = SSL_connect(kws->ssl);
+	out -= 4;
 
-			if (code == 1) {
-				kws->secure_established = 1;
-				break;
-			}
+	kws->stats.deflate_in += bytes;
+	kws->stats.deflate_out += out;
 
-			if (code == 0) {
-				return -1;
-			}
+	if (kws->deflate_reset) {
+		ws_zctx_put(&kws->zdef);
+	}
 
-			if (code < 0) {
-				int ssl_err = SSL_get_error(kws->ssl, code);
-				if (code < 0 && !SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
-					ks_log(KS_LOG_ERROR, "Failed to negotiate ssl connection with ssl error code: %d (%s)\n", ssl_err, ERR_error_string(ssl_err, NULL));
-					ERR_print_errors_cb(__log_ssl_errors, NULL);
-					return -1;
-				}
-			}
+	return out;
 
-			if (kws->block) {
-				ks_sleep_ms(10);
-			} else {
-				ks_sleep_ms(1);
-			}
+ fail:
 
-			kws->sanity--;
+	ks_log(KS_LOG_ERROR, "WS deflate failed (%d)\n", r);
+	ws_zctx_drop(&kws->zdef);
 
-			if (!kws->block) {
-				return -2;
-			}
+	return -1;
+}
 
-		} while (kws->sanity > 0);
+/* Inflates len bytes (plus the tail when last) into inflate_buf at out, NULL terminated. Returns the new length or -1 */
+static ks_ssize_t ws_inflate_into(kws_t *kws, ks_size_t out, const uint8_t *data, ks_size_t len, int last)
+{
+	z_stream *z;
+	int i, r = Z_OK;
 
-		if (!kws->sanity) {
-			return -1;
-		}
+	if (!kws->zinf && !(kws->zinf = ws_zctx_get(1, kws->inflate_bits, 0))) {
+		return -1;
 	}
 
-	while (!kws->down && !kws->handshake) {
-		int r = ws_client_handshake(kws);
+	z = &kws->zinf->z;
 
-		if (r < 0) {
-			kws->down = 1;
-			return -1;
-		}
+	for (i = 0; i < (last ? 2 : 1) && r != Z_STREAM_END; i++) {
+		z->next_in = (Bytef *)(i ? ws_deflate_tail : data);
+		z->avail_in = (uInt)(i ? sizeof(ws_deflate_tail) : len);
 
-		if (!kws->handshake && !kws->block) {
-			return -2;
-		}
+		do {
+			if (ws_reserve(kws, &kws->inflate_buf, &kws->inflate_buf_size, out + 1024 + z->avail_in * 2) != KS_STATUS_SUCCESS) {
+				goto fail;
+			}
 
-	}
+			z->next_out = kws->inflate_buf + out;
+			z->avail_out = (uInt)(kws->inflate_buf_size - out);
+			r = inflate(z, Z_SYNC_FLUSH);
+			out = kws->inflate_buf_size - z->avail_out;
 
-	kws->logical_established = 1;
-	if (kws->ssl) {
-		strncpy(kws->cipher_name, SSL_get_cipher_name(kws->ssl), sizeof(kws->cipher_name) - 1);
-		ks_log(KS_LOG_INFO, "SSL negotiation succeeded, negotiated cipher is: %s\n", kws->cipher_name);
-
-		if (ks_json_get_object_bool(kws->params, "ssl_validate_certificate", KS_FALSE)) {
-			X509 *cert = SSL_get_peer_certificate(kws->ssl);
+			if (kws->payload_size_max && (ks_ssize_t)out >= kws->payload_size_max) {
+				ks_log(KS_LOG_ERROR, "Read frame error because: inflated payload length is too big\n");
+				goto fail;
+			}
+		} while (r == Z_OK && (z->avail_in || !z->avail_out));
 
-			if (!cert) {
-				ks_log(KS_LOG_ERROR, "SSL negotiation failed, no certificate\n");
+		if (r != Z_OK && r != Z_BUF_ERROR && r != Z_STREAM_END) {
+			ks_log(KS_LOG_ERROR, "WS inflate failed (%d)\n", r);
+			goto fail;
+		}
+	}
 
-				return -1;
-			}
+	/* A final block from the peer ends its stream, the next message starts a fresh one */
+	if (r == Z_STREAM_END) {
+		inflateReset(z);
+	}
 
-			if (SSL_get_verify_result(kws->ssl) != X509_V_OK) {
-				ks_log(KS_LOG_ERROR, "SSL negotiation failed, invalid certificate\n");
-				X509_free(cert);
+	kws->inflate_buf[out] = '\0';
+	kws->stats.inflate_in += len;
 
-				return -1;
-			}
+	return out;
 
-			X509_free(cert);
-		}
+ fail:
 
-	} else {
-		memset(kws->cipher_name, 0, sizeof(kws->cipher_name));
-	}
+	ws_zctx_drop(&kws->zinf);
 
-	return 0;
+	return -1;
 }
 
-KS_DECLARE(ks_status_t) kws_get_cipher_name(kws_t *kws, char *name, ks_size_t name_len)
+/* The whole of a compressed message, inflated into inflate_buf */
+static ks_ssize_t ws_inflate_message(kws_t *kws, const uint8_t *data, ks_size_t len)
 {
-	if (kws->ssl) {
-		strncpy(name, kws->cipher_name, name_len);
-		return KS_STATUS_SUCCESS;
+	ks_ssize_t out = ws_inflate_into(kws, 0, data, len, 1);
+
+	if (out >= 0) {
+		kws->stats.inflate_out += out;
+
+		if (kws->inflate_reset) {
+			ws_zctx_put(&kws->zinf);
+		}
 	}
-	else
-		return KS_STATUS_INVALID_ARGUMENT;
+
+	return out;
 }
 
-static int establish_server_logical_layer(kws_t *kws)
+/*
+ * kws_read_chunk's piece of a compressed message: at most one frame buffer of output from the
+ * input already handed to the inflater, with the tail fed in once the final frame is used up.
+ */
+static ks_ssize_t ws_inflate_piece(kws_t *kws, kws_chunk_t *chunk, uint8_t **data)
 {
+	z_stream *z;
+	ks_size_t cap = kws->buflen - 1, out;
+	int r;
 
-	if (!kws->sanity) {
+	if (!kws->zinf && !(kws->zinf = ws_zctx_get(1, kws->inflate_bits, 0))) {
 		return -1;
 	}
 
-	if (kws->logical_established) {
-		return 0;
+	z = &kws->zinf->z;
+
+	if (!z->avail_in && kws->stream_tail) {
+		z->next_in = (Bytef *)ws_deflate_tail;
+		z->avail_in = sizeof(ws_deflate_tail);
+		kws->stream_tail = 0;
 	}
 
-	if (kws->secure && !kws->secure_established) {
-		int code;
+	if (ws_reserve(kws, &kws->inflate_buf, &kws->inflate_buf_size, cap) != KS_STATUS_SUCCESS) {
+		return -1;
+	}
 
-		if (!kws->ssl) {
-			kws->ssl = SSL_new(kws->ssl_ctx);
-			if (!kws->ssl) {
-				unsigned long ssl_new_error = ERR_peek_error();
-				ks_log(KS_LOG_ERROR, "Failed to initiate SSL with error [%lu]\n", ssl_new_error);
-				return -1;
-			}
+	z->next_out = kws->inflate_buf;
+	z->avail_out = (uInt)cap;
+	r = inflate(z, Z_SYNC_FLUSH);
+	out = cap - z->avail_out;
+
+	if (r == Z_STREAM_END) {
+		inflateReset(z);
+		z->avail_in = 0;
+		kws->stream_tail = 0;
+	} else if (r != Z_OK && r != Z_BUF_ERROR) {
+		ks_log(KS_LOG_ERROR, "WS inflate failed (%d)\n", r);
+		ws_zctx_drop(&kws->zinf);
+		return -1;
+	}
 
-			SSL_set_fd(kws->ssl, (int)kws->sock);
+	kws->stream_out_full = !z->avail_out;
+	kws->inflate_buf[out] = '\0';
+	kws->stats.inflate_out += out;
+
+	if (kws->payload_size_max && (ks_ssize_t)(kws->stream_msg_len + out) >= kws->payload_size_max) {
+		ks_log(KS_LOG_ERROR, "Read chunk error because: inflated payload length is too big\n");
+		ws_zctx_drop(&kws->zinf);
+		return -1;
+	}
+
+	chunk->oc = kws->stream_oc;
+	chunk->offset = kws->stream_msg_len;
+	kws->stream_msg_len += out;
+
+	if (!kws->stream_left && kws->stream_fin && !z->avail_in && !kws->stream_tail && !kws->stream_out_full) {
+		chunk->last = KS_TRUE;
+		kws->stream_oc = 0;
+		kws->stream_deflated = 0;
+		kws->stats.frames_read++;
+
+		if (kws->inflate_reset) {
+			ws_zctx_put(&kws->zinf);
 		}
+	}
 
-		do {
-			ERR_clear_error();
-			code = SSL_accept(kws->ssl);
+	*data = kws->inflate_buf;
 
-			if (code == 1) {
-				kws->secure_established = 1;
-				break;
-			}
+	return out;
+}
 
-			if (code == 0) {
-				return -1;
-			}
+/* More of the current compressed message can come out without reading */
+static int ws_inflate_pending(kws_t *kws)
+{
+	return kws->stream_deflated && (kws->stream_tail || kws->stream_out_full || (kws->zinf && kws->zinf->z.avail_in));
+}
 
-			if (code < 0) {
-				int ssl_err = SSL_get_error(kws->ssl, code);
-				if (code < 0 && !SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
-					ks_log(KS_LOG_ERROR, "Failed to negotiate ssl connection with ssl error code: %d (%s)\n", ssl_err, ERR_error_string(ssl_err, NULL));
-					ERR_print_errors_cb(__log_ssl_errors, NULL);
-					return -1;
+/* Hands freshly read compressed bytes to the inflater */
+static void ws_inflate_feed(kws_t *kws, uint8_t *data, ks_size_t len)
+{
+	if (!kws->zinf && !(kws->zinf = ws_zctx_get(1, kws->inflate_bits, 0))) {
+		return;
+	}
+
+	kws->zinf->z.next_in = data;
+	kws->zinf->z.avail_in = (uInt)len;
+	kws->stats.inflate_in += len;
+}
+#else
+struct kws_zctx_s {
+	int unused;
+};
+
+KS_DECLARE(void) kws_deflate_shutdown(void)
+{
+}
+
+#define ws_zctx_put(ctxP) (void)(ctxP)
+#define ws_deflate_message(kws, iov, iovcnt, bytes) (-1)
+#define ws_inflate_message(kws, data, len) (-1)
+#define ws_inflate_piece(kws, chunk, data) (-1)
+#define ws_inflate_pending(kws) 0
+#define ws_inflate_feed(kws, data, len)
+#endif
+
+KS_DECLARE(ks_bool_t) kws_deflate_enabled(kws_t *kws)
+{
+	return kws->deflate ? KS_TRUE : KS_FALSE;
+}
+
+KS_DECLARE(void) kws_get_ktls(kws_t *kws, ks_bool_t *tx, ks_bool_t *rx)
+{
+	ks_ssl_get_ktls(kws->secure && kws->secure_established ? kws->ssl : NULL, tx, rx);
+}
+
+static int ws_client_handshake(kws_t *kws)
+{
+	unsigned char nonce[16] = { 0 };
+	unsigned char enonce[128] = { 0 };
+	char *req = NULL;
+	char *extra_headers = NULL;
+	char ext[256];
+	const char *accept;
+	ks_ssize_t bytes;
+	int r;
+
+	gen_nonce(nonce, sizeof(nonce));
+	ws_deflate_offer(kws, ext, sizeof(ext));
+	b64encode(nonce, sizeof(nonce), enonce, sizeof(enonce));
+
+	if (kws->params) {
+		ks_json_t *headers = ks_json_get_object_item(kws->params, "headers");
+
+		if (headers) {
+			ks_json_t *param;
+
+			KS_JSON_ARRAY_FOREACH(param, headers) {
+				const char *k = ks_json_get_object_string(param, "key", NULL);
+				const char *v = ks_json_get_object_string(param, "value", NULL);
+
+				if (k && v) {
+					if (extra_headers) {
+						char *tmp = extra_headers;
+						extra_headers = ks_mprintf("%s%s: %s\r\n", tmp, k, v);
+						ks_safe_free(tmp);
+					} else {
+						extra_headers = ks_mprintf("%s: %s\r\n", k, v);
+					}
 				}
 			}
+		}
+	}
 
-			if (kws->block) {
-				ks_sleep_ms(10);
-			} else {
-				ks_sleep_ms(1);
-			}
+	req = ks_mprintf("GET %s HTTP/1.1\r\n"
+				"Host: %s\r\n"
+				"Upgrade: websocket\r\n"
+				"Connection: Upgrade\r\n"
+				"Sec-WebSocket-Key: %s\r\n"
+				"Sec-WebSocket-Version: 13\r\n"
+				"%s%s%s%s%s"
+				"\r\n",
+				kws->req_uri, kws->req_host, enonce,
+				kws->req_proto ? "Sec-WebSocket-Protocol: " : "",
+				kws->req_proto ? kws->req_proto : "",
+				kws->req_proto ? "\r\n" : "",
+				ext,
+				extra_headers ? extra_headers : "");
 
-			kws->sanity--;
+	if (extra_headers) free(extra_headers);
 
-			if (!kws->block) {
-				return -2;
-			}
+	kws_raw_write(kws, req, strlen(req));
 
-		} while (kws->sanity > 0);
+	ks_safe_free(req);
 
-		if (!kws->sanity) {
+	kws_http_init(&kws->http);
+	kws->datalen = 0;
+
+	do {
+		if ((bytes = kws_string_read(kws, kws->buffer + kws->datalen, kws->buflen - kws->datalen, WS_BLOCK)) <= 0) {
 			return -1;
 		}
 
-	}
+		kws->datalen += bytes;
+	} while (!(r = kws_http_parse(&kws->http, kws->buffer, kws->datalen)));
 
-	while (!kws->down && !kws->handshake) {
-		int r = ws_server_handshake(kws);
+	if (r < 0 || strcmp(kws->buffer + kws->http.start[1].off, "101")) {
+		return -1;
+	}
 
-		if (r < 0) {
-			kws->down = 1;
-			return -1;
-		}
+	accept = kws_http_get_known(&kws->http, kws->buffer, KWS_HTTP_SEC_WEBSOCKET_ACCEPT);
 
-		if (!kws->handshake && !kws->block) {
-			return -2;
-		}
+	if (!accept || !*accept || !verify_accept(kws, enonce, (char *)accept)) {
+		return -1;
+	}
 
+	if (ws_deflate_accept(kws) < 0) {
+		return -1;
 	}
 
-	kws->logical_established = 1;
-	if (kws->ssl) {
-		ks_log(KS_LOG_INFO, "SSL negotiation succeeded, negotiated cipher is: %s\n", SSL_get_cipher_name(kws->ssl));
+	/* Frames the server sent right behind its response */
+	if (kws->http.header_len < (ks_size_t)kws->datalen) {
+		kws->unprocessed_buffer_len = kws->datalen - kws->http.header_len;
+		kws->unprocessed_position = kws->buffer + kws->http.header_len;
 	}
 
+	kws->handshake = 1;
+
 	return 0;
 }
 
-static int establish_logical_layer(kws_t *kws)
+static int ws_server_respond(kws_t *kws, ks_ssize_t bytes);
+
+static int ws_server_handshake(kws_t *kws)
 {
-	if (kws->type == KWS_CLIENT) {
-		return establish_client_logical_layer(kws);
-	} else {
-		return establish_server_logical_layer(kws);
+	ks_ssize_t bytes;
+	int r;
+
+	if (kws->sock == KS_SOCK_INVALID) {
+		return -3;
 	}
-}
 
-KS_DECLARE(ks_status_t) kws_init_ex(kws_t **kwsP, ks_socket_t sock, SSL_CTX *ssl_ctx, const char *client_data, kws_flag_t flags, ks_pool_t *pool, ks_json_t *params)
-{
-	kws_t *kws;
+	kws_http_init(&kws->http);
 
-	if (*kwsP) kws = *kwsP;
-	else kws = ks_pool_alloc(pool, sizeof(*kws));
+	while((bytes = kws_string_read(kws, kws->buffer + kws->datalen, kws->buflen - kws->datalen, WS_BLOCK)) > 0) {
+		kws->datalen += bytes;
+		if (kws_http_parse(&kws->http, kws->buffer, kws->datalen)) {
+			break;
+		}
+	}
 
-	kws->flags = flags;
-	kws->unprocessed_buffer_len = 0;
-	kws->unprocessed_position = NULL;
-	kws->params = ks_json_duplicate(params, KS_TRUE);
-	kws->payload_size_max = ks_json_get_object_number_int(params, "payload_size_max", 0);
+	r = ws_server_respond(kws, bytes);
 
-	if ((flags & KWS_BLOCK)) {
-		kws->block = WS_BLOCK;
+	/* Frames sent right behind the request, unless it stays with kws_parse_header as plain HTTP */
+	if (!r && kws->handshake && !(kws->flags & KWS_HTTP) && kws->http.header_len < (ks_size_t)kws->datalen) {
+		kws->unprocessed_buffer_len = kws->datalen - kws->http.header_len;
+		kws->unprocessed_position = kws->buffer + kws->http.header_len;
 	}
 
-	if (client_data) {
-		char *p = NULL;
-		kws->req_uri = ks_pstrdup(pool, client_data);
+	return r;
+}
 
-		if ((p = strchr(kws->req_uri, ':'))) {
-			*p++ = '\0';
-			kws->req_host = p;
-			if ((p = strchr(kws->req_host, ':'))) {
-				*p++ = '\0';
-				kws->req_proto = p;
-			}
-		}
+/* Answers the upgrade request parsed into kws->http, bytes is the result of the last read */
+static int ws_server_respond(kws_t *kws, ks_ssize_t bytes)
+{
+	const char *key, *proto, *uri;
+	char proto_buf[384] = "";
+	char ext_buf[256] = "";
+	char input[512] = "";
+	unsigned char output[SHA1_HASH_SIZE] = "";
+	char b64[256] = "";
+	char respond[1024] = "";
 
-		kws->type = KWS_CLIENT;
-	} else {
-		kws->type = KWS_SERVER;
-		kws->flags |= KWS_FLAG_DONTMASK;
+	if (bytes < 0 || ((ks_size_t)bytes) > kws->buflen - 1) {
+		goto err;
 	}
 
-	kws->sock = sock;
-	kws->sanity = WS_INIT_SANITY;
-	kws->ssl_ctx = ssl_ctx;
+	*(kws->buffer + kws->datalen) = '\0';
 
-	kws->buflen = 1024 * 64;
-	kws->bbuflen = kws->buflen;
+	if (kws_http_parse(&kws->http, kws->buffer, kws->datalen) != 1 || strcasecmp(kws->buffer + kws->http.start[0].off, "GET")) {
+		goto err;
+	}
 
-	kws->buffer = ks_pool_alloc(pool, (unsigned long)kws->buflen);
-	kws->bbuffer = ks_pool_alloc(pool, (unsigned long)kws->bbuflen);
-	//printf("init %p %ld\n", (void *) kws->bbuffer, kws->bbuflen);
-	//memset(kws->buffer, 0, kws->buflen);
-	//memset(kws->bbuffer, 0, kws->bbuflen);
+	uri = kws->buffer + kws->http.start[1].off;
+	kws->uri = ks_pstrdup(ks_pool_get(kws), uri);
 
-	kws->secure = ssl_ctx ? 1 : 0;
+	key = kws_http_get_known(&kws->http, kws->buffer, KWS_HTTP_SEC_WEBSOCKET_KEY);
+	proto = kws_http_get_known(&kws->http, kws->buffer, KWS_HTTP_SEC_WEBSOCKET_PROTOCOL);
 
-	ks_socket_common_setup(sock);
+	if (!key || !*key) {
+		goto err;
+	}
 
-	{
-		/* Optional bound on the TLS + WS-upgrade handshake. The socket is
-		 * blocking by default, so without this a stalled upgrade (peer
-		 * completes the TCP+TLS but never returns the HTTP 101) hangs here
-		 * forever -- kws_connect's timeout only covers the TCP connect, not
-		 * the handshake reads. When the caller passes "ws_handshake_timeout_ms"
-		 * in params we drive the same resumable handshake state machine that
-		 * kws_read_frame re-drives, but non-blocking against a wall-clock
-		 * deadline, then restore blocking semantics for steady-state reads.
-		 * Absent / 0 = unchanged blocking behavior. */
-		uint32_t hs_timeout_ms = (uint32_t)ks_json_get_object_number_int(params, "ws_handshake_timeout_ms", 0);
-		int ll;
-
-		if (hs_timeout_ms > 0) {
-			int saved_block = kws->block;
-			ks_time_t deadline = ks_time_now() + ((ks_time_t)hs_timeout_ms * KS_USEC_PER_MSEC);
-
-			ks_socket_option(kws->sock, KS_SO_NONBLOCK, KS_TRUE);
-			kws->block = 0;
-
-			while ((ll = establish_logical_layer(kws)) == -2) {
-				ks_time_t now = ks_time_now();
-				int64_t remaining_ms;
-
-				if (now >= deadline) {
-					ks_log(KS_LOG_ERROR, "WS handshake timed out after %u ms\n", hs_timeout_ms);
-					ll = -1;
-					break;
-				}
-
-				remaining_ms = (deadline - now) / KS_USEC_PER_MSEC;
-				if (remaining_ms <= 0) remaining_ms = 1;
-				if (remaining_ms > 100) remaining_ms = 100;
-
-				kws_wait_sock(kws, (uint32_t)remaining_ms, KS_POLL_READ | KS_POLL_WRITE);
-			}
-
-			kws->block = saved_block;
-			ks_socket_option(kws->sock, KS_SO_NONBLOCK, KS_FALSE);
-		} else {
-			ll = establish_logical_layer(kws);
-		}
-
-		if (ll == -1) {
-			ks_log(KS_LOG_ERROR, "Failed to establish logical layer\n");
-			goto err;
-		}
-	}
+	snprintf(input, sizeof(input), "%s%s", key, WEBSOCKET_GUID);
+	sha1_digest(output, input);
+	b64encode((unsigned char *)output, SHA1_HASH_SIZE, (unsigned char *)b64, sizeof(b64));
 
-	if (kws->down) {
-		ks_log(KS_LOG_ERROR, "Link down\n");
-		goto err;
+	if (proto && *proto) {
+		snprintf(proto_buf, sizeof(proto_buf), "Sec-WebSocket-Protocol: %s\r\n", proto);
 	}
 
-	if (kws->type == KWS_SERVER)
-	{
-		X509 *cert = SSL_get_peer_certificate(kws->ssl);
-
-		if (cert && SSL_get_verify_result(kws->ssl) == X509_V_OK) {
-			GENERAL_NAMES *sans = X509_get_ext_d2i(cert, NID_subject_alt_name, NULL, NULL);
-
-			kws->certified_client = KS_TRUE;
-			if (sans) {
-				kws->sans_count = (ks_size_t)sk_GENERAL_NAME_num(sans);
-				if (kws->sans_count) kws->sans = ks_pool_calloc(pool, kws->sans_count, sizeof(char *));
-				for (ks_size_t i = 0; i < kws->sans_count; i++) {
-					const GENERAL_NAME *gname = sk_GENERAL_NAME_value(sans, (int)i);
-#if OPENSSL_VERSION_NUMBER >= 0x10100000
-					const unsigned char *name = ASN1_STRING_get0_data((const ASN1_STRING *)gname->d.dNSName);
-#else
-					char *name = (char *)ASN1_STRING_data(gname->d.dNSName);
-#endif
-					kws->sans[i] = ks_pstrdup(pool, (char *)name);
+	ws_deflate_answer(kws, ext_buf, sizeof(ext_buf));
 
-				}
-				sk_GENERAL_NAME_pop_free(sans, GENERAL_NAME_free);
-			}
-		}
+	snprintf(respond, sizeof(respond),
+			 "HTTP/1.1 101 Switching Protocols\r\n"
+			 "Upgrade: websocket\r\n"
+			 "Connection: Upgrade\r\n"
+			 "Sec-WebSocket-Accept: %s\r\n"
+			 "%s%s\r\n",
+			 b64,
+			 proto_buf,
+			 ext_buf);
 
-		if (cert) X509_free(cert);
+	if (kws_raw_write(kws, respond, strlen(respond)) != (ks_ssize_t)strlen(respond)) {
+		goto err;
 	}
 
-	*kwsP = kws;
+	kws->handshake = 1;
+	kws->flags &= ~KWS_HTTP;
 
-	return KS_STATUS_SUCCESS;
+	return 0;
 
  err:
-	kws_destroy(&kws);
-	*kwsP = NULL;
 
-	return KS_STATUS_FAIL;
-}
+	if (!(kws->flags & KWS_STAY_OPEN)) {
 
-KS_DECLARE(void) kws_set_init_callback(kws_t *kws, kws_init_callback_t callback)
-{
-	ks_assert(kws);
+		if (bytes > 0) {
+			snprintf(respond, sizeof(respond), "HTTP/1.1 400 Bad Request\r\n"
+					 "Sec-WebSocket-Version: 13\r\n\r\n");
+			respond[511] = 0;
 
-	kws->init_callback = callback;
-}
+			kws_raw_write(kws, respond, strlen(respond));
+		}
 
-KS_DECLARE(ks_status_t) kws_create(kws_t **kwsP, ks_pool_t *pool)
-{
-	kws_t *kws;
+		kws_close(kws, WS_NONE);
+	} else if (kws->flags & KWS_HTTP) {
+		kws->handshake = 1;
+		return 0;
+	}
 
-	kws = ks_pool_alloc(pool, sizeof(*kws));
-	*kwsP = kws;
+	return -1;
 
-	return KS_STATUS_SUCCESS;
 }
 
-KS_DECLARE(void) kws_destroy(kws_t **kwsP)
-{
-	kws_t *kws;
-	ks_assert(kwsP);
+#define SSL_IO_ERROR(err) (err == SSL_ERROR_SYSCALL || err == SSL_ERROR_SSL)
+#define SSL_ERROR_WANT_READ_WRITE(err) (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
 
-	if (!(kws = *kwsP)) {
-		return;
+static ks_ssize_t kws_read_unprocessed(kws_t *kws, void *data, ks_size_t bytes)
+{
+	if (kws->unprocessed_buffer_len > bytes) {
+		memmove((char *)data, kws->unprocessed_position, bytes);
+		kws->unprocessed_position += bytes;
+		kws->unprocessed_buffer_len -= bytes;
+		return bytes;
+	} else {
+		ssize_t len = kws->unprocessed_buffer_len;
+		memmove((char *)data, kws->unprocessed_position, len);
+		kws->unprocessed_buffer_len = 0;
+		kws->unprocessed_position = NULL;
+		if (len < (ssize_t)bytes) {
+			*((char *)data + len) = '\0';
+		}
+		return len;
 	}
+}
 
-	*kwsP = NULL;
+static ks_ssize_t kws_raw_recv(kws_t *kws, void *data, ks_size_t bytes, int block);
 
-	if (!kws->down) {
-		kws_close(kws, WS_NONE);
-	}
+KS_DECLARE(ks_ssize_t) kws_raw_read(kws_t *kws, void *data, ks_size_t bytes, int block)
+{
+	ks_ssize_t r;
 
-	if (kws->down > 1) {
-		return;
+	if (kws->unprocessed_buffer_len > 0) {
+		return kws_read_unprocessed(kws, data, bytes);
 	}
 
-	kws->down = 2;
+	/*
+	 * Once framing starts, pull whatever is waiting in one large read and serve the small header and
+	 * payload reads of following frames out of it. Reads at least as big as the buffer go straight through.
+	 */
+	if (kws->handshake && bytes < WS_READ_AHEAD && !(kws->flags & KWS_FLAG_NO_READ_AHEAD)) {
+		if (!kws->read_ahead) {
+			kws->read_ahead = ks_pool_alloc_nz(ks_pool_get(kws), WS_READ_AHEAD + 1);
+		}
 
-	if (kws->write_buffer) {
-		ks_pool_free(&kws->write_buffer);
-		kws->write_buffer = NULL;
-		kws->write_buffer_len = 0;
-	}
+		if ((r = kws_raw_recv(kws, kws->read_ahead, WS_READ_AHEAD, block)) <= 0) {
+			return r;
+		}
 
-	if (kws->ssl) {
-		SSL_free(kws->ssl);
-		kws->ssl = NULL;
-	}
+		kws->unprocessed_position = kws->read_ahead;
+		kws->unprocessed_buffer_len = r;
 
-	if (kws->destroy_ssl_ctx && kws->ssl_ctx) {
-		SSL_CTX_free(kws->ssl_ctx);
+		return kws_read_unprocessed(kws, data, bytes);
 	}
 
-	if (kws->buffer) ks_pool_free(&kws->buffer);
-	if (kws->bbuffer) ks_pool_free(&kws->bbuffer);
-
-	kws->buffer = kws->bbuffer = NULL;
-	if (kws->params) ks_json_delete(&kws->params);
-
-	ks_pool_free(&kws);
-	kws = NULL;
+	return kws_raw_recv(kws, data, bytes, block);
 }
 
-KS_DECLARE(ks_ssize_t) kws_close(kws_t *kws, int16_t reason)
+/* Waits until the socket is ready for flags or the deadline passes. 0 once it has, -1 on error */
+static int ws_wait_ready(kws_t *kws, ks_poll_t flags, ks_time_t deadline)
 {
+	ks_time_t now = ks_time_now();
 
-	if (kws->down) {
+	if (now >= deadline) {
+		return 0;
+	}
+
+	/* Errors and hangups wake us too, the retry is what reports them */
+	if (ks_wait_sock(kws->sock, (uint32_t)((deadline - now + 999) / 1000), flags | KS_POLL_ERROR) < 0 && !ks_errno_is_interupt(ks_errno())) {
 		return -1;
 	}
 
-	kws->down = 1;
+	return 1;
+}
 
-	if (kws->uri) {
-		ks_pool_free(&kws->uri);
-		kws->uri = NULL;
-	}
+static ks_ssize_t kws_raw_recv(kws_t *kws, void *data, ks_size_t bytes, int block)
+{
+	int r;
+	int ssl_err = 0;
+	ks_poll_t want = KS_POLL_READ;
+	ks_time_t deadline = block ? ks_time_now() + (ks_time_t)block * 1000 : 0;
 
-	if (kws->handshake && kws->sock != KS_SOCK_INVALID) {
-		uint16_t *u16;
-		int16_t got_reason = reason ? reason : WS_NORMAL_CLOSE /* regular close initiated by us */;
+	for (;;) {
+		if (kws->ssl) {
+			ERR_clear_error();
+			kws->stats.read_calls++;
+			r = SSL_read(kws->ssl, data, (int)bytes);
+			if (r == 0) {
+				ssl_err = SSL_get_error(kws->ssl, r);
+				if (ssl_err != SSL_ERROR_ZERO_RETURN) {
+					ks_log(KS_LOG_WARNING, "Weird SSL_read error: %d\n", ssl_err);
+					if (SSL_IO_ERROR(ssl_err)) {
+						kws->ssl_io_error = 1;
+					}
+				}
+			}
 
-		if (kws->type == KWS_CLIENT) {
-			const uint8_t maskb = 0x80;
-			uint8_t size = 0x02, fr[8] = {WSOC_CLOSE | 0x80, size | maskb, 0, 0, 0, 0, 0, 0}, masking_key[4], i;
-			uint8_t *p;
+			if (r < 0) {
+				ssl_err = SSL_get_error(kws->ssl, r);
 
-			u16 = (uint16_t *) &fr[6];
-			*u16 = htons((int16_t)got_reason); 
-			p = (uint8_t *)u16; /*use p for masking the reason which is the payload */
+				if (!SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+					if (SSL_IO_ERROR(ssl_err)) {
+						kws->ssl_io_error = 1;
+					}
 
-			gen_nonce(masking_key, 4);
-			memcpy((uint8_t *)fr + 2, &masking_key, 4);
+					r = -1;
+					goto end;
+				}
 
-			for (i = 0; i < size; i++) {
-				*(p + i) = (*((uint8_t *)p + i)) ^ (*(masking_key + (i % 4)));
+				/* A renegotiation can leave the read waiting on the socket being writable */
+				want = ssl_err == SSL_ERROR_WANT_WRITE ? KS_POLL_WRITE : KS_POLL_READ;
 			}
-
-			kws_raw_write(kws, fr, 8);
 		} else {
-			uint8_t fr[4] = {WSOC_CLOSE | 0x80, 2, 0};
+			kws->stats.read_calls++;
+			r = recv(kws->sock, data, (int)bytes, 0);
 
-			u16 = (uint16_t *) &fr[2];
-			*u16 = htons((int16_t)got_reason);
-			kws_raw_write(kws, fr, 4);
+			if (r == -1 && !ks_errno_is_blocking(ks_errno())) {
+				goto end;
+			}
 		}
-	}
-
-	if (kws->ssl && kws->sock != KS_SOCK_INVALID) {
-		/* first invocation of SSL_shutdown() would normally return 0 and just try to send SSL protocol close request (close_notify_alert).
-		   we just slightly polite, since we want to close socket fast and
-		   not bother waiting for SSL protocol close response before closing socket,
-		   since we want cleanup to be done fast for scenarios like:
-		   client change NAT (like jump from one WiFi to another) and now unreachable from old ip:port, however
-		   immidiately reconnect with new ip:port but old session id (and thus should replace the old session/channel)
-		   However it is recommended to do bidirectional shutdown
-		   and also to read all the remaining data sent by the client
-		   before it indicates EOF (SSL_ERROR_ZERO_RETURN).
-		   To avoid stuck in this process in case of dead peers,
-		   we wait for WS_SOFT_BLOCK time (1s) before we give up.
-		*/
-		int code = 0, rcode = 0;
-		int ssl_error = 0;
-		int n = 0, block_n = WS_SOFT_BLOCK / 10;
 
-		/* SSL layer was never established or underlying IO error occured */
-		if (!kws->secure_established || kws->ssl_io_error) {
+		if (r >= 0) {
 			goto end;
 		}
 
-		/* connection has been already closed */
-		if (SSL_get_shutdown(kws->ssl) & SSL_SENT_SHUTDOWN) {
+		if (!block) {
+			r = -2;
 			goto end;
 		}
 
-		/* peer closes the connection */
-		if (SSL_get_shutdown(kws->ssl) & SSL_RECEIVED_SHUTDOWN) {
-			ERR_clear_error();
-			SSL_shutdown(kws->ssl);
+		/* Sleep in poll rather than guess, the whole of what's left of block is spent waiting for data */
+		if (ws_wait_ready(kws, want, deadline) <= 0) {
+			r = -1;
 			goto end;
 		}
+	}
 
-		/* us closes the connection. We do bidirection shutdown handshake */
-		for(;;) {
-			ERR_clear_error();
-			code = SSL_shutdown(kws->ssl);
-			ssl_error = SSL_get_error(kws->ssl, code);
-			if (code <= 0 && ssl_error == SSL_ERROR_WANT_READ) {
-				/* need to make sure there are no more data to read */
-				for(;;) {
-					ERR_clear_error();
-					if ((rcode = SSL_read(kws->ssl, kws->buffer, 9)) <= 0) {
-						ssl_error = SSL_get_error(kws->ssl, rcode);
-						if (ssl_error == SSL_ERROR_ZERO_RETURN) {
-							break;
-						} else if (SSL_IO_ERROR(ssl_error)) {
-							goto end;
-						} else if (ssl_error == SSL_ERROR_WANT_READ) {
-							if (++n == block_n) {
-								goto end;
-							}
+ end:
 
-							ks_sleep_ms(10);
-						} else {
-							goto end;
-						}
-					}
-				}
-			} else if (code == 0 || (code < 0 && ssl_error == SSL_ERROR_WANT_WRITE)) {
-				if (++n == block_n) {
-					goto end;
-				}
+	if (r > 0 && r < bytes) {
+		*((char *)data + r) = '\0';
+	}
 
-				ks_sleep_ms(10);
+	if (r > 0) {
+		kws->stats.bytes_read += r;
+	}
+
+	return r;
+}
+
+/*
+ * Blocking read until bytes have been received, failure, or too many retries.
+ */
+static ks_ssize_t kws_raw_read_blocking(kws_t *kws, char *data, ks_size_t max_bytes, int max_retries)
+{
+	ks_ssize_t total_bytes_read = 0;
+	int zero_reads = 0;
+	while (total_bytes_read < max_bytes && zero_reads < max_retries)
+	{
+		int bytes_read = kws_raw_read(kws, data + total_bytes_read, max_bytes - total_bytes_read, WS_BLOCK);
+		if (bytes_read == 0)
+		{
+			zero_reads++;
+			continue;
+		}
+		else if (bytes_read < 0)
+		{
+			break;
+		}
+		total_bytes_read += (ks_ssize_t)bytes_read;
+		zero_reads = 0;
+	}
+	return total_bytes_read;
+}
+
+/**
+ * Read from websocket and store as NULL terminated string. Up to buffer_size - 1 bytes will be read from websocket. Contents of str_buffer is NULL terminated if >0 bytes are read from the websocket.
+ */
+KS_DECLARE(ks_ssize_t) kws_string_read(kws_t *kws, char *str_buffer, ks_size_t buffer_size, int block)
+{
+	if (buffer_size < 1) {
+		return -1;
+	}
+	str_buffer[buffer_size - 1] = '\0';
+	if (buffer_size < 2) {
+		return 0;
+	}
+	return kws_raw_read(kws, str_buffer, buffer_size - 1, block);
+}
+
+/*
+ * Blocking read as from websocket and store as NULL terminated string until buffer_size - 1 have been received, failure, or too many retries. Contents of str_buffer is NULL terminated if >0 bytes are read from the websocket.
+ */
+static ks_ssize_t kws_string_read_blocking(kws_t *kws, char *str_buffer, ks_size_t buffer_size, int max_retries)
+{
+	if (buffer_size < 1) {
+		return -1;
+	}
+	str_buffer[buffer_size - 1] = '\0';
+	if (buffer_size < 2) {
+		return 0;
+	}
+	return kws_raw_read_blocking(kws, str_buffer, buffer_size - 1, max_retries);
+}
+
+static ks_ssize_t loop_write(kws_t *kws, const void *data, ks_size_t bytes);
+static int ws_cork_flush(kws_t *kws);
+static void ws_cork_release(kws_t *kws);
+static void ws_flusher_forget(kws_t *kws);
+
+KS_DECLARE(ks_ssize_t) kws_raw_write(kws_t *kws, void *data, ks_size_t bytes)
+{
+	int r;
+	int ssl_err = 0;
+	ks_size_t wrote = 0;
+	ks_time_t deadline;
+
+	if (kws->loop) {
+		return loop_write(kws, data, bytes);
+	}
+
+	deadline = ks_time_now() + (ks_time_t)(kws->block ? kws->block : WS_WRITE_NOBLOCK) * 1000;
+
+	if (kws->ssl) {
+		do {
+			ERR_clear_error();
+			r = SSL_write(kws->ssl, (void *)((unsigned char *)data + wrote), (int)(bytes - wrote));
+			kws->stats.write_calls++;
+
+			if (r == 0) {
+				ssl_err = SSL_get_error(kws->ssl, r);
+				if (SSL_IO_ERROR(ssl_err)) {
+					kws->ssl_io_error = 1;
+				}
+
+				ssl_err = 42;
+				break;
+			}
+
+			if (r > 0) {
+				wrote += r;
+				continue;
+			}
+
+			ssl_err = SSL_get_error(kws->ssl, r);
+
+			if (!SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+				if (SSL_IO_ERROR(ssl_err)) {
+					kws->ssl_io_error = 1;
+				}
+
+				break;
+			}
+
+			if (ws_wait_ready(kws, ssl_err == SSL_ERROR_WANT_READ ? KS_POLL_READ : KS_POLL_WRITE, deadline) <= 0) {
+				ssl_err = 56;
+				break;
+			}
+
+			ssl_err = 0;
+		} while (wrote < bytes);
+
+		if (ssl_err) {
+			r = ssl_err * -1;
+		}
+
+		return r > 0 ? wrote : r;
+	}
+
+	do {
+		r = send(kws->sock, (void *)((unsigned char *)data + wrote), (int)(bytes - wrote), 0);
+		kws->stats.write_calls++;
+
+		if (r > 0) {
+			wrote += r;
+			continue;
+		}
+
+		if (r == -1 && !ks_errno_is_blocking(ks_errno())) {
+			break;
+		}
+
+		/* The peer isn't keeping up, wait for room in the send buffer instead of sleeping on it */
+		if (ws_wait_ready(kws, KS_POLL_WRITE, deadline) <= 0) {
+			r = -1;
+			break;
+		}
+	} while (wrote < bytes);
+
+	return r >= 0 ? wrote : r;
+}
+
+static void restore_socket(ks_socket_t sock)
+{
+	ks_socket_option(sock, KS_SO_NONBLOCK, KS_FALSE);
+}
+
+static int __log_ssl_errors(const char *err, size_t len, void *u)
+{
+	ks_log(KS_LOG_ERROR, "  %s", err);	// ssl adds a \n
+	return 0;
+}
+
+/* One round of a blocking handshake waits on the socket for up to 10ms, a peer that answers sooner goes on sooner */
+static void ws_wait_handshake(kws_t *kws, int ssl_err)
+{
+	ws_wait_ready(kws, ssl_err == SSL_ERROR_WANT_WRITE ? KS_POLL_WRITE : KS_POLL_READ, ks_time_now() + 10000);
+}
+
+static int establish_client_logical_layer(kws_t *kws)
+{
+
+	if (!kws->sanity) {
+		return -1;
+	}
+
+	if (kws->logical_established) {
+		return 0;
+	}
+
+	if (kws->secure && !kws->secure_established) {
+		int code;
+
+		if (!kws->ssl) {
+			kws->ssl = SSL_new(kws->ssl_ctx);
+			if (!kws->ssl) {
+				unsigned long ssl_new_error = ERR_peek_error();
+				ks_log(KS_LOG_ERROR, "Failed to initiate SSL with error [%lu]\n", ssl_new_error);
+				return -1;
+			}
+
+			SSL_set_fd(kws->ssl, (int)kws->sock);
+			if (kws->flags & KWS_FLAG_KTLS) ks_ssl_request_ktls(kws->ssl);
+
+			if (kws->init_callback) kws->init_callback(kws, kws->ssl);
+		}
+
+		/* Provide the server name, allowing SNI to work. */
+		SSL_set_tlsext_host_name(kws->ssl, kws->req_host);
+
+		do {
+			ERR_clear_error();
+			code = SSL_connect(kws->ssl);
+
+			if (code == 1) {
+				kws->secure_established = 1;
+				break;
+			}
+
+			if (code == 0) {
+				return -1;
+			}
+
+			if (code < 0) {
+				int ssl_err = SSL_get_error(kws->ssl, code);
+				if (code < 0 && !SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+					ks_log(KS_LOG_ERROR, "Failed to negotiate ssl connection with ssl error code: %d (%s)\n", ssl_err, ERR_error_string(ssl_err, NULL));
+					ERR_print_errors_cb(__log_ssl_errors, NULL);
+					return -1;
+				}
+
+				if (kws->block) {
+					ws_wait_handshake(kws, ssl_err);
+				}
+			}
+
+			kws->sanity--;
+
+			if (!kws->block) {
+				return -2;
+			}
+
+		} while (kws->sanity > 0);
+
+		if (!kws->sanity) {
+			return -1;
+		}
+	}
+
+	while (!kws->down && !kws->handshake) {
+		int r = ws_client_handshake(kws);
+
+		if (r < 0) {
+			kws->down = 1;
+			return -1;
+		}
+
+		if (!kws->handshake && !kws->block) {
+			return -2;
+		}
+
+	}
+
+	kws->logical_established = 1;
+	if (kws->ssl) {
+		strncpy(kws->cipher_name, SSL_get_cipher_name(kws->ssl), sizeof(kws->cipher_name) - 1);
+		ks_log(KS_LOG_INFO, "SSL negotiation succeeded, negotiated cipher is: %s\n", kws->cipher_name);
+
+		if (ks_json_get_object_bool(kws->params, "ssl_validate_certificate", KS_FALSE)) {
+			X509 *cert = SSL_get_peer_certificate(kws->ssl);
+
+			if (!cert) {
+				ks_log(KS_LOG_ERROR, "SSL negotiation failed, no certificate\n");
+
+				return -1;
+			}
+
+			if (SSL_get_verify_result(kws->ssl) != X509_V_OK) {
+				ks_log(KS_LOG_ERROR, "SSL negotiation failed, invalid certificate\n");
+				X509_free(cert);
+
+				return -1;
+			}
+
+			X509_free(cert);
+		}
+
+	} else {
+		memset(kws->cipher_name, 0, sizeof(kws->cipher_name));
+	}
+
+	return 0;
+}
+
+KS_DECLARE(ks_status_t) kws_get_cipher_name(kws_t *kws, char *name, ks_size_t name_len)
+{
+	if (kws->ssl) {
+		strncpy(name, kws->cipher_name, name_len);
+		return KS_STATUS_SUCCESS;
+	}
+	else
+		return KS_STATUS_INVALID_ARGUMENT;
+}
+
+static int establish_server_logical_layer(kws_t *kws)
+{
+
+	if (!kws->sanity) {
+		return -1;
+	}
+
+	if (kws->logical_established) {
+		return 0;
+	}
+
+	if (kws->secure && !kws->secure_established) {
+		int code;
+
+		if (!kws->ssl) {
+			kws->ssl = SSL_new(kws->ssl_ctx);
+			if (!kws->ssl) {
+				unsigned long ssl_new_error = ERR_peek_error();
+				ks_log(KS_LOG_ERROR, "Failed to initiate SSL with error [%lu]\n", ssl_new_error);
+				return -1;
+			}
+
+			SSL_set_fd(kws->ssl, (int)kws->sock);
+			if (kws->flags & KWS_FLAG_KTLS) ks_ssl_request_ktls(kws->ssl);
+		}
+
+		do {
+			ERR_clear_error();
+			code = SSL_accept(kws->ssl);
+
+			if (code == 1) {
+				kws->secure_established = 1;
+				break;
+			}
+
+			if (code == 0) {
+				return -1;
+			}
+
+			if (code < 0) {
+				int ssl_err = SSL_get_error(kws->ssl, code);
+				if (code < 0 && !SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+					ks_log(KS_LOG_ERROR, "Failed to negotiate ssl connection with ssl error code: %d (%s)\n", ssl_err, ERR_error_string(ssl_err, NULL));
+					ERR_print_errors_cb(__log_ssl_errors, NULL);
+					return -1;
+				}
+
+				if (kws->block) {
+					ws_wait_handshake(kws, ssl_err);
+				}
+			}
+
+			kws->sanity--;
+
+			if (!kws->block) {
+				return -2;
+			}
+
+		} while (kws->sanity > 0);
+
+		if (!kws->sanity) {
+			return -1;
+		}
+
+	}
+
+	while (!kws->down && !kws->handshake) {
+		int r = ws_server_handshake(kws);
+
+		if (r < 0) {
+			kws->down = 1;
+			return -1;
+		}
+
+		if (!kws->handshake && !kws->block) {
+			return -2;
+		}
+
+	}
+
+	kws->logical_established = 1;
+	if (kws->ssl) {
+		ks_log(KS_LOG_INFO, "SSL negotiation succeeded, negotiated cipher is: %s\n", SSL_get_cipher_name(kws->ssl));
+	}
+
+	return 0;
+}
+
+static int establish_logical_layer(kws_t *kws)
+{
+	if (kws->type == KWS_CLIENT) {
+		return establish_client_logical_layer(kws);
+	} else {
+		return establish_server_logical_layer(kws);
+	}
+}
+
+/* Everything kws_init_ex does short of the handshake */
+static ks_status_t kws_setup(kws_t **kwsP, ks_socket_t sock, SSL_CTX *ssl_ctx, const char *client_data, kws_flag_t flags, ks_pool_t *pool, ks_json_t *params)
+{
+	kws_t *kws;
+
+	if (*kwsP) kws = *kwsP;
+	else if (!(kws = ks_pool_alloc(pool, sizeof(*kws)))) return KS_STATUS_ALLOC;
+
+	kws->flags = flags;
+	kws->unprocessed_buffer_len = 0;
+	kws->unprocessed_position = NULL;
+	kws->params = ks_json_duplicate(params, KS_TRUE);
+	kws->payload_size_max = ks_json_get_object_number_int(params, "payload_size_max", 0);
+	kws->coalesce_window = (ks_time_t)ks_json_get_object_number_int(params, "write_coalesce_ms", 0) * 1000;
+	kws->coalesce_bytes = ks_json_get_object_number_int(params, "write_coalesce_bytes", WS_READ_AHEAD);
+
+	if ((flags & KWS_BLOCK)) {
+		kws->block = WS_BLOCK;
+	}
+
+	if (client_data) {
+		char *p = NULL;
+		kws->req_uri = ks_pstrdup(pool, client_data);
+
+		if ((p = strchr(kws->req_uri, ':'))) {
+			*p++ = '\0';
+			kws->req_host = p;
+			if ((p = strchr(kws->req_host, ':'))) {
+				*p++ = '\0';
+				kws->req_proto = p;
+			}
+		}
+
+		kws->type = KWS_CLIENT;
+	} else {
+		kws->type = KWS_SERVER;
+		kws->flags |= KWS_FLAG_DONTMASK;
+	}
+
+	kws->sock = sock;
+	kws->sanity = WS_INIT_SANITY;
+	kws->ssl_ctx = ssl_ctx;
+
+	kws->buflen = 1024 * 64;
+	kws->bbuflen = kws->buflen;
+
+	kws->buffer = ks_pool_alloc(pool, (unsigned long)kws->buflen);
+	kws->bbuffer = ks_pool_alloc(pool, (unsigned long)kws->bbuflen);
+	//printf("init %p %ld\n", (void *) kws->bbuffer, kws->bbuflen);
+	//memset(kws->buffer, 0, kws->buflen);
+	//memset(kws->bbuffer, 0, kws->bbuflen);
+
+	kws->secure = ssl_ctx ? 1 : 0;
+
+	if (!kws->write_mutex && ks_mutex_create(&kws->write_mutex, KS_MUTEX_FLAG_DEFAULT, pool) != KS_STATUS_SUCCESS) {
+		return KS_STATUS_FAIL;
+	}
+
+	ks_socket_common_setup(sock);
+
+	*kwsP = kws;
+
+	return KS_STATUS_SUCCESS;
+}
+
+KS_DECLARE(ks_status_t) kws_init_ex(kws_t **kwsP, ks_socket_t sock, SSL_CTX *ssl_ctx, const char *client_data, kws_flag_t flags, ks_pool_t *pool, ks_json_t *params)
+{
+	kws_t *kws;
+	ks_status_t status;
+
+	if ((status = kws_setup(kwsP, sock, ssl_ctx, client_data, flags, pool, params)) != KS_STATUS_SUCCESS) {
+		return status;
+	}
+
+	kws = *kwsP;
+
+	{
+		/* Optional bound on the TLS + WS-upgrade handshake. The socket is
+		 * blocking by default, so without this a stalled upgrade (peer
+		 * completes the TCP+TLS but never returns the HTTP 101) hangs here
+		 * forever -- kws_connect's timeout only covers the TCP connect, not
+		 * the handshake reads. When the caller passes "ws_handshake_timeout_ms"
+		 * in params we drive the same resumable handshake state machine that
+		 * kws_read_frame re-drives, but non-blocking against a wall-clock
+		 * deadline, then restore blocking semantics for steady-state reads.
+		 * Absent / 0 = unchanged blocking behavior. */
+		uint32_t hs_timeout_ms = (uint32_t)ks_json_get_object_number_int(params, "ws_handshake_timeout_ms", 0);
+		int ll;
+
+		if (hs_timeout_ms > 0) {
+			int saved_block = kws->block;
+			ks_time_t deadline = ks_time_now() + ((ks_time_t)hs_timeout_ms * KS_USEC_PER_MSEC);
+
+			ks_socket_option(kws->sock, KS_SO_NONBLOCK, KS_TRUE);
+			kws->block = 0;
+
+			while ((ll = establish_logical_layer(kws)) == -2) {
+				ks_time_t now = ks_time_now();
+				int64_t remaining_ms;
+
+				if (now >= deadline) {
+					ks_log(KS_LOG_ERROR, "WS handshake timed out after %u ms\n", hs_timeout_ms);
+					ll = -1;
+					break;
+				}
+
+				remaining_ms = (deadline - now) / KS_USEC_PER_MSEC;
+				if (remaining_ms <= 0) remaining_ms = 1;
+				if (remaining_ms > 100) remaining_ms = 100;
+
+				kws_wait_sock(kws, (uint32_t)remaining_ms, KS_POLL_READ | KS_POLL_WRITE);
+			}
+
+			kws->block = saved_block;
+			ks_socket_option(kws->sock, KS_SO_NONBLOCK, KS_FALSE);
+		} else {
+			ll = establish_logical_layer(kws);
+		}
+
+		if (ll == -1) {
+			ks_log(KS_LOG_ERROR, "Failed to establish logical layer\n");
+			goto err;
+		}
+	}
+
+	if (kws->down) {
+		ks_log(KS_LOG_ERROR, "Link down\n");
+		goto err;
+	}
+
+	if (kws->type == KWS_SERVER)
+	{
+		X509 *cert = SSL_get_peer_certificate(kws->ssl);
+
+		if (cert && SSL_get_verify_result(kws->ssl) == X509_V_OK) {
+			GENERAL_NAMES *sans = X509_get_ext_d2i(cert, NID_subject_alt_name, NULL, NULL);
+
+			kws->certified_client = KS_TRUE;
+			if (sans) {
+				kws->sans_count = (ks_size_t)sk_GENERAL_NAME_num(sans);
+				if (kws->sans_count) kws->sans = ks_pool_calloc(pool, kws->sans_count, sizeof(char *));
+				for (ks_size_t i = 0; i < kws->sans_count; i++) {
+					const GENERAL_NAME *gname = sk_GENERAL_NAME_value(sans, (int)i);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+					const unsigned char *name = ASN1_STRING_get0_data((const ASN1_STRING *)gname->d.dNSName);
+#else
+					char *name = (char *)ASN1_STRING_data(gname->d.dNSName);
+#endif
+					kws->sans[i] = ks_pstrdup(pool, (char *)name);
+
+				}
+				sk_GENERAL_NAME_pop_free(sans, GENERAL_NAME_free);
+			}
+		}
+
+		if (cert) X509_free(cert);
+	}
+
+	*kwsP = kws;
+
+	return KS_STATUS_SUCCESS;
+
+ err:
+	kws_destroy(&kws);
+	*kwsP = NULL;
+
+	return KS_STATUS_FAIL;
+}
+
+KS_DECLARE(void) kws_set_init_callback(kws_t *kws, kws_init_callback_t callback)
+{
+	ks_assert(kws);
+
+	kws->init_callback = callback;
+}
+
+KS_DECLARE(ks_status_t) kws_create(kws_t **kwsP, ks_pool_t *pool)
+{
+	kws_t *kws;
+
+	kws = ks_pool_alloc(pool, sizeof(*kws));
+
+	if (ks_mutex_create(&kws->write_mutex, KS_MUTEX_FLAG_DEFAULT, pool) != KS_STATUS_SUCCESS) {
+		ks_pool_free(&kws);
+		return KS_STATUS_FAIL;
+	}
+
+	*kwsP = kws;
+
+	return KS_STATUS_SUCCESS;
+}
+
+KS_DECLARE(void) kws_destroy(kws_t **kwsP)
+{
+	kws_t *kws;
+	ks_assert(kwsP);
+
+	if (!(kws = *kwsP)) {
+		return;
+	}
+
+	*kwsP = NULL;
+
+	ws_flusher_forget(kws);
+
+	if (!kws->down) {
+		kws_close(kws, WS_NONE);
+	}
+
+	if (kws->down > 1) {
+		return;
+	}
+
+	kws->down = 2;
+
+	if (kws->write_buffer) {
+		ks_pool_free(&kws->write_buffer);
+		kws->write_buffer = NULL;
+		kws->write_buffer_len = 0;
+	}
+
+	if (kws->ssl) {
+		SSL_free(kws->ssl);
+		kws->ssl = NULL;
+	}
+
+	if (kws->destroy_ssl_ctx && kws->ssl_ctx) {
+		SSL_CTX_free(kws->ssl_ctx);
+	}
+
+	if (kws->buffer) ks_pool_free(&kws->buffer);
+	if (kws->bbuffer) ks_pool_free(&kws->bbuffer);
+	if (kws->read_ahead) ks_pool_free(&kws->read_ahead);
+	if (kws->in) ks_pool_free(&kws->in);
+	if (kws->out) ks_pool_free(&kws->out);
+	if (kws->deflate_buf) ks_pool_free(&kws->deflate_buf);
+	if (kws->inflate_buf) ks_pool_free(&kws->inflate_buf);
+	if (kws->cork_buf) ks_pool_free(&kws->cork_buf);
+
+	ws_zctx_put(&kws->zdef);
+	ws_zctx_put(&kws->zinf);
+
+	kws->buffer = kws->bbuffer = NULL;
+	if (kws->params) ks_json_delete(&kws->params);
+	if (kws->write_mutex) ks_mutex_destroy(&kws->write_mutex);
+
+	ks_pool_free(&kws);
+	kws = NULL;
+}
+
+/* The close frame, at most once per connection */
+static void ws_send_close(kws_t *kws, int16_t reason)
+{
+	uint16_t *u16;
+	int16_t got_reason = reason ? reason : WS_NORMAL_CLOSE /* regular close initiated by us */;
+
+	if (!kws->handshake || kws->sock == KS_SOCK_INVALID || kws->close_sent) {
+		return;
+	}
+
+	kws->close_sent = 1;
+
+	if (kws->type == KWS_CLIENT) {
+		const uint8_t maskb = 0x80;
+		uint8_t size = 0x02, fr[8] = {WSOC_CLOSE | 0x80, size | maskb, 0, 0, 0, 0, 0, 0}, masking_key[4];
+		uint8_t *p;
+
+		u16 = (uint16_t *) &fr[6];
+		*u16 = htons((int16_t)got_reason); 
+		p = (uint8_t *)u16; /*use p for masking the reason which is the payload */
+
+		gen_nonce(masking_key, 4);
+		memcpy((uint8_t *)fr + 2, &masking_key, 4);
+
+		kws_mask(p, p, size, masking_key, 0);
+
+		kws_raw_write(kws, fr, 8);
+	} else {
+		uint8_t fr[4] = {WSOC_CLOSE | 0x80, 2, 0};
+
+		u16 = (uint16_t *) &fr[2];
+		*u16 = htons((int16_t)got_reason);
+		kws_raw_write(kws, fr, 4);
+	}
+}
+
+static ks_ssize_t ws_close(kws_t *kws, int16_t reason)
+{
+
+	if (kws->down) {
+		return -1;
+	}
+
+	/* Anything still held back goes out ahead of the close */
+	if (kws->handshake && kws->sock != KS_SOCK_INVALID) {
+		ws_cork_flush(kws);
+	}
+
+	kws->down = 1;
+
+	if (kws->uri) {
+		ks_pool_free(&kws->uri);
+		kws->uri = NULL;
+	}
+
+	ws_send_close(kws, reason);
+
+	if (kws->ssl && kws->sock != KS_SOCK_INVALID) {
+		/* first invocation of SSL_shutdown() would normally return 0 and just try to send SSL protocol close request (close_notify_alert).
+		   we just slightly polite, since we want to close socket fast and
+		   not bother waiting for SSL protocol close response before closing socket,
+		   since we want cleanup to be done fast for scenarios like:
+		   client change NAT (like jump from one WiFi to another) and now unreachable from old ip:port, however
+		   immidiately reconnect with new ip:port but old session id (and thus should replace the old session/channel)
+		   However it is recommended to do bidirectional shutdown
+		   and also to read all the remaining data sent by the client
+		   before it indicates EOF (SSL_ERROR_ZERO_RETURN).
+		   To avoid stuck in this process in case of dead peers,
+		   we wait for WS_SOFT_BLOCK time (1s) before we give up.
+		*/
+		int code = 0, rcode = 0;
+		int ssl_error = 0;
+		ks_time_t deadline = ks_time_now() + (ks_time_t)WS_SOFT_BLOCK * 1000;
+
+		/* SSL layer was never established or underlying IO error occured */
+		if (!kws->secure_established || kws->ssl_io_error) {
+			goto end;
+		}
+
+		/* connection has been already closed */
+		if (SSL_get_shutdown(kws->ssl) & SSL_SENT_SHUTDOWN) {
+			goto end;
+		}
+
+		/* peer closes the connection */
+		if (SSL_get_shutdown(kws->ssl) & SSL_RECEIVED_SHUTDOWN) {
+			ERR_clear_error();
+			SSL_shutdown(kws->ssl);
+			goto end;
+		}
+
+		/* us closes the connection. We do bidirection shutdown handshake */
+		for(;;) {
+			ERR_clear_error();
+			code = SSL_shutdown(kws->ssl);
+			ssl_error = SSL_get_error(kws->ssl, code);
+			if (code <= 0 && ssl_error == SSL_ERROR_WANT_READ) {
+				/* need to make sure there are no more data to read */
+				for(;;) {
+					ERR_clear_error();
+					if ((rcode = SSL_read(kws->ssl, kws->buffer, 9)) <= 0) {
+						ssl_error = SSL_get_error(kws->ssl, rcode);
+						if (ssl_error == SSL_ERROR_ZERO_RETURN) {
+							break;
+						} else if (SSL_IO_ERROR(ssl_error)) {
+							goto end;
+						} else if (ssl_error == SSL_ERROR_WANT_READ) {
+							if (ws_wait_ready(kws, KS_POLL_READ, deadline) <= 0) {
+								goto end;
+							}
+						} else {
+							goto end;
+						}
+					}
+				}
+			} else if (code == 0 || (code < 0 && ssl_error == SSL_ERROR_WANT_WRITE)) {
+				if (ws_wait_ready(kws, code == 0 ? KS_POLL_READ : KS_POLL_WRITE, deadline) <= 0) {
+					goto end;
+				}
 			} else { /* code != 0 */
 				goto end;
 			}
 		}
 	}
 
- end:
-	/* restore to blocking here, so any further read/writes will block */
-	restore_socket(kws->sock);
+ end:
+	/* restore to blocking here, so any further read/writes will block */
+	restore_socket(kws->sock);
+
+	if ((kws->flags & KWS_CLOSE_SOCK) && kws->sock != KS_SOCK_INVALID) {
+		/* signal socket to shutdown() before close(): FIN-ACK-FIN-ACK insead of RST-RST
+		   do not really handle errors here since it all going to die anyway.
+		   all buffered writes if any(like SSL_shutdown() ones) will still be sent.
+		 */
+#ifndef WIN32
+		shutdown(kws->sock, SHUT_RDWR);
+		close(kws->sock);
+#else
+		shutdown(kws->sock, SD_BOTH);
+		closesocket(kws->sock);
+#endif
+	}
+
+	kws->sock = KS_SOCK_INVALID;
+
+	return reason * -1;
+
+}
+
+KS_DECLARE(ks_ssize_t) kws_close(kws_t *kws, int16_t reason)
+{
+	ks_ssize_t r;
+
+	/* Writers on other threads see down once they get the lock */
+	ks_mutex_lock(kws->write_mutex);
+	r = ws_close(kws, reason);
+	ks_mutex_unlock(kws->write_mutex);
+
+	return r;
+}
+
+#ifndef WIN32
+#if defined(HAVE_BYTESWAP_H)
+#include <byteswap.h>
+#elif defined(HAVE_SYS_ENDIAN_H)
+#include <sys/endian.h>
+#elif defined (__APPLE__)
+#include <libkern/OSByteOrder.h>
+#define bswap_16 OSSwapInt16
+#define bswap_32 OSSwapInt32
+#define bswap_64 OSSwapInt64
+#elif defined (__UCLIBC__)
+#else
+#ifndef bswap_16
+	#define bswap_16(value) ((((value) & 0xff) << 8) | ((value) >> 8))
+	#define bswap_32(value) (((uint32_t)bswap_16((uint16_t)((value) & 0xffff)) << 16) | (uint32_t)bswap_16((uint16_t)((value) >> 16)))
+	#define bswap_64(value) (((uint64_t)bswap_32((uint32_t)((value) & 0xffffffff)) << 32) | (uint64_t)bswap_32((uint32_t)((value) >> 32)))
+#endif
+#endif
+#endif
+
+uint64_t hton64(uint64_t val)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+	return (val);
+#else
+	return bswap_64(val);
+#endif
+}
+
+uint64_t ntoh64(uint64_t val)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+	return (val);
+#else
+	return bswap_64(val);
+#endif
+}
+
+KS_DECLARE(ks_bool_t) kws_certified_client(kws_t *kws)
+{
+	ks_assert(kws);
+	return kws->certified_client;
+}
+
+KS_DECLARE(ks_status_t) kws_peer_sans(kws_t *kws, char *buf, ks_size_t buflen)
+{
+	ks_status_t ret = KS_STATUS_SUCCESS;
+	X509 *cert = NULL;
+
+	ks_assert(kws);
+	ks_assert(buf);
+	ks_assert(buflen);
+
+	cert = SSL_get_peer_certificate(kws->ssl);
+	if (!cert) {
+		ret = KS_STATUS_FAIL;
+		goto done;
+	}
+
+	if (SSL_get_verify_result(kws->ssl) != X509_V_OK) {
+		ret = KS_STATUS_FAIL;
+		goto done;
+	}
+
+	//if (X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName, buf, (int)buflen) < 0) {
+	//	ret = KS_STATUS_FAIL;
+	//	goto done;
+	//}
+
+	GENERAL_NAMES *san_names = X509_get_ext_d2i(cert, NID_subject_alt_name, NULL, NULL);
+	if (san_names) {
+		int san_names_nb = sk_GENERAL_NAME_num(san_names);
+		for (int i = 0; i < san_names_nb; i++) {
+			const GENERAL_NAME *current_name = sk_GENERAL_NAME_value(san_names, i);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+			const unsigned char *name = ASN1_STRING_get0_data((const ASN1_STRING *)current_name->d.dNSName);
+#else
+			char *name = (char *)ASN1_STRING_data(current_name->d.dNSName);
+#endif
+
+			if (name) continue;
+		}
+		sk_GENERAL_NAME_pop_free(san_names, GENERAL_NAME_free);
+	}
+done:
+	if (cert) X509_free(cert);
+
+	return ret;
+}
+
+KS_DECLARE(ks_ssize_t) kws_read_frame(kws_t *kws, kws_opcode_t *oc, uint8_t **data)
+{
+
+	ks_ssize_t need = 2;
+	char *maskp;
+	int ll = 0;
+	int frag = 0;
+	int deflated = 0;
+	int blen;
+
+	kws->body = kws->bbuffer;
+	kws->packetlen = 0;
+
+	*oc = WSOC_INVALID;
+
+ again:
+	need = 2;
+	maskp = NULL;
+	*data = NULL;
+
+	ll = establish_logical_layer(kws);
+
+	if (ll < 0) {
+		ks_log(KS_LOG_ERROR, "Read frame error from logical layer: ll = %d\n", ll);
+		return ll;
+	}
+
+	if (kws->down) {
+		ks_log(KS_LOG_ERROR, "Read frame error because kws is down");
+		return -1;
+	}
+
+	if (!kws->handshake) {
+		ks_log(KS_LOG_ERROR, "Read frame error because kws handshake is incomplete");
+		return kws_close(kws, WS_NONE);
+	}
+
+	ws_cork_release(kws);
+
+	if ((kws->datalen = kws_string_read(kws, kws->buffer, 9 + 1, kws->block)) < 0) { // read 9 bytes into NULL terminated 10 byte buffer
+		ks_log(KS_LOG_ERROR, "Read frame error because kws_string_read returned %ld\n", kws->datalen);
+		if (kws->datalen == -2) {
+			return -2;
+		}
+		return kws_close(kws, WS_NONE);
+	}
+
+	if (kws->datalen < need) {
+		ssize_t bytes = kws_string_read(kws, kws->buffer + kws->datalen, 9 - kws->datalen, WS_BLOCK);
+
+		if (bytes < 0 || (kws->datalen += bytes) < need) {
+			/* too small - protocol err */
+			ks_log(KS_LOG_ERROR, "Read frame error because kws_string_read: bytes = %ld, datalen = %ld, needed = %ld\n", bytes, kws->datalen, need);
+			return kws_close(kws, WS_NONE);
+		}
+	}
+
+	*oc = *kws->buffer & 0xf;
+
+	if (*oc == WSOC_TEXT || *oc == WSOC_BINARY) {
+		/* RSV1 on the first frame marks a compressed message */
+		deflated = kws->deflate && (*kws->buffer & 0x40);
+	}
+
+	switch(*oc) {
+	case WSOC_CLOSE:
+		{
+			/* Nominal case, debug output only */
+			ks_log(KS_LOG_DEBUG, "Read frame OPCODE = WSOC_CLOSE\n");
+			kws->plen = kws->buffer[1] & 0x7f;
+			*data = (uint8_t *) &kws->buffer[2];
+			return kws_close(kws, WS_RECV_CLOSE);
+		}
+		break;
+	case WSOC_CONTINUATION:
+	case WSOC_TEXT:
+	case WSOC_BINARY:
+	case WSOC_PING:
+	case WSOC_PONG:
+		{
+			int fin = (kws->buffer[0] >> 7) & 1;
+			int mask = (kws->buffer[1] >> 7) & 1;
+
+
+			if (!fin && *oc != WSOC_CONTINUATION) {
+				frag = 1;
+			} else if (fin && *oc == WSOC_CONTINUATION) {
+				frag = 0;
+			}
+
+			if (mask) {
+				need += 4;
+
+				if (need > kws->datalen) {
+					ks_ssize_t bytes = kws_string_read_blocking(kws, kws->buffer + kws->datalen, need - kws->datalen + 1, 10);
+					if (bytes < 0 || (kws->datalen += bytes) < need) {
+						/* too small - protocol err */
+						ks_log(KS_LOG_ERROR, "Read frame error because not enough data for mask\n");
+						*oc = WSOC_CLOSE;
+						return kws_close(kws, WS_NONE);
+					}
+				}
+			}
+
+			kws->plen = kws->buffer[1] & 0x7f;
+			kws->payload = &kws->buffer[2];
+
+			if (kws->plen == 127) {
+				uint64_t *u64;
+				ks_ssize_t more = 0;
+
+				need += 8;
+
+				if (need > kws->datalen) {
+					ks_ssize_t bytes = kws_string_read_blocking(kws, kws->buffer + kws->datalen, need - kws->datalen + 1, 10);
+					if (bytes < 0 || (kws->datalen += bytes) < need) {
+						/* too small - protocol err */
+						ks_log(KS_LOG_ERROR, "Read frame error because kws_string_read: more = %ld, need = %ld, datalen = %ld\n", more, need, kws->datalen);
+						*oc = WSOC_CLOSE;
+						return kws_close(kws, WS_NONE);
+					}
+				}
+
+				u64 = (uint64_t *) kws->payload;
+				kws->payload += 8;
+				kws->plen = (ks_ssize_t)ntoh64(*u64);
+			} else if (kws->plen == 126) {
+				uint16_t *u16;
+
+				need += 2;
+
+				if (need > kws->datalen) {
+					ks_ssize_t bytes = kws_string_read_blocking(kws, kws->buffer + kws->datalen, need - kws->datalen + 1, 10);
+					if (bytes < 0 || (kws->datalen += bytes) < need) {
+						/* too small - protocol err */
+						ks_log(KS_LOG_ERROR, "Read frame error because kws_string_read: not enough data for packet length\n");
+						*oc = WSOC_CLOSE;
+						return kws_close(kws, WS_NONE);
+					}
+				}
+
+				u16 = (uint16_t *) kws->payload;
+				kws->payload += 2;
+				kws->plen = ntohs(*u16);
+			}
+
+			if (mask) {
+				maskp = (char *)kws->payload;
+				kws->payload += 4;
+			}
+
+			need = (kws->plen - (kws->datalen - need));
+
+			if (need < 0) {
+				/* invalid read - protocol err .. */
+				ks_log(KS_LOG_ERROR, "Read frame error because need = %ld\n", need);
+				*oc = WSOC_CLOSE;
+				return kws_close(kws, WS_NONE);
+			}
+
+			/* size already written to the body */
+			blen = (int)(kws->body - kws->bbuffer);
+
+			/* The bbuffer for the body of the message should always be 1 larger than the total size (for null term) */
+			if (blen + kws->plen >= (ks_ssize_t)kws->bbuflen) {
+				void *tmp;
+
+				/* must be a sum of the size already written to the body (blen) plus the size to be written (kws->plen) */
+				kws->bbuflen = blen + kws->plen; /* total size */
+
+				/* and 1 more for NULL term */
+				kws->bbuflen++;
+
+				if (kws->payload_size_max && kws->bbuflen > kws->payload_size_max) {
+					/* size limit */
+					ks_log(KS_LOG_ERROR, "Read frame error because: payload length is too big\n");
+					*oc = WSOC_CLOSE;
+					return kws_close(kws, WS_NONE);
+				}
+
+				// make room for entire payload plus null terminator
+				if ((tmp = ks_pool_resize(kws->bbuffer, (unsigned long)kws->bbuflen))) {
+					kws->bbuffer = tmp;
+				} else {
+					abort();
+				}
+
+				kws->body = kws->bbuffer + blen;
+			}
+
+			kws->rplen = kws->plen - need;
+
+			if (kws->rplen) {
+				ks_assert((kws->body + kws->rplen) <= (kws->bbuffer + kws->bbuflen));
+				memcpy(kws->body, kws->payload, kws->rplen);
+			}
+
+			ks_assert((kws->body + kws->plen) <= (kws->bbuffer + kws->bbuflen));
+
+			while(need) {
+				ks_ssize_t r = kws_string_read(kws, kws->body + kws->rplen, need + 1, WS_BLOCK);
+
+				if (r < 1) {
+					/* invalid read - protocol err .. */
+					ks_log(KS_LOG_ERROR, "Read frame error because r = %ld\n", r);
+					*oc = WSOC_CLOSE;
+					return kws_close(kws, WS_NONE);
+				}
+
+				kws->datalen += r;
+				kws->rplen += r;
+				need -= r;
+			}
+
+			if (mask && maskp) {
+				kws_mask(kws->body, kws->body, kws->plen, (uint8_t *)maskp, 0);
+			}
+
+			if (*oc == WSOC_TEXT) {
+				*(kws->body+kws->rplen) = '\0';
+			}
+
+			kws->packetlen += kws->rplen;
+			kws->body += kws->rplen;
+
+			if (frag) {
+				goto again;
+			}
+
+			*data = (uint8_t *)kws->bbuffer;
+
+			if (deflated) {
+				ks_ssize_t len;
+
+				if ((len = ws_inflate_message(kws, (uint8_t *)kws->bbuffer, kws->packetlen)) < 0) {
+					*oc = WSOC_CLOSE;
+					return kws_close(kws, WS_PROTO_ERR);
+				}
+
+				*data = kws->inflate_buf;
+				kws->packetlen = len;
+			}
+
+			kws->stats.frames_read++;
+
+			//printf("READ[%ld][%d]-----------------------------:\n[%s]\n-------------------------------\n", kws->packetlen, *oc, (char *)*data);
+
+
+			return kws->packetlen;
+		}
+		break;
+	default:
+		{
+			/* invalid op code - protocol err .. */
+			ks_log(KS_LOG_ERROR, "Read frame error because unknown opcode = %ld\n", *oc);
+			*oc = WSOC_CLOSE;
+			return kws_close(kws, WS_PROTO_ERR);
+		}
+		break;
+	}
+}
+
+/* Reads exactly bytes, blocking for anything after the first. -2 if nothing was there in non blocking mode */
+static ks_ssize_t kws_read_exact(kws_t *kws, uint8_t *data, ks_size_t bytes, int block)
+{
+	ks_size_t got = 0;
+	ks_ssize_t r;
+
+	while (got < bytes) {
+		if ((r = kws_raw_read(kws, data + got, bytes - got, got ? WS_BLOCK : block)) <= 0) {
+			return (r == -2 && !got) ? -2 : -1;
+		}
+		got += r;
+	}
+
+	return got;
+}
+
+KS_DECLARE(ks_ssize_t) kws_read_chunk(kws_t *kws, kws_chunk_t *chunk, uint8_t **data)
+{
+	ks_size_t want;
+	ks_ssize_t r;
+	int ll;
+
+	*data = NULL;
+	memset(chunk, 0, sizeof(*chunk));
+
+	if ((ll = establish_logical_layer(kws)) < 0) {
+		return ll;
+	}
+
+	if (kws->down) {
+		return -1;
+	}
+
+	if (!kws->handshake) {
+		return kws_close(kws, WS_NONE);
+	}
+
+	ws_cork_release(kws);
+
+	if (ws_inflate_pending(kws)) {
+		if ((r = ws_inflate_piece(kws, chunk, data)) < 0) {
+			return kws_close(kws, WS_PROTO_ERR);
+		}
+		return r;
+	}
+
+	while (!kws->stream_left) {
+		uint8_t hdr[14];
+		uint64_t plen;
+		kws_opcode_t oc;
+		int fin, mask;
+		ks_size_t ext = 0;
+
+		if ((r = kws_read_exact(kws, hdr, 2, kws->block)) < 0) {
+			return r == -2 ? -2 : kws_close(kws, WS_NONE);
+		}
+
+		fin = (hdr[0] >> 7) & 1;
+		oc = hdr[0] & 0xf;
+		mask = (hdr[1] >> 7) & 1;
+		plen = hdr[1] & 0x7f;
+
+		if (plen == 126) ext = 2;
+		else if (plen == 127) ext = 8;
+
+		if (ext + mask * 4 && kws_read_exact(kws, hdr + 2, ext + mask * 4, WS_BLOCK) < 0) {
+			return kws_close(kws, WS_NONE);
+		}
+
+		if (ext == 2) {
+			uint16_t u16;
+			memcpy(&u16, hdr + 2, 2);
+			plen = ntohs(u16);
+		} else if (ext == 8) {
+			uint64_t u64;
+			memcpy(&u64, hdr + 2, 8);
+			plen = ntoh64(u64);
+		}
+
+		kws->stream_masked = mask;
+		if (mask) memcpy(kws->stream_mask, hdr + 2 + ext, 4);
+		kws->stream_frame_off = 0;
+
+		switch (oc) {
+		case WSOC_CLOSE:
+		case WSOC_PING:
+		case WSOC_PONG:
+			/* Control frames are small and never fragmented, hand them over whole in between chunks */
+			if (plen > 125 || !fin) {
+				return kws_close(kws, WS_PROTO_ERR);
+			}
+
+			if (plen && kws_read_exact(kws, (uint8_t *)kws->buffer, (ks_size_t)plen, WS_BLOCK) < 0) {
+				return kws_close(kws, WS_NONE);
+			}
+
+			if (mask) kws_mask(kws->buffer, kws->buffer, (ks_size_t)plen, kws->stream_mask, 0);
+			kws->buffer[plen] = '\0';
+
+			chunk->oc = oc;
+			chunk->last = KS_TRUE;
+			*data = (uint8_t *)kws->buffer;
+
+			if (oc == WSOC_CLOSE) {
+				kws->plen = (ks_ssize_t)plen;
+				return kws_close(kws, WS_RECV_CLOSE);
+			}
+
+			return (ks_ssize_t)plen;
+		case WSOC_TEXT:
+		case WSOC_BINARY:
+		case WSOC_CONTINUATION:
+			if ((oc == WSOC_CONTINUATION) == !kws->stream_oc) {
+				ks_log(KS_LOG_ERROR, "Read chunk error because of an unexpected %s frame\n", oc == WSOC_CONTINUATION ? "continuation" : "data");
+				return kws_close(kws, WS_PROTO_ERR);
+			}
+
+			if (oc != WSOC_CONTINUATION) {
+				kws->stream_oc = oc;
+				kws->stream_msg_len = 0;
+				kws->stream_deflated = kws->deflate && (hdr[0] & 0x40);
+			}
+
+			/* The limit applies to the whole message even though it is never held in one piece, compressed ones are checked as they inflate */
+			if (!kws->stream_deflated && kws->payload_size_max && (ks_ssize_t)(kws->stream_msg_len + plen) >= kws->payload_size_max) {
+				ks_log(KS_LOG_ERROR, "Read chunk error because: payload length is too big\n");
+				return kws_close(kws, WS_DATA_TOO_BIG);
+			}
+
+			kws->stream_left = plen;
+			kws->stream_fin = fin;
+
+			if (!plen && fin && kws->stream_deflated) {
+				kws->stream_tail = 1;
+				if ((r = ws_inflate_piece(kws, chunk, data)) < 0) {
+					return kws_close(kws, WS_PROTO_ERR);
+				}
+				return r;
+			}
+
+			if (!plen && fin) {
+				/* An empty final frame still ends the message */
+				chunk->oc = kws->stream_oc;
+				chunk->last = KS_TRUE;
+				chunk->offset = kws->stream_msg_len;
+				kws->stream_oc = 0;
+				kws->buffer[0] = '\0';
+				*data = (uint8_t *)kws->buffer;
+				return 0;
+			}
+			break;
+		default:
+			ks_log(KS_LOG_ERROR, "Read chunk error because unknown opcode = %d\n", oc);
+			return kws_close(kws, WS_PROTO_ERR);
+		}
+	}
+
+	/* Whatever one read brings in, never more than the fixed frame buffer. The frame's progress
+	   lives in kws, so a non blocking read with nothing there yet just picks up here next time */
+	want = kws->buflen - 1;
+	if ((uint64_t)want > kws->stream_left) want = (ks_size_t)kws->stream_left;
+
+	if ((r = kws_raw_read(kws, kws->buffer, want, kws->block)) <= 0) {
+		return r == -2 ? -2 : kws_close(kws, WS_NONE);
+	}
+
+	if (kws->stream_masked) {
+		kws_mask(kws->buffer, kws->buffer, r, kws->stream_mask, (ks_size_t)kws->stream_frame_off);
+	}
+
+	if (kws->stream_deflated) {
+		kws->stream_left -= r;
+		kws->stream_frame_off += r;
+		kws->stream_tail = !kws->stream_left && kws->stream_fin;
+
+		ws_inflate_feed(kws, (uint8_t *)kws->buffer, r);
+
+		if ((r = ws_inflate_piece(kws, chunk, data)) < 0) {
+			return kws_close(kws, WS_PROTO_ERR);
+		}
+		return r;
+	}
+
+	kws->buffer[r] = '\0';
+
+	chunk->oc = kws->stream_oc;
+	chunk->offset = kws->stream_msg_len;
+
+	kws->stream_left -= r;
+	kws->stream_frame_off += r;
+	kws->stream_msg_len += r;
+
+	if (!kws->stream_left && kws->stream_fin) {
+		chunk->last = KS_TRUE;
+		kws->stream_oc = 0;
+		kws->stats.frames_read++;
+	}
+
+	*data = (uint8_t *)kws->buffer;
+
+	return r;
+}
+
+#if 0
+static ks_ssize_t ws_feed_buf(kws_t *kws, void *data, ks_size_t bytes)
+{
+
+	if (bytes + kws->wdatalen > kws->buflen) {
+		return -1;
+	}
+
+	memcpy(kws->wbuffer + kws->wdatalen, data, bytes);
+
+	kws->wdatalen += bytes;
+
+	return bytes;
+}
+
+static ks_ssize_t ws_send_buf(kws_t *kws, kws_opcode_t oc)
+{
+	ks_ssize_t r = 0;
+
+	if (!kws->wdatalen) {
+		return -1;
+	}
+
+	r = ws_write_frame(kws, oc, kws->wbuffer, kws->wdatalen);
+
+	kws->wdatalen = 0;
+
+	return r;
+}
+#endif
+
+/* Fills in the unmasked frame header for a payload of bytes and returns its length */
+static ks_size_t ws_frame_header(uint8_t *hdr, kws_opcode_t oc, ks_size_t bytes)
+{
+	ks_size_t hlen = 2;
+
+	hdr[0] = (uint8_t)(oc | 0x80);
+
+	if (bytes < 126) {
+		hdr[1] = (uint8_t)bytes;
+	} else if (bytes < 0x10000) {
+		uint16_t u16 = htons((uint16_t) bytes);
+
+		hdr[1] = 126;
+		memcpy(&hdr[2], &u16, 2);
+		hlen += 2;
+	} else {
+		uint64_t u64 = hton64(bytes);
+
+		hdr[1] = 127;
+		memcpy(&hdr[2], &u64, 8);
+		hlen += 8;
+	}
+
+	return hlen;
+}
+
+#define KWS_IOV_MAX 64
+
+/*
+ * Hands the header and the caller's buffers straight to the kernel in one gathered send,
+ * picking up after partial writes and waiting for room the same way kws_raw_write does.
+ */
+static ks_ssize_t kws_raw_writev(kws_t *kws, const uint8_t *hdr, ks_size_t hlen, const kws_iovec_t *iov, int iovcnt, ks_size_t bytes)
+{
+#ifdef _WIN32
+	WSABUF vec[KWS_IOV_MAX + 1];
+	DWORD sent;
+#else
+	struct iovec vec[KWS_IOV_MAX + 1];
+	struct msghdr msg = { 0 };
+#endif
+	int i, n = 0, first = 0;
+	ks_size_t wrote = 0;
+	ks_ssize_t r;
+	ks_time_t deadline = ks_time_now() + (ks_time_t)(kws->block ? kws->block : WS_WRITE_NOBLOCK) * 1000;
+
+#ifdef _WIN32
+	vec[n].buf = (char *)hdr;
+	vec[n++].len = (ULONG)hlen;
+	for (i = 0; i < iovcnt; i++) {
+		if (!iov[i].len) continue;
+		vec[n].buf = (char *)iov[i].base;
+		vec[n++].len = (ULONG)iov[i].len;
+	}
+#else
+	vec[n].iov_base = (void *)hdr;
+	vec[n++].iov_len = hlen;
+	for (i = 0; i < iovcnt; i++) {
+		if (!iov[i].len) continue;
+		vec[n].iov_base = (void *)iov[i].base;
+		vec[n++].iov_len = iov[i].len;
+	}
+#endif
+
+	bytes += hlen;
+
+	do {
+#ifdef _WIN32
+		r = WSASend(kws->sock, vec + first, n - first, &sent, 0, NULL, NULL) == 0 ? (ks_ssize_t)sent : -1;
+#else
+		msg.msg_iov = vec + first;
+		msg.msg_iovlen = n - first;
+		r = sendmsg(kws->sock, &msg, 0);
+#endif
+		kws->stats.write_calls++;
+
+		if (r > 0) {
+			ks_size_t left = (ks_size_t)r;
+
+			wrote += left;
+
+			/* Drop what went out, trimming the front of a partially sent piece */
+			while (first < n && left) {
+#ifdef _WIN32
+				if (left >= vec[first].len) {
+					left -= vec[first++].len;
+				} else {
+					vec[first].buf += left;
+					vec[first].len -= (ULONG)left;
+					left = 0;
+				}
+#else
+				if (left >= vec[first].iov_len) {
+					left -= vec[first++].iov_len;
+				} else {
+					vec[first].iov_base = (uint8_t *)vec[first].iov_base + left;
+					vec[first].iov_len -= left;
+					left = 0;
+				}
+#endif
+			}
+		}
+
+		if (r == -1) {
+			if (!ks_errno_is_blocking(ks_errno())) {
+				break;
+			}
+
+			if (ws_wait_ready(kws, KS_POLL_WRITE, deadline) <= 0) {
+				break;
+			}
+		}
+
+	} while (wrote < bytes);
+
+	return r >= 0 ? (ks_ssize_t)wrote : r;
+}
+
+/* Lays a frame out at bp, masking it on the way when asked to. Returns its length on the wire */
+static ks_size_t ws_build_frame(uint8_t *bp, const uint8_t *hdr, ks_size_t hlen, const kws_iovec_t *iov, int iovcnt, ks_size_t bytes, int mask)
+{
+	ks_size_t off;
+	int i;
+
+	memcpy(bp, hdr, hlen);
+
+	if (mask) {
+		uint8_t masking_key[4];
+
+		gen_nonce(masking_key, 4);
+
+		*(bp + 1) |= 0x80;
+		memcpy(bp + hlen, masking_key, 4);
+		hlen += 4;
+
+		for (i = 0, off = 0; i < iovcnt; off += iov[i++].len) {
+			kws_mask(bp + hlen + off, iov[i].base, iov[i].len, masking_key, off);
+		}
+	} else {
+		for (i = 0, off = 0; i < iovcnt; off += iov[i++].len) {
+			memcpy(bp + hlen + off, iov[i].base, iov[i].len);
+		}
+	}
+
+	return hlen + bytes;
+}
+
+/* Writes out the frames held back by cork or the coalescing window in one go */
+static int ws_cork_flush(kws_t *kws)
+{
+	ks_size_t len = kws->cork_len;
+	ks_ssize_t r;
+
+	if (!len) {
+		return 0;
+	}
+
+	kws->cork_len = 0;
+	kws->stats.flushes++;
+	kws->stats.frames_written += kws->cork_frames;
+	kws->cork_frames = 0;
+
+	r = kws_raw_write(kws, kws->cork_buf, len);
+
+	return r == (ks_ssize_t)len ? 0 : -1;
+}
+
+KS_DECLARE(void) kws_cork(kws_t *kws)
+{
+	ks_mutex_lock(kws->write_mutex);
+	kws->corked = 1;
+	ks_mutex_unlock(kws->write_mutex);
+}
+
+KS_DECLARE(ks_status_t) kws_uncork(kws_t *kws)
+{
+	ks_status_t status;
+
+	ks_mutex_lock(kws->write_mutex);
+	kws->corked = 0;
+	status = kws_flush(kws);
+	ks_mutex_unlock(kws->write_mutex);
+
+	return status;
+}
+
+KS_DECLARE(ks_status_t) kws_flush(kws_t *kws)
+{
+	int r;
+
+	ks_mutex_lock(kws->write_mutex);
+	r = kws->down ? -1 : ws_cork_flush(kws);
+	ks_mutex_unlock(kws->write_mutex);
+
+	return r < 0 ? KS_STATUS_FAIL : KS_STATUS_SUCCESS;
+}
+
+KS_DECLARE(int) kws_flush_due(kws_t *kws)
+{
+	ks_time_t age;
+	int due = -1;
+
+	ks_mutex_lock(kws->write_mutex);
+
+	if (kws->cork_len && !kws->corked) {
+		age = ks_time_now() - kws->cork_since;
+		due = age >= kws->coalesce_window ? 0 : (int)((kws->coalesce_window - age + 999) / 1000);
+	}
+
+	ks_mutex_unlock(kws->write_mutex);
+
+	return due;
+}
+
+/* Reading or waiting on the peer, who may be waiting on what we're holding */
+static void ws_cork_release(kws_t *kws)
+{
+	if (!kws->cork_len) {
+		return;
+	}
+
+	ks_mutex_lock(kws->write_mutex);
+	if (kws->cork_len && !kws->corked && !kws->down) {
+		ws_cork_flush(kws);
+	}
+	ks_mutex_unlock(kws->write_mutex);
+}
+
+/*
+ * One thread flushes coalescing windows that run out with nobody writing or reading on the connection.
+ * Its list is guarded by the cond's mutex, which is taken after a write_mutex and never before one.
+ */
+static struct {
+	ks_spinlock_t lock;
+	ks_cond_t *cond;
+	ks_thread_t *thread;
+	kws_t *head;
+} g_flusher;
+
+static void ws_flusher_unlink(kws_t *kws)
+{
+	if (!kws->flush_linked) {
+		return;
+	}
+
+	if (kws->flush_prev) kws->flush_prev->flush_next = kws->flush_next;
+	else g_flusher.head = kws->flush_next;
+	if (kws->flush_next) kws->flush_next->flush_prev = kws->flush_prev;
+
+	kws->flush_next = kws->flush_prev = NULL;
+	kws->flush_linked = 0;
+}
+
+static void ws_flusher_link(kws_t *kws);
+
+static void *ws_flusher_thread(ks_thread_t *thread, void *data)
+{
+	ks_cond_lock(g_flusher.cond);
+
+	while (!ks_thread_stop_requested(thread)) {
+		ks_time_t now = ks_time_now(), next = now + 1000000;
+		kws_t *kws, *due = NULL;
+
+		for (kws = g_flusher.head; kws; kws = kws->flush_next) {
+			ks_time_t at = kws->cork_since + kws->coalesce_window;
+
+			if (at <= now) {
+				if (ks_mutex_trylock(kws->write_mutex) == KS_STATUS_SUCCESS) {
+					due = kws;
+					break;
+				}
+
+				/* Mid write, it checks the window itself, look again shortly */
+				at = now + 1000;
+			}
+
+			if (at < next) next = at;
+		}
+
+		if (!due) {
+			ks_cond_timedwait(g_flusher.cond, (next - now + 999) / 1000);
+			continue;
+		}
+
+		/* The write lock keeps kws_destroy waiting while the flush runs without the list lock */
+		ws_flusher_unlink(due);
+		ks_cond_unlock(g_flusher.cond);
+
+		if (due->cork_len && !due->corked && !due->down) {
+			if (ks_time_now() - due->cork_since >= due->coalesce_window) {
+				due->stats.flush_timeouts++;
+				ws_cork_flush(due);
+			} else {
+				/* Flushed and refilled since the scan */
+				ws_flusher_link(due);
+			}
+		}
+
+		ks_mutex_unlock(due->write_mutex);
+		ks_cond_lock(g_flusher.cond);
+	}
+
+	ks_cond_unlock(g_flusher.cond);
+
+	return NULL;
+}
+
+static ks_status_t ws_flusher_start(void)
+{
+	ks_status_t status = KS_STATUS_SUCCESS;
+
+	if (g_flusher.thread) {
+		return status;
+	}
+
+	ks_spinlock_acquire(&g_flusher.lock);
+
+	if (!g_flusher.thread) {
+		if ((status = ks_cond_create(&g_flusher.cond, ks_global_pool())) == KS_STATUS_SUCCESS &&
+			(status = ks_thread_create_tag(&g_flusher.thread, ws_flusher_thread, NULL, ks_global_pool(), "kws_flusher")) != KS_STATUS_SUCCESS) {
+			ks_cond_destroy(&g_flusher.cond);
+		}
+	}
+
+	ks_spinlock_release(&g_flusher.lock);
+
+	return status;
+}
+
+/* Called with the write lock held once frames are held for the coalescing window */
+static void ws_flusher_link(kws_t *kws)
+{
+	if (kws->flush_linked || ws_flusher_start() != KS_STATUS_SUCCESS) {
+		return;
+	}
+
+	ks_cond_lock(g_flusher.cond);
+	kws->flush_prev = NULL;
+	kws->flush_next = g_flusher.head;
+	if (g_flusher.head) g_flusher.head->flush_prev = kws;
+	g_flusher.head = kws;
+	kws->flush_linked = 1;
+	ks_cond_signal(g_flusher.cond);
+	ks_cond_unlock(g_flusher.cond);
+}
+
+/* Off the list, and past any flush the flusher already started on it */
+static void ws_flusher_forget(kws_t *kws)
+{
+	if (!g_flusher.thread) {
+		return;
+	}
+
+	ks_cond_lock(g_flusher.cond);
+	ws_flusher_unlink(kws);
+	ks_cond_unlock(g_flusher.cond);
+
+	ks_mutex_lock(kws->write_mutex);
+	ks_mutex_unlock(kws->write_mutex);
+}
+
+KS_DECLARE(void) kws_flusher_shutdown(void)
+{
+	if (!g_flusher.thread) {
+		return;
+	}
+
+	ks_thread_request_stop(g_flusher.thread);
+
+	ks_cond_lock(g_flusher.cond);
+	while (g_flusher.head) {
+		ws_flusher_unlink(g_flusher.head);
+	}
+	ks_cond_signal(g_flusher.cond);
+	ks_cond_unlock(g_flusher.cond);
+
+	ks_thread_join(g_flusher.thread);
+	ks_thread_destroy(&g_flusher.thread);
+	ks_cond_destroy(&g_flusher.cond);
+}
+
+static ks_ssize_t ws_write_framev(kws_t *kws, kws_opcode_t oc, const kws_iovec_t *iov, int iovcnt)
+{
+	uint8_t hdr[14] = { 0 };
+	ks_size_t hlen, flen, bytes = 0, msg_bytes;
+	kws_iovec_t ziov;
+	int rsv1 = 0;
+	uint8_t *bp;
+	ks_ssize_t raw_ret = 0;
+	int mask = (kws->flags & KWS_FLAG_DONTMASK) ? 0 : 1;
+	int i;
+
+	if (kws->down) {
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		bytes += iov[i].len;
+	}
+
+	msg_bytes = bytes;
+
+	if (kws->deflate && (oc == WSOC_TEXT || oc == WSOC_BINARY) && bytes >= WS_DEFLATE_MIN) {
+		ks_ssize_t zlen;
+
+		if ((zlen = ws_deflate_message(kws, iov, iovcnt, bytes)) < 0) {
+			return -1;
+		}
+
+		ziov.base = kws->deflate_buf;
+		ziov.len = zlen;
+		iov = &ziov;
+		iovcnt = 1;
+		bytes = zlen;
+		rsv1 = 0x40;
+	}
+
+	hlen = ws_frame_header(hdr, oc, bytes);
+	hdr[0] |= rsv1;
+	flen = hlen + mask * 4 + bytes;
+
+	if ((kws->corked || kws->coalesce_window) && !kws->loop) {
+		/* Whatever is held has to go out first when this frame won't fit after it */
+		if (kws->cork_len && kws->cork_len + flen > kws->coalesce_bytes && ws_cork_flush(kws) < 0) {
+			return -1;
+		}
+
+		if (flen < kws->coalesce_bytes) {
+			if (ws_reserve(kws, &kws->cork_buf, &kws->cork_size, kws->cork_len + flen) != KS_STATUS_SUCCESS) {
+				return -1;
+			}
+
+			if (!kws->cork_len) {
+				kws->cork_since = ks_time_now();
+			}
+
+			kws->cork_len += ws_build_frame(kws->cork_buf + kws->cork_len, hdr, hlen, iov, iovcnt, bytes, mask);
+			kws->cork_frames++;
+
+			if (oc == WSOC_CLOSE || (!kws->corked && ks_time_now() - kws->cork_since >= kws->coalesce_window)) {
+				if (oc != WSOC_CLOSE) kws->stats.flush_timeouts++;
+				if (ws_cork_flush(kws) < 0) {
+					return -1;
+				}
+			} else if (!kws->corked) {
+				/* Nothing may come along to check the window again, the flusher will */
+				ws_flusher_link(kws);
+			}
+
+			return msg_bytes;
+		}
+	}
+
+	/* Unmasked frames on a plain socket go out without touching the payload */
+	if (!mask && !kws->ssl && !kws->loop && iovcnt <= KWS_IOV_MAX) {
+		raw_ret = kws_raw_writev(kws, hdr, hlen, iov, iovcnt, bytes);
+
+		if (raw_ret <= 0 || raw_ret != (ks_ssize_t) (hlen + bytes)) {
+			return raw_ret;
+		}
+
+		kws->stats.frames_written++;
+
+		return msg_bytes;
+	}
+
+	/* Masking needs somewhere to put the result and TLS would turn each piece into its own record, so build the frame */
+	if (kws->write_buffer_len < (hlen + bytes + 1 + mask * 4)) {
+		void *tmp;
+
+		kws->write_buffer_len = hlen + bytes + 1 + mask * 4;
+		if (!kws->write_buffer) kws->write_buffer = ks_pool_alloc_nz(ks_pool_get(kws), (unsigned long)kws->write_buffer_len);
+		else if ((tmp = ks_pool_resize(kws->write_buffer, (unsigned long)kws->write_buffer_len))) {
+			kws->write_buffer = tmp;
+		} else {
+			abort();
+		}
+	}
+
+	bp = (uint8_t *) kws->write_buffer;
+	flen = ws_build_frame(bp, hdr, hlen, iov, iovcnt, bytes, mask);
+
+	raw_ret = kws_raw_write(kws, bp, flen);
+
+	if (raw_ret <= 0 || raw_ret != (ks_ssize_t) flen) {
+		return raw_ret;
+	}
+
+	kws->stats.frames_written++;
+
+	return msg_bytes;
+}
+
+KS_DECLARE(ks_ssize_t) kws_write_framev(kws_t *kws, kws_opcode_t oc, const kws_iovec_t *iov, int iovcnt)
+{
+	ks_ssize_t r;
+
+	/* A frame is compressed and goes out whole, and not after the connection closed under us */
+	ks_mutex_lock(kws->write_mutex);
+	r = ws_write_framev(kws, oc, iov, iovcnt);
+	ks_mutex_unlock(kws->write_mutex);
+
+	return r;
+}
+
+KS_DECLARE(ks_ssize_t) kws_write_frame(kws_t *kws, kws_opcode_t oc, const void *data, ks_size_t bytes)
+{
+	kws_iovec_t iov;
+
+	//printf("WRITE[%ld]-----------------------------:\n[%s]\n-----------------------------------\n", bytes, (char *) data);
+
+	iov.base = data;
+	iov.len = bytes;
+
+	return kws_write_framev(kws, oc, &iov, 1);
+}
+
+KS_DECLARE(ks_status_t) kws_get_buffer(kws_t *kws, char **bufP, ks_size_t *buflen)
+{
+	*bufP = kws->buffer;
+	*buflen = kws->datalen;
+
+	return KS_STATUS_SUCCESS;
+}
+
+KS_DECLARE(ks_size_t) kws_sans_count(kws_t *kws)
+{
+	ks_assert(kws);
+
+	return kws->sans_count;
+}
+
+KS_DECLARE(const char *) kws_sans_get(kws_t *kws, ks_size_t index)
+{
+	ks_assert(kws);
+	if (index >= kws->sans_count) return NULL;
+	return kws->sans[index];
+}
+
+KS_DECLARE(ks_status_t) kws_connect(kws_t **kwsP, ks_json_t *params, kws_flag_t flags, ks_pool_t *pool)
+{
+	return kws_connect_ex(kwsP, params, flags, pool, NULL, 30000);
+}
+
+KS_DECLARE(ks_status_t) kws_connect_ex(kws_t **kwsP, ks_json_t *params, kws_flag_t flags, ks_pool_t *pool, SSL_CTX *ssl_ctx, uint32_t timeout_ms)
+{
+	ks_sockaddr_t addr = { 0 };
+	ks_socket_t cl_sock = KS_SOCK_INVALID;
+	int family = AF_INET;
+	const char *ip = "127.0.0.1";
+	ks_port_t port = 443;
+	// char buf[50] = "";
+	const char *url = ks_json_get_object_string(params, "url", NULL);
+	// const char *headers = ks_json_get_object_string(params, "headers", NULL);
+	const char *host = NULL;
+	const char *protocol = ks_json_get_object_string(params, "protocol", NULL);
+	const char *path = NULL;
+	char *p = NULL;
+	const char *client_data = NULL;
+	int destroy_ssl_ctx = 0;
+	ks_status_t status;
+
+	if (!url) {
+		ks_json_t *tmp;
+
+		path = ks_json_get_object_string(params, "path", NULL);
+		host = ks_json_get_object_string(params, "host", NULL);
+		tmp = ks_json_get_object_item(params, "port");
+		ks_json_value_number_int(tmp, (int *)&port);
+	} else {
+		if (!strncmp(url, "wss://", 6)) {
+			if (!ssl_ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+				ssl_ctx = SSL_CTX_new(TLS_client_method());
+#else
+				ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
+#endif
+				if (!ssl_ctx) {
+					unsigned long ssl_ctx_error = ERR_peek_error();
+					ks_log(KS_LOG_ERROR, "Failed to initiate SSL context with ssl error [%lu].\n", ssl_ctx_error);
+					return KS_STATUS_FAIL;
+				}
+
+				SSL_CTX_set_default_verify_paths(ssl_ctx);
+
+				destroy_ssl_ctx++;
+			}
+
+			p = (char *)url + 6;
+		} else if (!strncmp(url, "ws://", 5))  {
+			p = (char *)url + 5;
+			port = 80;
+		} else {
+			*kwsP = NULL;
+			return KS_STATUS_FAIL;
+		}
+
+		host = ks_pstrdup(pool, p);
+
+		// if (*host == '[') // todo ipv6
+
+		if ((p = strchr(host, ':'))) {
+			*p++ = '\0';
+			if (p) {
+				port = (ks_port_t)atoi(p);
+			}
+		} else {
+			p = (char *)host;
+		}
+
+		p = strchr(p, '/');
+
+		if (p) {
+			path = ks_pstrdup(pool, p);
+			*p = '\0';
+		} else {
+			path = "/";
+		}
+	}
+
+	if (!host || !path) {
+		status = KS_STATUS_FAIL;
+		goto err;
+	}
+
+	status = ks_addr_getbyname(host, port, AF_UNSPEC, &addr);
+	if (status != KS_STATUS_SUCCESS) {
+		goto err;
+	}
+
+	cl_sock = ks_socket_connect_ex(SOCK_STREAM, IPPROTO_TCP, &addr, timeout_ms);
+
+	if (protocol) {
+		client_data = ks_psprintf(pool, "%s:%s:%s", path, host, protocol);
+	} else {
+		client_data = ks_psprintf(pool, "%s:%s", path, host);
+	}
+
+	if (kws_init_ex(kwsP, cl_sock, ssl_ctx, client_data, flags, pool, params) != KS_STATUS_SUCCESS) {
+		status = KS_STATUS_FAIL;
+		goto err;
+	}
+
+	if (destroy_ssl_ctx) {
+		(*kwsP)->destroy_ssl_ctx = 1;
+	}
+
+	return KS_STATUS_SUCCESS;
+
+err:
+	if (destroy_ssl_ctx) {
+		SSL_CTX_free(ssl_ctx);
+	}
+
+	return status;
+}
+
+KS_DECLARE(int) kws_wait_sock(kws_t *kws, uint32_t ms, ks_poll_t flags)
+{
+	if (kws->sock == KS_SOCK_INVALID) return KS_POLL_ERROR;
+
+	if (kws->unprocessed_buffer_len > 0) return KS_POLL_READ;
+
+	if (kws->ssl && SSL_pending(kws->ssl) > 0) return KS_POLL_READ;
+
+	if ((flags & KS_POLL_READ)) {
+		ws_cork_release(kws);
+	}
+
+	return ks_wait_sock(kws->sock, ms, flags);
+}
+
+KS_DECLARE(void) kws_get_stats(kws_t *kws, kws_stats_t *stats)
+{
+	*stats = kws->stats;
+}
+
+KS_DECLARE(int) kws_test_flag(kws_t *kws, kws_flag_t flag)
+{
+	return kws->flags & flag;
+}
+KS_DECLARE(int) kws_set_flag(kws_t *kws, kws_flag_t flag)
+{
+	return kws->flags |= flag;
+}
+KS_DECLARE(int) kws_clear_flag(kws_t *kws, kws_flag_t flag)
+{
+	return kws->flags &= ~flag;
+}
+
+/* clean the uri to protect us from vulnerability attack */
+static ks_status_t clean_uri(char *uri)
+{
+	int argc;
+	char *argv[64];
+	int last, i, len, uri_len = 0;
+	const unsigned int max_segments = sizeof(argv) / sizeof(argv[0]);
+
+	argc = ks_separate_string(uri, '/', argv, max_segments);
+
+	if ((unsigned int)argc == max_segments) { /* too deep */
+		return KS_STATUS_FAIL;
+	}
+
+	last = 1;
+	for(i = 1; i < argc; i++) {
+		if (*argv[i] == '\0' || !strcmp(argv[i], ".")) {
+			/* ignore //// or /././././ */
+		} else if (!strcmp(argv[i], "..")) {
+			/* got /../, go up one level */
+			if (last > 1) last--;
+		} else {
+			argv[last++] = argv[i];
+		}
+	}
+
+	for(i = 1; i < last; i++) {
+		len = strlen(argv[i]);
+		sprintf(uri + uri_len, "/%s", argv[i]);
+		uri_len += (len + 1);
+	}
 
-	if ((kws->flags & KWS_CLOSE_SOCK) && kws->sock != KS_SOCK_INVALID) {
-		/* signal socket to shutdown() before close(): FIN-ACK-FIN-ACK insead of RST-RST
-		   do not really handle errors here since it all going to die anyway.
-		   all buffered writes if any(like SSL_shutdown() ones) will still be sent.
-		 */
-#ifndef WIN32
-		shutdown(kws->sock, SHUT_RDWR);
-		close(kws->sock);
-#else
-		shutdown(kws->sock, SD_BOTH);
-		closesocket(kws->sock);
-#endif
+	if (*uri == '\0') {
+		*uri++ = '/';
+		*uri = '\0';
 	}
 
-	kws->sock = KS_SOCK_INVALID;
+	return KS_STATUS_SUCCESS;
+}
 
-	return reason * -1;
+KS_DECLARE(ks_status_t) kws_parse_qs(kws_request_t *request, char *qs)
+{
+	char *q;
+	char *next;
+	char *name, *val;
 
-}
+	if (qs) {
+		q = qs;
+	} else { /*parse our own qs, dup to avoid modify the original string */
+		q = strdup(request->qs);
+	}
 
-#ifndef WIN32
-#if defined(HAVE_BYTESWAP_H)
-#include <byteswap.h>
-#elif defined(HAVE_SYS_ENDIAN_H)
-#include <sys/endian.h>
-#elif defined (__APPLE__)
-#include <libkern/OSByteOrder.h>
-#define bswap_16 OSSwapInt16
-#define bswap_32 OSSwapInt32
-#define bswap_64 OSSwapInt64
-#elif defined (__UCLIBC__)
-#else
-#ifndef bswap_16
-	#define bswap_16(value) ((((value) & 0xff) << 8) | ((value) >> 8))
-	#define bswap_32(value) (((uint32_t)bswap_16((uint16_t)((value) & 0xffff)) << 16) | (uint32_t)bswap_16((uint16_t)((value) >> 16)))
-	#define bswap_64(value) (((uint64_t)bswap_32((uint32_t)((value) & 0xffffffff)) << 32) | (uint64_t)bswap_32((uint32_t)((value) >> 32)))
-#endif
-#endif
-#endif
+	if (!q) return KS_STATUS_FAIL;
 
-uint64_t hton64(uint64_t val)
-{
-#if __BYTE_ORDER == __BIG_ENDIAN
-	return (val);
-#else
-	return bswap_64(val);
-#endif
-}
+	next = q;
 
-uint64_t ntoh64(uint64_t val)
-{
-#if __BYTE_ORDER == __BIG_ENDIAN
-	return (val);
-#else
-	return bswap_64(val);
-#endif
-}
+	while (q && request->total_headers < KWS_MAX_HEADERS) {
+		char *p;
 
-KS_DECLARE(ks_bool_t) kws_certified_client(kws_t *kws)
-{
-	ks_assert(kws);
-	return kws->certified_client;
+		if ((next = strchr(next, '&'))) {
+			*next++ = '\0';
+		}
+
+		for (p = q; p && *p; p++) {
+			if (*p == '+') *p = ' ';
+		}
+
+		ks_url_decode(q);
+
+		name = q;
+		if ((val = strchr(name, '='))) {
+			*val++ = '\0';
+			request->headers_k[request->total_headers] = strdup(name);
+			request->headers_v[request->total_headers] = strdup(val);
+			request->total_headers++;
+		}
+		q = next;
+	}
+
+	if (!qs) {
+		ks_safe_free(q);
+	}
+
+	return KS_STATUS_SUCCESS;
 }
 
-KS_DECLARE(ks_status_t) kws_peer_sans(kws_t *kws, char *buf, ks_size_t buflen)
+/* What kws_request_t._buffer points at, so the public struct keeps its layout */
+typedef struct kws_request_buffer_s {
+	ks_size_t headers;         /* headers_k/v below this point are in head, the rest came from kws_parse_qs */
+	char head[];
+} kws_request_buffer_t;
+
+KS_DECLARE(ks_status_t) kws_parse_header(kws_t *kws, kws_request_t **requestP)
 {
-	ks_status_t ret = KS_STATUS_SUCCESS;
-	X509 *cert = NULL;
+	char *buffer = kws->buffer;
+	ks_size_t datalen = kws->datalen;
+	kws_http_t *http = &kws->http;
+	ks_status_t status = KS_STATUS_FAIL;
+	kws_request_buffer_t *rb;
+	const char *host, *version;
+	ks_size_t host_len = 0;
+	uint32_t i;
+	char *b, *p;
+	int r;
 
-	ks_assert(kws);
-	ks_assert(buf);
-	ks_assert(buflen);
+	/* The handshake may have parsed this already, a partial head keeps its state for the next call */
+	if ((r = kws_http_parse(http, buffer, datalen)) != 1) {
+		if (r < 0) kws_http_init(http);
+		return status;
+	}
 
-	cert = SSL_get_peer_certificate(kws->ssl);
-	if (!cert) {
-		ret = KS_STATUS_FAIL;
-		goto done;
+	ks_assert(requestP);
+	kws_request_t *request = *requestP;
+
+	if (!request) request = malloc(sizeof(kws_request_t));
+	if (!request) {
+		kws_http_init(http);
+		return status;
 	}
+	memset(request, 0, sizeof(kws_request_t));
+	*requestP = request;
 
-	if (SSL_get_verify_result(kws->ssl) != X509_V_OK) {
-		ret = KS_STATUS_FAIL;
-		goto done;
+	if ((host = kws_http_get_known(http, buffer, KWS_HTTP_HOST))) {
+		host_len = strlen(host) + 1;
 	}
 
-	//if (X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName, buf, (int)buflen) < 0) {
-	//	ret = KS_STATUS_FAIL;
-	//	goto done;
-	//}
+	/* One copy of the already split head, plus room to split the host from its port */
+	rb = malloc(sizeof(*rb) + http->header_len + host_len);
+	ks_assert(rb);
+	rb->headers = 0;
+	request->_buffer = (char *)rb;
+	b = rb->head;
+	memcpy(b, buffer, http->header_len);
+
+	request->method = b + http->start[0].off;
+	request->uri = b + http->start[1].off;
+	version = b + http->start[2].off;
+	request->bytes_buffered = datalen;
+	request->bytes_header = http->header_len;
+	request->bytes_read = http->header_len;
 
-	GENERAL_NAMES *san_names = X509_get_ext_d2i(cert, NID_subject_alt_name, NULL, NULL);
-	if (san_names) {
-		int san_names_nb = sk_GENERAL_NAME_num(san_names);
-		for (int i = 0; i < san_names_nb; i++) {
-			const GENERAL_NAME *current_name = sk_GENERAL_NAME_value(san_names, i);
+	if (*request->uri != '/') goto err; /* must start from '/' */
 
-#if OPENSSL_VERSION_NUMBER >= 0x10100000
-			const unsigned char *name = ASN1_STRING_get0_data((const ASN1_STRING *)current_name->d.dNSName);
-#else
-			char *name = (char *)ASN1_STRING_data(current_name->d.dNSName);
-#endif
+	if ((p = strchr(request->uri, '?'))) {
+		*p++ = '\0';
+		request->qs = p;
+	}
 
-			if (name) continue;
+	if (clean_uri((char *)request->uri) != KS_STATUS_SUCCESS) {
+		goto err;
+	}
+
+	if (!strncmp(version, "HTTP/1.1", 8)) {
+		request->keepalive = KS_TRUE;
+	} else if (strncmp(version, "HTTP/1.0", 8)) {
+		goto err;
+	}
+
+	for (i = 0; i < http->count; i++) {
+		request->headers_k[i] = b + http->headers[i].name.off;
+		request->headers_v[i] = b + http->headers[i].value.off;
+	}
+
+	request->total_headers = rb->headers = http->count;
+
+	if (host) {
+		char *h = b + http->header_len;
+
+		memcpy(h, host, host_len);
+		request->host = h;
+
+		if ((p = strchr(h, ':'))) {
+			*p++ = '\0';
+
+			if (*p) request->port = (ks_port_t)atoi(p);
 		}
-		sk_GENERAL_NAME_pop_free(san_names, GENERAL_NAME_free);
 	}
-done:
-	if (cert) X509_free(cert);
 
-	return ret;
+	request->user_agent = kws_http_get_known(http, b, KWS_HTTP_USER_AGENT);
+	request->content_type = kws_http_get_known(http, b, KWS_HTTP_CONTENT_TYPE);
+	request->referer = kws_http_get_known(http, b, KWS_HTTP_REFERER);
+	request->authorization = kws_http_get_known(http, b, KWS_HTTP_AUTHORIZATION);
+
+	if ((p = (char *)kws_http_get_known(http, b, KWS_HTTP_CONTENT_LENGTH))) {
+		request->content_length = atoi(p);
+	}
+
+	kws->datalen = datalen -= http->header_len;
+
+	if (datalen > 0) {
+		// shift remining bytes to start of buffer including ending '\0'
+		memmove(buffer, buffer + http->header_len, datalen + 1);
+		kws->unprocessed_buffer_len = datalen;
+		kws->unprocessed_position = kws->buffer;
+	}
+
+	kws_http_init(http);
+
+	if (request->qs) {
+		kws_parse_qs(request, NULL);
+	}
+
+	return KS_STATUS_SUCCESS;
+
+err:
+	/* A DONE parser with this head's offsets would hand the same bad request to the next call */
+	kws_http_init(http);
+	kws_request_free(requestP);
+	return status;
 }
 
-KS_DECLARE(ks_ssize_t) kws_read_frame(kws_t *kws, kws_opcode_t *oc, uint8_t **data)
+KS_DECLARE(void) kws_request_free(kws_request_t **request)
 {
+	if (!request || !*request) return;
+	kws_request_reset(*request);
+	free(*request);
+	*request = NULL;
+}
 
-	ks_ssize_t need = 2;
-	char *maskp;
-	int ll = 0;
-	int frag = 0;
-	int blen;
+KS_DECLARE(char *) kws_request_dump(kws_request_t *request)
+{
+	if (!request || !request->method) return NULL;
 
-	kws->body = kws->bbuffer;
-	kws->packetlen = 0;
+	printf("method: %s\n", request->method);
 
-	*oc = WSOC_INVALID;
+	if (request->uri) printf("uri: %s\n", request->uri);
+	if (request->qs)  printf("qs: %s\n", request->qs);
+	if (request->host) printf("host: %s\n", request->host);
+	if (request->port) printf("port: %d\n", request->port);
+	if (request->from) printf("from: %s\n", request->from);
+	if (request->user_agent) printf("user_agent: %s\n", request->user_agent);
+	if (request->referer) printf("referer: %s\n", request->referer);
+	if (request->user) printf("user: %s\n", request->user);
+	printf("keepalive: %d\n", request->keepalive);
+	if (request->content_type) printf("content_type: %s\n", request->content_type);
+	if (request->content_length) printf("content_length: %u\n", (uint32_t)request->content_length);
+	if (request->authorization) printf("authorization: %s\n", request->authorization);
 
- again:
-	need = 2;
-	maskp = NULL;
-	*data = NULL;
+	printf("headers:\n-------------------------\n");
 
-	ll = establish_logical_layer(kws);
+	int i;
 
-	if (ll < 0) {
-		ks_log(KS_LOG_ERROR, "Read frame error from logical layer: ll = %d\n", ll);
-		return ll;
+	for (i = 0; i < KWS_MAX_HEADERS; i++) {
+		if (!request->headers_k[i] || !request->headers_v[i]) break;
+		printf("%s: %s\n", request->headers_k[i], request->headers_v[i]);
 	}
 
-	if (kws->down) {
-		ks_log(KS_LOG_ERROR, "Read frame error because kws is down");
-		return -1;
-	}
+	return NULL;
+}
+
+KS_DECLARE(void) kws_request_reset(kws_request_t *request)
+{
+	ks_size_t i = 0;
 
-	if (!kws->handshake) {
-		ks_log(KS_LOG_ERROR, "Read frame error because kws handshake is incomplete");
-		return kws_close(kws, WS_NONE);
+	if (!request) return;
+	if (request->_buffer) {
+		i = ((kws_request_buffer_t *)request->_buffer)->headers;
+		free(request->_buffer);
+		request->_buffer = NULL;
 	}
 
-	if ((kws->datalen = kws_string_read(kws, kws->buffer, 9 + 1, kws->block)) < 0) { // read 9 bytes into NULL terminated 10 byte buffer
-		ks_log(KS_LOG_ERROR, "Read frame error because kws_string_read returned %ld\n", kws->datalen);
-		if (kws->datalen == -2) {
-			return -2;
-		}
-		return kws_close(kws, WS_NONE);
+	/* Only what kws_parse_qs added is owned per entry */
+	for (; i < request->total_headers && i < KWS_MAX_HEADERS; i++) {
+		free((void *)request->headers_k[i]);
+		free((void *)request->headers_v[i]);
 	}
 
-	if (kws->datalen < need) {
-		ssize_t bytes = kws_string_read(kws, kws->buffer + kws->datalen, 9 - kws->datalen, WS_BLOCK);
+	memset(request->headers_k, 0, sizeof(request->headers_k));
+	memset(request->headers_v, 0, sizeof(request->headers_v));
+	request->total_headers = 0;
+}
 
-		if (bytes < 0 || (kws->datalen += bytes) < need) {
-			/* too small - protocol err */
-			ks_log(KS_LOG_ERROR, "Read frame error because kws_string_read: bytes = %ld, datalen = %ld, needed = %ld\n", bytes, kws->datalen, need);
-			return kws_close(kws, WS_NONE);
-		}
+KS_DECLARE(ks_ssize_t) kws_read_buffer(kws_t *kws, uint8_t **data, ks_size_t bytes, int block)
+{
+	if (bytes > kws->buflen) {
+		bytes = kws->buflen;
 	}
+	*data = kws->buffer;
+	return kws_string_read(kws, kws->buffer, bytes, block);
+}
 
-	*oc = *kws->buffer & 0xf;
+KS_DECLARE(ks_status_t) kws_keepalive(kws_t *kws)
+{
+	ks_ssize_t bytes = 0;;
+	kws->datalen = 0;
+	kws_http_init(&kws->http);
 
-	switch(*oc) {
-	case WSOC_CLOSE:
-		{
-			/* Nominal case, debug output only */
-			ks_log(KS_LOG_DEBUG, "Read frame OPCODE = WSOC_CLOSE\n");
-			kws->plen = kws->buffer[1] & 0x7f;
-			*data = (uint8_t *) &kws->buffer[2];
-			return kws_close(kws, WS_RECV_CLOSE);
+	while ((bytes = kws_string_read(kws, kws->buffer + kws->datalen, kws->buflen - kws->datalen, WS_BLOCK)) > 0) {
+		kws->datalen += bytes;
+		switch (kws_http_parse(&kws->http, kws->buffer, kws->datalen)) {
+		case 1:
+			return KS_STATUS_SUCCESS;
+		case -1:
+			return KS_STATUS_FAIL;
 		}
-		break;
-	case WSOC_CONTINUATION:
-	case WSOC_TEXT:
-	case WSOC_BINARY:
-	case WSOC_PING:
-	case WSOC_PONG:
-		{
-			int fin = (kws->buffer[0] >> 7) & 1;
-			int mask = (kws->buffer[1] >> 7) & 1;
+	}
 
+	return KS_STATUS_FAIL;
+}
 
-			if (!fin && *oc != WSOC_CONTINUATION) {
-				frag = 1;
-			} else if (fin && *oc == WSOC_CONTINUATION) {
-				frag = 0;
-			}
+KS_DECLARE(const char *) kws_request_get_header(kws_request_t *request, const char *key)
+{
+	ks_size_t i;
 
-			if (mask) {
-				need += 4;
+	for (i = 0; i < request->total_headers && i < KWS_MAX_HEADERS; i++) {
+		if (request->headers_k[i] && !strcmp(request->headers_k[i], key)) {
+			return request->headers_v[i];
+		}
+	}
 
-				if (need > kws->datalen) {
-					ks_ssize_t bytes = kws_string_read_blocking(kws, kws->buffer + kws->datalen, need - kws->datalen + 1, 10);
-					if (bytes < 0 || (kws->datalen += bytes) < need) {
-						/* too small - protocol err */
-						ks_log(KS_LOG_ERROR, "Read frame error because not enough data for mask\n");
-						*oc = WSOC_CLOSE;
-						return kws_close(kws, WS_NONE);
-					}
-				}
-			}
+	return NULL;
+}
 
-			kws->plen = kws->buffer[1] & 0x7f;
-			kws->payload = &kws->buffer[2];
+/*****************************************************************************/
+/* kws_loop: many connections driven by socket readiness from one thread */
+
+#define KWS_LOOP_EVENTS 64
+#define KWS_LOOP_MAX_WAIT 100 /* ms, how long a loop can go without noticing kws_loop_stop */
+#define KWS_LOOP_LINGER_MS 1000 /* how long a closing connection gets to write out its close frame */
+
+struct kws_loop_s {
+	ks_mutex_t *mutex;
+	kws_t *head;
+	ks_size_t count;
+	ks_size_t lingering;
+	volatile int running;
+#ifdef KWS_LOOP_EPOLL
+	int epfd;
+#else
+	ks_cond_t *cond;	/* wakes an empty loop when a connection is added or it is stopped */
+	struct pollfd *pfds;	/* poll set and its connections, grown with the count */
+	kws_t **conns;
+	ks_size_t poll_size;
+#endif
+};
 
-			if (kws->plen == 127) {
-				uint64_t *u64;
-				ks_ssize_t more = 0;
+/* One non blocking recv/SSL_read. Returns bytes, 0 on orderly close, -2 when it would block and -1 on error */
+static ks_ssize_t loop_recv(kws_t *kws, void *data, ks_size_t bytes)
+{
+	ks_ssize_t r;
 
-				need += 8;
+	kws->stats.read_calls++;
 
-				if (need > kws->datalen) {
-					ks_ssize_t bytes = kws_string_read_blocking(kws, kws->buffer + kws->datalen, need - kws->datalen + 1, 10);
-					if (bytes < 0 || (kws->datalen += bytes) < need) {
-						/* too small - protocol err */
-						ks_log(KS_LOG_ERROR, "Read frame error because kws_string_read: more = %ld, need = %ld, datalen = %ld\n", more, need, kws->datalen);
-						*oc = WSOC_CLOSE;
-						return kws_close(kws, WS_NONE);
-					}
-				}
+	if (kws->ssl) {
+		int ssl_err;
 
-				u64 = (uint64_t *) kws->payload;
-				kws->payload += 8;
-				kws->plen = (ks_ssize_t)ntoh64(*u64);
-			} else if (kws->plen == 126) {
-				uint16_t *u16;
+		ERR_clear_error();
 
-				need += 2;
+		if ((r = SSL_read(kws->ssl, data, (int)bytes)) > 0) {
+			kws->stats.bytes_read += r;
+			return r;
+		}
 
-				if (need > kws->datalen) {
-					ks_ssize_t bytes = kws_string_read_blocking(kws, kws->buffer + kws->datalen, need - kws->datalen + 1, 10);
-					if (bytes < 0 || (kws->datalen += bytes) < need) {
-						/* too small - protocol err */
-						ks_log(KS_LOG_ERROR, "Read frame error because kws_string_read: not enough data for packet length\n");
-						*oc = WSOC_CLOSE;
-						return kws_close(kws, WS_NONE);
-					}
-				}
+		ssl_err = SSL_get_error(kws->ssl, (int)r);
 
-				u16 = (uint16_t *) kws->payload;
-				kws->payload += 2;
-				kws->plen = ntohs(*u16);
-			}
+		if (ssl_err == SSL_ERROR_ZERO_RETURN) {
+			return 0;
+		}
 
-			if (mask) {
-				maskp = (char *)kws->payload;
-				kws->payload += 4;
-			}
+		if (SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+			kws->loop_want_write = ssl_err == SSL_ERROR_WANT_WRITE;
+			return -2;
+		}
 
-			need = (kws->plen - (kws->datalen - need));
+		if (SSL_IO_ERROR(ssl_err)) {
+			kws->ssl_io_error = 1;
+		}
 
-			if (need < 0) {
-				/* invalid read - protocol err .. */
-				ks_log(KS_LOG_ERROR, "Read frame error because need = %ld\n", need);
-				*oc = WSOC_CLOSE;
-				return kws_close(kws, WS_NONE);
-			}
+		return -1;
+	}
 
-			/* size already written to the body */
-			blen = (int)(kws->body - kws->bbuffer);
+	if ((r = recv(kws->sock, data, (int)bytes, 0)) > 0) {
+		kws->stats.bytes_read += r;
+		return r;
+	}
 
-			/* The bbuffer for the body of the message should always be 1 larger than the total size (for null term) */
-			if (blen + kws->plen >= (ks_ssize_t)kws->bbuflen) {
-				void *tmp;
+	if (r == 0) {
+		return 0;
+	}
 
-				/* must be a sum of the size already written to the body (blen) plus the size to be written (kws->plen) */
-				kws->bbuflen = blen + kws->plen; /* total size */
+	return ks_errno_is_blocking(ks_errno()) ? -2 : -1;
+}
 
-				/* and 1 more for NULL term */
-				kws->bbuflen++;
+/* One non blocking send/SSL_write, same returns as loop_recv */
+static ks_ssize_t loop_send(kws_t *kws, const void *data, ks_size_t bytes)
+{
+	ks_ssize_t r;
 
-				if (kws->payload_size_max && kws->bbuflen > kws->payload_size_max) {
-					/* size limit */
-					ks_log(KS_LOG_ERROR, "Read frame error because: payload length is too big\n");
-					*oc = WSOC_CLOSE;
-					return kws_close(kws, WS_NONE);
-				}
+	kws->stats.write_calls++;
 
-				// make room for entire payload plus null terminator
-				if ((tmp = ks_pool_resize(kws->bbuffer, (unsigned long)kws->bbuflen))) {
-					kws->bbuffer = tmp;
-				} else {
-					abort();
-				}
+	if (kws->ssl) {
+		int ssl_err;
 
-				kws->body = kws->bbuffer + blen;
-			}
+		ERR_clear_error();
 
-			kws->rplen = kws->plen - need;
+		if ((r = SSL_write(kws->ssl, data, (int)bytes)) > 0) {
+			return r;
+		}
 
-			if (kws->rplen) {
-				ks_assert((kws->body + kws->rplen) <= (kws->bbuffer + kws->bbuflen));
-				memcpy(kws->body, kws->payload, kws->rplen);
-			}
+		ssl_err = SSL_get_error(kws->ssl, (int)r);
 
-			ks_assert((kws->body + kws->plen) <= (kws->bbuffer + kws->bbuflen));
+		if (SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+			return -2;
+		}
 
-			while(need) {
-				ks_ssize_t r = kws_string_read(kws, kws->body + kws->rplen, need + 1, WS_BLOCK);
+		if (SSL_IO_ERROR(ssl_err)) {
+			kws->ssl_io_error = 1;
+		}
 
-				if (r < 1) {
-					/* invalid read - protocol err .. */
-					ks_log(KS_LOG_ERROR, "Read frame error because r = %ld\n", r);
-					*oc = WSOC_CLOSE;
-					return kws_close(kws, WS_NONE);
-				}
+		return -1;
+	}
 
-				kws->datalen += r;
-				kws->rplen += r;
-				need -= r;
-			}
+	if ((r = send(kws->sock, data, (int)bytes, 0)) >= 0) {
+		return r;
+	}
 
-			if (mask && maskp) {
-				ks_ssize_t i;
+	return ks_errno_is_blocking(ks_errno()) ? -2 : -1;
+}
 
-				for (i = 0; i < kws->plen; i++) {
-					kws->body[i] ^= maskp[i % 4];
-				}
-			}
+/* Ask for write readiness only while something is waiting to go out */
+static void loop_arm(kws_t *kws)
+{
+	int want = (kws->out_len || kws->loop_want_write) ? 1 : 0;
 
-			if (*oc == WSOC_TEXT) {
-				*(kws->body+kws->rplen) = '\0';
-			}
+	if (want == kws->loop_armed) {
+		return;
+	}
 
-			kws->packetlen += kws->rplen;
-			kws->body += kws->rplen;
+	kws->loop_armed = want;
 
-			if (frag) {
-				goto again;
-			}
+#ifdef KWS_LOOP_EPOLL
+	{
+		struct epoll_event ev = { 0 };
 
-			*data = (uint8_t *)kws->bbuffer;
+		ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+		ev.data.ptr = kws;
+		epoll_ctl(kws->loop->epfd, EPOLL_CTL_MOD, (int)kws->sock, &ev);
+	}
+#endif
+}
 
-			//printf("READ[%ld][%d]-----------------------------:\n[%s]\n-------------------------------\n", kws->packetlen, *oc, (char *)*data);
+/* kws_raw_write for a connection on a loop: write what the socket takes now and queue the rest for write readiness */
+static ks_ssize_t loop_write(kws_t *kws, const void *data, ks_size_t bytes)
+{
+	ks_ssize_t r = 0;
+	ks_size_t wrote = 0;
 
+	ks_mutex_lock(kws->write_mutex);
 
-			return kws->packetlen;
+	if (!kws->out_len) {
+		if ((r = loop_send(kws, data, bytes)) == -1) {
+			ks_mutex_unlock(kws->write_mutex);
+			return -1;
 		}
-		break;
-	default:
-		{
-			/* invalid op code - protocol err .. */
-			ks_log(KS_LOG_ERROR, "Read frame error because unknown opcode = %ld\n", *oc);
-			*oc = WSOC_CLOSE;
-			return kws_close(kws, WS_PROTO_ERR);
+
+		if (r > 0) {
+			wrote = (ks_size_t)r;
 		}
-		break;
 	}
-}
 
-#if 0
-static ks_ssize_t ws_feed_buf(kws_t *kws, void *data, ks_size_t bytes)
-{
+	if (wrote < bytes) {
+		if (ws_reserve(kws, &kws->out, &kws->out_size, kws->out_len + bytes - wrote) != KS_STATUS_SUCCESS) {
+			ks_mutex_unlock(kws->write_mutex);
+			return -1;
+		}
 
-	if (bytes + kws->wdatalen > kws->buflen) {
-		return -1;
+		memcpy(kws->out + kws->out_len, (uint8_t *)data + wrote, bytes - wrote);
+		kws->out_len += bytes - wrote;
+		loop_arm(kws);
 	}
 
-	memcpy(kws->wbuffer + kws->wdatalen, data, bytes);
-
-	kws->wdatalen += bytes;
+	ks_mutex_unlock(kws->write_mutex);
 
 	return bytes;
 }
 
-static ks_ssize_t ws_send_buf(kws_t *kws, kws_opcode_t oc)
+static int loop_flush(kws_t *kws)
 {
-	ks_ssize_t r = 0;
+	ks_ssize_t r;
 
-	if (!kws->wdatalen) {
-		return -1;
-	}
+	kws->loop_want_write = 0;
+
+	while (kws->out_len) {
+		if ((r = loop_send(kws, kws->out, kws->out_len)) == -1) {
+			return -1;
+		}
+
+		if (r == -2) {
+			break;
+		}
 
-	r = ws_write_frame(kws, oc, kws->wbuffer, kws->wdatalen);
+		kws->out_len -= r;
+		memmove(kws->out, kws->out + r, kws->out_len);
+	}
 
-	kws->wdatalen = 0;
+	loop_arm(kws);
 
-	return r;
+	return 0;
 }
-#endif
 
-KS_DECLARE(ks_ssize_t) kws_write_frame(kws_t *kws, kws_opcode_t oc, const void *data, ks_size_t bytes)
+/* TLS accept and the HTTP upgrade, resumed each time the socket is ready. 0 when done, -2 to wait, -1 on failure */
+static int loop_handshake(kws_t *kws)
 {
-	uint8_t hdr[14] = { 0 };
-	ks_size_t hlen = 2;
-	uint8_t *bp;
-	ks_ssize_t raw_ret = 0;
-	int mask = (kws->flags & KWS_FLAG_DONTMASK) ? 0 : 1;
+	ks_ssize_t r = 0;
+	int parsed;
 
-	if (kws->down) {
-		return -1;
-	}
+	if (kws->secure && !kws->secure_established) {
+		int code, ssl_err;
 
-	//printf("WRITE[%ld]-----------------------------:\n[%s]\n-----------------------------------\n", bytes, (char *) data);
+		if (!kws->ssl) {
+			if (!(kws->ssl = SSL_new(kws->ssl_ctx))) {
+				return -1;
+			}
 
-	hdr[0] = (uint8_t)(oc | 0x80);
+			SSL_set_fd(kws->ssl, (int)kws->sock);
+			SSL_set_mode(kws->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+			if (kws->flags & KWS_FLAG_KTLS) ks_ssl_request_ktls(kws->ssl);
+			if (kws->init_callback) kws->init_callback(kws, kws->ssl);
+		}
 
-	if (bytes < 126) {
-		hdr[1] = (uint8_t)bytes;
-	} else if (bytes < 0x10000) {
-		uint16_t *u16;
+		ERR_clear_error();
 
-		hdr[1] = 126;
-		hlen += 2;
+		if ((code = SSL_accept(kws->ssl)) != 1) {
+			ssl_err = SSL_get_error(kws->ssl, code);
+
+			if (code < 0 && SSL_ERROR_WANT_READ_WRITE(ssl_err)) {
+				kws->loop_want_write = ssl_err == SSL_ERROR_WANT_WRITE;
+				return -2;
+			}
 
-		u16 = (uint16_t *) &hdr[2];
-		*u16 = htons((uint16_t) bytes);
+			ks_log(KS_LOG_ERROR, "Failed to negotiate ssl connection with ssl error code: %d\n", ssl_err);
+			return -1;
+		}
 
-	} else {
-		uint64_t *u64;
+		kws->loop_want_write = 0;
+		kws->secure_established = 1;
+	}
 
-		hdr[1] = 127;
-		hlen += 8;
+	while (!(parsed = kws_http_parse(&kws->http, kws->buffer, kws->datalen))) {
+		if (kws->datalen >= (ks_ssize_t)kws->buflen - 1) {
+			return -1;
+		}
+
+		if ((r = loop_recv(kws, kws->buffer + kws->datalen, kws->buflen - kws->datalen - 1)) <= 0) {
+			return r == -2 ? -2 : -1;
+		}
 
-		u64 = (uint64_t *) &hdr[2];
-		*u64 = hton64(bytes);
+		kws->datalen += r;
+		kws->buffer[kws->datalen] = '\0';
 	}
 
-	if (kws->write_buffer_len < (hlen + bytes + 1 + mask * 4)) {
-		void *tmp;
+	/* Frames sent right behind the request */
+	if (parsed > 0 && kws->http.header_len < (ks_size_t)kws->datalen) {
+		ks_size_t extra = kws->datalen - kws->http.header_len;
 
-		kws->write_buffer_len = hlen + bytes + 1 + mask * 4;
-		if (!kws->write_buffer) kws->write_buffer = ks_pool_alloc(ks_pool_get(kws), (unsigned long)kws->write_buffer_len);
-		else if ((tmp = ks_pool_resize(kws->write_buffer, (unsigned long)kws->write_buffer_len))) {
-			kws->write_buffer = tmp;
-		} else {
-			abort();
+		if (ws_reserve(kws, &kws->in, &kws->in_size, extra) != KS_STATUS_SUCCESS) {
+			return -1;
 		}
+
+		memcpy(kws->in, kws->buffer + kws->http.header_len, extra);
+		kws->in_len = extra;
 	}
 
-	bp = (uint8_t *) kws->write_buffer;
-	memcpy(bp, (void *) &hdr[0], hlen);
+	if (ws_server_respond(kws, kws->datalen) < 0 || !kws->handshake) {
+		return -1;
+	}
 
-	if (mask) {
-		ks_size_t i;
-		uint8_t masking_key[4];
+	kws->logical_established = 1;
 
-		gen_nonce(masking_key, 4);
+	return 0;
+}
 
-		*(bp + 1) |= 0x80;
-		memcpy(bp + hlen, masking_key, 4);
-		hlen += 4;
+static void loop_deliver(kws_t *kws, kws_opcode_t oc, uint8_t *data, ks_size_t len);
 
-		for (i = 0; i < bytes; i++) {
-			*(bp + hlen + i) = (*((uint8_t *)data + i)) ^ (*(masking_key + (i % 4)));
-		}
-	} else {
-		memcpy(bp + hlen, data, bytes);
-	}
+/* A data message, inflating it first when it came compressed. -1 when it doesn't inflate */
+static int loop_deliver_data(kws_t *kws, kws_opcode_t oc, uint8_t *data, ks_size_t len, int deflated)
+{
+	ks_ssize_t out;
 
-	raw_ret = kws_raw_write(kws, bp, (hlen + bytes));
+	if (!deflated) {
+		loop_deliver(kws, oc, data, len);
+		return 0;
+	}
 
-	if (raw_ret <= 0 || raw_ret != (ks_ssize_t) (hlen + bytes)) {
-		return raw_ret;
+	if ((out = ws_inflate_message(kws, data, len)) < 0) {
+		return -1;
 	}
 
-	return bytes;
+	loop_deliver(kws, oc, kws->inflate_buf, (ks_size_t)out);
+
+	return 0;
 }
 
-KS_DECLARE(ks_status_t) kws_get_buffer(kws_t *kws, char **bufP, ks_size_t *buflen)
+static void loop_deliver(kws_t *kws, kws_opcode_t oc, uint8_t *data, ks_size_t len)
 {
-	*bufP = kws->buffer;
-	*buflen = kws->datalen;
+	uint8_t saved = data[len];
 
-	return KS_STATUS_SUCCESS;
-}
+	data[len] = '\0';
+	kws->stats.frames_read++;
 
-KS_DECLARE(ks_size_t) kws_sans_count(kws_t *kws)
-{
-	ks_assert(kws);
+	if (kws->callbacks.on_message) {
+		kws->callbacks.on_message(kws->loop, kws, oc, data, len, kws->user_data);
+	}
 
-	return kws->sans_count;
+	data[len] = saved;
 }
 
-KS_DECLARE(const char *) kws_sans_get(kws_t *kws, ks_size_t index)
+/* Hand every complete frame in the input buffer to on_message, leaving a partial one at the front. -1 closes the connection */
+static int loop_parse(kws_t *kws)
 {
-	ks_assert(kws);
-	if (index >= kws->sans_count) return NULL;
-	return kws->sans[index];
-}
+	ks_size_t off = 0;
+	int r = 0;
+
+	while (!kws->loop_closing) {
+		uint8_t *f = kws->in + off, *payload;
+		ks_size_t avail = kws->in_len - off, hlen = 2;
+		uint64_t plen;
+		int fin, mask;
+		kws_opcode_t oc;
+
+		if (avail < 2) break;
+
+		fin = (f[0] >> 7) & 1;
+		oc = f[0] & 0xf;
+		mask = (f[1] >> 7) & 1;
+		plen = f[1] & 0x7f;
+
+		if (plen == 126) {
+			uint16_t u16;
+
+			if (avail < 4) break;
+			memcpy(&u16, f + 2, 2);
+			plen = ntohs(u16);
+			hlen += 2;
+		} else if (plen == 127) {
+			uint64_t u64;
+
+			if (avail < 10) break;
+			memcpy(&u64, f + 2, 8);
+			plen = ntoh64(u64);
+			hlen += 8;
+		}
 
-KS_DECLARE(ks_status_t) kws_connect(kws_t **kwsP, ks_json_t *params, kws_flag_t flags, ks_pool_t *pool)
-{
-	return kws_connect_ex(kwsP, params, flags, pool, NULL, 30000);
-}
+		if (mask) hlen += 4;
 
-KS_DECLARE(ks_status_t) kws_connect_ex(kws_t **kwsP, ks_json_t *params, kws_flag_t flags, ks_pool_t *pool, SSL_CTX *ssl_ctx, uint32_t timeout_ms)
-{
-	ks_sockaddr_t addr = { 0 };
-	ks_socket_t cl_sock = KS_SOCK_INVALID;
-	int family = AF_INET;
-	const char *ip = "127.0.0.1";
-	ks_port_t port = 443;
-	// char buf[50] = "";
-	const char *url = ks_json_get_object_string(params, "url", NULL);
-	// const char *headers = ks_json_get_object_string(params, "headers", NULL);
-	const char *host = NULL;
-	const char *protocol = ks_json_get_object_string(params, "protocol", NULL);
-	const char *path = NULL;
-	char *p = NULL;
-	const char *client_data = NULL;
-	int destroy_ssl_ctx = 0;
-	ks_status_t status;
+		if ((kws->payload_size_max && (ks_ssize_t)(plen + kws->frag_len) >= kws->payload_size_max) || plen > (uint64_t)0x7fffffff) {
+			ks_log(KS_LOG_ERROR, "Read frame error because: payload length is too big\n");
+			kws->loop_closing = WS_PROTO_ERR;
+			r = -1;
+			break;
+		}
 
-	if (!url) {
-		ks_json_t *tmp;
+		if (avail < hlen + plen) {
+			/* Make room for the rest of it */
+			if (ws_reserve(kws, &kws->in, &kws->in_size, kws->in_len - off + (hlen + (ks_size_t)plen - avail)) != KS_STATUS_SUCCESS) {
+				r = -1;
+			}
+			break;
+		}
 
-		path = ks_json_get_object_string(params, "path", NULL);
-		host = ks_json_get_object_string(params, "host", NULL);
-		tmp = ks_json_get_object_item(params, "port");
-		ks_json_value_number_int(tmp, (int *)&port);
-	} else {
-		if (!strncmp(url, "wss://", 6)) {
-			if (!ssl_ctx) {
-#if OPENSSL_VERSION_NUMBER >= 0x10100000
-				ssl_ctx = SSL_CTX_new(TLS_client_method());
-#else
-				ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
-#endif
-				if (!ssl_ctx) {
-					unsigned long ssl_ctx_error = ERR_peek_error();
-					ks_log(KS_LOG_ERROR, "Failed to initiate SSL context with ssl error [%lu].\n", ssl_ctx_error);
-					return KS_STATUS_FAIL;
-				}
+		payload = f + hlen;
 
-				SSL_CTX_set_default_verify_paths(ssl_ctx);
+		if (mask) {
+			kws_mask(payload, payload, (ks_size_t)plen, f + hlen - 4, 0);
+		}
 
-				destroy_ssl_ctx++;
+		off += hlen + (ks_size_t)plen;
+
+		switch (oc) {
+		case WSOC_CLOSE:
+			kws->loop_closing = WS_RECV_CLOSE;
+			break;
+		case WSOC_PING:
+		case WSOC_PONG:
+			loop_deliver(kws, oc, payload, (ks_size_t)plen);
+			break;
+		case WSOC_TEXT:
+		case WSOC_BINARY:
+		case WSOC_CONTINUATION:
+			if (oc != WSOC_CONTINUATION && fin && !kws->frag_oc) {
+				if (loop_deliver_data(kws, oc, payload, (ks_size_t)plen, kws->deflate && (f[0] & 0x40)) < 0) {
+					kws->loop_closing = WS_PROTO_ERR;
+					r = -1;
+				}
+				break;
 			}
 
-			p = (char *)url + 6;
-		} else if (!strncmp(url, "ws://", 5))  {
-			p = (char *)url + 5;
-			port = 80;
-		} else {
-			*kwsP = NULL;
-			return KS_STATUS_FAIL;
-		}
+			/* Fragments are joined in bbuffer the same way kws_read_frame does */
+			if ((oc == WSOC_CONTINUATION) == !kws->frag_oc) {
+				kws->loop_closing = WS_PROTO_ERR;
+				r = -1;
+				break;
+			}
 
-		host = ks_pstrdup(pool, p);
+			if (oc != WSOC_CONTINUATION) {
+				kws->frag_oc = oc;
+				kws->frag_len = 0;
+				kws->frag_deflated = kws->deflate && (f[0] & 0x40);
+			}
 
-		// if (*host == '[') // todo ipv6
+			if (kws->frag_len + plen + 1 > kws->bbuflen) {
+				void *tmp;
 
-		if ((p = strchr(host, ':'))) {
-			*p++ = '\0';
-			if (p) {
-				port = (ks_port_t)atoi(p);
+				if (!(tmp = ks_pool_resize(kws->bbuffer, (unsigned long)(kws->frag_len + plen + 1)))) {
+					r = -1;
+					break;
+				}
+
+				kws->bbuffer = tmp;
+				kws->bbuflen = kws->frag_len + (ks_size_t)plen + 1;
 			}
-		} else {
-			p = (char *)host;
-		}
 
-		p = strchr(p, '/');
+			memcpy(kws->bbuffer + kws->frag_len, payload, (ks_size_t)plen);
+			kws->frag_len += (ks_size_t)plen;
 
-		if (p) {
-			path = ks_pstrdup(pool, p);
-			*p = '\0';
-		} else {
-			path = "/";
+			if (fin) {
+				oc = kws->frag_oc;
+				kws->frag_oc = 0;
+				if (loop_deliver_data(kws, oc, (uint8_t *)kws->bbuffer, kws->frag_len, kws->frag_deflated) < 0) {
+					kws->loop_closing = WS_PROTO_ERR;
+					r = -1;
+				}
+			}
+			break;
+		default:
+			ks_log(KS_LOG_ERROR, "Read frame error because unknown opcode = %d\n", oc);
+			kws->loop_closing = WS_PROTO_ERR;
+			r = -1;
+			break;
 		}
-	}
 
-	if (!host || !path) {
-		status = KS_STATUS_FAIL;
-		goto err;
+		if (r < 0) break;
 	}
 
-	status = ks_addr_getbyname(host, port, AF_UNSPEC, &addr);
-	if (status != KS_STATUS_SUCCESS) {
-		goto err;
+	if (off) {
+		kws->in_len -= off;
+		memmove(kws->in, kws->in + off, kws->in_len);
 	}
 
-	cl_sock = ks_socket_connect_ex(SOCK_STREAM, IPPROTO_TCP, &addr, timeout_ms);
+	return r;
+}
 
-	if (protocol) {
-		client_data = ks_psprintf(pool, "%s:%s:%s", path, host, protocol);
-	} else {
-		client_data = ks_psprintf(pool, "%s:%s", path, host);
+/* Queue the close frame behind anything already in kws->out and start the linger deadline */
+static void loop_queue_close(kws_t *kws)
+{
+	if (kws->loop_linger) {
+		return;
 	}
 
-	if (kws_init_ex(kwsP, cl_sock, ssl_ctx, client_data, flags, pool, params) != KS_STATUS_SUCCESS) {
-		status = KS_STATUS_FAIL;
-		goto err;
-	}
+	kws->loop_linger = ks_time_now() + (ks_time_t)KWS_LOOP_LINGER_MS * 1000;
 
-	if (destroy_ssl_ctx) {
-		(*kwsP)->destroy_ssl_ctx = 1;
+	if (!kws->down) {
+		ws_send_close(kws, (int16_t)kws->loop_closing);
 	}
+}
 
-	return KS_STATUS_SUCCESS;
+/* Keep a closing connection until the close frame and everything ahead of it is written.
+ * Loop thread only. Returns -1 once the connection can be finished, 0 to wait for write readiness */
+static int loop_linger(kws_t *kws)
+{
+	if (!kws->loop_linger) {
+		kws->loop->lingering++;
+		loop_queue_close(kws);
+	}
 
-err:
-	if (destroy_ssl_ctx) {
-		SSL_CTX_free(ssl_ctx);
+	if (loop_flush(kws) < 0 || !kws->out_len || ks_time_now() >= kws->loop_linger) {
+		return -1;
 	}
 
-	return status;
+	return 0;
 }
 
-KS_DECLARE(int) kws_wait_sock(kws_t *kws, uint32_t ms, ks_poll_t flags)
+/* Blocking version for when nothing will service the connection again */
+static void loop_drain(kws_t *kws)
 {
-	if (kws->sock == KS_SOCK_INVALID) return KS_POLL_ERROR;
+	ks_time_t now;
 
-	if (kws->unprocessed_buffer_len > 0) return KS_POLL_READ;
-
-	if (kws->ssl && SSL_pending(kws->ssl) > 0) return KS_POLL_READ;
-
-	return ks_wait_sock(kws->sock, ms, flags);
+	while (loop_linger(kws) == 0 && (now = ks_time_now()) < kws->loop_linger) {
+		ks_wait_sock(kws->sock, (uint32_t)((kws->loop_linger - now + 999) / 1000), KS_POLL_WRITE);
+	}
 }
 
-KS_DECLARE(int) kws_test_flag(kws_t *kws, kws_flag_t flag)
-{
-	return kws->flags & flag;
-}
-KS_DECLARE(int) kws_set_flag(kws_t *kws, kws_flag_t flag)
-{
-	return kws->flags |= flag;
-}
-KS_DECLARE(int) kws_clear_flag(kws_t *kws, kws_flag_t flag)
+static void loop_link(kws_loop_t *loop, kws_t *kws)
 {
-	return kws->flags &= ~flag;
+	ks_mutex_lock(loop->mutex);
+	kws->loop_prev = NULL;
+	kws->loop_next = loop->head;
+	if (loop->head) loop->head->loop_prev = kws;
+	loop->head = kws;
+	loop->count++;
+	ks_mutex_unlock(loop->mutex);
+
+#ifndef KWS_LOOP_EPOLL
+	ks_cond_signal(loop->cond);
+#endif
 }
 
-/* clean the uri to protect us from vulnerability attack */
-static ks_status_t clean_uri(char *uri)
+static void loop_finish(kws_loop_t *loop, kws_t *kws)
 {
-	int argc;
-	char *argv[64];
-	int last, i, len, uri_len = 0;
-	const unsigned int max_segments = sizeof(argv) / sizeof(argv[0]);
-
-	argc = ks_separate_string(uri, '/', argv, max_segments);
+	ks_mutex_lock(loop->mutex);
+	if (kws->loop_prev) kws->loop_prev->loop_next = kws->loop_next;
+	else loop->head = kws->loop_next;
+	if (kws->loop_next) kws->loop_next->loop_prev = kws->loop_prev;
+	loop->count--;
+	if (kws->loop_linger) loop->lingering--;
+	ks_mutex_unlock(loop->mutex);
+
+#ifdef KWS_LOOP_EPOLL
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, (int)kws->sock, NULL);
+#endif
 
-	if ((unsigned int)argc == max_segments) { /* too deep */
-		return KS_STATUS_FAIL;
+	if (kws->callbacks.on_close) {
+		kws->callbacks.on_close(loop, kws, kws->user_data);
 	}
 
-	last = 1;
-	for(i = 1; i < argc; i++) {
-		if (*argv[i] == '\0' || !strcmp(argv[i], ".")) {
-			/* ignore //// or /././././ */
-		} else if (!strcmp(argv[i], "..")) {
-			/* got /../, go up one level */
-			if (last > 1) last--;
-		} else {
-			argv[last++] = argv[i];
-		}
+	ks_mutex_lock(kws->write_mutex);
+
+	/* Connections that didn't linger (errors) still get one non blocking try at the close frame */
+	loop_queue_close(kws);
+	loop_flush(kws);
+
+	/* close_notify only after the close frame, nothing can be written once it is out */
+	if (kws->ssl && kws->secure_established && !kws->ssl_io_error) {
+		/* One close_notify attempt, a reactor can't sit in kws_close's bidirectional shutdown */
+		SSL_shutdown(kws->ssl);
+		SSL_set_shutdown(kws->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
 	}
 
-	for(i = 1; i < last; i++) {
-		len = strlen(argv[i]);
-		sprintf(uri + uri_len, "/%s", argv[i]);
-		uri_len += (len + 1);
+	if (!kws->down) {
+		kws_close(kws, (int16_t)kws->loop_closing);
 	}
 
-	if (*uri == '\0') {
-		*uri++ = '/';
-		*uri = '\0';
+	kws->loop = NULL;
+	ks_mutex_unlock(kws->write_mutex);
+
+	kws_loop_unref(&kws);
+}
+
+#ifdef KWS_LOOP_EPOLL
+/* A closing peer that stopped reading never reports write readiness, end it at its deadline.
+   Picked under the mutex but finished outside it, on_close may well call back into the loop */
+static void loop_sweep(kws_loop_t *loop)
+{
+	kws_t *kws, *expired = NULL;
+	ks_time_t now;
+
+	if (!loop->lingering) {
+		return;
 	}
 
-	return KS_STATUS_SUCCESS;
+	now = ks_time_now();
+
+	ks_mutex_lock(loop->mutex);
+	for (kws = loop->head; kws; kws = kws->loop_next) {
+		if (kws->loop_linger && now >= kws->loop_linger) {
+			kws->loop_sweep = expired;
+			expired = kws;
+		}
+	}
+	ks_mutex_unlock(loop->mutex);
+
+	while ((kws = expired)) {
+		expired = kws->loop_sweep;
+		loop_finish(loop, kws);
+	}
 }
+#endif
 
-KS_DECLARE(ks_status_t) kws_parse_qs(kws_request_t *request, char *qs)
+/* Work through whatever the socket is ready for. Returns -1 once the connection should be finished */
+static int loop_service(kws_t *kws, int readable, int writable)
 {
-	char *q;
-	char *next;
-	char *name, *val;
+	int r = 0;
 
-	if (qs) {
-		q = qs;
-	} else { /*parse our own qs, dup to avoid modify the original string */
-		q = strdup(request->qs);
+	ks_mutex_lock(kws->write_mutex);
+
+	if (writable || kws->loop_want_write) {
+		if (loop_flush(kws) < 0) {
+			r = -1;
+			goto end;
+		}
 	}
 
-	if (!q) return KS_STATUS_FAIL;
+	if (!kws->logical_established) {
+		if ((r = loop_handshake(kws)) == -2) {
+			r = 0;
+			goto end;
+		}
 
-	next = q;
+		if (r < 0) goto end;
 
-	while (q && request->total_headers < KWS_MAX_HEADERS) {
-		char *p;
+		if (kws->callbacks.on_open) {
+			kws->callbacks.on_open(kws->loop, kws, kws->user_data);
+		}
 
-		if ((next = strchr(next, '&'))) {
-			*next++ = '\0';
+		readable = 1;
+
+		if (kws->in_len && loop_parse(kws) < 0) {
+			r = -1;
+			goto end;
 		}
+	}
 
-		for (p = q; p && *p; p++) {
-			if (*p == '+') *p = ' ';
+	while (readable && !kws->loop_closing) {
+		ks_ssize_t bytes;
+
+		if (kws->in_len == kws->in_size && ws_reserve(kws, &kws->in, &kws->in_size, kws->in_size + 1) != KS_STATUS_SUCCESS) {
+			r = -1;
+			break;
 		}
 
-		ks_url_decode(q);
+		/* Drain it, TLS may be holding decrypted data the socket no longer reports */
+		if ((bytes = loop_recv(kws, kws->in + kws->in_len, kws->in_size - kws->in_len)) == -2) {
+			break;
+		}
 
-		name = q;
-		if ((val = strchr(name, '='))) {
-			*val++ = '\0';
-			request->headers_k[request->total_headers] = strdup(name);
-			request->headers_v[request->total_headers] = strdup(val);
-			request->total_headers++;
+		if (bytes <= 0) {
+			r = -1;
+			break;
+		}
+
+		kws->in_len += bytes;
+
+		if (loop_parse(kws) < 0) {
+			r = -1;
 		}
-		q = next;
 	}
 
-	if (!qs) {
-		ks_safe_free(q);
+ end:
+
+	if (kws->loop_closing) {
+		r = loop_linger(kws);
 	}
 
-	return KS_STATUS_SUCCESS;
+	if (r == 0) {
+		loop_arm(kws);
+	}
+
+	ks_mutex_unlock(kws->write_mutex);
+
+	return r;
 }
 
-KS_DECLARE(ks_status_t) kws_parse_header(kws_t *kws, kws_request_t **requestP)
+static ks_status_t loop_register(kws_loop_t *loop, kws_t *kws, const kws_loop_callbacks_t *callbacks, void *user_data)
 {
-	char *buffer = kws->buffer;
-	ks_size_t datalen = kws->datalen;
-	ks_status_t status = KS_STATUS_FAIL;
-	char *p = (char *)buffer;
-	int i = 10;
-	char *http = NULL;
-	int header_count;
-	char *headers[64] = { 0 };
-	int argc;
-	char *argv[2] = { 0 };
-	char *body = NULL;
+	if (callbacks) kws->callbacks = *callbacks;
+	kws->user_data = user_data;
+	kws->block = 0;
+	kws->flags &= ~KWS_BLOCK;
 
-	if (datalen < 16)	return status; /* minimum GET / HTTP/1.1\r\n */
+	kws->loop_refs = 1;
+	ks_socket_option(kws->sock, KS_SO_NONBLOCK, KS_TRUE);
 
-	while(i--) { // sanity check
-		if (*p++ == ' ') break;
+	if (kws->ssl) {
+		SSL_set_mode(kws->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 	}
 
-	if (i == 0) return status;
+	kws->loop = loop;
 
-	if ((body = strstr(buffer, "\r\n\r\n"))) {
-		*body = '\0';
-		body += 4;
-	} else if (( body = strstr(buffer, "\n\n"))) {
-		*body = '\0';
-		body += 2;
-	} else {
-		return status;
+	return KS_STATUS_SUCCESS;
+}
+
+static ks_status_t loop_watch(kws_loop_t *loop, kws_t *kws)
+{
+#ifdef KWS_LOOP_EPOLL
+	struct epoll_event ev = { 0 };
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = kws;
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, (int)kws->sock, &ev) < 0) {
+		return KS_STATUS_FAIL;
 	}
+#endif
 
-	ks_assert(requestP);
-	kws_request_t *request = *requestP;
+	loop_link(loop, kws);
 
-	if (!request) request = malloc(sizeof(kws_request_t));
-	if (!request) return status;
-	memset(request, 0, sizeof(kws_request_t));
-	*requestP = request;
+	return KS_STATUS_SUCCESS;
+}
 
-	request->_buffer = strdup(buffer);
-	ks_assert(request->_buffer);
-	request->method = request->_buffer;
-	request->bytes_buffered = datalen;
-	request->bytes_header = body - buffer;
-	request->bytes_read = body - buffer;
+KS_DECLARE(ks_status_t) kws_loop_create(kws_loop_t **loopP, ks_pool_t *pool)
+{
+	kws_loop_t *loop;
 
-	p = strchr(request->method, ' ');
+	ks_assert(loopP);
 
-	if (!p) goto err;
+	loop = ks_pool_alloc(pool, sizeof(*loop));
 
-	*p++ = '\0';
+#ifdef KWS_LOOP_EPOLL
+	if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		ks_pool_free(&loop);
+		return KS_STATUS_FAIL;
+	}
+#else
+	if (ks_cond_create(&loop->cond, pool) != KS_STATUS_SUCCESS) {
+		ks_pool_free(&loop);
+		return KS_STATUS_FAIL;
+	}
+#endif
 
-	if (*p != '/') goto err; /* must start from '/' */
+	ks_mutex_create(&loop->mutex, KS_MUTEX_FLAG_DEFAULT, pool);
 
-	request->uri = p;
-	p = strchr(request->uri, ' ');
+	*loopP = loop;
 
-	if (!p) goto err;
+	return KS_STATUS_SUCCESS;
+}
 
-	*p++ = '\0';
-	http = p;
+KS_DECLARE(void) kws_loop_destroy(kws_loop_t **loopP)
+{
+	kws_loop_t *loop;
 
-	p = strchr(request->uri, '?');
+	ks_assert(loopP);
 
-	if (p) {
-		*p++ = '\0';
-		request->qs = p;
+	if (!(loop = *loopP)) {
+		return;
 	}
 
-	if (clean_uri((char *)request->uri) != KS_STATUS_SUCCESS) {
-		goto err;
-	}
+	*loopP = NULL;
 
-	if (!strncmp(http, "HTTP/1.1", 8)) {
-		request->keepalive = KS_TRUE;
-	} else if (strncmp(http, "HTTP/1.0", 8)) {
-		goto err;
-	}
+	while (loop->head) {
+		kws_t *kws = loop->head;
 
-	p = strchr(http, '\n');
+		ks_mutex_lock(kws->write_mutex);
+		if (!kws->loop_closing) kws->loop_closing = WS_NORMAL_CLOSE;
+		loop_drain(kws);
+		ks_mutex_unlock(kws->write_mutex);
 
-	if (p) {
-		*p++ = '\0'; // now the first header
-	} else {
-		goto noheader;
+		loop_finish(loop, kws);
 	}
 
-	header_count = ks_separate_string(p, '\n', headers, sizeof(headers)/ sizeof(headers[0]));
-
-	if (header_count < 1) goto err;
+#ifdef KWS_LOOP_EPOLL
+	close(loop->epfd);
+#else
+	ks_cond_destroy(&loop->cond);
+	if (loop->pfds) ks_pool_free(&loop->pfds);
+	if (loop->conns) ks_pool_free(&loop->conns);
+#endif
 
-	for (i = 0; i < header_count; i++) {
-		char *header, *value;
-		int len;
+	ks_mutex_destroy(&loop->mutex);
+	ks_pool_free(&loop);
+}
 
-		argc = ks_separate_string(headers[i], ':', argv, 2);
+KS_DECLARE(ks_status_t) kws_loop_accept(kws_loop_t *loop, ks_socket_t sock, SSL_CTX *ssl_ctx, kws_flag_t flags, ks_json_t *params,
+										const kws_loop_callbacks_t *callbacks, void *user_data, kws_t **kwsP)
+{
+	kws_t *kws = NULL;
 
-		if (argc != 2) goto err;
+	if (kws_setup(&kws, sock, ssl_ctx, NULL, flags | KWS_CLOSE_SOCK, ks_pool_get(loop), params) != KS_STATUS_SUCCESS) {
+		return KS_STATUS_FAIL;
+	}
 
-		header = argv[0];
-		value = argv[1];
+	loop_register(loop, kws, callbacks, user_data);
 
-		while (*value == ' ') value++;
+	if (loop_watch(loop, kws) != KS_STATUS_SUCCESS) {
+		kws->loop = NULL;
+		kws_destroy(&kws);
+		return KS_STATUS_FAIL;
+	}
 
-		len = strlen(value);
+	if (kwsP) *kwsP = kws;
 
-		if (len && *(value + len - 1) == '\r') *(value + len - 1) = '\0';
+	return KS_STATUS_SUCCESS;
+}
 
-		request->headers_k[i] = strdup(header);
-		request->headers_v[i] = strdup(value);
+KS_DECLARE(ks_status_t) kws_loop_add(kws_loop_t *loop, kws_t *kws, const kws_loop_callbacks_t *callbacks, void *user_data)
+{
+	kws_flag_t flags;
+	int block, r = 0;
 
-		if (!strncasecmp(header, "User-Agent", 10)) {
-			request->user_agent = value;
-		} else if (!strncasecmp(header, "Host", 4)) {
-			request->host = value;
-			p = strchr(value, ':');
+	if (kws->loop || kws->down || !kws->logical_established) {
+		return KS_STATUS_INVALID_ARGUMENT;
+	}
 
-			if (p) {
-				*p++ = '\0';
+	/* The loop writes as it goes, so nothing is held back once it owns the connection */
+	if (ws_cork_flush(kws) < 0) {
+		return KS_STATUS_FAIL;
+	}
 
-				if (*p) request->port = (ks_port_t)atoi(p);
-			}
-		} else if (!strncasecmp(header, "Content-Type", 12)) {
-			request->content_type = value;
-		} else if (!strncasecmp(header, "Content-Length", 14)) {
-			request->content_length = atoi(value);
-		} else if (!strncasecmp(header, "Referer", 7)) {
-			request->referer = value;
-		} else if (!strncasecmp(header, "Authorization", 7)) {
-			request->authorization = value;
-		}
+	block = kws->block;
+	flags = kws->flags;
+	loop_register(loop, kws, callbacks, user_data);
+
+	/* Bytes that arrived with the handshake or were already read ahead */
+	if (kws->unprocessed_buffer_len) {
+		ws_reserve(kws, &kws->in, &kws->in_size, kws->unprocessed_buffer_len);
+		memcpy(kws->in, kws->unprocessed_position, kws->unprocessed_buffer_len);
+		kws->in_len = kws->unprocessed_buffer_len;
+		kws->unprocessed_buffer_len = 0;
+		kws->unprocessed_position = NULL;
 	}
 
-	request->total_headers = i;
-	if (datalen >= body - buffer) {
-		kws->datalen = datalen -= (body - buffer);
+	if (kws->callbacks.on_open) {
+		kws->callbacks.on_open(loop, kws, user_data);
 	}
 
-	if (datalen > 0) {
-		// shift remining bytes to start of buffer including ending '\0'
-		memmove(buffer, body, datalen + 1);
-		kws->unprocessed_buffer_len = datalen;
-		kws->unprocessed_position = kws->buffer;
+	if (kws->in_len) {
+		ks_mutex_lock(kws->write_mutex);
+		r = loop_parse(kws);
+		ks_mutex_unlock(kws->write_mutex);
 	}
 
-noheader:
+	if (r < 0 || loop_watch(loop, kws) != KS_STATUS_SUCCESS) {
+		/* Handed back to the caller the way it came in, on_close pairs with the on_open above */
+		if (kws->callbacks.on_close) {
+			kws->callbacks.on_close(loop, kws, user_data);
+		}
 
-	if (request->qs) {
-		kws_parse_qs(request, NULL);
+		kws->loop = NULL;
+		kws->loop_refs = 0;
+		kws->block = block;
+		kws->flags = flags;
+		ks_socket_option(kws->sock, KS_SO_NONBLOCK, KS_FALSE);
+
+		return KS_STATUS_FAIL;
 	}
 
 	return KS_STATUS_SUCCESS;
-
-err:
-	kws_request_free(requestP);
-	return status;
 }
 
-KS_DECLARE(void) kws_request_free(kws_request_t **request)
+KS_DECLARE(void) kws_loop_close(kws_t *kws, int16_t reason)
 {
-	if (!request || !*request) return;
-	kws_request_reset(*request);
-	free(*request);
-	*request = NULL;
-}
+	if (!kws->loop_refs) {
+		return;
+	}
 
-KS_DECLARE(char *) kws_request_dump(kws_request_t *request)
-{
-	if (!request || !request->method) return NULL;
+	ks_mutex_lock(kws->write_mutex);
 
-	printf("method: %s\n", request->method);
+	if (kws->loop && !kws->down) {
+		if (!kws->loop_closing) {
+			kws->loop_closing = reason ? reason : WS_NORMAL_CLOSE;
+		}
 
-	if (request->uri) printf("uri: %s\n", request->uri);
-	if (request->qs)  printf("qs: %s\n", request->qs);
-	if (request->host) printf("host: %s\n", request->host);
-	if (request->port) printf("port: %d\n", request->port);
-	if (request->from) printf("from: %s\n", request->from);
-	if (request->user_agent) printf("user_agent: %s\n", request->user_agent);
-	if (request->referer) printf("referer: %s\n", request->referer);
-	if (request->user) printf("user: %s\n", request->user);
-	printf("keepalive: %d\n", request->keepalive);
-	if (request->content_type) printf("content_type: %s\n", request->content_type);
-	if (request->content_length) printf("content_length: %u\n", (uint32_t)request->content_length);
-	if (request->authorization) printf("authorization: %s\n", request->authorization);
+		/* Shutting down the read side (0 is SHUT_RD/SD_RECEIVE) reports EOF, which wakes the loop up to finish it */
+		ks_socket_shutdown(kws->sock, 0);
+	}
 
-	printf("headers:\n-------------------------\n");
+	ks_mutex_unlock(kws->write_mutex);
+}
 
-	int i;
+KS_DECLARE(ks_status_t) kws_loop_ref(kws_t *kws)
+{
+	ks_status_t status = KS_STATUS_INVALID_ARGUMENT;
 
-	for (i = 0; i < KWS_MAX_HEADERS; i++) {
-		if (!request->headers_k[i] || !request->headers_v[i]) break;
-		printf("%s: %s\n", request->headers_k[i], request->headers_v[i]);
+	ks_mutex_lock(kws->write_mutex);
+	if (kws->loop_refs) {
+		kws->loop_refs++;
+		status = KS_STATUS_SUCCESS;
 	}
+	ks_mutex_unlock(kws->write_mutex);
 
-	return NULL;
+	return status;
 }
 
-KS_DECLARE(void) kws_request_reset(kws_request_t *request)
+KS_DECLARE(void) kws_loop_unref(kws_t **kwsP)
 {
-	int i;
+	kws_t *kws;
+	int refs;
 
-	if (!request) return;
-	if (request->_buffer) {
-		free(request->_buffer);
-		request->_buffer = NULL;
+	ks_assert(kwsP);
+
+	if (!(kws = *kwsP)) {
+		return;
 	}
 
-	for (i = 0; i < KWS_MAX_HEADERS; i++) {
-		if (!request->headers_k[i] || !request->headers_v[i]) break;
-		free((void *)request->headers_k[i]);
-		request->headers_k[i] = NULL;
-		free((void *)request->headers_v[i]);
-		request->headers_v[i] = NULL;
+	*kwsP = NULL;
+
+	ks_mutex_lock(kws->write_mutex);
+	refs = --kws->loop_refs;
+	ks_mutex_unlock(kws->write_mutex);
+
+	if (refs) {
+		return;
 	}
 
-	request->total_headers = 0;
+	kws_destroy(&kws);
 }
 
-KS_DECLARE(ks_ssize_t) kws_read_buffer(kws_t *kws, uint8_t **data, ks_size_t bytes, int block)
+KS_DECLARE(ks_size_t) kws_loop_count(kws_loop_t *loop)
 {
-	if (bytes > kws->buflen) {
-		bytes = kws->buflen;
-	}
-	*data = kws->buffer;
-	return kws_string_read(kws, kws->buffer, bytes, block);
+	return loop->count;
 }
 
-KS_DECLARE(ks_status_t) kws_keepalive(kws_t *kws)
+KS_DECLARE(int) kws_loop_run_once(kws_loop_t *loop, uint32_t timeout_ms)
 {
-	ks_ssize_t bytes = 0;;
-	kws->datalen = 0;
+	int i, n;
+#ifdef KWS_LOOP_EPOLL
+	struct epoll_event events[KWS_LOOP_EVENTS];
 
-	while ((bytes = kws_string_read(kws, kws->buffer + kws->datalen, kws->buflen - kws->datalen, WS_BLOCK)) > 0) {
-		kws->datalen += bytes;
-		if (strstr(kws->buffer, "\r\n\r\n") || strstr(kws->buffer, "\n\n")) {
-			return KS_STATUS_SUCCESS;
+	if ((n = epoll_wait(loop->epfd, events, KWS_LOOP_EVENTS, (int)timeout_ms)) < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		kws_t *kws = (kws_t *)events[i].data.ptr;
+		int readable = (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? 1 : 0;
+		int writable = (events[i].events & EPOLLOUT) ? 1 : 0;
+
+		if (loop_service(kws, readable, writable) < 0) {
+			loop_finish(loop, kws);
 		}
 	}
 
-	return KS_STATUS_FAIL;
+	loop_sweep(loop);
+#else
+	kws_t *kws;
+	ks_size_t count;
+
+	/* No epoll here, poll a snapshot of the connections instead */
+	ks_mutex_lock(loop->mutex);
+	count = loop->count;
+
+	/* Nothing to poll, wait for kws_loop_add or kws_loop_stop rather than sleeping through them */
+	if (!count) {
+		ks_mutex_unlock(loop->mutex);
+
+		ks_cond_lock(loop->cond);
+		if (!loop->count) ks_cond_timedwait(loop->cond, timeout_ms);
+		ks_cond_unlock(loop->cond);
+
+		return 0;
+	}
+
+	/* Only reallocated when the loop has more connections than ever before */
+	if (count > loop->poll_size) {
+		if (loop->pfds) {
+			loop->pfds = ks_pool_resize(loop->pfds, sizeof(*loop->pfds) * count);
+			loop->conns = ks_pool_resize(loop->conns, sizeof(*loop->conns) * count);
+		} else {
+			loop->pfds = ks_pool_alloc(ks_pool_get(loop), sizeof(*loop->pfds) * count);
+			loop->conns = ks_pool_alloc(ks_pool_get(loop), sizeof(*loop->conns) * count);
+		}
+		loop->poll_size = count;
+	}
+
+	for (i = 0, kws = loop->head; kws; kws = kws->loop_next, i++) {
+		loop->conns[i] = kws;
+		loop->pfds[i].fd = kws->sock;
+		loop->pfds[i].events = POLLIN | (kws->loop_armed ? POLLOUT : 0);
+		loop->pfds[i].revents = 0;
+	}
+	ks_mutex_unlock(loop->mutex);
+
+	if ((n = ks_poll(loop->pfds, (uint32_t)count, (int)timeout_ms)) < 0) {
+		return ks_errno_is_interupt(ks_errno()) ? 0 : -1;
+	}
+
+	/* Closing connections are serviced on a timeout too, that is what ends them at their deadline */
+	for (i = 0; i < (int)count; i++) {
+		struct pollfd *pfd = &loop->pfds[i];
+
+		if (!pfd->revents && !loop->conns[i]->loop_closing) continue;
+
+		if (loop_service(loop->conns[i], (pfd->revents & (POLLIN | POLLHUP | POLLERR)) ? 1 : 0, (pfd->revents & POLLOUT) ? 1 : 0) < 0) {
+			loop_finish(loop, loop->conns[i]);
+		}
+	}
+#endif
+
+	return n;
 }
 
-KS_DECLARE(const char *) kws_request_get_header(kws_request_t *request, const char *key)
+KS_DECLARE(void) kws_loop_run(kws_loop_t *loop)
 {
-	int i;
+	loop->running = 1;
 
-	for (i = 0; i < KWS_MAX_HEADERS; i++) {
-		if (request->headers_k[i] && !strcmp(request->headers_k[i], key)) {
-			return request->headers_v[i];
+	while (loop->running) {
+		if (kws_loop_run_once(loop, KWS_LOOP_MAX_WAIT) < 0) {
+			break;
 		}
 	}
+}
 
-	return NULL;
+KS_DECLARE(void) kws_loop_stop(kws_loop_t *loop)
+{
+	loop->running = 0;
+
+#ifndef KWS_LOOP_EPOLL
+	ks_cond_signal(loop->cond);
+#endif
 }
+
 /* For Emacs:
  * Local Variables:
  * mode:c
@@ -23,14 +23,14 @@
 #include "libks/ks.h"
 #include "tap.h"
 
-int test1(void)
+int test1(ks_hash_flag_t flags)
 {
 	ks_pool_t *pool;
 	ks_hash_t *hash;
 	int i, sum1 = 0, sum2 = 0;
 
 	ks_pool_open(&pool);
-	ks_hash_create(&hash, KS_HASH_MODE_DEFAULT, KS_HASH_FREE_BOTH | KS_HASH_FLAG_RWLOCK, pool);
+	ks_hash_create(&hash, KS_HASH_MODE_DEFAULT, KS_HASH_FREE_BOTH | KS_HASH_FLAG_RWLOCK | flags, pool);
 
 	for (i = 1; i < 1001; i++) {
 		char *key = ks_pprintf(pool, "KEY %d", i);
@@ -150,7 +150,7 @@ int test2(void)
 }
 
 #define TEST3_SIZE 20
-int test3(void)
+int test3(ks_hash_flag_t flags)
 {
 	ks_pool_t *pool;
 	ks_hash_t *hash;
@@ -160,7 +160,7 @@ int test3(void)
 	char *A, *B, *C;
 
 	ks_pool_open(&pool);
-	ks_hash_create(&hash, KS_HASH_MODE_ARBITRARY, KS_HASH_FLAG_NOLOCK, pool);
+	ks_hash_create(&hash, KS_HASH_MODE_ARBITRARY, KS_HASH_FLAG_NOLOCK | flags, pool);
 	ks_hash_set_keysize(hash, TEST3_SIZE);
 
 	ks_hash_insert(hash, data, "FOO");
@@ -183,6 +183,324 @@ int test3(void)
 
 }
 
+static int destroyed = 0;
+
+static void count_destructor(void *ptr)
+{
+	destroyed++;
+}
+
+/* Churn an open addressing table through growth and tombstone rebuilds, checking it against a plain array */
+int test_open(void)
+{
+	ks_pool_t *pool;
+	ks_hash_t *hash;
+	ks_hash_iterator_t *itt;
+	static intptr_t present[4096];
+	intptr_t i, k;
+	int count = 0, seen = 0;
+
+	ks_pool_open(&pool);
+	ks_hash_create(&hash, KS_HASH_MODE_INT, KS_HASH_FLAG_NOLOCK | KS_HASH_FLAG_DUP_CHECK | KS_HASH_FLAG_OPEN_ADDRESSING, pool);
+	ks_hash_set_destructor(hash, count_destructor);
+
+	srand(1234);
+	memset(present, 0, sizeof(present));
+
+	for (i = 0; i < 200000; i++) {
+		k = rand() % 4096;
+
+		if (rand() % 3) {
+			if (!present[k]) count++;
+			present[k] = i + 1;
+			ks_hash_insert(hash, (void *)k, (void *)(i + 1));
+		} else {
+			if (present[k]) count--;
+			present[k] = 0;
+			ks_hash_remove(hash, (void *)k);
+		}
+	}
+
+	if ((int)ks_hash_count(hash) != count) return 0;
+
+	for (k = 0; k < 4096; k++) {
+		if ((intptr_t)ks_hash_search(hash, (void *)k, KS_UNLOCKED) != present[k]) return 0;
+	}
+
+	for (itt = ks_hash_first(hash, KS_UNLOCKED); itt; itt = ks_hash_next(&itt)) {
+		const void *key;
+		void *val;
+
+		ks_hash_this(itt, &key, NULL, &val);
+		if (present[(intptr_t)key] != (intptr_t)val) return 0;
+		seen++;
+	}
+
+	if (seen != count) return 0;
+
+	destroyed = 0;
+	ks_hash_destroy(&hash);
+	ks_pool_close(&pool);
+
+	return destroyed == count;
+}
+
+#define SHARD_THREADS 4
+#define SHARD_KEYS 2048
+#define SHARD_OPS 100000
+
+typedef struct {
+	ks_hash_t *hash;
+	ks_locked_t locked;
+	int id;
+	int bad;
+	ks_time_t elapsed;
+} shard_job_t;
+
+/* Values always equal their key so a reader can spot a torn or stale entry */
+static void *shard_thread(ks_thread_t *thread, void *data)
+{
+	shard_job_t *job = (shard_job_t *) data;
+	intptr_t k, v;
+	unsigned int seed = job->id;
+	int i;
+
+	job->elapsed = ks_time_now();
+
+	for (i = 0; i < SHARD_OPS; i++) {
+		seed = seed * 1103515245 + 12345;
+		k = ((seed >> 8) % SHARD_KEYS) + 1;
+
+		if ((seed >> 4) % 10 == 0) {
+			/* Each thread only writes its own slice of the key space */
+			k = k - (k % SHARD_THREADS) + job->id;
+			if (k == 0) k = SHARD_THREADS;
+
+			if ((seed >> 20) & 1) {
+				ks_hash_insert(job->hash, (void *)k, (void *)k);
+			} else {
+				ks_hash_remove(job->hash, (void *)k);
+			}
+		} else {
+			v = (intptr_t)ks_hash_search(job->hash, (void *)k, job->locked);
+			if (job->locked == KS_READLOCKED) ks_hash_read_unlock(job->hash);
+			if (v && v != k) job->bad++;
+		}
+	}
+
+	job->elapsed = ks_time_now() - job->elapsed;
+
+	return NULL;
+}
+
+static ks_time_t shard_run(ks_hash_flag_t flags, int *bad)
+{
+	ks_thread_t *threads[SHARD_THREADS];
+	shard_job_t jobs[SHARD_THREADS];
+	ks_pool_t *pool;
+	ks_hash_t *hash;
+	ks_time_t elapsed = 0;
+	intptr_t k;
+	int i;
+
+	ks_pool_open(&pool);
+	ks_hash_create(&hash, KS_HASH_MODE_INT, flags, pool);
+
+	for (k = 1; k <= SHARD_KEYS; k++) {
+		ks_hash_insert(hash, (void *)k, (void *)k);
+	}
+
+	for (i = 0; i < SHARD_THREADS; i++) {
+		jobs[i].hash = hash;
+		/* Sharded lookups are safe without any lock */
+		jobs[i].locked = (flags & KS_HASH_FLAG_SHARDED) ? KS_UNLOCKED : KS_READLOCKED;
+		jobs[i].id = i;
+		jobs[i].bad = 0;
+		ks_thread_create(&threads[i], shard_thread, &jobs[i], pool);
+	}
+
+	for (i = 0; i < SHARD_THREADS; i++) {
+		ks_thread_join(threads[i]);
+		ks_thread_destroy(&threads[i]);
+		*bad += jobs[i].bad;
+		elapsed += jobs[i].elapsed;
+	}
+
+	ks_hash_destroy(&hash);
+	ks_pool_close(&pool);
+
+	return elapsed;
+}
+
+/* Unlocked lookups racing inserts and removes, then compare against a whole table lock */
+int test_sharded(void)
+{
+	ks_time_t t[3];
+	int bad = 0;
+
+	t[0] = shard_run(KS_HASH_FLAG_SHARDED, &bad);
+	t[1] = shard_run(KS_HASH_FLAG_SHARDED | KS_HASH_FLAG_OPEN_ADDRESSING, &bad);
+	t[2] = shard_run(KS_HASH_FLAG_RWLOCK, &bad);
+
+	printf("BENCH %d threads 90%% lookups: sharded %lldus sharded+open %lldus rwlock %lldus\n", SHARD_THREADS,
+		   (long long)t[0], (long long)t[1], (long long)t[2]);
+
+	return bad == 0;
+}
+
+typedef struct {
+	ks_hash_t *hash;
+	int op;
+	volatile int done;
+} lock_job_t;
+
+static void *lock_thread(ks_thread_t *thread, void *data)
+{
+	lock_job_t *job = (lock_job_t *) data;
+
+	if (job->op == 0) {
+		ks_hash_read_lock(job->hash);
+		ks_hash_read_unlock(job->hash);
+	} else if (job->op == 1) {
+		ks_hash_insert(job->hash, (void *)(intptr_t)2, (void *)(intptr_t)2);
+	} else {
+		ks_hash_search(job->hash, (void *)(intptr_t)1, KS_UNLOCKED);
+	}
+
+	job->done = 1;
+
+	return NULL;
+}
+
+/* Runs op on another thread, returns whether it finished within ms */
+static int lock_try(ks_hash_t *hash, int op, int ms, ks_thread_t **thread, lock_job_t *job)
+{
+	job->hash = hash;
+	job->op = op;
+	job->done = 0;
+	ks_thread_create(thread, lock_thread, job, ks_pool_get(hash));
+
+	while (!job->done && ms-- > 0) {
+		ks_sleep_ms(1);
+	}
+
+	return job->done;
+}
+
+static void lock_join(ks_thread_t **thread)
+{
+	ks_thread_join(*thread);
+	ks_thread_destroy(thread);
+}
+
+/* The whole table locks of a sharded table behave like RWLOCK's: shared reads, exclusive writes */
+int test_sharded_locks(void)
+{
+	ks_thread_t *thread;
+	lock_job_t job;
+	ks_pool_t *pool;
+	ks_hash_t *hash;
+	int r = 1;
+
+	ks_pool_open(&pool);
+	ks_hash_create(&hash, KS_HASH_MODE_INT, KS_HASH_FLAG_SHARDED, pool);
+	ks_hash_insert(hash, (void *)(intptr_t)1, (void *)(intptr_t)1);
+
+	ks_hash_read_lock(hash);
+	if (!lock_try(hash, 0, 1000, &thread, &job)) r = 0;
+	lock_join(&thread);
+	if (lock_try(hash, 1, 100, &thread, &job)) r = 0;
+	ks_hash_read_unlock(hash);
+	lock_join(&thread);
+
+	ks_hash_write_lock(hash);
+	if (lock_try(hash, 2, 100, &thread, &job)) r = 0;
+	/* The holder itself can still look up and write */
+	if (ks_hash_search(hash, (void *)(intptr_t)1, KS_UNLOCKED) != (void *)(intptr_t)1) r = 0;
+	ks_hash_insert(hash, (void *)(intptr_t)3, (void *)(intptr_t)3);
+	ks_hash_write_unlock(hash);
+	lock_join(&thread);
+
+	if (!job.done || ks_hash_search(hash, (void *)(intptr_t)2, KS_UNLOCKED) != (void *)(intptr_t)2) r = 0;
+
+	ks_hash_destroy(&hash);
+	ks_pool_close(&pool);
+
+	return r;
+}
+
+#define BENCH_KEYS 200000
+
+static void bench(const char *name, ks_hash_mode_t mode, ks_hash_flag_t flags, void **keys, void **misses)
+{
+	ks_pool_t *pool;
+	ks_hash_t *hash;
+	ks_time_t t[4];
+	int i, found = 0;
+
+	ks_pool_open(&pool);
+	ks_hash_create(&hash, mode, KS_HASH_FLAG_NOLOCK | flags, pool);
+
+	t[0] = ks_time_now();
+	for (i = 0; i < BENCH_KEYS; i++) {
+		ks_hash_insert(hash, keys[i], keys[i]);
+	}
+	t[0] = ks_time_now() - t[0];
+
+	t[1] = ks_time_now();
+	for (i = 0; i < BENCH_KEYS; i++) {
+		found += ks_hash_search(hash, keys[i], KS_UNLOCKED) != NULL;
+	}
+	t[1] = ks_time_now() - t[1];
+
+	t[2] = ks_time_now();
+	for (i = 0; i < BENCH_KEYS; i++) {
+		found += ks_hash_search(hash, misses[i], KS_UNLOCKED) != NULL;
+	}
+	t[2] = ks_time_now() - t[2];
+
+	t[3] = ks_time_now();
+	for (i = 0; i < BENCH_KEYS; i++) {
+		ks_hash_remove(hash, keys[i]);
+	}
+	t[3] = ks_time_now() - t[3];
+
+	printf("BENCH %-16s %-8s insert %6lldus hit %6lldus miss %6lldus remove %6lldus (%d found)\n", name,
+		   (flags & KS_HASH_FLAG_OPEN_ADDRESSING) ? "open" : "chained",
+		   (long long)t[0], (long long)t[1], (long long)t[2], (long long)t[3], found);
+
+	ks_hash_destroy(&hash);
+	ks_pool_close(&pool);
+}
+
+static void bench_all(void)
+{
+	ks_pool_t *pool;
+	void **keys, **misses;
+	int i;
+
+	ks_pool_open(&pool);
+	keys = ks_pool_alloc(pool, sizeof(void *) * BENCH_KEYS);
+	misses = ks_pool_alloc(pool, sizeof(void *) * BENCH_KEYS);
+
+	for (i = 0; i < BENCH_KEYS; i++) {
+		keys[i] = (void *)(intptr_t)(i * 7 + 1);
+		misses[i] = (void *)(intptr_t)(i * 7 + 2);
+	}
+
+	bench("int", KS_HASH_MODE_INT, 0, keys, misses);
+	bench("int", KS_HASH_MODE_INT, KS_HASH_FLAG_OPEN_ADDRESSING, keys, misses);
+
+	for (i = 0; i < BENCH_KEYS; i++) {
+		keys[i] = ks_pprintf(pool, "session-%08x-key", i);
+		misses[i] = ks_pprintf(pool, "session-%08x-nokey", i);
+	}
+
+	bench("string", KS_HASH_MODE_DEFAULT, 0, keys, misses);
+	bench("string", KS_HASH_MODE_DEFAULT, KS_HASH_FLAG_OPEN_ADDRESSING, keys, misses);
+
+	ks_pool_close(&pool);
+}
 
 int main(int argc, char **argv)
 {
@@ -190,11 +508,20 @@ int main(int argc, char **argv)
 	ks_init();
 	ks_global_set_log_level(KS_LOG_LEVEL_DEBUG);
 
-	plan(3);
+	plan(10);
 
-	ok(test1());
+	ok(test1(0));
+	ok(test1(KS_HASH_FLAG_OPEN_ADDRESSING));
+	ok(test1(KS_HASH_FLAG_SHARDED));
 	ok(test2());
-	ok(test3());
+	ok(test3(0));
+	ok(test3(KS_HASH_FLAG_OPEN_ADDRESSING));
+	ok(test3(KS_HASH_FLAG_SHARDED));
+	ok(test_open());
+	ok(test_sharded());
+	ok(test_sharded_locks());
+
+	bench_all();
 
 	ks_shutdown();
 
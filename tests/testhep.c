@@ -0,0 +1,563 @@
+/*
+ * Copyright (c) 2018-2025 SignalWire, Inc
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include "libks/ks.h"
+#include "tap.h"
+
+#define BENCH_CALLS 1000000
+#define BENCH_BATCH 32
+#define BENCH_SENDS 100000
+
+static const char sip[] =
+	"OPTIONS sip:100@192.0.2.20 SIP/2.0\r\n"
+	"Via: SIP/2.0/WSS 192.0.2.10:5061;branch=z9hG4bK776asdhds\r\n"
+	"Max-Forwards: 70\r\n"
+	"To: <sip:100@192.0.2.20>\r\n"
+	"From: <sip:200@192.0.2.10>;tag=1928301774\r\n"
+	"Call-ID: a84b4c76e66710\r\n"
+	"CSeq: 63104 OPTIONS\r\n"
+	"Content-Length: 0\r\n\r\n";
+
+static void capture_params(ks_hepv3_capture_params_t *params, int family)
+{
+	memset(params, 0, sizeof(*params));
+	params->ip_family = family;
+	params->local_ip = family == AF_INET ? "192.0.2.10" : "2001:db8::10";
+	params->remote_ip = family == AF_INET ? "192.0.2.20" : "2001:db8::20";
+	params->local_port = 5061;
+	params->remote_port = 40000;
+	params->direction = KS_HEPV3_DIR_SEND;
+	params->capture_id = KS_HEPV3_DEFAULT_NODE_ID;
+	params->protocol_type_id = 1;
+	params->payload = (char *)sip;
+	params->payload_size = sizeof(sip) - 1;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Walk the chunks of one packet and check every field against the params */
+static int check_packet(const uint8_t *buf, ks_size_t len, int family, ks_time_t ts)
+{
+	ks_size_t pos = 6;
+	int seen = 0;
+
+	if (len < 6 || memcmp(buf, "HEP3", 4) || get16(buf + 4) != len) return 0;
+
+	while (pos < len) {
+		uint16_t type, clen;
+		const uint8_t *data;
+
+		if (len - pos < 6 || get16(buf + pos)) return 0;
+		type = get16(buf + pos + 2);
+		clen = get16(buf + pos + 4);
+		if (clen < 6 || clen > len - pos) return 0;
+		data = buf + pos + 6;
+
+		switch (type) {
+		case 0x01: if (data[0] != family) return 0; break;
+		case 0x02: if (data[0] != IPPROTO_TCP) return 0; break;
+		case 0x03: if (memcmp(data, "\xc0\x00\x02\x0a", 4)) return 0; break;
+		case 0x04: if (memcmp(data, "\xc0\x00\x02\x14", 4)) return 0; break;
+		case 0x05: if (data[0] != 0x20 || data[15] != 0x10) return 0; break;
+		case 0x06: if (data[0] != 0x20 || data[15] != 0x20) return 0; break;
+		case 0x07: if (get16(data) != 5061) return 0; break;
+		case 0x08: if (get16(data) != 40000) return 0; break;
+		case 0x09: if (ts && get32(data) != (uint32_t)(ts / 1000000)) return 0; break;
+		case 0x0a: if (ts && get32(data) != (uint32_t)(ts % 1000000)) return 0; break;
+		case 0x0b: if (data[0] != 1) return 0; break;
+		case 0x0c: if (get32(data) != KS_HEPV3_DEFAULT_NODE_ID) return 0; break;
+		case 0x0f: if (clen - 6 != sizeof(sip) - 1 || memcmp(data, sip, sizeof(sip) - 1)) return 0; break;
+		default: return 0;
+		}
+
+		seen++;
+		pos += clen;
+	}
+
+	return pos == len && seen == 11;
+}
+
+static int test_capture(int family)
+{
+	ks_hepv3_capture_params_t params;
+	ks_hepv3_capture_ctx_t *ctx = NULL;
+	char buf[1024], *created = NULL, *pooled = NULL;
+	ks_size_t len, created_len, pooled_len;
+	int r = 1;
+
+	capture_params(&params, family);
+
+	created_len = ks_hepv3_capture_create(&params, &created);
+	if (!created || !check_packet((uint8_t *)created, created_len, family, 0)) r = 0;
+
+	if (ks_hepv3_capture_ctx_create(&ctx, &params, NULL) != KS_STATUS_SUCCESS) return 0;
+
+	len = ks_hepv3_capture_encode(ctx, sip, sizeof(sip) - 1, buf, sizeof(buf));
+	if (len != created_len || len != ks_hepv3_capture_size(ctx, sizeof(sip) - 1)) r = 0;
+	if (!check_packet((uint8_t *)buf, len, family, 0)) r = 0;
+
+	/* Same bytes as the one-shot path apart from the timestamps */
+	if (memcmp(buf, created, 42) || memcmp(buf + 46, created + 46, 6) || memcmp(buf + 56, created + 56, len - 56)) r = 0;
+
+	pooled_len = ks_hepv3_capture_encode_alloc(ctx, sip, sizeof(sip) - 1, &pooled);
+	if (pooled_len != len || !check_packet((uint8_t *)pooled, pooled_len, family, 0)) r = 0;
+
+	/* Short buffers and empty payloads are refused */
+	if (ks_hepv3_capture_encode(ctx, sip, sizeof(sip) - 1, buf, len - 1)) r = 0;
+	if (ks_hepv3_capture_encode(ctx, sip, 0, buf, sizeof(buf))) r = 0;
+
+	free(created);
+	ks_pool_free(&pooled);
+	ks_hepv3_capture_ctx_destroy(&ctx);
+
+	return r && !ctx;
+}
+
+static int test_batch(void)
+{
+	ks_hepv3_capture_params_t params;
+	ks_hepv3_capture_ctx_t *ctx = NULL;
+	ks_hepv3_capture_item_t items[3];
+	ks_time_t ts = 1700000000123456LL;
+	char buf[1024];
+	ks_size_t one, used, n, i;
+	int r = 1;
+
+	capture_params(&params, AF_INET);
+	if (ks_hepv3_capture_ctx_create(&ctx, &params, NULL) != KS_STATUS_SUCCESS) return 0;
+
+	for (i = 0; i < 3; i++) {
+		items[i].payload = sip;
+		items[i].payload_size = sizeof(sip) - 1;
+		items[i].timestamp = ts + i;
+	}
+
+	one = ks_hepv3_capture_size(ctx, sizeof(sip) - 1);
+
+	/* Room for two, the third is left for the caller */
+	n = ks_hepv3_capture_encode_batch(ctx, items, 3, buf, one * 2 + one / 2, &used);
+	if (n != 2 || used != one * 2) r = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!check_packet((uint8_t *)buf + i * one, one, AF_INET, ts + i)) r = 0;
+	}
+
+	ks_hepv3_capture_ctx_destroy(&ctx);
+
+	return r;
+}
+
+static ks_socket_t bind_local(int type, ks_port_t *port)
+{
+	ks_sockaddr_t addr;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	ks_socket_t sock;
+
+	if ((sock = socket(AF_INET, type, 0)) == KS_SOCK_INVALID) return KS_SOCK_INVALID;
+
+	ks_socket_option(sock, SO_REUSEADDR, KS_TRUE);
+	ks_addr_set(&addr, "127.0.0.1", *port, AF_INET);
+
+	if (ks_addr_bind(sock, &addr) != KS_STATUS_SUCCESS || getsockname(sock, (struct sockaddr *)&sin, &len)) {
+		ks_socket_close(&sock);
+		return KS_SOCK_INVALID;
+	}
+
+	*port = ntohs(sin.sin_port);
+
+	if (type == SOCK_STREAM) listen(sock, 4);
+
+	return sock;
+}
+
+/* Accept one connection and split the stream back into packets, returns how many checked out */
+static int receive_stream(ks_socket_t listener, int expect, uint32_t timeout_ms)
+{
+	static uint8_t buf[256 * 1024];
+	ks_time_t deadline = ks_time_now() + (ks_time_t)timeout_ms * 1000;
+	ks_size_t have = 0;
+	ks_socket_t sock;
+	int got = 0;
+
+	if (!(ks_wait_sock(listener, timeout_ms, KS_POLL_READ) & KS_POLL_READ)) return -1;
+	if ((sock = accept(listener, NULL, NULL)) == KS_SOCK_INVALID) return -1;
+
+	while (got < expect && ks_time_now() < deadline) {
+		ks_ssize_t r;
+
+		if (!(ks_wait_sock(sock, 100, KS_POLL_READ) & KS_POLL_READ)) continue;
+		if ((r = recv(sock, (char *)buf + have, sizeof(buf) - have, 0)) <= 0) break;
+		have += r;
+
+		while (have >= 6 && have >= get16(buf + 4)) {
+			ks_size_t len = get16(buf + 4);
+
+			if (!check_packet(buf, len, AF_INET, 0)) {
+				got = -1;
+				goto done;
+			}
+
+			got++;
+			memmove(buf, buf + len, have - len);
+			have -= len;
+		}
+	}
+
+done:
+	ks_socket_close(&sock);
+
+	return got;
+}
+
+/* The collector can see the bytes before the sender thread gets to count them */
+static void wait_sent(ks_hepv3_sender_t *sender, uint64_t expect, ks_hepv3_sender_stats_t *stats)
+{
+	ks_time_t deadline = ks_time_now() + 1000000;
+
+	ks_hepv3_sender_stats(sender, stats);
+	while (stats->sent < expect && ks_time_now() < deadline) {
+		ks_sleep_ms(1);
+		ks_hepv3_sender_stats(sender, stats);
+	}
+}
+
+static void sender_params(ks_hepv3_sender_params_t *params, ks_pool_t *pool, ks_port_t port)
+{
+	memset(params, 0, sizeof(*params));
+	params->server = "127.0.0.1";
+	params->port = port;
+	params->pool = pool;
+	params->connect_timeout_ms = 1000;
+	params->reconnect_min_ms = 20;
+	params->reconnect_max_ms = 100;
+}
+
+static int test_sender_stream(ks_pool_t *pool)
+{
+	ks_hepv3_capture_params_t cparams;
+	ks_hepv3_sender_params_t params;
+	ks_hepv3_capture_ctx_t *ctx = NULL;
+	ks_hepv3_sender_t *sender = NULL;
+	ks_hepv3_sender_stats_t stats;
+	ks_port_t port = 0;
+	ks_socket_t listener;
+	int i, got, r = 1;
+
+	capture_params(&cparams, AF_INET);
+	ks_hepv3_capture_ctx_create(&ctx, &cparams, pool);
+
+	if ((listener = bind_local(SOCK_STREAM, &port)) == KS_SOCK_INVALID) return 0;
+
+	sender_params(&params, pool, port);
+	if (ks_hepv3_sender_create(&sender, &params) != KS_STATUS_SUCCESS) return 0;
+
+	for (i = 0; i < 500; i++) {
+		if (ks_hepv3_sender_capture(sender, ctx, sip, sizeof(sip) - 1) != KS_STATUS_SUCCESS) r = 0;
+	}
+
+	got = receive_stream(listener, 500, 5000);
+	wait_sent(sender, 500, &stats);
+
+	if (got != 500 || stats.queued != 500 || stats.sent != 500 || stats.dropped || stats.depth) r = 0;
+	if (stats.bytes != 500 * ks_hepv3_capture_size(ctx, sizeof(sip) - 1)) r = 0;
+
+	ks_hepv3_sender_destroy(&sender);
+	ks_hepv3_capture_ctx_destroy(&ctx);
+	ks_socket_close(&listener);
+
+	return r && !sender;
+}
+
+static int test_sender_dgram(ks_pool_t *pool)
+{
+	ks_hepv3_capture_params_t cparams;
+	ks_hepv3_sender_params_t params;
+	ks_hepv3_capture_ctx_t *ctx = NULL;
+	ks_hepv3_sender_t *sender = NULL;
+	ks_hepv3_sender_stats_t stats;
+	ks_time_t deadline;
+	ks_port_t port = 0;
+	ks_socket_t sock;
+	uint8_t buf[2048];
+	int i, got = 0, r = 1;
+
+	capture_params(&cparams, AF_INET);
+	ks_hepv3_capture_ctx_create(&ctx, &cparams, pool);
+
+	if ((sock = bind_local(SOCK_DGRAM, &port)) == KS_SOCK_INVALID) return 0;
+	ks_socket_rcvbuf(sock, 1024 * 1024);
+
+	sender_params(&params, pool, port);
+	params.use_udp = KS_TRUE;
+	if (ks_hepv3_sender_create(&sender, &params) != KS_STATUS_SUCCESS) return 0;
+
+	for (i = 0; i < 200; i++) {
+		ks_hepv3_sender_capture(sender, ctx, sip, sizeof(sip) - 1);
+	}
+
+	deadline = ks_time_now() + 5000000;
+
+	/* Every datagram is exactly one packet */
+	while (got < 200 && ks_time_now() < deadline) {
+		ks_ssize_t n;
+
+		if (!(ks_wait_sock(sock, 100, KS_POLL_READ) & KS_POLL_READ)) continue;
+		if ((n = recv(sock, (char *)buf, sizeof(buf), 0)) <= 0) break;
+		if (!check_packet(buf, n, AF_INET, 0)) r = 0;
+		got++;
+	}
+
+	wait_sent(sender, 200, &stats);
+
+	if (got != 200 || stats.sent != 200 || stats.writes > stats.sent) r = 0;
+
+	ks_hepv3_sender_destroy(&sender);
+	ks_hepv3_capture_ctx_destroy(&ctx);
+	ks_socket_close(&sock);
+
+	return r;
+}
+
+/* Nothing is listening at first: captures queue up to the limit, the rest are
+ * dropped, and the queue goes out in one write once the collector appears */
+static int test_sender_reconnect(ks_pool_t *pool)
+{
+	ks_hepv3_capture_params_t cparams;
+	ks_hepv3_sender_params_t params;
+	ks_hepv3_capture_ctx_t *ctx = NULL;
+	ks_hepv3_sender_t *sender = NULL;
+	ks_hepv3_sender_stats_t stats;
+	ks_port_t port = 0;
+	ks_socket_t listener;
+	ks_time_t t;
+	int i, got, r = 1;
+
+	capture_params(&cparams, AF_INET);
+	ks_hepv3_capture_ctx_create(&ctx, &cparams, pool);
+
+	/* Find a free port and leave it closed */
+	if ((listener = bind_local(SOCK_STREAM, &port)) == KS_SOCK_INVALID) return 0;
+	ks_socket_close(&listener);
+
+	sender_params(&params, pool, port);
+	params.queue_len = 8;
+	if (ks_hepv3_sender_create(&sender, &params) != KS_STATUS_SUCCESS) return 0;
+
+	t = ks_time_now();
+	for (i = 0; i < 20; i++) {
+		ks_hepv3_sender_capture(sender, ctx, sip, sizeof(sip) - 1);
+	}
+	t = ks_time_now() - t;
+
+	ks_sleep_ms(200);
+	ks_hepv3_sender_stats(sender, &stats);
+
+	/* Callers never waited on the dead collector */
+	if (t > 100000 || stats.queued != 8 || stats.dropped != 12 || stats.depth != 8 || stats.sent || !stats.reconnects) r = 0;
+
+	if ((listener = bind_local(SOCK_STREAM, &port)) == KS_SOCK_INVALID) return 0;
+
+	got = receive_stream(listener, 8, 5000);
+	wait_sent(sender, 8, &stats);
+
+	if (got != 8 || stats.sent != 8 || stats.writes != 1) r = 0;
+
+	ks_hepv3_sender_destroy(&sender);
+	ks_hepv3_capture_ctx_destroy(&ctx);
+	ks_socket_close(&listener);
+
+	return r;
+}
+
+static void *drain_thread(ks_thread_t *thread, void *data)
+{
+	ks_socket_t listener = *(ks_socket_t *)data;
+	static char buf[64 * 1024];
+	ks_socket_t sock;
+
+	if (!(ks_wait_sock(listener, 5000, KS_POLL_READ) & KS_POLL_READ)) return NULL;
+	if ((sock = accept(listener, NULL, NULL)) == KS_SOCK_INVALID) return NULL;
+
+	while (!ks_thread_stop_requested(thread)) {
+		if (!(ks_wait_sock(sock, 100, KS_POLL_READ) & KS_POLL_READ)) continue;
+		if (recv(sock, buf, sizeof(buf), 0) <= 0) break;
+	}
+
+	ks_socket_close(&sock);
+
+	return NULL;
+}
+
+/* What a signaling thread pays per capture, writing itself versus queueing */
+static void bench_sender(ks_pool_t *pool)
+{
+	ks_hepv3_capture_params_t cparams;
+	ks_hepv3_socket_params_t sparams = { 0 };
+	ks_hepv3_sender_params_t params;
+	ks_hepv3_capture_ctx_t *ctx = NULL;
+	ks_hepv3_socket_t *hep_sock = NULL;
+	ks_hepv3_sender_t *sender = NULL;
+	ks_hepv3_sender_stats_t stats;
+	ks_thread_t *drain = NULL;
+	ks_port_t port = 0;
+	ks_socket_t listener;
+	char buf[1024];
+	ks_time_t t;
+	int i;
+
+	capture_params(&cparams, AF_INET);
+	ks_hepv3_capture_ctx_create(&ctx, &cparams, pool);
+
+	if ((listener = bind_local(SOCK_STREAM, &port)) == KS_SOCK_INVALID) return;
+
+	ks_thread_create(&drain, drain_thread, &listener, pool);
+	sparams.server = "127.0.0.1";
+	sparams.port = port;
+	sparams.pool = pool;
+
+	if (ks_hepv3_socket_init(&sparams, &hep_sock) == KS_STATUS_SUCCESS) {
+		t = ks_time_now();
+		for (i = 0; i < BENCH_SENDS; i++) {
+			ks_size_t len = ks_hepv3_capture_encode(ctx, sip, sizeof(sip) - 1, buf, sizeof(buf));
+
+			ks_hepv3_socket_write(hep_sock, buf, &len);
+		}
+		t = ks_time_now() - t;
+		printf("BENCH ks_hepv3_socket_write %.1fns per packet\n", (double)t * 1000 / BENCH_SENDS);
+		ks_hepv3_socket_destroy(&hep_sock);
+	}
+
+	ks_thread_request_stop(drain);
+	ks_thread_join(drain);
+	ks_thread_destroy(&drain);
+
+	ks_thread_create(&drain, drain_thread, &listener, pool);
+	sender_params(&params, pool, port);
+	params.queue_len = BENCH_SENDS;
+	ks_hepv3_sender_create(&sender, &params);
+
+	t = ks_time_now();
+	for (i = 0; i < BENCH_SENDS; i++) {
+		ks_hepv3_sender_capture(sender, ctx, sip, sizeof(sip) - 1);
+	}
+	t = ks_time_now() - t;
+
+	do {
+		ks_sleep_ms(10);
+		ks_hepv3_sender_stats(sender, &stats);
+	} while (stats.depth && stats.sent + stats.dropped < BENCH_SENDS);
+
+	printf("BENCH ks_hepv3_sender_capture %.1fns per packet, %llu sent in %llu writes, %llu dropped, latency avg %lluus max %lluus\n",
+		   (double)t * 1000 / BENCH_SENDS, (unsigned long long)stats.sent, (unsigned long long)stats.writes,
+		   (unsigned long long)stats.dropped, (unsigned long long)stats.latency_avg_us, (unsigned long long)stats.latency_max_us);
+
+	ks_hepv3_sender_destroy(&sender);
+	ks_thread_request_stop(drain);
+	ks_thread_join(drain);
+	ks_thread_destroy(&drain);
+	ks_hepv3_capture_ctx_destroy(&ctx);
+	ks_socket_close(&listener);
+}
+
+static void bench(void)
+{
+	ks_hepv3_capture_params_t params;
+	ks_hepv3_capture_ctx_t *ctx = NULL;
+	ks_hepv3_capture_item_t items[BENCH_BATCH];
+	static char buf[BENCH_BATCH * 1024];
+	volatile ks_size_t sink = 0;
+	ks_size_t used;
+	ks_time_t t;
+	int i;
+
+	capture_params(&params, AF_INET);
+	ks_hepv3_capture_ctx_create(&ctx, &params, NULL);
+
+	t = ks_time_now();
+	for (i = 0; i < BENCH_CALLS; i++) {
+		char *out = NULL;
+		sink += ks_hepv3_capture_create(&params, &out);
+		free(out);
+	}
+	t = ks_time_now() - t;
+	printf("BENCH ks_hepv3_capture_create %.1fns per packet\n", (double)t * 1000 / BENCH_CALLS);
+
+	t = ks_time_now();
+	for (i = 0; i < BENCH_CALLS; i++) {
+		sink += ks_hepv3_capture_encode(ctx, sip, sizeof(sip) - 1, buf, sizeof(buf));
+	}
+	t = ks_time_now() - t;
+	printf("BENCH ks_hepv3_capture_encode %.1fns per packet\n", (double)t * 1000 / BENCH_CALLS);
+
+	for (i = 0; i < BENCH_BATCH; i++) {
+		items[i].payload = sip;
+		items[i].payload_size = sizeof(sip) - 1;
+		items[i].timestamp = 0;
+	}
+
+	t = ks_time_now();
+	for (i = 0; i < BENCH_CALLS / BENCH_BATCH; i++) {
+		sink += ks_hepv3_capture_encode_batch(ctx, items, BENCH_BATCH, buf, sizeof(buf), &used);
+	}
+	t = ks_time_now() - t;
+	printf("BENCH ks_hepv3_capture_encode_batch(%d) %.1fns per packet\n", BENCH_BATCH,
+		   (double)t * 1000 / (BENCH_CALLS / BENCH_BATCH * BENCH_BATCH));
+
+	ks_hepv3_capture_ctx_destroy(&ctx);
+	(void)sink;
+}
+
+int main(int argc, char **argv)
+{
+	ks_pool_t *pool = NULL;
+
+	ks_init();
+	ks_pool_open(&pool);
+
+	plan(6);
+
+	ok(test_capture(AF_INET));
+	ok(test_capture(AF_INET6));
+	ok(test_batch());
+	ok(test_sender_stream(pool));
+	ok(test_sender_dgram(pool));
+	ok(test_sender_reconnect(pool));
+
+	bench();
+	bench_sender(pool);
+
+	ks_pool_close(&pool);
+	ks_shutdown();
+
+	done_testing();
+}
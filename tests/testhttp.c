@@ -935,6 +935,105 @@ end:
 	return r;
 }
 
+static const char g_parse_req[] =
+	"GET /chat?room=1&x=y HTTP/1.1\r\n"
+	"Host: example.com:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Origin: https://example.com\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+	"Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+	"X-Custom:   padded value  \r\n"
+	"\r\n"
+	"BODY";
+
+#define PARSE_ROUNDS 200000
+
+/* kws_http_parse on its own: resuming a byte at a time, lookups, malformed heads and its parse rate */
+static int test_http_parse(void)
+{
+	char buf[2048], one[2048];
+	ks_size_t len = sizeof(g_parse_req) - 1, i;
+	kws_http_t http, whole;
+	ks_time_t start, elapsed;
+	int r = 0, n;
+
+	memcpy(buf, g_parse_req, len);
+	kws_http_init(&whole);
+	if (kws_http_parse(&whole, buf, len) != 1) return 0;
+	if (whole.header_len != len - 4 || whole.count != 13) return 0;
+	if (strcmp(buf + whole.start[0].off, "GET") || strcmp(buf + whole.start[1].off, "/chat?room=1&x=y") ||
+		strcmp(buf + whole.start[2].off, "HTTP/1.1")) return 0;
+	if (strcmp(kws_http_get_known(&whole, buf, KWS_HTTP_SEC_WEBSOCKET_KEY), "dGhlIHNhbXBsZSBub25jZQ==")) return 0;
+	if (strcmp(kws_http_get(&whole, buf, "sec-websocket-version"), "13")) return 0;
+	if (strcmp(kws_http_get(&whole, buf, "x-custom"), "padded value")) return 0;
+	if (strcmp(kws_http_get(&whole, buf, "Cookie"), "session=0123456789abcdef0123456789abcdef; theme=dark")) return 0;
+	if (kws_http_get(&whole, buf, "Missing") || kws_http_get_known(&whole, buf, KWS_HTTP_CONTENT_LENGTH)) return 0;
+
+	/* Fed a byte at a time it has to land on the same index */
+	memcpy(one, g_parse_req, len);
+	kws_http_init(&http);
+	for (i = 1; i <= len && !(n = kws_http_parse(&http, one, i)); i++);
+	if (n != 1 || memcmp(&http, &whole, sizeof(http)) || memcmp(one, buf, len)) return 0;
+
+	/* Responses have a reason phrase with spaces in it, bare LFs are fine too */
+	strcpy(buf, "HTTP/1.1 101 Switching Protocols\nSec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\n\n");
+	kws_http_init(&http);
+	if (kws_http_parse(&http, buf, strlen(buf)) != 1 || strcmp(buf + http.start[1].off, "101") ||
+		strcmp(buf + http.start[2].off, "Switching Protocols") ||
+		strcmp(kws_http_get_known(&http, buf, KWS_HTTP_SEC_WEBSOCKET_ACCEPT), "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")) return 0;
+
+	/* A repeated header replaces the earlier one, known or not */
+	strcpy(buf, "GET / HTTP/1.1\r\nHost: a\r\nX-Dup: 1\r\nHost: b\r\nx-dup: 2\r\n\r\n");
+	kws_http_init(&http);
+	if (kws_http_parse(&http, buf, strlen(buf)) != 1 || http.count != 4 ||
+		strcmp(kws_http_get_known(&http, buf, KWS_HTTP_HOST), "b") || strcmp(kws_http_get(&http, buf, "X-Dup"), "2")) return 0;
+
+	strcpy(buf, "GET / HTTP/1.1\r\nHost: a\r\n");
+	kws_http_init(&http);
+	if (kws_http_parse(&http, buf, strlen(buf)) != 0) return 0;
+
+	strcpy(buf, "GET / HTTP/1.1\r\nNo colon here\r\n\r\n");
+	kws_http_init(&http);
+	if (kws_http_parse(&http, buf, strlen(buf)) != -1 || kws_http_parse(&http, buf, strlen(buf)) != -1) return 0;
+
+	strcpy(buf, "GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n");
+	kws_http_init(&http);
+	if (kws_http_parse(&http, buf, strlen(buf)) != -1) return 0;
+
+	strcpy(buf, "GET / HTTP/1.1\r\nHost : a\r\n\r\n");
+	kws_http_init(&http);
+	if (kws_http_parse(&http, buf, strlen(buf)) != -1) return 0;
+
+	n = sprintf(buf, "GET / HTTP/1.1\r\n");
+	for (i = 0; i <= KWS_MAX_HEADERS; i++) n += sprintf(buf + n, "X-%d: %d\r\n", (int)i, (int)i);
+	strcpy(buf + n, "\r\n");
+	kws_http_init(&http);
+	if (kws_http_parse(&http, buf, strlen(buf)) != -1) return 0;
+
+	start = ks_time_now();
+	for (i = 0; i < PARSE_ROUNDS; i++) {
+		memcpy(buf, g_parse_req, len);
+		kws_http_init(&http);
+		r += kws_http_parse(&http, buf, len);
+		r += kws_http_get_known(&http, buf, KWS_HTTP_SEC_WEBSOCKET_KEY) != NULL;
+		r += kws_http_get_known(&http, buf, KWS_HTTP_HOST) != NULL;
+	}
+	elapsed = ks_time_now() - start;
+
+	printf("BENCH http parse: %d requests of %d bytes in %lldus, %.0f ns/request, %.1f MB/s\n",
+		   PARSE_ROUNDS, (int)len, (long long)elapsed, elapsed * 1000.0 / PARSE_ROUNDS,
+		   elapsed ? (double)len * PARSE_ROUNDS / elapsed : 0.0);
+
+	return r == 3 * PARSE_ROUNDS;
+}
+
 int main(void)
 {
 	int have_v4 = 0, have_v6 = 0;
@@ -947,9 +1046,10 @@ int main(void)
 	have_v4 = ks_zstr_buf(v4) ? 0 : 1;
 	// have_v6 = ks_zstr_buf(v6) ? 0 : 1;
 
-	plan((have_v4 * 6) + (have_v6 * 4) + 1);
+	plan((have_v4 * 6) + (have_v6 * 4) + 2);
 
 	ok(have_v4 || have_v6);
+	ok(test_http_parse());
 
 	if (have_v4 || have_v6) {
 		ks_gen_cert(".", "testhttp.pem");
@@ -65,6 +65,222 @@ void cleanup(void *ptr, void *arg, ks_pool_cleanup_action_t action, ks_pool_clea
 	}
 }
 
+static int slab_cleanups = 0;
+
+static void slab_cleanup(void *ptr, void *arg, ks_pool_cleanup_action_t action, ks_pool_cleanup_type_t type)
+{
+	if (action == KS_MPCL_DESTROY) {
+		slab_cleanups++;
+	}
+}
+
+static int test_slab(void)
+{
+	ks_pool_t *pool = NULL;
+	void *ptrs[1000];
+	char *str, *first;
+	int i;
+
+	if (ks_pool_open_ex(&pool, KS_POOL_FLAG_SLAB) != KS_STATUS_SUCCESS) return 0;
+
+	for (i = 0; i < 1000; i++) {
+		ptrs[i] = ks_pool_alloc(pool, (i % 300) + 1);
+		if (ks_pool_get(ptrs[i]) != pool || !ks_pool_verify(ptrs[i])) return 0;
+	}
+
+	/* Freed slots come back out of the same size class */
+	first = ptrs[0];
+	ks_pool_free(&ptrs[0]);
+	ptrs[0] = ks_pool_alloc(pool, 1);
+	if (ptrs[0] != first) return 0;
+
+	for (i = 0; i < 1000; i += 2) {
+		ks_pool_free(&ptrs[i]);
+	}
+
+	/* Grow within the slot, then out of it, then past the largest class */
+	str = ks_pool_alloc(pool, 10);
+	ks_snprintf(str, 10, "%s", "slab");
+	first = str;
+	str = ks_pool_resize(str, 16);
+	if (str != first || strcmp(str, "slab")) return 0;
+	str = ks_pool_resize(str, 200);
+	if (strcmp(str, "slab") || !ks_pool_verify(str)) return 0;
+	str = ks_pool_resize(str, 64 * 1024);
+	if (strcmp(str, "slab") || !ks_pool_verify(str)) return 0;
+
+	/* Refs and cleanup callbacks behave as they do for malloc'd prefixes */
+	str = ks_pool_alloc(pool, 32);
+	ks_pool_set_cleanup(str, NULL, slab_cleanup);
+	ks_pool_ref(str);
+	if (ks_pool_free(&str) != KS_STATUS_REFS_EXIST || !str) return 0;
+	ks_pool_free(&str);
+	if (slab_cleanups != 1) return 0;
+
+	str = ks_pool_alloc(pool, 32);
+	ks_pool_set_cleanup(str, NULL, slab_cleanup);
+	str = ks_pool_resize(str, 1024);
+	ks_pool_set_cleanup(ks_pool_alloc(pool, 8000), NULL, slab_cleanup);
+
+	ks_pool_close(&pool);
+
+	return pool == NULL && slab_cleanups == 3;
+}
+
+#define BENCH_ROUNDS 20000
+#define BENCH_BATCH 16
+
+static void *bench_thread(ks_thread_t *thread, void *data)
+{
+	ks_pool_t *pool = (ks_pool_t *)data;
+	void *ptrs[BENCH_BATCH];
+	int i, j;
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		for (j = 0; j < BENCH_BATCH; j++) {
+			ptrs[j] = ks_pool_alloc(pool, 16 << (j % 5));
+		}
+		for (j = 0; j < BENCH_BATCH; j++) {
+			ks_pool_free(&ptrs[j]);
+		}
+	}
+
+	return NULL;
+}
+
+static ks_time_t bench_pool(ks_pool_flag_t flags, int thread_count)
+{
+	ks_thread_t *threads[64];
+	ks_pool_t *pool = NULL;
+	ks_time_t start;
+	int i;
+
+	ks_pool_open_ex(&pool, flags);
+
+	start = ks_time_now();
+
+	for (i = 0; i < thread_count; i++) {
+		ks_thread_create(&threads[i], bench_thread, pool, NULL);
+	}
+
+	for (i = 0; i < thread_count; i++) {
+		ks_thread_join(threads[i]);
+		ks_thread_destroy(&threads[i]);
+	}
+
+	start = ks_time_now() - start;
+
+	ks_pool_close(&pool);
+
+	return start;
+}
+
+static int test_thread_cache(void)
+{
+	ks_pool_t *pool = NULL;
+	ks_size_t alloc_c = 0, user_alloc = 0;
+	void *ptrs[500];
+	int max_threads = ks_env_cpu_count();
+	int threads, i;
+
+	if (max_threads > 16) max_threads = 16;
+	if (max_threads < 4) max_threads = 4;
+
+	/* Everything allocated and freed through the magazines balances out once flushed */
+	ks_pool_open_ex(&pool, KS_POOL_FLAG_THREAD_CACHE);
+	for (i = 0; i < 500; i++) {
+		ptrs[i] = ks_pool_alloc(pool, (i % 100) + 1);
+	}
+	for (i = 0; i < 500; i++) {
+		ks_pool_free(&ptrs[i]);
+		if (ptrs[i]) return 0;
+	}
+	ks_pool_thread_cache_flush();
+	ks_pool_stats(pool, &alloc_c, &user_alloc, NULL, NULL);
+	if (alloc_c || user_alloc) return 0;
+
+	/* Slots parked in this thread must not outlive a clear */
+	ptrs[0] = ks_pool_alloc(pool, 64);
+	ks_pool_free(&ptrs[0]);
+	ks_pool_clear(pool);
+	ptrs[0] = ks_pool_alloc(pool, 64);
+	if (!ks_pool_verify(ptrs[0])) return 0;
+	ks_pool_close(&pool);
+
+	printf("THREAD CACHE BENCH (%d allocs per thread):\n", BENCH_ROUNDS * BENCH_BATCH);
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		ks_time_t plain = bench_pool(KS_POOL_FLAG_DEFAULT, threads);
+		ks_time_t cached = bench_pool(KS_POOL_FLAG_THREAD_CACHE, threads);
+
+		printf("  %2d threads: default %8lldus thread cache %8lldus\n", threads, (long long)plain, (long long)cached);
+	}
+
+	return 1;
+}
+
+static int test_no_zero(void)
+{
+	ks_pool_t *pool = NULL;
+	ks_time_t zeroed, raw;
+	ks_size_t size;
+	unsigned char *buf, *first;
+	int i;
+
+	/* calloc keeps zeroing even in a no zero pool, reusing a dirty slot */
+	ks_pool_open_ex(&pool, KS_POOL_FLAG_SLAB | KS_POOL_FLAG_NO_ZERO);
+	buf = ks_pool_alloc(pool, 100);
+	memset(buf, 0xAA, 100);
+	first = buf;
+	ks_pool_free(&buf);
+	buf = ks_pool_calloc(pool, 10, 10);
+	if (buf != first || !ks_pool_verify(buf)) return 0;
+	for (i = 0; i < 100; i++) {
+		if (buf[i]) return 0;
+	}
+	ks_pool_close(&pool);
+
+	/* Resize growth is only zeroed when asked for, even in a no zero pool */
+	ks_pool_open_ex(&pool, KS_POOL_FLAG_NO_ZERO);
+	buf = ks_pool_alloc_nz(pool, 16);
+	memset(buf, 0xAA, 16);
+	buf = ks_pool_resize(buf, 64);
+	if (buf[15] != 0xAA || !ks_pool_verify(buf)) return 0;
+	memset(buf, 0xAA, 64);
+	buf = ks_pool_resize_zero(buf, 128);
+	if (buf[63] != 0xAA || !ks_pool_verify(buf)) return 0;
+	for (i = 64; i < 128; i++) {
+		if (buf[i]) return 0;
+	}
+	ks_pool_free(&buf);
+	ks_pool_close(&pool);
+	ks_pool_open(&pool);
+
+	printf("NO ZERO BENCH (32 alloc/free rounds):\n");
+	for (size = 64 * 1024; size <= 16 * 1024 * 1024; size *= 4) {
+		zeroed = ks_time_now();
+		for (i = 0; i < 32; i++) {
+			buf = ks_pool_alloc(pool, size);
+			buf[size - 1] = 1;
+			ks_pool_free(&buf);
+		}
+		zeroed = ks_time_now() - zeroed;
+
+		raw = ks_time_now();
+		for (i = 0; i < 32; i++) {
+			buf = ks_pool_alloc_nz(pool, size);
+			buf[size - 1] = 1;
+			ks_pool_free(&buf);
+		}
+		raw = ks_time_now() - raw;
+
+		printf("  %8zu bytes: zeroed %8lldus no zero %8lldus\n", (size_t)size, (long long)zeroed, (long long)raw);
+	}
+
+	ks_pool_close(&pool);
+
+	return 1;
+}
+
 int main(int argc, char **argv)
 {
 	ks_pool_t *pool;
@@ -76,7 +292,7 @@ int main(int argc, char **argv)
 
 	ks_init();
 
-	plan(14);
+	plan(17);
 
 	if (argc > 1) {
 		int tmp = atoi(argv[1]);
@@ -281,6 +497,15 @@ int main(int argc, char **argv)
 		exit(255);
 	}
 
+	printf("SLAB:\n");
+	ok(test_slab());
+
+	printf("THREAD CACHE:\n");
+	ok(test_thread_cache());
+
+	printf("NO ZERO:\n");
+	ok(test_no_zero());
+
 	ks_shutdown();
 
 	done_testing();
@@ -49,7 +49,7 @@ static void do_flush(ks_q_t *q, void *ptr, void *flush_data)
 
 }
 
-int qtest1(int loops)
+int qtest1(int loops, uint32_t flags)
 {
 	ks_thread_t *thread;
 	ks_q_t *q;
@@ -59,7 +59,7 @@ int qtest1(int loops)
 	void *pop;
 
 	ks_pool_open(&pool);
-	ks_q_create(&q, pool, loops);
+	ks_q_create_ex(&q, pool, loops, flags);
 
 	ks_thread_create(&thread, test1_thread, q, pool);
 
@@ -81,7 +81,7 @@ int qtest1(int loops)
 
 	ks_q_destroy(&q);
 
-	ks_q_create(&q, pool, loops);
+	ks_q_create_ex(&q, pool, loops, flags);
 	ks_q_set_flush_fn(q, do_flush, pool);
 
 	for (i = 0; i < loops; i++) {
@@ -142,7 +142,7 @@ static void *test2_thread(ks_thread_t *thread, void *data)
 	return (void *) (intptr_t)popped;
 }
 
-ks_size_t qtest2(int ttl, int try, int loops)
+ks_size_t qtest2(int ttl, int try, int loops, uint32_t flags)
 {
 	ks_thread_t *threads[MAX];
 	ks_q_t *q;
@@ -155,7 +155,7 @@ ks_size_t qtest2(int ttl, int try, int loops)
 	int total_popped = 0;
 
 	ks_pool_open(&pool);
-	ks_q_create(&q, pool, qlen);
+	ks_q_create_ex(&q, pool, qlen, flags);
 
 	t2.q = q;
 	t2.try = try;
@@ -220,14 +220,14 @@ ks_size_t qtest2(int ttl, int try, int loops)
 
 }
 
-ks_status_t qtest3()
+ks_status_t qtest3(uint32_t flags)
 {
 	ks_q_t *q = NULL;
 	ks_pool_t *pool = NULL;
 	ks_status_t status = KS_STATUS_SUCCESS;
 
 	ks_pool_open(&pool);
-	ks_q_create(&q, pool, 0);
+	ks_q_create_ex(&q, pool, (flags & KS_Q_FLAG_LOCKFREE) ? 4 : 0, flags);
 
 	int *val = (int*)ks_pool_alloc(pool, sizeof(int));
 	int *tmp = NULL;
@@ -239,38 +239,226 @@ ks_status_t qtest3()
 	if (tmp != val) return KS_STATUS_FAIL;
 	if (ks_q_size(q) != 1) return KS_STATUS_FAIL;
 
+	if (flags & KS_Q_FLAG_LOCKFREE) {
+		int i;
+
+		/* Bounded ring rejects the push once all slots are taken */
+		for (i = 1; i < 4; i++) {
+			if (ks_q_trypush(q, val) != KS_STATUS_SUCCESS) return KS_STATUS_FAIL;
+		}
+		if (ks_q_trypush(q, val) != KS_STATUS_BREAK) return KS_STATUS_FAIL;
+		if (ks_q_size(q) != 4 || ks_q_maxlen(q) != 4) return KS_STATUS_FAIL;
+		for (i = 0; i < 4; i++) {
+			if (ks_q_trypop(q, (void **)&tmp) != KS_STATUS_SUCCESS || tmp != val) return KS_STATUS_FAIL;
+		}
+		if (ks_q_trypop(q, (void **)&tmp) != KS_STATUS_BREAK) return KS_STATUS_FAIL;
+		if (ks_q_pop_timeout(q, (void **)&tmp, 100) != KS_STATUS_TIMEOUT) return KS_STATUS_FAIL;
+	}
+
 	ks_q_destroy(&q);
 	ks_pool_close(&pool);
 
 	return status;
 }
 
+ks_status_t qtest_batch(uint32_t flags)
+{
+	ks_q_t *q = NULL;
+	ks_pool_t *pool = NULL;
+	void *in[8], *out[8];
+	ks_size_t moved = 0;
+	intptr_t i;
+
+	ks_pool_open(&pool);
+	ks_q_create_ex(&q, pool, 4, flags);
+
+	for (i = 0; i < 8; i++) {
+		in[i] = (void *)(i + 1);
+	}
+
+	/* Only as many as fit in the queue are moved */
+	if (ks_q_push_batch(q, in, 8, &moved) != KS_STATUS_SUCCESS || moved != 4) return KS_STATUS_FAIL;
+	if (ks_q_size(q) != 4) return KS_STATUS_FAIL;
+	if (ks_q_pop_batch(q, out, 3, 0, &moved) != KS_STATUS_SUCCESS || moved != 3) return KS_STATUS_FAIL;
+	if (ks_q_pop_batch(q, out + 3, 8, 0, &moved) != KS_STATUS_SUCCESS || moved != 1) return KS_STATUS_FAIL;
+
+	for (i = 0; i < 4; i++) {
+		if (out[i] != in[i]) return KS_STATUS_FAIL;
+	}
+
+	if (ks_q_pop_batch(q, out, 8, 100, &moved) != KS_STATUS_TIMEOUT || moved != 0) return KS_STATUS_FAIL;
+
+	ks_q_destroy(&q);
+	ks_pool_close(&pool);
+
+	return KS_STATUS_SUCCESS;
+}
+
+struct wake_data {
+	ks_q_t *q;
+	volatile int waiting;
+	ks_status_t status;
+};
+
+static void *wake_popper(ks_thread_t *thread, void *data)
+{
+	struct wake_data *wd = (struct wake_data *) data;
+	void *ptr;
+
+	wd->waiting = 1;
+	wd->status = ks_q_pop(wd->q, &ptr);
+
+	return NULL;
+}
+
+/* ks_q_wake sends a popper blocked on an empty queue back with KS_STATUS_BREAK */
+static ks_status_t qtest_wake(uint32_t flags)
+{
+	struct wake_data wd = { 0 };
+	ks_thread_t *thread = NULL;
+	ks_pool_t *pool = NULL;
+	ks_status_t r = KS_STATUS_SUCCESS;
+	int sanity = 100;
+
+	ks_pool_open(&pool);
+	ks_q_create_ex(&wd.q, pool, 8, flags);
+	wd.status = KS_STATUS_FAIL;
+
+	ks_thread_create(&thread, wake_popper, &wd, pool);
+
+	while (!wd.waiting && --sanity > 0) {
+		ks_sleep_ms(10);
+	}
+
+	/* Give it time to block */
+	ks_sleep_ms(50);
+	ks_q_wake(wd.q);
+	ks_thread_join(thread);
+
+	if (wd.status != KS_STATUS_BREAK) r = KS_STATUS_FAIL;
+
+	ks_thread_destroy(&thread);
+	ks_q_destroy(&wd.q);
+	ks_pool_close(&pool);
+
+	return r;
+}
+
+#define BENCH_ITEMS 200000
+#define BENCH_BATCH 32
+
+struct bench_data {
+	ks_q_t *q;
+	int batch;
+};
+
+static void *bench_consumer(ks_thread_t *thread, void *data)
+{
+	struct bench_data *bd = (struct bench_data *) data;
+	void *ptrs[BENCH_BATCH];
+	ks_size_t popped;
+	int total = 0;
+
+	while (total < BENCH_ITEMS) {
+		if (bd->batch) {
+			if (ks_q_pop_batch(bd->q, ptrs, BENCH_BATCH, 100, &popped) == KS_STATUS_SUCCESS) {
+				total += (int)popped;
+			}
+		} else if (ks_q_pop_timeout(bd->q, ptrs, 100) == KS_STATUS_SUCCESS) {
+			total++;
+		}
+	}
+
+	return NULL;
+}
+
+static void qbench(uint32_t flags, int batch)
+{
+	struct bench_data bd = { 0 };
+	ks_thread_t *thread = NULL;
+	ks_pool_t *pool = NULL;
+	void *ptrs[BENCH_BATCH];
+	ks_size_t pushed;
+	ks_time_t start, elapsed;
+	int i = 0, j;
+
+	ks_pool_open(&pool);
+	ks_q_create_ex(&bd.q, pool, 1024, flags);
+	bd.batch = batch;
+
+	for (j = 0; j < BENCH_BATCH; j++) {
+		ptrs[j] = (void *)(intptr_t)(j + 1);
+	}
+
+	start = ks_time_now();
+	ks_thread_create(&thread, bench_consumer, &bd, pool);
+
+	while (i < BENCH_ITEMS) {
+		if (batch) {
+			int n = BENCH_ITEMS - i < BENCH_BATCH ? BENCH_ITEMS - i : BENCH_BATCH;
+			if (ks_q_push_batch(bd.q, ptrs, n, &pushed) == KS_STATUS_SUCCESS) {
+				i += (int)pushed;
+			}
+		} else if (ks_q_push(bd.q, ptrs[0]) == KS_STATUS_SUCCESS) {
+			i++;
+		}
+	}
+
+	ks_thread_join(thread);
+	elapsed = ks_time_now() - start;
+
+	printf("BENCH %-8s %-6s %d items in %lldus (%.0f items/sec)\n",
+		   (flags & KS_Q_FLAG_LOCKFREE) ? "lockfree" : "list", batch ? "batch" : "single",
+		   BENCH_ITEMS, (long long)elapsed, elapsed ? BENCH_ITEMS * 1000000.0 / elapsed : 0.0);
+
+	ks_thread_destroy(&thread);
+	ks_q_destroy(&bd.q);
+	ks_pool_close(&pool);
+}
+
 int main(int argc, char **argv)
 {
 	int ttl;
 	int size = 100000;
 	int runs = 1;
 	int i;
+	ks_q_t *q = NULL;
 
 	ks_init();
 
-	plan(4 * runs + 1);
+	plan(8 * runs + 7);
 
 	ttl = ks_env_cpu_count() * 5;
 	//ttl = 5;
 	ttl = MIN(MAX, ttl);
 
 
-	ok(qtest3() == KS_STATUS_SUCCESS);
+	ok(qtest3(KS_Q_FLAG_DEFAULT) == KS_STATUS_SUCCESS);
+	ok(qtest3(KS_Q_FLAG_LOCKFREE) == KS_STATUS_SUCCESS);
+	ok(ks_q_create_ex(&q, ks_global_pool(), 0, KS_Q_FLAG_LOCKFREE) == KS_STATUS_ARG_INVALID);
+	ok(qtest_batch(KS_Q_FLAG_DEFAULT) == KS_STATUS_SUCCESS);
+	ok(qtest_batch(KS_Q_FLAG_LOCKFREE) == KS_STATUS_SUCCESS);
+	ok(qtest_wake(KS_Q_FLAG_DEFAULT) == KS_STATUS_SUCCESS);
+	ok(qtest_wake(KS_Q_FLAG_LOCKFREE) == KS_STATUS_SUCCESS);
 	for(i = 0; i < runs; i++) {
-		ok(qtest1(size));
-		ok(qtest2(ttl, 0, size) == 0);
-		ok(qtest2(ttl, 1, size) == 0);
-		ok(qtest2(ttl, 2, size) == 0);
+		ok(qtest1(size, KS_Q_FLAG_DEFAULT));
+		ok(qtest2(ttl, 0, size, KS_Q_FLAG_DEFAULT) == 0);
+		ok(qtest2(ttl, 1, size, KS_Q_FLAG_DEFAULT) == 0);
+		ok(qtest2(ttl, 2, size, KS_Q_FLAG_DEFAULT) == 0);
+
+		ok(qtest1(size, KS_Q_FLAG_LOCKFREE));
+		ok(qtest2(ttl, 0, size, KS_Q_FLAG_LOCKFREE) == 0);
+		ok(qtest2(ttl, 1, size, KS_Q_FLAG_LOCKFREE) == 0);
+		ok(qtest2(ttl, 2, size, KS_Q_FLAG_LOCKFREE) == 0);
 	}
 
 	printf("TTL %d RUNS %d\n", ttl, runs);
 
+	qbench(KS_Q_FLAG_DEFAULT, 0);
+	qbench(KS_Q_FLAG_DEFAULT, 1);
+	qbench(KS_Q_FLAG_LOCKFREE, 0);
+	qbench(KS_Q_FLAG_LOCKFREE, 1);
+
 	ks_shutdown();
 
 	done_testing();
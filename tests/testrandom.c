@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2018-2023 SignalWire, Inc
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "libks/ks.h"
+#include "tap.h"
+
+#ifndef KS_PLAT_WIN
+#include <sys/wait.h>
+#endif
+
+#define THREADS 4
+#define BENCH_CALLS 1000000
+
+static uint64_t thread_first[THREADS];
+
+static void *first_value_thread(ks_thread_t *thread, void *data)
+{
+	uint64_t *out = (uint64_t *)data;
+
+	*out = ks_random_uint64();
+
+	return NULL;
+}
+
+/* Every byte value turns up, and no byte position is stuck */
+static int test_bytes(void)
+{
+	static uint8_t buf[64 * 1024 + 3];
+	int counts[256] = { 0 };
+	ks_size_t i;
+	int r = 1;
+
+	/* Odd sizes across the internal buffer's edges */
+	ks_random_bytes(buf, 3);
+	ks_random_bytes(buf + 3, sizeof(buf) - 3);
+
+	for (i = 0; i < sizeof(buf); i++) {
+		counts[buf[i]]++;
+	}
+
+	for (i = 0; i < 256; i++) {
+		/* Expected is 256 each, this is far outside any honest run */
+		if (counts[i] < 128 || counts[i] > 400) r = 0;
+	}
+
+	return r;
+}
+
+static int test_uniform(void)
+{
+	int counts[6] = { 0 };
+	int i, r = 1;
+
+	if (ks_random_uniform(0) != 0 || ks_random_uniform(1) != 0) return 0;
+
+	for (i = 0; i < 60000; i++) {
+		uint32_t v = ks_random_uniform(6);
+
+		if (v >= 6) return 0;
+		counts[v]++;
+	}
+
+	for (i = 0; i < 6; i++) {
+		if (counts[i] < 9000 || counts[i] > 11000) r = 0;
+	}
+
+	return r;
+}
+
+/* Each thread seeds its own generator */
+static int test_threads(void)
+{
+	ks_thread_t *threads[THREADS];
+	int i, j;
+
+	for (i = 0; i < THREADS; i++) {
+		ks_thread_create(&threads[i], first_value_thread, &thread_first[i], NULL);
+	}
+
+	for (i = 0; i < THREADS; i++) {
+		ks_thread_join(threads[i]);
+		ks_thread_destroy(&threads[i]);
+	}
+
+	for (i = 0; i < THREADS; i++) {
+		for (j = i + 1; j < THREADS; j++) {
+			if (thread_first[i] == thread_first[j]) return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* A forked child must not carry on with its parent's stream */
+static int test_fork(void)
+{
+#ifndef KS_PLAT_WIN
+	int fds[2];
+	uint64_t parent, child = 0;
+	pid_t pid;
+
+	ks_random_uint64();
+
+	if (pipe(fds)) return 0;
+
+	if (!(pid = fork())) {
+		child = ks_random_uint64();
+		if (write(fds[1], &child, sizeof(child)) != sizeof(child)) _exit(1);
+		_exit(0);
+	}
+
+	parent = ks_random_uint64();
+
+	if (read(fds[0], &child, sizeof(child)) != sizeof(child)) return 0;
+
+	waitpid(pid, NULL, 0);
+	close(fds[0]);
+	close(fds[1]);
+
+	return parent != child;
+#else
+	return 1;
+#endif
+}
+
+static int test_uuid_string(void)
+{
+	ks_uuid_t uuid, other;
+	const char *str;
+	char buf[33];
+	int i;
+
+	ks_uuid(&uuid);
+	ks_uuid(&other);
+	str = ks_uuid_thr_str(&uuid);
+
+	/* Version 4 with the RFC 4122 variant */
+	if (str[14] != '4' || !strchr("89ab", str[19]) || !ks_uuid_cmp(&uuid, &other)) return 0;
+
+	ks_random_string(buf, sizeof(buf) - 1, "ab");
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (i = 0; i < (int)sizeof(buf) - 1; i++) {
+		if (buf[i] != 'a' && buf[i] != 'b') return 0;
+	}
+
+	return 1;
+}
+
+static void bench(void)
+{
+	static uint8_t bulk[1024 * 1024];
+	volatile uint32_t sink = 0;
+	ks_time_t t;
+	int i;
+
+	t = ks_time_now();
+	for (i = 0; i < BENCH_CALLS; i++) sink += ks_random_uint32();
+	t = ks_time_now() - t;
+	printf("BENCH ks_random_uint32 %.1fns per call\n", (double)t * 1000 / BENCH_CALLS);
+
+	t = ks_time_now();
+	for (i = 0; i < BENCH_CALLS; i++) sink += ks_random_uint64() != 0;
+	t = ks_time_now() - t;
+	printf("BENCH ks_random_uint64 %.1fns per call\n", (double)t * 1000 / BENCH_CALLS);
+
+	t = ks_time_now();
+	for (i = 0; i < BENCH_CALLS; i++) {
+		uint8_t mask[4];
+		ks_random_bytes(mask, sizeof(mask));
+		sink += mask[0];
+	}
+	t = ks_time_now() - t;
+	printf("BENCH ks_random_bytes(4) %.1fns per call\n", (double)t * 1000 / BENCH_CALLS);
+
+	/* What a websocket mask used to cost, reseeding rand() on every frame */
+	t = ks_time_now();
+	for (i = 0; i < BENCH_CALLS; i++) {
+		ks_time_t now = ks_time_now();
+		int j;
+
+		srand((unsigned int)(((now >> 32) ^ now) & 0xffffffff));
+		for (j = 0; j < 4; j++) sink += (uint32_t)(255 * 1.0 * rand() / (RAND_MAX + 1.0));
+	}
+	t = ks_time_now() - t;
+	printf("BENCH srand+rand 4 bytes %.1fns per call\n", (double)t * 1000 / BENCH_CALLS);
+
+	t = ks_time_now();
+	for (i = 0; i < 64; i++) ks_random_bytes(bulk, sizeof(bulk));
+	t = ks_time_now() - t;
+	printf("BENCH ks_random_bytes bulk %.1f MB/s\n", (double)sizeof(bulk) * 64 / (t ? t : 1));
+
+	(void)sink;
+}
+
+int main(int argc, char **argv)
+{
+	ks_init();
+
+	plan(5);
+
+	ok(test_bytes());
+	ok(test_uniform());
+	ok(test_threads());
+	ok(test_fork());
+	ok(test_uuid_string());
+
+	bench();
+
+	ks_shutdown();
+
+	done_testing();
+}
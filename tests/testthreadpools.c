@@ -75,13 +75,326 @@ static int test1()
 	return 1;
 }
 
+#define FANOUT_DEPTH 4
+#define FANOUT_WIDTH 4
+
+struct fanout {
+	ks_thread_pool_t *tp;
+	volatile uint32_t done;
+};
+
+struct fanout_job {
+	struct fanout *fo;
+	int depth;
+};
+
+static void *fanout_thread(ks_thread_t *thread, void *data)
+{
+	struct fanout_job *job = (struct fanout_job *) data;
+	int i;
+
+	/* Every job queues its children from inside the worker, these should land on its local deque */
+	if (job->depth < FANOUT_DEPTH) {
+		for (i = 0; i < FANOUT_WIDTH; i++) {
+			struct fanout_job *child = ks_pool_alloc(ks_pool_get(job), sizeof(*child));
+			child->fo = job->fo;
+			child->depth = job->depth + 1;
+			ks_thread_pool_add_job(job->fo->tp, fanout_thread, child);
+		}
+	}
+
+	ks_atomic_increment_uint32(&job->fo->done);
+	ks_pool_free(&job);
+
+	return NULL;
+}
+
+static int test_fanout(uint32_t flags)
+{
+	ks_pool_t *pool;
+	struct fanout fo = { 0 };
+	struct fanout_job *root;
+	uint32_t expected = 0, level = 1;
+	ks_time_t start;
+	int i;
+
+	for (i = 0; i <= FANOUT_DEPTH; i++) {
+		expected += level;
+		level *= FANOUT_WIDTH;
+	}
+
+	ks_pool_open(&pool);
+	ks_thread_pool_create_ex(&fo.tp, 2, 16, KS_THREAD_DEFAULT_STACK, KS_PRI_DEFAULT, 5, flags);
+
+	start = ks_time_now();
+
+	root = ks_pool_alloc(pool, sizeof(*root));
+	root->fo = &fo;
+	ks_thread_pool_add_job(fo.tp, fanout_thread, root);
+
+	while (fo.done < expected && ks_time_now() - start < 30000000) {
+		ks_sleep(1000);
+	}
+
+	printf("FANOUT %s: %u/%u jobs in %lldus\n", (flags & KS_THREAD_POOL_FLAG_WORK_STEALING) ? "work stealing" : "shared queue",
+		   fo.done, expected, (long long)(ks_time_now() - start));
+
+	while(ks_thread_pool_backlog(fo.tp)) {
+		ks_sleep(1000);
+	}
+
+	ks_thread_pool_destroy(&fo.tp);
+	ks_pool_close(&pool);
+
+	return fo.done == expected;
+}
+
+static void *double_thread(ks_thread_t *thread, void *data)
+{
+	return (void *)((intptr_t)data * 2);
+}
+
+static void *slow_thread(ks_thread_t *thread, void *data)
+{
+	ks_sleep_ms(300);
+	return data;
+}
+
+static void *count_thread(ks_thread_t *thread, void *data)
+{
+	ks_atomic_increment_uint32((volatile uint32_t *)data);
+	return NULL;
+}
+
+struct nested {
+	ks_thread_pool_t *tp;
+	volatile uint32_t count;
+};
+
+static void *nested_thread(ks_thread_t *thread, void *data)
+{
+	struct nested *n = (struct nested *) data;
+	ks_task_group_t *group = NULL;
+	int i;
+
+	/* Waiting on a group from inside a worker must not deadlock a pool with only two threads */
+	ks_task_group_create(&group, n->tp);
+	for (i = 0; i < 10; i++) {
+		ks_task_group_add(group, count_thread, (void *)&n->count);
+	}
+	ks_task_group_wait(group, 0);
+	ks_task_group_destroy(&group);
+
+	return NULL;
+}
+
+static int test_futures(uint32_t flags)
+{
+	ks_thread_pool_t *tp = NULL;
+	ks_thread_pool_future_t *futures[64];
+	ks_thread_pool_future_t *slow = NULL;
+	ks_task_group_t *group = NULL;
+	struct nested n = { 0 };
+	volatile uint32_t count = 0;
+	intptr_t i;
+	int r = 1;
+
+	ks_thread_pool_create_ex(&tp, 2, 2, KS_THREAD_DEFAULT_STACK, KS_PRI_DEFAULT, 5, flags);
+
+	for (i = 0; i < 64; i++) {
+		ks_thread_pool_submit(tp, double_thread, (void *)i, &futures[i]);
+	}
+
+	for (i = 0; i < 64; i++) {
+		if (ks_thread_pool_future_wait(futures[i], 0) != KS_STATUS_SUCCESS) r = 0;
+		if (!ks_thread_pool_future_ready(futures[i])) r = 0;
+		if ((intptr_t)ks_thread_pool_future_result(futures[i]) != i * 2) r = 0;
+		ks_thread_pool_future_destroy(&futures[i]);
+	}
+
+	ks_thread_pool_submit(tp, slow_thread, (void *)tp, &slow);
+	if (ks_thread_pool_future_wait(slow, 50) != KS_STATUS_TIMEOUT) r = 0;
+	if (ks_thread_pool_future_result(slow) != NULL) r = 0;
+	if (ks_thread_pool_future_wait(slow, 5000) != KS_STATUS_SUCCESS) r = 0;
+	if (ks_thread_pool_future_result(slow) != (void *)tp) r = 0;
+	ks_thread_pool_future_destroy(&slow);
+
+	ks_task_group_create(&group, tp);
+	for (i = 0; i < 500; i++) {
+		ks_task_group_add(group, count_thread, (void *)&count);
+	}
+	if (ks_task_group_wait(group, 0) != KS_STATUS_SUCCESS || count != 500) r = 0;
+	if (ks_task_group_pending(group) != 0) r = 0;
+
+	n.tp = tp;
+	for (i = 0; i < 4; i++) {
+		ks_task_group_add(group, nested_thread, &n);
+	}
+	if (ks_task_group_wait(group, 10000) != KS_STATUS_SUCCESS || n.count != 40) r = 0;
+	if (ks_task_group_destroy(&group) != KS_STATUS_SUCCESS) r = 0;
+
+	ks_thread_pool_destroy(&tp);
+
+	return r;
+}
+
+struct lanes {
+	volatile uint32_t release;
+	volatile uint32_t next;
+	int order[15];
+};
+
+struct lane_job {
+	struct lanes *l;
+	int priority;
+};
+
+static void *block_thread(ks_thread_t *thread, void *data)
+{
+	struct lanes *l = (struct lanes *) data;
+
+	while (!l->release) {
+		ks_sleep_ms(1);
+	}
+
+	return NULL;
+}
+
+static void *lane_thread(ks_thread_t *thread, void *data)
+{
+	struct lane_job *job = (struct lane_job *) data;
+
+	job->l->order[ks_atomic_increment_uint32(&job->l->next)] = job->priority;
+
+	return NULL;
+}
+
+static void *expired_thread(ks_thread_t *thread, void *data)
+{
+	return data;
+}
+
+static int test_priority(uint32_t flags)
+{
+	ks_thread_pool_t *tp = NULL;
+	ks_thread_pool_future_t *futures[15];
+	ks_thread_pool_future_t *late = NULL, *blocker = NULL;
+	ks_thread_pool_stats_t stats;
+	struct lanes l = { 0 };
+	struct lane_job jobs[15];
+	int i, r = 1;
+
+	/* A single worker, held busy while the lanes fill up */
+	ks_thread_pool_create_ex(&tp, 1, 1, KS_THREAD_DEFAULT_STACK, KS_PRI_DEFAULT, 5, flags);
+	ks_thread_pool_submit(tp, block_thread, &l, &blocker);
+
+	while (!ks_thread_pool_stats(tp, &stats) && stats.busy == 0) {
+		ks_sleep_ms(1);
+	}
+
+	for (i = 0; i < 15; i++) {
+		jobs[i].l = &l;
+		jobs[i].priority = 2 - (i % 3);
+		ks_thread_pool_add_job_ex(tp, lane_thread, &jobs[i], (ks_thread_pool_priority_t)jobs[i].priority, 0, NULL, &futures[i]);
+	}
+
+	ks_thread_pool_add_job_ex(tp, lane_thread, &jobs[0], KS_THREAD_POOL_PRIORITY_HIGH, 10, expired_thread, &late);
+
+	ks_thread_pool_stats(tp, &stats);
+	if (stats.lanes[KS_THREAD_POOL_PRIORITY_HIGH].depth != 6 || stats.lanes[KS_THREAD_POOL_PRIORITY_LOW].depth != 5) r = 0;
+
+	ks_sleep_ms(50);
+	l.release = 1;
+
+	for (i = 0; i < 15; i++) {
+		ks_thread_pool_future_wait(futures[i], 0);
+		ks_thread_pool_future_destroy(&futures[i]);
+	}
+
+	/* The late job missed its deadline and never ran, its expired callback did */
+	if (ks_thread_pool_future_wait(late, 0) != KS_STATUS_TIMEOUT || !ks_thread_pool_future_expired(late)) r = 0;
+	if (ks_thread_pool_future_result(late) != &jobs[0]) r = 0;
+	ks_thread_pool_future_destroy(&late);
+	ks_thread_pool_future_destroy(&blocker);
+
+	if (l.next != 15) r = 0;
+	for (i = 0; i < 15; i++) {
+		if (l.order[i] != i / 5) r = 0;
+	}
+
+	ks_thread_pool_stats(tp, &stats);
+	for (i = 0; i < KS_THREAD_POOL_PRIORITY_COUNT; i++) {
+		ks_thread_pool_lane_stats_t *ls = &stats.lanes[i];
+		printf("LANE %d: depth %zu queued %llu run %llu expired %llu wait p50 %lldus p90 %lldus p99 %lldus max %lldus\n", i,
+			   (size_t)ls->depth, (unsigned long long)ls->queued, (unsigned long long)ls->run, (unsigned long long)ls->expired,
+			   (long long)ls->wait_p50, (long long)ls->wait_p90, (long long)ls->wait_p99, (long long)ls->wait_max);
+	}
+
+	if (stats.lanes[KS_THREAD_POOL_PRIORITY_HIGH].expired != 1 || stats.lanes[KS_THREAD_POOL_PRIORITY_HIGH].run != 5) r = 0;
+	if (stats.lanes[KS_THREAD_POOL_PRIORITY_LOW].run != 5 || stats.lanes[KS_THREAD_POOL_PRIORITY_LOW].wait_p99 < 50000) r = 0;
+	if (stats.lanes[KS_THREAD_POOL_PRIORITY_LOW].wait_max > stats.lanes[KS_THREAD_POOL_PRIORITY_LOW].wait_p99) r = 0;
+
+	ks_thread_pool_destroy(&tp);
+
+	return r;
+}
+
+/* Within a lane jobs with a deadline go earliest first, then the ones without in FIFO order */
+static int test_deadline_order(void)
+{
+	ks_thread_pool_t *tp = NULL;
+	ks_thread_pool_future_t *futures[8];
+	ks_thread_pool_future_t *blocker = NULL;
+	ks_thread_pool_stats_t stats;
+	struct lanes l = { 0 };
+	struct lane_job jobs[8];
+	int i, r = 1;
+
+	ks_thread_pool_create_ex(&tp, 1, 1, KS_THREAD_DEFAULT_STACK, KS_PRI_DEFAULT, 5, KS_THREAD_POOL_FLAG_DEFAULT);
+	ks_thread_pool_submit(tp, block_thread, &l, &blocker);
+
+	while (!ks_thread_pool_stats(tp, &stats) && stats.busy == 0) {
+		ks_sleep_ms(1);
+	}
+
+	/* 0 and 1 have no deadline, 2..7 are due in decreasing order */
+	for (i = 0; i < 8; i++) {
+		jobs[i].l = &l;
+		jobs[i].priority = i;
+		ks_thread_pool_add_job_ex(tp, lane_thread, &jobs[i], KS_THREAD_POOL_PRIORITY_NORMAL, i < 2 ? 0 : 60000 - i * 1000, NULL, &futures[i]);
+	}
+
+	l.release = 1;
+
+	for (i = 0; i < 8; i++) {
+		if (ks_thread_pool_future_wait(futures[i], 0) != KS_STATUS_SUCCESS) r = 0;
+		ks_thread_pool_future_destroy(&futures[i]);
+	}
+	ks_thread_pool_future_destroy(&blocker);
+
+	for (i = 0; i < 8; i++) {
+		if (l.order[i] != (i < 6 ? 7 - i : i - 6)) r = 0;
+	}
+
+	ks_thread_pool_destroy(&tp);
+
+	return r;
+}
+
 int main(int argc, char **argv)
 {
 	ks_init();
 
-	plan(1);
+	plan(8);
 
 	ok(test1());
+	ok(test_fanout(KS_THREAD_POOL_FLAG_DEFAULT));
+	ok(test_fanout(KS_THREAD_POOL_FLAG_WORK_STEALING));
+	ok(test_futures(KS_THREAD_POOL_FLAG_DEFAULT));
+	ok(test_futures(KS_THREAD_POOL_FLAG_WORK_STEALING));
+	ok(test_priority(KS_THREAD_POOL_FLAG_DEFAULT));
+	ok(test_priority(KS_THREAD_POOL_FLAG_WORK_STEALING));
+	ok(test_deadline_order());
 
 	ks_shutdown();
 
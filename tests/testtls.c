@@ -29,6 +29,9 @@ typedef struct  {
 	ks_sockaddr_t server_addr;
 	ks_socket_t server_socket;
 	ks_bool_t ready;
+	ks_bool_t async;
+	ks_bool_t ktls;
+	ks_size_t bulk; /* when set the server sinks this many bytes and answers with the count */
 	ks_tls_shared_ctx_t *shared_ctx;
 } tls_data_t;
 
@@ -40,6 +43,22 @@ static char TLS_TEST_PAYLOAD[] = "TESTING.TLS.PAYLOAD...........................
 #define TLS_TEST_READ_BUF_LEN 1024
 #define TLS_TEST_SERVER_CERT "testtls_server.pem"
 
+/* Steps a handshake from ks_tls_*_start the way an event loop would */
+static ks_status_t drive_handshake(ks_tls_t *ktls, uint32_t timeout_ms)
+{
+	ks_time_t deadline = ks_time_now() + (ks_time_t)timeout_ms * 1000;
+	ks_poll_t want = 0;
+	ks_status_t status;
+
+	while ((status = ks_tls_handshake(ktls, &want)) == KS_STATUS_RETRY) {
+		if (ks_time_now() >= deadline || ks_wait_sock(ks_tls_get_socket(ktls), 100, want | KS_POLL_ERROR) < 0) {
+			return KS_STATUS_FAIL;
+		}
+	}
+
+	return status;
+}
+
 void server_callback(ks_socket_t server_sock, ks_socket_t client_sock, ks_sockaddr_t *addr, void *user_data)
 {
 	ks_status_t status;
@@ -57,13 +76,40 @@ void server_callback(ks_socket_t server_sock, ks_socket_t client_sock, ks_sockad
 	params.init_timeout_ms = 2000;
 	params.peer_socket = client_sock;
 
-	status = ks_tls_accept(&ktls, &params, tls_data->pool);
+	if (tls_data->async) {
+		if ((status = ks_tls_accept_start(&ktls, &params, tls_data->pool)) == KS_STATUS_SUCCESS) {
+			status = drive_handshake(ktls, params.init_timeout_ms);
+		}
+	} else {
+		status = ks_tls_accept(&ktls, &params, tls_data->pool);
+	}
 
 	if (status != KS_STATUS_SUCCESS) {
 		ks_log(KS_LOG_ERROR, "SERVER: Accept fail\n");
 		goto end;
 	}
 
+	if (tls_data->bulk) {
+		static uint8_t sink[65536];
+		uint64_t total = 0;
+		ks_size_t len;
+
+		while (total < tls_data->bulk) {
+			len = sizeof(sink);
+
+			if (ks_tls_read_timeout(ktls, sink, &len, TLS_TEST_READ_TIMEOUT_MS) != KS_STATUS_SUCCESS) {
+				ks_log(KS_LOG_ERROR, "SERVER: Bulk read fail after [%llu] bytes\n", (unsigned long long)total);
+				goto end;
+			}
+
+			total += len;
+		}
+
+		len = sizeof(total);
+		ks_tls_write_timeout(ktls, &total, &len, TLS_TEST_WRITE_TIMEOUT_MS);
+		goto end;
+	}
+
 	do {
 		uint8_t *read_p = read_buf + read_bytes;
 		// read_chunk_size = TLS_TEST_READ_BUF_LEN - read_bytes;
@@ -109,6 +155,7 @@ static void *tcp_sock_server(ks_thread_t *thread, void *thread_data)
 	ctx_params.chain_file = "./" TLS_TEST_SERVER_CERT;
 	ctx_params.cert_file = "./" TLS_TEST_SERVER_CERT;
 	ctx_params.key_file = "./" TLS_TEST_SERVER_CERT;
+	ctx_params.ktls = tls_data->ktls;
 	// ctx_params.debug = KS_TRUE;
 
 	if (ks_tls_create_shared_server_ctx(&shared_ctx, &ctx_params, tls_data->pool) != KS_STATUS_SUCCESS) {
@@ -128,46 +175,115 @@ static void *tcp_sock_server(ks_thread_t *thread, void *thread_data)
 	return NULL;
 }
 
-static int test_tls(char *ip)
+static int start_server(tls_data_t *tls_data, ks_thread_t **thread_p, char *ip, int port)
 {
-	int result = 0;
-	ks_socket_t server_sock = KS_SOCK_INVALID;
 	int family = strchr(ip, ':') ? AF_INET6 : AF_INET;
-	tls_data_t tls_data = {0};
-	ks_pool_t *pool = NULL;
-	ks_thread_t *thread_p = NULL;
 	int sanity = 100;
+
+	tls_data->server_socket = KS_SOCK_INVALID;
+
+	if (ks_addr_set(&tls_data->server_addr, ip, port, family) != KS_STATUS_SUCCESS) {
+		ks_log(KS_LOG_ERROR, "TSL CLIENT Can't set ADDR\n");
+		return 0;
+	}
+
+	tls_data->server_socket = socket(family, SOCK_STREAM, IPPROTO_TCP);
+
+	if (tls_data->server_socket == KS_SOCK_INVALID) {
+		ks_log(KS_LOG_ERROR, "TLS CLIENT Can't create sock family %d\n", family);
+		return 0;
+	}
+
+	ks_pool_open(&tls_data->pool);
+
+	tls_data->family = family;
+
+	ks_socket_option(tls_data->server_socket, TCP_NODELAY, KS_TRUE);
+
+	ks_thread_create(thread_p, tcp_sock_server, tls_data, tls_data->pool);
+
+	while(!tls_data->ready && --sanity > 0) {
+		ks_sleep_ms(10);
+	}
+
+	return tls_data->ready;
+}
+
+static void stop_server(tls_data_t *tls_data, ks_thread_t **thread_p)
+{
+	if (tls_data->server_socket != KS_SOCK_INVALID) {
+		ks_socket_shutdown(tls_data->server_socket, SHUT_RDWR);
+		ks_socket_close(&tls_data->server_socket);
+	}
+
+	if (*thread_p) {
+		ks_thread_join(*thread_p);
+		*thread_p = NULL;
+	}
+
+	if (tls_data->pool) {
+		ks_pool_close(&tls_data->pool);
+	}
+}
+
+/* Connect, echo the payload and hang up. The read also takes in TLS 1.3 session tickets */
+static int echo_round_ex(ks_tls_connect_params_t *client_params, ks_pool_t *pool, ks_bool_t async, ks_bool_t *reused, ks_time_t *handshake_us)
+{
 	ks_tls_t *ktls = NULL;
-	ks_tls_connect_params_t client_params = {0};
-	ks_status_t status = KS_STATUS_FAIL;
 	ks_size_t write_bytes = sizeof(TLS_TEST_PAYLOAD);
 	char data[1024] = {0};
 	ks_size_t read_bytes = 1024;
+	ks_time_t start = ks_time_now();
+	int result = 0;
 
-	if (ks_addr_set(&tls_data.server_addr, ip, TLS_TEST_PORT, family) != KS_STATUS_SUCCESS) {
-		ks_log(KS_LOG_ERROR, "TSL CLIENT Can't set ADDR\n");
+	if (async) {
+		if (ks_tls_connect_start(&ktls, client_params, pool) != KS_STATUS_SUCCESS || drive_handshake(ktls, client_params->init_timeout_ms) != KS_STATUS_SUCCESS) {
+			ks_log(KS_LOG_ERROR, "TLS CLIENT Can't step a handshake with host [%s]\n", client_params->host);
+			goto end;
+		}
+	} else if (ks_tls_connect(&ktls, client_params, pool) != KS_STATUS_SUCCESS) {
+		ks_log(KS_LOG_ERROR, "TLS CLIENT Can't connect to host [%s]\n", client_params->host);
 		goto end;
 	}
 
-	server_sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
+	if (handshake_us) *handshake_us = ks_time_now() - start;
+	if (reused) *reused = ks_tls_session_reused(ktls);
 
-	if (server_sock == KS_SOCK_INVALID) {
-		ks_log(KS_LOG_ERROR, "TLS CLIENT Can't create sock family %d\n", family);
+	if (ks_tls_write_timeout(ktls, TLS_TEST_PAYLOAD, &write_bytes, TLS_TEST_WRITE_TIMEOUT_MS) != KS_STATUS_SUCCESS) {
+		ks_log(KS_LOG_ERROR, "TLS CLIENT Can't write [%s]\n", client_params->host);
 		goto end;
 	}
 
-	ks_pool_open(&pool);
+	if (ks_tls_read_timeout(ktls, data, &read_bytes, TLS_TEST_READ_TIMEOUT_MS) != KS_STATUS_SUCCESS) {
+		ks_log(KS_LOG_ERROR, "TLS CLIENT Can't read\n");
+		goto end;
+	}
 
-	tls_data.pool = pool;
-	tls_data.family = family;
-	tls_data.server_socket = server_sock;
+	ks_log(KS_LOG_DEBUG, "TLS CLIENT Wrote [%ld] bytes\n", (long)write_bytes);
+	ks_log(KS_LOG_DEBUG, "TLS CLIENT Read [%ld] bytes\n", (long)read_bytes);
 
-	ks_socket_option(tls_data.server_socket, TCP_NODELAY, KS_TRUE);
+	result = !strncmp(data, TLS_TEST_PAYLOAD, sizeof(TLS_TEST_PAYLOAD));
 
-	ks_thread_create(&thread_p, tcp_sock_server, &tls_data, pool);
+end:
+	ks_tls_destroy(&ktls);
 
-	while(!tls_data.ready && --sanity > 0) {
-		ks_sleep_ms(10);
+	return result;
+}
+
+static int echo_round(ks_tls_connect_params_t *client_params, ks_pool_t *pool, ks_bool_t *reused, ks_time_t *handshake_us)
+{
+	return echo_round_ex(client_params, pool, KS_FALSE, reused, handshake_us);
+}
+
+static int test_tls(char *ip)
+{
+	int result = 0;
+	tls_data_t tls_data = {0};
+	ks_thread_t *thread_p = NULL;
+	ks_tls_connect_params_t client_params = {0};
+
+	if (!start_server(&tls_data, &thread_p, ip, TLS_TEST_PORT)) {
+		goto end;
 	}
 
 	/* Client connection */
@@ -180,50 +296,272 @@ static int test_tls(char *ip)
 
 	/* Create a couple of connections. */
 	for (int i = 0; i < 2; i ++) {
-		if (ks_tls_connect(&ktls, &client_params, pool) != KS_STATUS_SUCCESS) {
-			ks_log(KS_LOG_ERROR, "TLS CLIENT Can't connect to host [%s]\n", ip);
+		if (!echo_round(&client_params, tls_data.pool, NULL, NULL)) {
+			goto end;
+		}
+	}
+
+	result = 1;
+
+end:
+	stop_server(&tls_data, &thread_p);
+
+	return result;
+}
+
+#define TLS_RESUME_ROUNDS 20
+
+/* Reconnects with and without the session cache, every reconnect after the first should resume */
+static int test_tls_resume(char *ip)
+{
+	int result = 0, resumed = 0, i;
+	tls_data_t tls_data = {0};
+	ks_thread_t *thread_p = NULL;
+	ks_tls_connect_params_t client_params = {0};
+	ks_tls_session_stats_t before, after;
+	ks_time_t full_us = 0, resumed_us = 0, us;
+	ks_bool_t reused;
+
+	ks_tls_session_cache_flush();
+	ks_tls_get_session_stats(&before);
+
+	if (!start_server(&tls_data, &thread_p, ip, TLS_TEST_PORT + 1)) {
+		goto end;
+	}
+
+	client_params.host = ip;
+	client_params.port = TLS_TEST_PORT + 1;
+	client_params.verify_peer = KS_TLS_VERIFY_DISABLED;
+	client_params.init_timeout_ms = 5000;
+	client_params.connect_timeout_ms = 5000;
+
+	for (i = 0; i < TLS_RESUME_ROUNDS; i++) {
+		if (!echo_round(&client_params, tls_data.pool, &reused, &us) || reused) {
 			goto end;
 		}
 
-		if (ks_tls_write_timeout(ktls, TLS_TEST_PAYLOAD, &write_bytes, TLS_TEST_WRITE_TIMEOUT_MS) != KS_STATUS_SUCCESS) {
-			ks_log(KS_LOG_ERROR, "TLS CLIENT Can't write [%s]\n", ip);
+		full_us += us;
+	}
+
+	client_params.enable_resumption = KS_TRUE;
+
+	/* The first one seeds the cache */
+	if (!echo_round(&client_params, tls_data.pool, &reused, NULL) || reused) {
+		goto end;
+	}
+
+	for (i = 0; i < TLS_RESUME_ROUNDS; i++) {
+		if (!echo_round(&client_params, tls_data.pool, &reused, &us)) {
 			goto end;
 		}
 
-		if (ks_tls_read_timeout(ktls, data, &read_bytes, TLS_TEST_READ_TIMEOUT_MS) != KS_STATUS_SUCCESS) {
-			ks_log(KS_LOG_ERROR, "TLS CLIENT Can't read\n");
+		resumed += reused;
+		resumed_us += us;
+	}
+
+	/* A session from a connection that skipped verification is never offered to one that verifies */
+	client_params.verify_peer = KS_TLS_VERIFY_ENABLED;
+
+	if (echo_round(&client_params, tls_data.pool, &reused, NULL) && reused) {
+		goto end;
+	}
+
+	ks_tls_get_session_stats(&after);
+
+	printf("BENCH tls connect over %s: full handshake %lldus, resumed %lldus, %d/%d resumed\n", ip,
+		   (long long)(full_us / TLS_RESUME_ROUNDS), (long long)(resumed_us / TLS_RESUME_ROUNDS), resumed, TLS_RESUME_ROUNDS);
+	printf("BENCH tls sessions: client full %llu resumed %llu, server full %llu resumed %llu, tickets %llu renewed %llu\n",
+		   (unsigned long long)(after.client_full - before.client_full), (unsigned long long)(after.client_resumed - before.client_resumed),
+		   (unsigned long long)(after.server_full - before.server_full), (unsigned long long)(after.server_resumed - before.server_resumed),
+		   (unsigned long long)(after.tickets_issued - before.tickets_issued), (unsigned long long)(after.tickets_renewed - before.tickets_renewed));
+
+	/* Both ends negotiate TLS 1.3 here, so each resumption also reissues its ticket */
+	result = resumed == TLS_RESUME_ROUNDS && after.client_resumed - before.client_resumed == TLS_RESUME_ROUNDS &&
+		after.server_resumed - before.server_resumed == TLS_RESUME_ROUNDS && after.tickets_renewed - before.tickets_renewed >= TLS_RESUME_ROUNDS;
+
+end:
+	stop_server(&tls_data, &thread_p);
+
+	return result;
+}
+
+/* Both ends stepped with ks_tls_handshake, timed against blocking ks_tls_connect/ks_tls_accept */
+static int test_tls_async(char *ip)
+{
+	int result = 0, i;
+	tls_data_t tls_data = {0};
+	ks_thread_t *thread_p = NULL;
+	ks_tls_connect_params_t client_params = {0};
+	ks_time_t blocking_us = 0, async_us = 0, us;
+
+	if (!start_server(&tls_data, &thread_p, ip, TLS_TEST_PORT + 2)) {
+		goto end;
+	}
+
+	client_params.host = ip;
+	client_params.port = TLS_TEST_PORT + 2;
+	client_params.verify_peer = KS_TLS_VERIFY_DISABLED;
+	client_params.init_timeout_ms = 5000;
+	client_params.connect_timeout_ms = 5000;
+
+	for (i = 0; i < TLS_RESUME_ROUNDS; i++) {
+		if (!echo_round_ex(&client_params, tls_data.pool, KS_FALSE, NULL, &us)) {
 			goto end;
 		}
 
-		ks_log(KS_LOG_DEBUG, "TLS CLIENT Wrote [%ld] bytes\n", (long)write_bytes);
-		ks_log(KS_LOG_DEBUG, "TLS CLIENT Read [%ld] bytes\n", (long)read_bytes);
+		blocking_us += us;
+	}
+
+	tls_data.async = KS_TRUE;
 
-		if (strncmp(data, TLS_TEST_PAYLOAD, sizeof(TLS_TEST_PAYLOAD))) {
+	for (i = 0; i < TLS_RESUME_ROUNDS; i++) {
+		if (!echo_round_ex(&client_params, tls_data.pool, KS_TRUE, NULL, &us)) {
 			goto end;
 		}
 
-		ks_tls_destroy(&ktls);
+		async_us += us;
 	}
 
+	printf("BENCH tls handshake over %s: blocking %lldus, stepped %lldus\n", ip,
+		   (long long)(blocking_us / TLS_RESUME_ROUNDS), (long long)(async_us / TLS_RESUME_ROUNDS));
+
 	result = 1;
 
+end:
+	stop_server(&tls_data, &thread_p);
+
+	return result;
+}
+
+#ifndef WIN32
+#define TLS_BULK_TESTS 1
+#define TLS_BULK_BYTES (4 * 1024 * 1024)
+
+/* Pushes TLS_BULK_BYTES to a sink with ks_tls_write or ks_tls_sendfile, returns MB/s or -1 */
+static double bulk_round(ks_tls_connect_params_t *client_params, ks_pool_t *pool, int fd, ks_bool_t *tx, ks_bool_t *rx)
+{
+	static uint8_t chunk[65536];
+	ks_tls_t *ktls = NULL;
+	ks_size_t sent = 0, len;
+	uint64_t total = 0;
+	ks_time_t start;
+	double mbs = -1;
+
+	if (ks_tls_connect(&ktls, client_params, pool) != KS_STATUS_SUCCESS) {
+		goto end;
+	}
+
+	ks_tls_get_ktls(ktls, tx, rx);
+	start = ks_time_now();
+
+	if (fd >= 0) {
+		sent = TLS_BULK_BYTES;
+
+		if (ks_tls_sendfile(ktls, fd, 0, &sent, TLS_TEST_WRITE_TIMEOUT_MS) != KS_STATUS_SUCCESS) {
+			goto end;
+		}
+	} else {
+		while (sent < TLS_BULK_BYTES) {
+			len = sizeof(chunk);
+
+			if (ks_tls_write_timeout(ktls, chunk, &len, TLS_TEST_WRITE_TIMEOUT_MS) != KS_STATUS_SUCCESS) {
+				goto end;
+			}
+
+			sent += len;
+		}
+	}
+
+	len = sizeof(total);
+
+	if (ks_tls_read_timeout(ktls, &total, &len, TLS_TEST_READ_TIMEOUT_MS) != KS_STATUS_SUCCESS || total != TLS_BULK_BYTES) {
+		goto end;
+	}
+
+	mbs = (double)TLS_BULK_BYTES / (ks_time_now() - start);
+
 end:
 	ks_tls_destroy(&ktls);
 
-	if (server_sock != KS_SOCK_INVALID) {
-		ks_socket_shutdown(server_sock, SHUT_RDWR);
-		ks_socket_close(&server_sock);
+	return mbs;
+}
+
+/* Bulk throughput with kernel TLS asked for and not, through ks_tls_write and ks_tls_sendfile.
+ * Without the kernel tls module both run in userspace, which is what the fallback has to survive */
+static int test_tls_bulk(char *ip)
+{
+	int result = 0, fd = -1, i;
+	tls_data_t tls_data = {0};
+	ks_thread_t *thread_p = NULL;
+	ks_tls_connect_params_t client_params = {0};
+	static uint8_t chunk[65536];
+	char path[1024];
+	const char *tmpdir = getenv("TMPDIR");
+	double write_mbs[2], sendfile_mbs[2];
+	ks_bool_t tx[2], rx[2];
+
+	snprintf(path, sizeof(path), "%s/testtls_bulk.XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+
+	if ((fd = mkstemp(path)) < 0) {
+		goto end;
 	}
 
-	if (thread_p) {
-		ks_thread_join(thread_p);
+	/* The descriptor is all sendfile needs, so nothing is left behind whichever way this ends */
+	unlink(path);
+
+	for (i = 0; i < TLS_BULK_BYTES / (int)sizeof(chunk); i++) {
+		memset(chunk, i, sizeof(chunk));
+
+		if (write(fd, chunk, sizeof(chunk)) != sizeof(chunk)) {
+			goto end;
+		}
+	}
+
+	tls_data.ktls = KS_TRUE;
+	tls_data.bulk = TLS_BULK_BYTES;
+
+	if (!start_server(&tls_data, &thread_p, ip, TLS_TEST_PORT + 3)) {
+		goto end;
+	}
+
+	client_params.host = ip;
+	client_params.port = TLS_TEST_PORT + 3;
+	client_params.verify_peer = KS_TLS_VERIFY_DISABLED;
+	client_params.init_timeout_ms = 5000;
+	client_params.connect_timeout_ms = 5000;
+
+	for (i = 0; i < 2; i++) {
+		client_params.ktls = i ? KS_TRUE : KS_FALSE;
+
+		if ((write_mbs[i] = bulk_round(&client_params, tls_data.pool, -1, &tx[i], &rx[i])) < 0 ||
+			(sendfile_mbs[i] = bulk_round(&client_params, tls_data.pool, fd, NULL, NULL)) < 0) {
+			goto end;
+		}
+
+		/* Offload is only ever on when it was asked for */
+		if (!i && (tx[i] || rx[i])) {
+			goto end;
+		}
 	}
 
-	if (pool) {
-		ks_pool_close(&pool);
+	printf("BENCH tls bulk over %s: userspace write %.0fMB/s sendfile %.0fMB/s, "
+		   "ktls (tx %d rx %d) write %.0fMB/s sendfile %.0fMB/s\n", ip,
+		   write_mbs[0], sendfile_mbs[0], tx[1], rx[1], write_mbs[1], sendfile_mbs[1]);
+
+	result = 1;
+
+end:
+	stop_server(&tls_data, &thread_p);
+
+	if (fd >= 0) {
+		close(fd);
 	}
+
 	return result;
 }
+#else
+#define TLS_BULK_TESTS 0
+#endif
 
 int main(void)
 {
@@ -243,7 +581,7 @@ int main(void)
 	have_v4 = ks_zstr_buf(v4) ? 0 : 1;
 	have_v6 = ks_zstr_buf(v6) ? 0 : 1;
 
-	plan(have_v4 + have_v6 + 1);
+	plan(have_v4 * (3 + TLS_BULK_TESTS) + have_v6 * 3 + 1);
 
 	ok(have_v4 || have_v6);
 
@@ -253,10 +591,17 @@ int main(void)
 
 	if (have_v4) {
 		ok(test_tls(v4));
+		ok(test_tls_resume(v4));
+		ok(test_tls_async(v4));
+#if TLS_BULK_TESTS
+		ok(test_tls_bulk(v4));
+#endif
 	}
 
 	if (have_v6) {
 		ok(test_tls(v6));
+		ok(test_tls_resume(v6));
+		ok(test_tls_async(v6));
 	}
 
 	unlink("./" TLS_TEST_SERVER_CERT);
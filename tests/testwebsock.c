@@ -36,6 +36,233 @@ static int tcp_port = 8090;
 
 static char __MSG[] = "TESTING................................................................................/TESTING";
 
+#define BIG_FRAME (256 * 1024)
+static uint8_t big_frame[BIG_FRAME];
+
+#define BURST_FRAMES 2000
+#define BURST_LEN 32
+
+/* Many small frames back to back in one write, so the reader sees them arrive together */
+static void send_burst(kws_t *kws)
+{
+	static uint8_t burst[BURST_FRAMES * (BURST_LEN + 2)];
+	uint8_t *p = burst;
+	int i;
+
+	for (i = 0; i < BURST_FRAMES; i++) {
+		*p++ = WSOC_BINARY | 0x80;
+		*p++ = BURST_LEN;
+		memset(p, i & 0xff, BURST_LEN);
+		p += BURST_LEN;
+	}
+
+	kws_raw_write(kws, burst, sizeof(burst));
+}
+
+static int read_burst(kws_t *kws, ks_size_t *read_calls, ks_time_t *elapsed)
+{
+	kws_stats_t before, after;
+	kws_opcode_t oc;
+	uint8_t *data;
+	ks_ssize_t bytes;
+	int i, j;
+
+	kws_get_stats(kws, &before);
+	*elapsed = ks_time_now();
+
+	kws_write_frame(kws, WSOC_TEXT, "BURST", 5);
+
+	for (i = 0; i < BURST_FRAMES; i++) {
+		bytes = kws_read_frame(kws, &oc, &data);
+
+		if (bytes != BURST_LEN || oc != WSOC_BINARY) return 0;
+
+		for (j = 0; j < BURST_LEN; j++) {
+			if (data[j] != (i & 0xff)) return 0;
+		}
+	}
+
+	*elapsed = ks_time_now() - *elapsed;
+	kws_get_stats(kws, &after);
+	*read_calls = after.read_calls - before.read_calls;
+
+	return after.frames_read - before.frames_read == BURST_FRAMES;
+}
+
+#define CORK_FRAMES 200
+
+/* Small frames through kws_write_frame, held back and written together when corked, then how many writes that took */
+static void send_corked(kws_t *kws, int cork)
+{
+	kws_stats_t before, after;
+	char count[32];
+	int i;
+
+	kws_get_stats(kws, &before);
+
+	if (cork) kws_cork(kws);
+
+	for (i = 0; i < CORK_FRAMES; i++) {
+		memset(count, i & 0xff, BURST_LEN);
+		kws_write_frame(kws, WSOC_BINARY, count, BURST_LEN);
+	}
+
+	if (cork) kws_uncork(kws);
+
+	kws_get_stats(kws, &after);
+	snprintf(count, sizeof(count), "%lu", (unsigned long)(after.write_calls - before.write_calls));
+	kws_write_frame(kws, WSOC_TEXT, count, strlen(count));
+}
+
+static int read_corked(kws_t *kws, int cork, unsigned long *write_calls, ks_time_t *elapsed)
+{
+	kws_opcode_t oc;
+	uint8_t *data;
+	int i;
+
+	*elapsed = ks_time_now();
+
+	kws_write_frame(kws, WSOC_TEXT, cork ? "CORK" : "NOCORK", cork ? 4 : 6);
+
+	for (i = 0; i < CORK_FRAMES; i++) {
+		if (kws_read_frame(kws, &oc, &data) != BURST_LEN || oc != WSOC_BINARY || data[0] != (i & 0xff)) return 0;
+	}
+
+	if (kws_read_frame(kws, &oc, &data) <= 0 || oc != WSOC_TEXT) return 0;
+
+	*elapsed = ks_time_now() - *elapsed;
+	*write_calls = strtoul((char *)data, NULL, 10);
+
+	return 1;
+}
+
+#define SLOW_FRAMES 128
+#define SLOW_LEN (32 * 1024)
+#define ECHOES 200
+
+/* A reader that keeps falling behind, so the writer spends its time waiting for room */
+static void read_slowly(kws_t *kws)
+{
+	kws_opcode_t oc;
+	uint8_t *data;
+	char count[32];
+	int i, got = 0;
+
+	for (i = 0; i < SLOW_FRAMES; i++) {
+		if (kws_read_frame(kws, &oc, &data) == SLOW_LEN) got++;
+		if (!(i % 8)) ks_sleep_ms(2);
+	}
+
+	snprintf(count, sizeof(count), "%d", got);
+	kws_write_frame(kws, WSOC_TEXT, count, strlen(count));
+}
+
+static int cmp_time(const void *a, const void *b)
+{
+	ks_time_t x = *(const ks_time_t *)a, y = *(const ks_time_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Time of each write against the slow reader, then round trips of small echoes, as p50 and p99 */
+static int measure_latency(kws_t *kws, int ssl)
+{
+	static ks_time_t times[SLOW_FRAMES > ECHOES ? SLOW_FRAMES : ECHOES];
+	kws_opcode_t oc;
+	uint8_t *data;
+	int i, r = 1;
+
+	kws_write_frame(kws, WSOC_TEXT, "SLOW", 4);
+
+	for (i = 0; i < SLOW_FRAMES; i++) {
+		times[i] = ks_time_now();
+		if (kws_write_frame(kws, WSOC_BINARY, big_frame, SLOW_LEN) != SLOW_LEN) r = 0;
+		times[i] = ks_time_now() - times[i];
+	}
+
+	if (kws_read_frame(kws, &oc, &data) <= 0 || atoi((char *)data) != SLOW_FRAMES) r = 0;
+
+	qsort(times, SLOW_FRAMES, sizeof(times[0]), cmp_time);
+	printf("BENCH %d %d byte writes to a slow reader over %s: p50 %lldus p99 %lldus max %lldus\n", SLOW_FRAMES, SLOW_LEN, ssl ? "TLS" : "TCP",
+		   (long long)times[SLOW_FRAMES / 2], (long long)times[SLOW_FRAMES * 99 / 100], (long long)times[SLOW_FRAMES - 1]);
+
+	for (i = 0; i < ECHOES; i++) {
+		times[i] = ks_time_now();
+		kws_write_frame(kws, WSOC_TEXT, "ECHO", 4);
+		if (kws_read_frame(kws, &oc, &data) != 4 || strcmp((char *)data, "ECHO")) r = 0;
+		times[i] = ks_time_now() - times[i];
+	}
+
+	qsort(times, ECHOES, sizeof(times[0]), cmp_time);
+	printf("BENCH %d echoes over %s: p50 %lldus p99 %lldus max %lldus\n", ECHOES, ssl ? "TLS" : "TCP",
+		   (long long)times[ECHOES / 2], (long long)times[ECHOES * 99 / 100], (long long)times[ECHOES - 1]);
+
+	/* Both ends used to sleep 10ms whenever a read found nothing there yet */
+	if (times[ECHOES / 2] >= 10000) r = 0;
+
+	return r;
+}
+
+/* big_frame as one binary message over three fragments, with a ping in the middle of it */
+static void send_stream(kws_t *kws)
+{
+	uint8_t hdr[10];
+	ks_size_t off = 0, len;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		len = i < 2 ? BIG_FRAME / 3 : BIG_FRAME - 2 * (BIG_FRAME / 3);
+
+		hdr[0] = (i ? WSOC_CONTINUATION : WSOC_BINARY) | (i == 2 ? 0x80 : 0);
+		hdr[1] = 127;
+		memset(hdr + 2, 0, 8);
+		hdr[7] = (uint8_t)(len >> 16);
+		hdr[8] = (uint8_t)(len >> 8);
+		hdr[9] = (uint8_t)len;
+
+		kws_raw_write(kws, hdr, sizeof(hdr));
+		kws_raw_write(kws, big_frame + off, len);
+		off += len;
+
+		if (i == 0) {
+			hdr[0] = WSOC_PING | 0x80;
+			hdr[1] = 4;
+			memcpy(hdr + 2, "ping", 4);
+			kws_raw_write(kws, hdr, 6);
+		}
+	}
+}
+
+static int read_stream(kws_t *kws)
+{
+	kws_chunk_t chunk;
+	uint8_t *data;
+	ks_ssize_t bytes;
+	ks_size_t total = 0, chunks = 0;
+	int pings = 0;
+
+	kws_write_frame(kws, WSOC_TEXT, "STREAM", 6);
+
+	do {
+		if ((bytes = kws_read_chunk(kws, &chunk, &data)) < 0) return 0;
+
+		if (chunk.oc == WSOC_PING) {
+			if (bytes != 4 || memcmp(data, "ping", 4)) return 0;
+			pings++;
+			continue;
+		}
+
+		if (chunk.oc != WSOC_BINARY || chunk.offset != total || bytes > 64 * 1024) return 0;
+		if (memcmp(data, big_frame + total, bytes)) return 0;
+
+		total += bytes;
+		chunks++;
+	} while (chunk.oc == WSOC_PING || !chunk.last);
+
+	printf("WS CLIENT STREAMED %lu bytes in %lu chunks\n", (unsigned long)total, (unsigned long)chunks);
+
+	return total == BIG_FRAME && pings == 1;
+}
 
 typedef struct ssl_profile_s {
 	const SSL_METHOD *ssl_method;
@@ -144,9 +371,46 @@ void server_callback(ks_socket_t server_sock, ks_socket_t client_sock, ks_sockad
 		printf("WS SERVER READ %ld bytes [%s]\n", (long)bytes, (char *)data);
 	} while(ks_zstr_buf((char *)data) || strcmp((char *)data, __MSG));
 
-	bytes = kws_write_frame(kws, WSOC_TEXT, (char *)data, strlen((char *)data));
+	{
+		/* Echo it back in pieces, followed by a frame big enough to need several sends */
+		kws_iovec_t iov[3];
+		ks_size_t len = strlen((char *)data);
+		int i;
+
+		iov[0].base = data;
+		iov[0].len = 7;
+		iov[1].base = data + 7;
+		iov[1].len = 0;
+		iov[2].base = data + 7;
+		iov[2].len = len - 7;
+
+		bytes = kws_write_framev(kws, WSOC_TEXT, iov, 3);
+		printf("WS SERVER WRITE %ld bytes\n", (long)bytes);
+
+		for (i = 0; i < 3; i++) {
+			iov[i].base = big_frame + i * (BIG_FRAME / 3);
+			iov[i].len = i < 2 ? BIG_FRAME / 3 : BIG_FRAME - 2 * (BIG_FRAME / 3);
+		}
+
+		bytes = kws_write_framev(kws, WSOC_BINARY, iov, 3);
+		printf("WS SERVER WRITE %ld bytes\n", (long)bytes);
+	}
 
-	printf("WS SERVER WRITE %ld bytes\n", (long)bytes);
+	while (kws_read_frame(kws, &oc, &data) > 0) {
+		if (!strcmp((char *)data, "BURST")) {
+			send_burst(kws);
+		} else if (!strcmp((char *)data, "STREAM")) {
+			send_stream(kws);
+		} else if (!strcmp((char *)data, "CORK") || !strcmp((char *)data, "NOCORK")) {
+			send_corked(kws, *data == 'C');
+		} else if (!strcmp((char *)data, "SLOW")) {
+			read_slowly(kws);
+		} else if (!strcmp((char *)data, "ECHO")) {
+			kws_write_frame(kws, WSOC_TEXT, "ECHO", 4);
+		} else {
+			break;
+		}
+	}
 
  end:
 
@@ -185,11 +449,16 @@ static int test_ws(char *ip, int ssl)
 	struct tcp_data tcp_data = { 0 };
 	int r = 1, sanity = 100;
 	kws_t *kws = NULL;
+	ks_json_t *params = ks_json_create_object();
+	kws_stats_t stats;
 
 	ks_pool_open(&pool);
 
 	tcp_data.pool = pool;
 
+	/* The client holds its writes back, each gets flushed by the read for its answer */
+	ks_json_add_number_to_object(params, "write_coalesce_ms", 50);
+
 	if (ssl) {
 		tcp_data.ssl = 1;
 		tcp_data.client_profile.ssl_method = SSLv23_client_method();
@@ -230,14 +499,31 @@ static int test_ws(char *ip, int ssl)
 	ks_addr_set(&addr, ip, tcp_port, family);
 	cl_sock = ks_socket_connect(SOCK_STREAM, IPPROTO_TCP, &addr);
 
+	{
+		/* A small send buffer so the slow reader pushes back quickly */
+		int sndbuf = 64 * 1024;
+
+		setsockopt(cl_sock, SOL_SOCKET, SO_SNDBUF, (const char *)&sndbuf, sizeof(sndbuf));
+	}
+
 	printf("WS %s CLIENT SOCKET %d %s %d\n", ssl ? "SSL" : "PLAIN", (int)cl_sock, addr.host, addr.port);
 
-	if (kws_init(&kws, cl_sock, tcp_data.client_profile.ssl_ctx, "/verto:tatooine.freeswitch.org:verto", KWS_BLOCK, pool) != KS_STATUS_SUCCESS) {
+	if (kws_init_ex(&kws, cl_sock, tcp_data.client_profile.ssl_ctx, "/verto:tatooine.freeswitch.org:verto", KWS_BLOCK, pool, params) != KS_STATUS_SUCCESS) {
 		printf("WS CLIENT CREATE FAIL\n");
 		goto end;
 	}
 
-	kws_write_frame(kws, WSOC_TEXT, __MSG, strlen(__MSG));
+	{
+		/* Masked pieces, the key has to carry on across each boundary */
+		kws_iovec_t iov[2];
+
+		iov[0].base = __MSG;
+		iov[0].len = 5;
+		iov[1].base = __MSG + 5;
+		iov[1].len = strlen(__MSG) - 5;
+
+		kws_write_framev(kws, WSOC_TEXT, iov, 2);
+	}
 
 	kws_opcode_t oc;
 	uint8_t *data;
@@ -246,6 +532,73 @@ static int test_ws(char *ip, int ssl)
 	bytes = kws_read_frame(kws, &oc, &data);
 	printf("WS CLIENT READ %ld bytes [%s]\n", (long)bytes, (char *)data);
 
+	if (bytes != (ks_ssize_t)strlen(__MSG) || memcmp(data, __MSG, bytes)) {
+		r = 0;
+	}
+
+	bytes = kws_read_frame(kws, &oc, &data);
+	printf("WS CLIENT READ %ld bytes\n", (long)bytes);
+
+	if (bytes != BIG_FRAME || oc != WSOC_BINARY || memcmp(data, big_frame, BIG_FRAME)) {
+		r = 0;
+	}
+
+	if (!read_stream(kws)) {
+		r = 0;
+	}
+
+	{
+		ks_size_t calls[2] = { 0 };
+		ks_time_t elapsed[2] = { 0 };
+
+		if (!read_burst(kws, &calls[0], &elapsed[0])) r = 0;
+
+		kws_set_flag(kws, KWS_FLAG_NO_READ_AHEAD);
+		if (!read_burst(kws, &calls[1], &elapsed[1])) r = 0;
+
+		printf("BENCH %d %d byte frames over %s: read ahead %lu reads %lldus, without %lu reads %lldus\n",
+			   BURST_FRAMES, BURST_LEN, ssl ? "TLS" : "TCP", (unsigned long)calls[0], (long long)elapsed[0],
+			   (unsigned long)calls[1], (long long)elapsed[1]);
+
+		if (calls[0] >= calls[1]) r = 0;
+	}
+
+	{
+		unsigned long calls[2] = { 0 };
+		ks_time_t elapsed[2] = { 0 };
+
+		if (!read_corked(kws, 1, &calls[0], &elapsed[0])) r = 0;
+		if (!read_corked(kws, 0, &calls[1], &elapsed[1])) r = 0;
+
+		printf("BENCH %d %d byte frames written over %s: corked %lu writes %lldus, uncorked %lu writes %lldus\n",
+			   CORK_FRAMES, BURST_LEN, ssl ? "TLS" : "TCP", calls[0], (long long)elapsed[0], calls[1], (long long)elapsed[1]);
+
+		if (calls[0] != 1 || calls[1] < CORK_FRAMES) r = 0;
+	}
+
+	if (!measure_latency(kws, ssl)) {
+		r = 0;
+	}
+
+	{
+		/* Nothing writes or reads after this one, the window has to run out on its own */
+		kws_stats_t before;
+
+		kws_get_stats(kws, &before);
+		kws_write_frame(kws, WSOC_TEXT, "ECHO", 4);
+		ks_sleep_ms(200);
+		kws_get_stats(kws, &stats);
+
+		if (kws_flush_due(kws) != -1 || stats.flush_timeouts != before.flush_timeouts + 1) r = 0;
+		if (kws_read_frame(kws, &oc, &data) != 4 || strcmp((char *)data, "ECHO")) r = 0;
+	}
+
+	kws_get_stats(kws, &stats);
+	printf("WS CLIENT %lu frames in %lu flushes, %lu forced by the window\n",
+		   (unsigned long)stats.frames_written, (unsigned long)stats.flushes, (unsigned long)stats.flush_timeouts);
+
+	if (!stats.flushes || stats.frames_written < stats.flushes) r = 0;
+
  end:
 
 	kws_destroy(&kws);
@@ -265,29 +618,476 @@ static int test_ws(char *ip, int ssl)
 
 	ks_socket_close(&cl_sock);
 
+	ks_json_delete(&params);
 	ks_pool_close(&pool);
 
 	return r;
 }
 
+static const char *mask_kernels[] = { "scalar", "word", "sse2", "avx2", "neon", NULL };
+
+/* Every kernel against the plain byte loop, over all head/tail alignments and key offsets */
+static int test_mask(void)
+{
+	static uint8_t src[512 + 32], dst[512 + 32], ref[512 + 32];
+	const uint8_t key[4] = { 0x12, 0x9a, 0xf0, 0x5c };
+	ks_size_t len, off, sa, da, i;
+	int k, bad = 0;
 
+	for (i = 0; i < sizeof(src); i++) {
+		src[i] = (uint8_t)(i * 31 + 7);
+	}
+
+	for (k = 0; mask_kernels[k]; k++) {
+		if (kws_mask_set_kernel(mask_kernels[k]) != KS_STATUS_SUCCESS) {
+			printf("MASK kernel %s not available\n", mask_kernels[k]);
+			continue;
+		}
+
+		for (len = 0; len <= 300; len++) {
+			for (off = 0; off < 4; off++) {
+				for (sa = 0; sa < 16; sa++) {
+					for (i = 0; i < len; i++) {
+						ref[i] = src[sa + i] ^ key[(off + i) % 4];
+					}
+
+					for (da = 0; da < 16; da++) {
+						memset(dst, 0xee, sizeof(dst));
+						kws_mask(dst + da, src + sa, len, key, off);
+
+						if (memcmp(dst + da, ref, len) || (da && dst[da - 1] != 0xee) || dst[da + len] != 0xee) {
+							bad++;
+						}
+					}
+
+					/* In place, as kws_read_frame uses it */
+					memcpy(dst + sa, src + sa, len);
+					kws_mask(dst + sa, dst + sa, len, key, off);
+					if (memcmp(dst + sa, ref, len)) bad++;
+				}
+			}
+		}
+
+		printf("MASK kernel %s: %d mismatches\n", mask_kernels[k], bad);
+	}
+
+	kws_mask_set_kernel(NULL);
+
+	return bad == 0;
+}
+
+#define MASK_BENCH_SIZE (4 * 1024 * 1024)
+#define MASK_BENCH_RUNS 16
+
+static void bench_mask(void)
+{
+	uint8_t *buf = malloc(MASK_BENCH_SIZE + 1);
+	const uint8_t key[4] = { 0x12, 0x9a, 0xf0, 0x5c };
+	ks_time_t t;
+	int k, r;
+	size_t i;
+
+	memset(buf, 0x55, MASK_BENCH_SIZE + 1);
+
+	t = ks_time_now();
+	for (r = 0; r < MASK_BENCH_RUNS; r++) {
+		for (i = 0; i < MASK_BENCH_SIZE; i++) {
+			buf[i + 1] ^= key[i % 4];
+		}
+	}
+	t = ks_time_now() - t;
+	printf("BENCH mask %-8s %8.1f MB/s\n", "loop", (double)MASK_BENCH_SIZE * MASK_BENCH_RUNS / (t ? t : 1));
+
+	for (k = 0; mask_kernels[k]; k++) {
+		if (kws_mask_set_kernel(mask_kernels[k]) != KS_STATUS_SUCCESS) continue;
+
+		/* Deliberately misaligned by one byte */
+		t = ks_time_now();
+		for (r = 0; r < MASK_BENCH_RUNS; r++) {
+			kws_mask(buf + 1, buf + 1, MASK_BENCH_SIZE, key, 0);
+		}
+		t = ks_time_now() - t;
+		printf("BENCH mask %-8s %8.1f MB/s\n", mask_kernels[k], (double)MASK_BENCH_SIZE * MASK_BENCH_RUNS / (t ? t : 1));
+	}
+
+	kws_mask_set_kernel(NULL);
+	printf("MASK using %s\n", kws_mask_get_kernel());
+
+	free(buf);
+}
+
+#define LOOP_CLIENTS 16
+#define LOOP_MESSAGES 50
+
+struct loop_data {
+	kws_loop_t *loop;
+	ks_socket_t sock;
+	ks_sockaddr_t addr;
+	SSL_CTX *ssl_ctx;
+	kws_flag_t flags;
+	ks_json_t *params;
+	volatile int ready;
+	volatile uint32_t opened;
+	volatile uint32_t closed;
+	volatile uint32_t messages;
+	int hold;
+	kws_t *held;
+};
+
+static void loop_on_open(kws_loop_t *loop, kws_t *kws, void *user_data)
+{
+	struct loop_data *ld = (struct loop_data *) user_data;
+
+	ks_atomic_increment_uint32(&ld->opened);
+
+	/* Kept past on_close to check the connection outlives the loop's use of it */
+	if (ld->hold && !ld->held && kws_loop_ref(kws) == KS_STATUS_SUCCESS) {
+		ld->held = kws;
+	}
+}
+
+/* Echo everything straight back from the loop thread */
+static void loop_on_message(kws_loop_t *loop, kws_t *kws, kws_opcode_t oc, uint8_t *data, ks_size_t len, void *user_data)
+{
+	struct loop_data *ld = (struct loop_data *) user_data;
+
+	ks_atomic_increment_uint32(&ld->messages);
+	kws_write_frame(kws, oc, data, len);
+}
+
+static void loop_on_close(kws_loop_t *loop, kws_t *kws, void *user_data)
+{
+	struct loop_data *ld = (struct loop_data *) user_data;
+
+	ks_atomic_increment_uint32(&ld->closed);
+}
+
+static const kws_loop_callbacks_t loop_callbacks = { loop_on_open, loop_on_message, loop_on_close };
+
+static void loop_accept_callback(ks_socket_t server_sock, ks_socket_t client_sock, ks_sockaddr_t *addr, void *user_data)
+{
+	struct loop_data *ld = (struct loop_data *) user_data;
+
+	kws_loop_accept(ld->loop, client_sock, ld->ssl_ctx, ld->flags, ld->params, &loop_callbacks, ld, NULL);
+}
+
+static void *loop_listen_thread(ks_thread_t *thread, void *thread_data)
+{
+	struct loop_data *ld = (struct loop_data *) thread_data;
+
+	ld->ready = 1;
+	ks_listen_sock(ld->sock, &ld->addr, 0, loop_accept_callback, ld);
+
+	return NULL;
+}
+
+static void *loop_run_thread(ks_thread_t *thread, void *thread_data)
+{
+	kws_loop_run((kws_loop_t *) thread_data);
+
+	return NULL;
+}
+
+/* Blocking clients against one loop thread serving all of them */
+static int test_loop(char *ip, int ssl)
+{
+	ks_thread_t *listen_thread = NULL, *run_thread = NULL;
+	ks_pool_t *pool;
+	struct loop_data ld = { 0 };
+	ssl_profile_t server_profile = { 0 }, client_profile = { 0 };
+	kws_t *clients[LOOP_CLIENTS] = { 0 };
+	int family = strchr(ip, ':') ? AF_INET6 : AF_INET;
+	int i, j, r = 1, sanity = 100;
+	char msg[64];
+	uint8_t frag[4 + 10];
+
+	ks_pool_open(&pool);
+
+	if (ssl) {
+		server_profile.ssl_method = SSLv23_server_method();
+		ks_set_string(server_profile.cert, "./testwebsock.pem");
+		ks_set_string(server_profile.key, "./testwebsock.pem");
+		ks_set_string(server_profile.chain, "./testwebsock.pem");
+		init_ssl(&server_profile);
+		ld.ssl_ctx = server_profile.ssl_ctx;
+
+		client_profile.ssl_method = SSLv23_client_method();
+		ks_set_string(client_profile.cert, "./testwebsock.pem");
+		ks_set_string(client_profile.key, "./testwebsock.pem");
+		ks_set_string(client_profile.chain, "./testwebsock.pem");
+		init_ssl(&client_profile);
+	}
+
+	ld.hold = 1;
+	kws_loop_create(&ld.loop, pool);
+	ks_addr_set(&ld.addr, ip, tcp_port + 1, family);
+	ld.sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
+	ks_socket_option(ld.sock, SO_REUSEADDR, KS_TRUE);
+
+	ks_thread_create(&run_thread, loop_run_thread, ld.loop, pool);
+	ks_thread_create(&listen_thread, loop_listen_thread, &ld, pool);
+
+	while (!ld.ready && --sanity > 0) {
+		ks_sleep(10000);
+	}
+
+	for (i = 0; i < LOOP_CLIENTS; i++) {
+		ks_socket_t sock = ks_socket_connect(SOCK_STREAM, IPPROTO_TCP, &ld.addr);
+
+		if (kws_init(&clients[i], sock, client_profile.ssl_ctx, "/loop:localhost:loop", KWS_BLOCK | KWS_CLOSE_SOCK, pool) != KS_STATUS_SUCCESS) {
+			r = 0;
+			goto end;
+		}
+	}
+
+	for (j = 0; j < LOOP_MESSAGES; j++) {
+		for (i = 0; i < LOOP_CLIENTS; i++) {
+			snprintf(msg, sizeof(msg), "client %d message %d", i, j);
+			kws_write_frame(clients[i], WSOC_TEXT, msg, strlen(msg));
+		}
+
+		for (i = 0; i < LOOP_CLIENTS; i++) {
+			kws_opcode_t oc;
+			uint8_t *data;
+
+			snprintf(msg, sizeof(msg), "client %d message %d", i, j);
+
+			if (kws_read_frame(clients[i], &oc, &data) != (ks_ssize_t)strlen(msg) || strcmp((char *)data, msg)) {
+				r = 0;
+			}
+		}
+	}
+
+	/* A fragmented message followed by one big enough to queue behind a full socket */
+	frag[0] = WSOC_TEXT;
+	frag[1] = 0x80 | 4;
+	memset(frag + 2, 0, 4);
+	memcpy(frag + 6, "frag", 4);
+	kws_raw_write(clients[0], frag, 10);
+	frag[0] = WSOC_CONTINUATION | 0x80;
+	memcpy(frag + 6, "ment", 4);
+	kws_raw_write(clients[0], frag, 10);
+
+	kws_write_frame(clients[0], WSOC_BINARY, big_frame, BIG_FRAME);
+
+	{
+		kws_opcode_t oc;
+		uint8_t *data;
+
+		if (kws_read_frame(clients[0], &oc, &data) != 8 || oc != WSOC_TEXT || strcmp((char *)data, "fragment")) {
+			r = 0;
+		}
+
+		if (kws_read_frame(clients[0], &oc, &data) != BIG_FRAME || oc != WSOC_BINARY || memcmp(data, big_frame, BIG_FRAME)) {
+			r = 0;
+		}
+	}
+
+	printf("LOOP %s opened %u messages %u connections %lu\n", ssl ? "TLS" : "TCP", ld.opened, ld.messages,
+		   (unsigned long)kws_loop_count(ld.loop));
+
+	if (ld.opened != LOOP_CLIENTS || ld.messages != LOOP_CLIENTS * LOOP_MESSAGES + 2) {
+		r = 0;
+	}
+
+ end:
+
+	for (i = 0; i < LOOP_CLIENTS; i++) {
+		kws_destroy(&clients[i]);
+	}
+
+	sanity = 200;
+	while (ld.closed < ld.opened && --sanity > 0) {
+		ks_sleep(10000);
+	}
+
+	if (ld.closed != LOOP_CLIENTS) {
+		r = 0;
+	}
+
+	/* Finished by the loop but still referenced: writes fail, closing again is harmless */
+	if (!ld.held || kws_write_frame(ld.held, WSOC_TEXT, "late", 4) >= 0) {
+		r = 0;
+	}
+	if (ld.held) kws_loop_close(ld.held, WS_NORMAL_CLOSE);
+	kws_loop_unref(&ld.held);
+
+	kws_loop_stop(ld.loop);
+	ks_thread_join(run_thread);
+	kws_loop_destroy(&ld.loop);
+
+	ks_socket_shutdown(ld.sock, 2);
+	ks_socket_close(&ld.sock);
+	ks_thread_join(listen_thread);
+
+	if (ssl) {
+		SSL_CTX_free(server_profile.ssl_ctx);
+		SSL_CTX_free(client_profile.ssl_ctx);
+	}
+
+	ks_pool_close(&pool);
+
+	return r;
+}
+
+#define DEFLATE_MESSAGES 500
+
+/*
+ * JSON-RPC style traffic echoed by a deflate enabled loop: one client keeping its context,
+ * one resetting every message on a small window and one that never asks for deflate.
+ */
+static int test_deflate(char *ip)
+{
+	ks_thread_t *listen_thread = NULL, *run_thread = NULL;
+	ks_pool_t *pool;
+	struct loop_data ld = { 0 };
+	ks_json_t *params[3];
+	kws_t *clients[3] = { 0 };
+	const char *names[3] = { "context takeover", "no takeover, 10 bit window", "off" };
+	int family = strchr(ip, ':') ? AF_INET6 : AF_INET;
+	int i, j, r = 1, sanity = 100;
+	char msg[512];
+
+	ks_pool_open(&pool);
+
+	params[0] = NULL;
+	params[1] = ks_json_create_object();
+	ks_json_add_bool_to_object(params[1], "deflate_no_context_takeover", KS_TRUE);
+	ks_json_add_number_to_object(params[1], "deflate_window_bits", 10);
+	params[2] = NULL;
+
+	ld.flags = KWS_FLAG_DEFLATE;
+	kws_loop_create(&ld.loop, pool);
+	ks_addr_set(&ld.addr, ip, tcp_port + 2, family);
+	ld.sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
+	ks_socket_option(ld.sock, SO_REUSEADDR, KS_TRUE);
+
+	ks_thread_create(&run_thread, loop_run_thread, ld.loop, pool);
+	ks_thread_create(&listen_thread, loop_listen_thread, &ld, pool);
+
+	while (!ld.ready && --sanity > 0) {
+		ks_sleep(10000);
+	}
+
+	for (i = 0; i < 3; i++) {
+		ks_socket_t sock = ks_socket_connect(SOCK_STREAM, IPPROTO_TCP, &ld.addr);
+
+		if (kws_init_ex(&clients[i], sock, NULL, "/deflate:localhost:deflate", KWS_BLOCK | KWS_CLOSE_SOCK | (i < 2 ? KWS_FLAG_DEFLATE : 0),
+						pool, params[i]) != KS_STATUS_SUCCESS) {
+			r = 0;
+			goto end;
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		kws_stats_t stats;
+		ks_time_t write_time = 0, started;
+
+		for (j = 0; j < DEFLATE_MESSAGES && r; j++) {
+			kws_opcode_t oc;
+			uint8_t *data;
+			int len = snprintf(msg, sizeof(msg),
+							   "{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"blade.execute\",\"params\":{\"requester_nodeid\":\"%08x-node\","
+							   "\"responder_nodeid\":\"%08x-node\",\"protocol\":\"signalwire\",\"method\":\"calling.send_digits\","
+							   "\"params\":{\"call_id\":\"%d\",\"digits\":\"%d\"}}}", j, i * 7919, j * 104729, j, j % 10);
+
+			/* Writes are where compression costs CPU, the echo's read is mostly waiting */
+			started = ks_time_now();
+			kws_write_frame(clients[i], WSOC_TEXT, msg, len);
+			write_time += ks_time_now() - started;
+
+			if (kws_read_frame(clients[i], &oc, &data) != len || oc != WSOC_TEXT || strcmp((char *)data, msg)) {
+				r = 0;
+			}
+		}
+
+		kws_get_stats(clients[i], &stats);
+
+		printf("BENCH deflate %s: %d messages written in %lldus, sent %lu as %lu bytes, received %lu as %lu bytes\n", names[i], DEFLATE_MESSAGES,
+			   (long long)write_time, (unsigned long)stats.deflate_in, (unsigned long)stats.deflate_out,
+			   (unsigned long)stats.inflate_out, (unsigned long)stats.inflate_in);
+
+		if (kws_deflate_enabled(clients[i]) != (i < 2 && kws_deflate_enabled(clients[0]))) {
+			r = 0;
+		}
+
+		/* Each message on its own barely compresses, with the context kept the repetition across them does */
+		if (kws_deflate_enabled(clients[i]) && (stats.deflate_out * (i ? 1 : 4) >= stats.deflate_in || stats.inflate_in * (i ? 1 : 4) >= stats.inflate_out)) {
+			r = 0;
+		}
+	}
+
+	/* A big compressed message read back in bounded pieces */
+	for (i = 0; i < 2; i++) {
+		kws_chunk_t chunk;
+		uint8_t *data;
+		ks_ssize_t bytes;
+		ks_size_t total = 0;
+
+		kws_write_frame(clients[i], WSOC_BINARY, big_frame, BIG_FRAME);
+
+		do {
+			if ((bytes = kws_read_chunk(clients[i], &chunk, &data)) < 0 || bytes > 64 * 1024 ||
+				chunk.oc != WSOC_BINARY || chunk.offset != total || memcmp(data, big_frame + total, bytes)) {
+				r = 0;
+				break;
+			}
+			total += bytes;
+		} while (!chunk.last);
+
+		if (total != BIG_FRAME) {
+			r = 0;
+		}
+	}
+
+ end:
+
+	for (i = 0; i < 3; i++) {
+		kws_destroy(&clients[i]);
+	}
+
+	sanity = 200;
+	while (ld.closed < ld.opened && --sanity > 0) {
+		ks_sleep(10000);
+	}
+
+	kws_loop_stop(ld.loop);
+	ks_thread_join(run_thread);
+	kws_loop_destroy(&ld.loop);
+
+	ks_socket_shutdown(ld.sock, 2);
+	ks_socket_close(&ld.sock);
+	ks_thread_join(listen_thread);
+
+	ks_json_delete(&params[1]);
+	ks_pool_close(&pool);
+
+	return r;
+}
 
 int main(void)
 {
-	int have_v4 = 0, have_v6 = 0;
+	int have_v4 = 0, have_v6 = 0, i;
 	ks_find_local_ip(v4, sizeof(v4), &mask, AF_INET, NULL);
 	ks_find_local_ip(v6, sizeof(v6), NULL, AF_INET6, NULL);
 	ks_init();
 
+	for (i = 0; i < BIG_FRAME; i++) {
+		big_frame[i] = (uint8_t)(i * 7);
+	}
+
 	printf("IPS: v4: [%s] v6: [%s]\n", v4, v6);
 
 	have_v4 = ks_zstr_buf(v4) ? 0 : 1;
 	have_v6 = ks_zstr_buf(v6) ? 0 : 1;
 
-	plan((have_v4 * 2) + (have_v6 * 2) + 1);
+	plan((have_v4 * 5) + (have_v6 * 5) + 2);
 
 	ok(have_v4 || have_v6);
 
+	ok(test_mask());
+	bench_mask();
+
 	if (have_v4 || have_v6) {
 		ks_gen_cert(".", "testwebsock.pem");
 	}
@@ -295,11 +1095,17 @@ int main(void)
 	if (have_v4) {
 		ok(test_ws(v4, 0));
 		ok(test_ws(v4, 1));
+		ok(test_loop(v4, 0));
+		ok(test_loop(v4, 1));
+		ok(test_deflate(v4));
 	}
 
 	if (have_v6) {
 		ok(test_ws(v6, 0));
 		ok(test_ws(v6, 1));
+		ok(test_loop(v6, 0));
+		ok(test_loop(v6, 1));
+		ok(test_deflate(v6));
 	}
 
 	unlink("./testwebsock.pem");